@@ -0,0 +1,229 @@
+#include "rtweekend.h"
+#include "accumulation.h"
+#include "mapped_file.h"
+#include "pfm.h"
+
+#include <string.h>
+
+/*
+
+Merge the accumulation files of several runs of the same frame (see accumulation.h):
+
+    build\theNextWeek.exe 1 --accum > run1.acc     (on one machine)
+    build\theNextWeek.exe 1 --accum > run2.acc     (on another)
+    build\accumulate_merge.exe merged.acc run1.acc run2.acc
+    build\accumulate_merge.exe merged.pfm merged.acc more_runs.acc
+
+If the output ends in .pfm we write the final image (each pixel's sum over its count) to tonemap later,
+otherwise the merged accumulation file (which can itself be merged with more runs later).
+
+The inputs are memory mapped and merged one row at a time, from the top down (and we let the OS drop each row
+once it is merged), so this takes a constant amount of memory no matter how big the images are (even 16K frames).
+
+The output is written to output.tmp first and renamed once all the inputs are unmapped, so it can be one of the
+inputs (build\accumulate_merge.exe all.acc all.acc more_runs.acc adds more runs to all.acc).
+
+*/
+
+/// @brief Move to the given position of the file (which can be past 2GB, even where long is 32 bits).
+static bool file_seek(FILE *file, long long position)
+{
+#ifdef _WIN32
+    return _fseeki64(file, position, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)position, SEEK_SET) == 0;
+#endif
+}
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: accumulate_merge output.(acc|pfm) input.acc [input.acc ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    const char *output_path = argv[1];
+    int num_inputs = argc - 2;
+
+    size_t path_length = strlen(output_path);
+    bool pfm = path_length >= 4 && strcmp(output_path + path_length - 4, ".pfm") == 0;
+
+    double start_time = seconds_now();
+
+    struct Mapped_File *inputs = calloc(num_inputs, sizeof(struct Mapped_File));
+    if (inputs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the inputs!\n");
+        return EXIT_FAILURE;
+    }
+
+    struct Accumulation_Header merged_header;
+    uint64_t runs = 0;
+
+    for (int i = 0; i < num_inputs; i++)
+    {
+        const char *path = argv[2 + i];
+        if (!map_file(&inputs[i], path) || inputs[i].size < sizeof(struct Accumulation_Header))
+        {
+            fprintf(stderr, "Could not read %s\n", path);
+            return EXIT_FAILURE;
+        }
+
+        struct Accumulation_Header header;
+        memcpy(&header, inputs[i].data, sizeof(header));
+
+        const char *why;
+        if (!accumulation_header_valid(&header, &why))
+        {
+            fprintf(stderr, "Can't merge %s (%s)\n", path, why);
+            return EXIT_FAILURE;
+        }
+
+        size_t expected_size = sizeof(header) +
+                               (size_t)header.image_width * header.image_height * sizeof(struct Accumulation_Pixel);
+        if (inputs[i].size != expected_size)
+        {
+            fprintf(stderr, "Can't merge %s (it is truncated)\n", path);
+            return EXIT_FAILURE;
+        }
+
+        if (i == 0)
+        {
+            merged_header = header;
+        }
+        else if (header.image_width != merged_header.image_width || header.image_height != merged_header.image_height)
+        {
+            fprintf(stderr, "Can't merge %s (it is %ux%u, but %s is %ux%u)\n", path,
+                    header.image_width, header.image_height, argv[2], merged_header.image_width, merged_header.image_height);
+            return EXIT_FAILURE;
+        }
+
+        // Runs with the same seed rendered the very same samples, so merging them gains nothing
+        // (and makes the result look less noisy than it is).
+        for (int k = 0; k < i && header.runs == 1; k++)
+        {
+            struct Accumulation_Header other;
+            memcpy(&other, inputs[k].data, sizeof(other));
+            if (other.runs == 1 && other.seed == header.seed)
+            {
+                fprintf(stderr, "Warning: %s and %s were rendered with the same seed\n", argv[2 + k], path);
+            }
+        }
+
+        runs += header.runs;
+    }
+
+    int image_width = (int)merged_header.image_width;
+    int image_height = (int)merged_header.image_height;
+
+    merged_header.runs = runs;
+    merged_header.seed = (runs == 1) ? merged_header.seed : 0;
+
+    char temp_path[4096];
+    int length = snprintf(temp_path, sizeof(temp_path), "%s.tmp", output_path);
+    FILE *out = (length > 0 && length < (int)sizeof(temp_path)) ? fopen(temp_path, "wb") : NULL;
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s.tmp for writing\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    struct Accumulation_Pixel *row = malloc(image_width * sizeof(struct Accumulation_Pixel));
+    float *pfm_row = malloc(image_width * 3 * sizeof(float));
+    if (row == NULL || pfm_row == NULL)
+    {
+        fprintf(stderr, "Could not allocate the rows!\n");
+        return EXIT_FAILURE;
+    }
+
+    bool ok = pfm ? fprintf(out, "PF\n%i %i\n-1.0\n", image_width, image_height) > 0
+                  : fwrite(&merged_header, sizeof(merged_header), 1, out) == 1;
+    long long pfm_header_length = ftell(out);
+
+    double samples = 0;
+    size_t row_bytes = image_width * sizeof(struct Accumulation_Pixel);
+
+    for (int j = 0; ok && j < image_height; j++)
+    {
+        size_t offset = sizeof(struct Accumulation_Header) + (size_t)j * row_bytes;
+
+        memset(row, 0, row_bytes);
+        for (int i = 0; i < num_inputs; i++)
+        {
+            const struct Accumulation_Pixel *in = (const struct Accumulation_Pixel *)(inputs[i].data + offset);
+            for (int x = 0; x < image_width; x++)
+            {
+                row[x].sum[0] += in[x].sum[0];
+                row[x].sum[1] += in[x].sum[1];
+                row[x].sum[2] += in[x].sum[2];
+                row[x].count += in[x].count;
+            }
+            mapped_file_release(&inputs[i], offset, row_bytes);
+        }
+
+        for (int x = 0; x < image_width; x++)
+        {
+            samples += row[x].count;
+        }
+
+        if (!pfm)
+        {
+            ok = fwrite(row, sizeof(struct Accumulation_Pixel), image_width, out) == (size_t)image_width;
+            continue;
+        }
+
+        for (int x = 0; x < image_width; x++)
+        {
+            double scale = (row[x].count > 0) ? 1.0 / row[x].count : 0;
+            pfm_row[3 * x + 0] = (float)(row[x].sum[0] * scale);
+            pfm_row[3 * x + 1] = (float)(row[x].sum[1] * scale);
+            pfm_row[3 * x + 2] = (float)(row[x].sum[2] * scale);
+        }
+        if (!pfm_little_endian())
+        {
+            pfm_swap_bytes(pfm_row, (size_t)image_width * 3);
+        }
+
+        // We read the inputs from the top down (so the OS can read ahead), but PFM rows go from the bottom up.
+        long long position = pfm_header_length + (long long)(image_height - 1 - j) * image_width * 3 * sizeof(float);
+        ok = file_seek(out, position) &&
+             fwrite(pfm_row, sizeof(float), (size_t)image_width * 3, out) == (size_t)image_width * 3;
+    }
+
+    ok = (fclose(out) == 0) && ok;
+
+    for (int i = 0; i < num_inputs; i++)
+    {
+        unmap_file(&inputs[i]);
+    }
+
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows.
+    if (ok)
+    {
+        remove(output_path);
+    }
+#endif
+    if (!ok || rename(temp_path, output_path) != 0)
+    {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        remove(temp_path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Merged %i files (%llu runs, %.1f samples per pixel on average) into %s in %.1f ms\n",
+            num_inputs, (unsigned long long)runs, samples / ((double)image_width * image_height), output_path,
+            1000 * (seconds_now() - start_time));
+
+    free(inputs);
+    free(row);
+    free(pfm_row);
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+A pixel's color is the average of its samples, and an average of averages is only right if we know how
+many samples went into each of them. So to combine renders of the same frame from several runs
+(on several machines, say), each run writes an accumulation file: for every pixel, the *sum* of the
+radiance of its samples and how many samples that was. Merging runs is then just adding the files up
+(see accumulate_merge.c), and dividing the sums by the counts gives the same image as a single run
+with all the samples, as long as each run used its own seed (see random_run_seed).
+
+The file is a fixed size header followed by one Accumulation_Pixel per pixel, row by row from the top.
+Everything is stored in the byte order of the machine that wrote it (byte_order tells us what it was),
+and the header is 64 bytes so the pixels stay aligned when the file is memory mapped.
+
+*/
+
+#define ACCUMULATION_MAGIC "RTACCUM1"
+#define ACCUMULATION_VERSION 1
+#define ACCUMULATION_BYTE_ORDER 0x01020304u
+
+struct Accumulation_Header
+{
+    char magic[8];       //< ACCUMULATION_MAGIC (without its terminating 0)
+    uint32_t version;    //< ACCUMULATION_VERSION
+    uint32_t byte_order; //< ACCUMULATION_BYTE_ORDER, as written by the machine that wrote the file
+    uint32_t image_width;
+    uint32_t image_height;
+    uint64_t runs;        //< How many runs were merged into this file (1 for a file written by a render)
+    uint64_t seed;        //< The seed of the run (only meaningful if runs is 1)
+    uint64_t reserved[3]; //< 0 (room for later versions)
+};
+
+struct Accumulation_Pixel
+{
+    double sum[3]; //< The sum of the (linear) colors of all the samples of this pixel
+    double count;  //< How many samples that was (a double, so it is exact up to 2^53 samples)
+};
+
+/// @brief Make the header for a single run of the given size.
+static inline struct Accumulation_Header make_accumulation_header(int image_width, int image_height, uint64_t seed)
+{
+    struct Accumulation_Header header = {
+        .version = ACCUMULATION_VERSION,
+        .byte_order = ACCUMULATION_BYTE_ORDER,
+        .image_width = (uint32_t)image_width,
+        .image_height = (uint32_t)image_height,
+        .runs = 1,
+        .seed = seed,
+    };
+    memcpy(header.magic, ACCUMULATION_MAGIC, 8);
+    return header;
+}
+
+/// @brief Whether header is the header of an accumulation file we can read (on this machine).
+/// @param why Set to what is wrong with it (if anything).
+static inline bool accumulation_header_valid(const struct Accumulation_Header *header, const char **why)
+{
+    if (memcmp(header->magic, ACCUMULATION_MAGIC, 8) != 0)
+    {
+        *why = "not an accumulation file";
+        return false;
+    }
+    if (header->version != ACCUMULATION_VERSION)
+    {
+        *why = "unsupported version";
+        return false;
+    }
+    if (header->byte_order != ACCUMULATION_BYTE_ORDER)
+    {
+        *why = "written by a machine with a different byte order";
+        return false;
+    }
+    if (header->image_width == 0 || header->image_height == 0)
+    {
+        *why = "empty image";
+        return false;
+    }
+    return true;
+}
+
+/// @brief Write the pixels of (part of) a single render, after the header (see write_accumulation).
+/// @return false if they could not be written.
+static inline bool write_accumulation_pixels(FILE *out, const color3 *pixels, size_t num_pixels, int samples_per_pixel)
+{
+    bool ok = true;
+    for (size_t pixel = 0; ok && pixel < num_pixels; pixel++)
+    {
+        struct Accumulation_Pixel accumulated = {
+            .sum = {pixels[pixel][0] * samples_per_pixel,
+                    pixels[pixel][1] * samples_per_pixel,
+                    pixels[pixel][2] * samples_per_pixel},
+            .count = samples_per_pixel,
+        };
+        ok = fwrite(&accumulated, sizeof(accumulated), 1, out) == 1;
+    }
+    return ok;
+}
+
+/// @brief Write the result of a single render as an accumulation file.
+/// @param pixels The average linear color of each pixel, row by row (as camera_render_pixels renders them).
+/// @param samples_per_pixel How many samples each pixel is the average of.
+/// @remark out must be opened in binary mode.
+/// @return false if the file could not be written.
+static inline bool write_accumulation(FILE *out, const color3 *pixels, int image_width, int image_height,
+                                      int samples_per_pixel, uint64_t seed)
+{
+    struct Accumulation_Header header = make_accumulation_header(image_width, image_height, seed);
+    return fwrite(&header, sizeof(header), 1, out) == 1 &&
+           write_accumulation_pixels(out, pixels, (size_t)image_width * image_height, samples_per_pixel);
+}
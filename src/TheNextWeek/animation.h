@@ -0,0 +1,209 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "scene.h"
+#include "bvh.h"
+
+/*
+
+Rendering an animation (a turntable, objects moving around, ...) one process per frame means setting up
+the scene and building its BVH from scratch for every frame.
+Instead we render all the frames in one go:
+
+    1. Between frames most objects only move a little, so instead of rebuilding the BVH we refit it
+       (keep the tree, just update its boxes). Refitting is much cheaper, but the tree gets worse as
+       objects drift from where it was built for, so we rebuild once its SAH cost grows too much.
+    2. We keep two copies of the world (double buffering). While the render threads finish the last tiles
+       of one frame, the first thread with nothing left to do sets up the other copy for the next frame.
+
+*/
+
+struct Animation
+{
+    int first_frame;
+    int last_frame; //< Inclusive
+
+    /// @brief Move things into place for the given frame.
+    /// The world and camera are reset to the initial ones before each call, so the update should set
+    /// positions from the frame number (not move them relative to the previous frame).
+    /// The update must not add or remove objects.
+    void (*update)(struct Hittable *world, int world_length, struct Camera_Config *cam, int frame, void *user_data);
+    void *user_data;
+
+    /// @brief Where to write each frame, a printf pattern for the frame number (like "frame_%04d.ppm").
+    /// The frames are written in the camera's output_format.
+    const char *output_pattern;
+
+    /// @brief Rebuild the BVH (instead of refitting it) once its SAH cost is this many times its cost
+    /// right after it was built. 0 means 1.5.
+    double rebuild_threshold;
+};
+
+/// @brief One of the two copies of the world we alternate between.
+struct Animation_Frame
+{
+    struct Hittable *world;
+    struct Scene scene;
+    struct BVH bvh;
+    struct Camera_Config cam;
+    int frame;
+    bool built; //< If the BVH was built at least once
+};
+
+/// @brief What preparing a frame needs (passed to animation_prepare_frame as the tail task).
+struct Animation_Prepare
+{
+    const struct Animation *anim;
+    const struct Hittable *initial_world;
+    int world_length;
+    const struct Camera_Config *initial_cam;
+    struct Animation_Frame *target;
+    int frame;
+};
+
+/// @brief Set the target copy of the world up for the given frame (and refit or rebuild its BVH).
+static void animation_prepare_frame(void *arg)
+{
+    struct Animation_Prepare *prep = arg;
+    struct Animation_Frame *target = prep->target;
+
+    // Any random numbers the update uses should be the same no matter which thread prepares the frame.
+    random_seed(prep->initial_cam->seed ^ mix_bits((uint64_t)prep->frame));
+
+    double start_time = seconds_now();
+
+    memcpy(target->world, prep->initial_world, prep->world_length * sizeof(struct Hittable));
+    target->cam = *prep->initial_cam;
+    target->frame = prep->frame;
+    if (prep->anim->update != NULL)
+    {
+        prep->anim->update(target->world, prep->world_length, &target->cam, prep->frame, prep->anim->user_data);
+    }
+
+    double threshold = (prep->anim->rebuild_threshold > 0) ? prep->anim->rebuild_threshold : 1.5;
+    const char *action = "built";
+
+    if (target->built)
+    {
+        bvh_refit(&target->bvh);
+        action = "refit";
+
+        double cost = bvh_sah_cost(&target->bvh);
+        if (cost > threshold * target->bvh.built_cost)
+        {
+            if (!bvh_build(&target->bvh, target->world, prep->world_length))
+            {
+                fprintf(stderr, "Could not allocate the BVH!\n");
+                exit(EXIT_FAILURE);
+            }
+            action = "rebuilt";
+        }
+    }
+    else
+    {
+        if (!bvh_build(&target->bvh, target->world, prep->world_length))
+        {
+            fprintf(stderr, "Could not allocate the BVH!\n");
+            exit(EXIT_FAILURE);
+        }
+        target->built = true;
+    }
+
+    fprintf(stderr, "\nFrame %i: BVH %s in %.4f seconds (SAH cost %.2f, %.2f times the cost when built)",
+            prep->frame, action, seconds_now() - start_time,
+            bvh_sah_cost(&target->bvh), bvh_sah_cost(&target->bvh) / target->bvh.built_cost);
+}
+
+/// @brief Render all frames of the animation (each into its own ppm file).
+/// @param world The initial world (not changed). Its lights and background come from scene_template.
+/// @param scene_template Used for the background and sampling of every frame.
+/// @param cam The initial camera config.
+static inline void animation_render(const struct Hittable *world, int world_length, const struct Scene *scene_template,
+                                    const struct Camera_Config *cam, const struct Animation *anim)
+{
+    struct Animation_Frame frames[2] = {0};
+
+    for (int f = 0; f < 2; f++)
+    {
+        frames[f].world = malloc((world_length > 0 ? world_length : 1) * sizeof(struct Hittable));
+        if (frames[f].world == NULL)
+        {
+            fprintf(stderr, "Could not allocate the animation frames!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Lights are found by pointer into the world, so each copy needs its own scene.
+        memcpy(frames[f].world, world, world_length * sizeof(struct Hittable));
+        if (!scene_init(&frames[f].scene, frames[f].world, world_length))
+        {
+            fprintf(stderr, "Could not allocate the scene lights!\n");
+            exit(EXIT_FAILURE);
+        }
+        frames[f].scene.has_background = scene_template->has_background;
+        memcpy(frames[f].scene.background, scene_template->background, 3 * sizeof(double));
+        frames[f].scene.environment = scene_template->environment;
+        frames[f].scene.sampling = scene_template->sampling;
+        frames[f].scene.bvh = &frames[f].bvh;
+    }
+
+    int image_height = camera_image_height(cam);
+    color3 *pixels = malloc((size_t)cam->image_width * image_height * sizeof(color3));
+    if (pixels == NULL)
+    {
+        fprintf(stderr, "Could not allocate the image!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start_time = seconds_now();
+
+    // The first frame has nothing to overlap with.
+    struct Animation_Prepare prep = {.anim = anim, .initial_world = world, .world_length = world_length,
+                                     .initial_cam = cam, .target = &frames[0], .frame = anim->first_frame};
+    animation_prepare_frame(&prep);
+
+    int current = 0;
+    for (int frame = anim->first_frame; frame <= anim->last_frame; frame++)
+    {
+        struct Animation_Frame *now = &frames[current];
+
+        if (now->cam.image_width != cam->image_width || camera_image_height(&now->cam) != image_height)
+        {
+            fprintf(stderr, "\nThe animation update must not change the image size!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Prepare the next frame in the other copy while this frame's last tiles are rendering.
+        bool has_next = frame < anim->last_frame;
+        prep.target = &frames[1 - current];
+        prep.frame = frame + 1;
+
+        camera_render_pixels(&now->scene, &now->cam, pixels, has_next ? animation_prepare_frame : NULL, &prep);
+
+        char path[1024];
+        snprintf(path, sizeof(path), anim->output_pattern, frame);
+        FILE *out = fopen(path, "wb");
+        if (out == NULL)
+        {
+            fprintf(stderr, "\nCould not open %s for writing!\n", path);
+            exit(EXIT_FAILURE);
+        }
+        write_image(out, &now->cam, pixels, cam->image_width, image_height);
+        fclose(out);
+
+        current = 1 - current;
+    }
+
+    int num_frames = anim->last_frame - anim->first_frame + 1;
+    double elapsed = seconds_now() - start_time;
+    fprintf(stderr, "\nAnimation done! (%i frames in %.2f seconds, %.2f seconds per frame)",
+            num_frames, elapsed, elapsed / num_frames);
+
+    free(pixels);
+    for (int f = 0; f < 2; f++)
+    {
+        bvh_free(&frames[f].bvh);
+        scene_free(&frames[f].scene);
+        free(frames[f].world);
+    }
+}
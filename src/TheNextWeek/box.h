@@ -0,0 +1,97 @@
+#pragma once
+
+#include "hittable.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+
+/// @brief A solid axis-aligned box.
+/// @remark Besides being a primitive in its own right, a box is a handy boundary for a Constant_Medium.
+struct Box
+{
+    struct AABB bounds;
+    const struct Material_Cfg *mat_cfg; //< The material config for the material the box is made from.
+};
+
+/// @brief Make a box from two opposite corners (in any order).
+static inline struct Box make_box(const point3 a, const point3 b, const struct Material_Cfg *mat_cfg)
+{
+    return (struct Box){.bounds = aabb_from_points(a, b), .mat_cfg = mat_cfg};
+}
+
+/// @brief detect if the ray hits the box
+/// @param ray
+/// @param ray_interval
+/// @param rec the Hit_Record
+/// @return bool if box was hit by given ray
+static inline bool box_hit(const struct Box *box, const struct Ray *ray, struct Interval ray_interval, struct Hit_Record *rec)
+{
+    // Same slab test as aabb_hit, but we keep track of which slab we enter and leave through
+    // (that is the face we hit, which gives us the normal).
+    double t_enter = -infinity, t_exit = infinity;
+    int enter_axis = 0, exit_axis = 0;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const struct Interval *ax = aabb_axis_interval(&box->bounds, axis);
+        const double adinv = 1.0 / ray->direction[axis];
+
+        double t0 = (ax->min - ray->origin[axis]) * adinv;
+        double t1 = (ax->max - ray->origin[axis]) * adinv;
+
+        if (t0 > t1)
+        {
+            double temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+
+        if (t0 > t_enter)
+        {
+            t_enter = t0;
+            enter_axis = axis;
+        }
+        if (t1 < t_exit)
+        {
+            t_exit = t1;
+            exit_axis = axis;
+        }
+    }
+
+    if (t_exit <= t_enter)
+    {
+        return false;
+    }
+
+    int axis;
+    if (interval_surrounds(&ray_interval, t_enter))
+    {
+        // The ray comes from outside the box.
+        rec->t = t_enter;
+        rec->front_face = true;
+        axis = enter_axis;
+    }
+    else if (interval_surrounds(&ray_interval, t_exit))
+    {
+        // The ray starts inside the box.
+        rec->t = t_exit;
+        rec->front_face = false;
+        axis = exit_axis;
+    }
+    else
+    {
+        return false;
+    }
+
+    ray_at(rec->p, ray, rec->t);
+
+    // We make sure the normal always goes against the ray.
+    rec->normal[0] = 0;
+    rec->normal[1] = 0;
+    rec->normal[2] = 0;
+    rec->normal[axis] = (ray->direction[axis] > 0) ? -1.0 : 1.0;
+
+    rec->mat_cfg = (struct Material_Cfg *)box->mat_cfg;
+
+    return true;
+}
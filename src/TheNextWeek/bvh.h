@@ -0,0 +1,1072 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <float.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+
+A bounding volume hierarchy (BVH) is a tree of bounding boxes.
+The root box contains the whole world, each node's box contains the boxes of its two children,
+and the leaves hold (a few) world objects.
+A ray that misses a node's box can't hit anything in it, so we can skip that whole subtree.
+This makes finding the closest hit roughly logarithmic (instead of linear) in the number of objects.
+See section 3 of TheNextWeek for more details.
+
+We store the tree in a flat array of nodes. A node always comes before its children in the array,
+which lets us refit the tree (update all its boxes after objects move) in a single backward pass.
+
+*/
+
+#define BVH_MAX_LEAF_SIZE 2     //< Nodes with this few objects are always leaves
+#define BVH_MAX_SAH_LEAF_SIZE 8 //< Nodes with this few objects become leaves if splitting them doesn't pay off
+#define BVH_BINS 16             //< How many bins the builder sorts the centroids into (along each axis)
+#define BVH_MAX_DEPTH 96        //< Nodes this deep are split at the median (see bvh_partition)
+#define BVH_TASK_SIZE 16384     //< Subtrees with this few objects are built by a single thread
+#define BVH_PARALLEL_SIZE 65536 //< Nodes with this many objects have their bounds and bins found by all threads
+
+// A ray keeps at most one node per level on the stack, and the tree is at most BVH_MAX_DEPTH + 31 levels deep
+// (the median splits below BVH_MAX_DEPTH halve the at most 2^31 objects every level).
+#define BVH_STACK_SIZE 128
+
+// The relative costs of visiting a node and of intersecting an object (for the SAH cost, see bvh_sah_cost).
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECT_COST 1.0
+
+struct BVH_Node
+{
+    struct AABB box;
+    int left;  //< (Internal nodes) Index of the left child in BVH.nodes
+    int right; //< (Internal nodes) Index of the right child in BVH.nodes
+    int first; //< (Leaves) Index of the first object of this leaf in BVH.indices
+    int count; //< (Leaves) How many objects this leaf has. 0 for internal nodes.
+};
+
+struct BVH
+{
+    const struct Hittable *world; //< The objects the BVH is built over (not owned by the BVH)
+    int world_length;
+
+    struct BVH_Node *nodes; //< nodes[0] is the root
+    int num_nodes;
+    int *indices; //< Indices into world, grouped by leaf
+
+    double built_cost;    //< The SAH cost of the tree right after it was (re)built
+    double build_seconds; //< How long the last (re)build took
+};
+
+/// @brief The surface area of a box (0 for an empty box).
+static inline double aabb_surface_area(const struct AABB *box)
+{
+    double dx = interval_size(&box->x);
+    double dy = interval_size(&box->y);
+    double dz = interval_size(&box->z);
+    if (dx < 0 || dy < 0 || dz < 0)
+    {
+        return 0;
+    }
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+/// @brief Returns the center of the box along axis.
+static inline double aabb_centroid(const struct AABB *box, int axis)
+{
+    const struct Interval *ax = aabb_axis_interval(box, axis);
+    return 0.5 * (ax->min + ax->max);
+}
+
+/*
+
+The builder works on float boxes rather than AABBs: that halves the memory it streams through at every level
+of the tree (which is what takes the time), and a box of four floats (x, y, z and a spare lane) is one SSE
+register, so growing a box is two instructions. Each double box is rounded outward to floats, so a float box
+always contains its object, and so does every node box made from them. (Like vec4, where SSE isn't available
+we fall back to plain C on the four lanes.)
+
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_SSE
+#endif
+
+/// @brief Four floats: x, y, z and a spare lane.
+typedef union
+{
+#if defined(BVH_SSE)
+    __m128 v;
+#endif
+    float e[4];
+} bvh_float4;
+
+/// @brief A box as the builder sees it (see above). The spare lanes hold nothing meaningful.
+struct BVH_Box
+{
+    bvh_float4 min;
+    bvh_float4 max;
+};
+
+#define BVH_BOX_EMPTY                                                                                               \
+    ((struct BVH_Box){.min.e = {INFINITY, INFINITY, INFINITY, INFINITY},                                           \
+                      .max.e = {-INFINITY, -INFINITY, -INFINITY, -INFINITY}})
+
+/// @brief An object as the builder sees it. The builder reorders these (rather than indices into the world),
+/// so the boxes it looks at are next to each other in memory.
+/// @remark The index of the object in the world is kept in the spare lane of box.min (see bvh_ref_index),
+/// which keeps a ref at 32 bytes.
+struct BVH_Ref
+{
+    struct BVH_Box box;
+};
+
+static inline int bvh_ref_index(const struct BVH_Ref *ref)
+{
+    int index;
+    memcpy(&index, &ref->box.min.e[3], sizeof(int));
+    return index;
+}
+
+/// @brief The next float after f toward -infinity (or if up, toward +infinity). f must not be NaN.
+/// @remark Like nextafterf, but inlined (the builder calls this for most coordinates of every object).
+static inline float bvh_next_float(float f, bool up)
+{
+    if (f == 0)
+    {
+        return up ? FLT_TRUE_MIN : -FLT_TRUE_MIN;
+    }
+
+    // Adding one to the bits of a float moves it away from 0 (to the next float of larger magnitude).
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits += ((f > 0) == up) ? 1 : -1;
+    memcpy(&f, &bits, sizeof(bits));
+    return f;
+}
+
+/// @brief The ref of an object (the smallest float box that contains its box, and its index).
+static inline struct BVH_Ref bvh_make_ref(const struct AABB *box, int index)
+{
+    struct BVH_Ref ref = {.box = BVH_BOX_EMPTY};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const struct Interval *extent = aabb_axis_interval(box, axis);
+        float min = (float)extent->min;
+        float max = (float)extent->max;
+        ref.box.min.e[axis] = (min > extent->min) ? bvh_next_float(min, false) : min;
+        ref.box.max.e[axis] = (max < extent->max) ? bvh_next_float(max, true) : max;
+    }
+    memcpy(&ref.box.min.e[3], &index, sizeof(int));
+    return ref;
+}
+
+static inline struct AABB bvh_box_to_aabb(const struct BVH_Box *box)
+{
+    const point3 min = {box->min.e[0], box->min.e[1], box->min.e[2]};
+    const point3 max = {box->max.e[0], box->max.e[1], box->max.e[2]};
+    return (min[0] <= max[0]) ? aabb_from_points(min, max) : AABB_EMPTY;
+}
+
+/// @brief Grow box to contain the box [min, max].
+/// @remark Unlike aabb_union, this doesn't handle NaNs (which the builder never sees in the lanes it uses),
+/// so it compiles to plain min and max instructions.
+static inline void bvh_grow4(struct BVH_Box *box, bvh_float4 min, bvh_float4 max)
+{
+#if defined(BVH_SSE)
+    box->min.v = _mm_min_ps(box->min.v, min.v);
+    box->max.v = _mm_max_ps(box->max.v, max.v);
+#else
+    for (int lane = 0; lane < 4; lane++)
+    {
+        box->min.e[lane] = (min.e[lane] < box->min.e[lane]) ? min.e[lane] : box->min.e[lane];
+        box->max.e[lane] = (max.e[lane] > box->max.e[lane]) ? max.e[lane] : box->max.e[lane];
+    }
+#endif
+}
+
+/// @brief Grow box to contain other.
+static inline void bvh_grow(struct BVH_Box *box, const struct BVH_Box *other)
+{
+    bvh_grow4(box, other->min, other->max);
+}
+
+/// @brief The centroid of the object, times 2 (the builder only ever compares centroids,
+/// and bins them relative to other centroids, so it never needs to halve them). The last lane is 0.
+static inline bvh_float4 bvh_centroid(const struct BVH_Ref *ref)
+{
+    bvh_float4 c;
+#if defined(BVH_SSE)
+    // Clear the index out of the spare lane first: as a float it is (usually) a denormal, and arithmetic on
+    // denormals is very slow.
+    __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    c.v = _mm_add_ps(_mm_and_ps(ref->box.min.v, xyz), ref->box.max.v);
+#else
+    for (int axis = 0; axis < 3; axis++)
+    {
+        c.e[axis] = ref->box.min.e[axis] + ref->box.max.e[axis];
+    }
+    c.e[3] = 0;
+#endif
+    return c;
+}
+
+static inline double bvh_box_extent(const struct BVH_Box *box, int axis)
+{
+    return (double)box->max.e[axis] - box->min.e[axis];
+}
+
+/// @brief Half the surface area of a box (0 for an empty box).
+/// @remark The builder only compares areas with each other, so (unlike aabb_surface_area) we skip doubling them,
+/// and floats are plenty.
+static inline float bvh_box_half_area(const struct BVH_Box *box)
+{
+    float dx = box->max.e[0] - box->min.e[0];
+    float dy = box->max.e[1] - box->min.e[1];
+    float dz = box->max.e[2] - box->min.e[2];
+    if (dx < 0 || dy < 0 || dz < 0)
+    {
+        return 0;
+    }
+    return dx * dy + dy * dz + dz * dx;
+}
+
+/// @brief Reorder refs[start, end) so that refs[mid] is the object whose centroid (along axis)
+/// would be there if they were sorted, with smaller ones before it and larger ones after (quickselect).
+static void bvh_select_median(struct BVH_Ref *refs, int start, int end, int mid, int axis)
+{
+    while (end - start > 1)
+    {
+        float pivot = bvh_centroid(&refs[(start + end) / 2]).e[axis];
+        int i = start, j = end - 1;
+
+        while (i <= j)
+        {
+            while (bvh_centroid(&refs[i]).e[axis] < pivot)
+            {
+                i++;
+            }
+            while (bvh_centroid(&refs[j]).e[axis] > pivot)
+            {
+                j--;
+            }
+            if (i <= j)
+            {
+                struct BVH_Ref temp = refs[i];
+                refs[i] = refs[j];
+                refs[j] = temp;
+                i++;
+                j--;
+            }
+        }
+
+        if (mid <= j)
+        {
+            end = j + 1;
+        }
+        else if (mid >= i)
+        {
+            start = i;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/// @brief The surface area heuristic (SAH) cost of the tree: the expected cost of tracing a random ray
+/// through it, where the probability of a ray visiting a node is its surface area over the root's.
+/// @remark Lower is better. This is what degrades as objects move away from where the tree was built for.
+static inline double bvh_sah_cost(const struct BVH *bvh)
+{
+    double root_area = aabb_surface_area(&bvh->nodes[0].box);
+    if (root_area <= 0)
+    {
+        return 0;
+    }
+
+    double cost = 0;
+    for (int i = 0; i < bvh->num_nodes; i++)
+    {
+        const struct BVH_Node *node = &bvh->nodes[i];
+        double area = aabb_surface_area(&node->box) / root_area;
+        cost += (node->count > 0) ? area * node->count * BVH_INTERSECT_COST : area * BVH_TRAVERSAL_COST;
+    }
+
+    return cost;
+}
+
+/*
+
+Building the tree (the binned SAH).
+
+Each node splits its objects in two with a plane (perpendicular to an axis). The best plane is the one that
+gives the lowest SAH cost: visiting the node, plus intersecting the objects of each child times the
+probability of a ray that hits the node hitting that child (the child's surface area over the node's).
+Trying every object's centroid as a plane would take O(n log n) per node, so instead we drop the centroids
+into BVH_BINS equal bins along each axis, and only try the planes between bins: one pass over the objects to
+fill the bins, a sweep over the bins to find the best plane, and one more pass to move the objects to their
+side of it (which also finds the bounds of both children). When no plane beats just intersecting all the
+objects, and there are few enough of them, the node becomes a leaf.
+
+This is also easy to do in parallel:
+    - The big nodes near the root have their objects binned by all threads, each over its own part of them
+      (and then the bins are added up).
+    - Once a node has at most BVH_TASK_SIZE objects, its whole subtree becomes a task, built by one thread into
+      its own array of nodes. When all tasks are done, their nodes are copied after the nodes near the root
+      (in the order the tasks were made, so a node still comes before its children).
+
+Boxes and bins add up the same way in any order, and which subtrees become tasks only depends on their size,
+so the tree is the very same whatever the number of threads.
+
+*/
+
+/// @brief A bin of the binned SAH: the objects whose centroids fall in it.
+struct BVH_Bin
+{
+    struct BVH_Box box;
+    int count;
+};
+
+/// @brief The bounds of the objects of a node.
+struct BVH_Range_Info
+{
+    struct BVH_Box box;       //< The union of the objects' boxes
+    struct BVH_Box centroids; //< The box of their centroids (see bvh_centroid)
+};
+
+/// @brief A subtree for one thread to build (into its own nodes).
+struct BVH_Task
+{
+    int start, end; //< The objects (in BVH_Builder.refs)
+    int depth;
+    struct BVH_Range_Info info;
+    int parent; //< The node (near the root) this subtree is a child of
+    bool left;  //< Whether it is the parent's left child
+
+    struct BVH_Node *nodes;
+    int num_nodes;
+};
+
+struct BVH_Builder
+{
+    const struct Hittable *world;
+    struct BVH_Ref *refs; //< The objects, grouped by leaf once the tree is built
+    int num_threads;
+
+    struct BVH_Task *tasks;
+    int num_tasks;
+    int tasks_capacity;
+    atomic_int next_task; //< The next task no thread has taken yet
+    atomic_bool failed;   //< Set if a task could not allocate its nodes
+};
+
+/// @brief How many bins to sort count objects into. Small nodes (which is most of them) get fewer bins,
+/// since setting up and sweeping the bins would otherwise cost far more than binning their few objects.
+static inline int bvh_num_bins(int count)
+{
+    return (count < BVH_BINS) ? count : BVH_BINS;
+}
+
+/// @brief What bvh_bin_indices needs to bin centroids into num_bins bins along each axis of the centroids' box.
+struct BVH_Binning
+{
+    bvh_float4 min;   //< The min of the centroids' box
+    bvh_float4 scale; //< num_bins over the size of the centroids' box along each axis (or 0 if it has no size)
+    bvh_float4 last;  //< num_bins - 1
+};
+
+static inline struct BVH_Binning bvh_make_binning(const struct BVH_Box *centroids, int num_bins)
+{
+    struct BVH_Binning binning = {.min = centroids->min};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double extent = bvh_box_extent(centroids, axis);
+        binning.scale.e[axis] = (extent > 0) ? (float)(num_bins / extent) : 0;
+        binning.last.e[axis] = (float)(num_bins - 1);
+    }
+    binning.min.e[3] = binning.scale.e[3] = binning.last.e[3] = 0;
+    return binning;
+}
+
+/// @brief Set bins to which bin the centroid falls in along each axis (the last lane is meaningless).
+static inline void bvh_bin_indices(const struct BVH_Binning *binning, bvh_float4 centroid, int bins[4])
+{
+#if defined(BVH_SSE)
+    __m128 bin = _mm_mul_ps(_mm_sub_ps(centroid.v, binning->min.v), binning->scale.v);
+    _mm_storeu_si128((__m128i *)bins, _mm_cvttps_epi32(_mm_min_ps(bin, binning->last.v)));
+#else
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float bin = (centroid.e[axis] - binning->min.e[axis]) * binning->scale.e[axis];
+        bins[axis] = (int)((bin < binning->last.e[axis]) ? bin : binning->last.e[axis]);
+    }
+#endif
+}
+
+/// @brief Find the bounds of the objects refs[start, end).
+static void bvh_range_bounds(const struct BVH_Ref *refs, int start, int end, struct BVH_Range_Info *info)
+{
+    info->box = BVH_BOX_EMPTY;
+    info->centroids = BVH_BOX_EMPTY;
+    for (int i = start; i < end; i++)
+    {
+        bvh_float4 c = bvh_centroid(&refs[i]);
+        bvh_grow(&info->box, &refs[i].box);
+        bvh_grow4(&info->centroids, c, c);
+    }
+}
+
+/// @brief Fill the first num_bins bins (along each axis) with the objects refs[start, end),
+/// whose centroids are in centroids.
+static void bvh_range_bins(const struct BVH_Ref *refs, int start, int end, const struct BVH_Box *centroids,
+                           int num_bins, struct BVH_Bin bins[3][BVH_BINS])
+{
+    struct BVH_Binning binning = bvh_make_binning(centroids, num_bins);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int b = 0; b < num_bins; b++)
+        {
+            bins[axis][b] = (struct BVH_Bin){.box = BVH_BOX_EMPTY, .count = 0};
+        }
+    }
+
+    for (int i = start; i < end; i++)
+    {
+        int b[4];
+        bvh_bin_indices(&binning, bvh_centroid(&refs[i]), b);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            bvh_grow(&bins[axis][b[axis]].box, &refs[i].box);
+            bins[axis][b[axis]].count++;
+        }
+    }
+}
+
+/// @brief Part of the objects, for one thread to set up (the first time) or bin.
+struct BVH_Range_Job
+{
+    const struct BVH_Builder *builder;
+    int start, end;
+
+    const struct BVH_Box *centroids; //< The centroids' box to bin over, or NULL to set up the objects' refs
+    struct BVH_Range_Info info;   //< (Setting up) The bounds of the objects
+    struct BVH_Bin bins[3][BVH_BINS];
+};
+
+static int bvh_range_job(void *arg)
+{
+    struct BVH_Range_Job *job = arg;
+    struct BVH_Ref *refs = job->builder->refs;
+
+    if (job->centroids != NULL)
+    {
+        bvh_range_bins(refs, job->start, job->end, job->centroids, BVH_BINS, job->bins);
+        return 0;
+    }
+
+    for (int i = job->start; i < job->end; i++)
+    {
+        struct AABB box = hittable_bounding_box(&job->builder->world[i]);
+        refs[i] = bvh_make_ref(&box, i);
+    }
+    bvh_range_bounds(refs, job->start, job->end, &job->info);
+    return 0;
+}
+
+/// @brief Bin the objects refs[start, end) (if centroids is not NULL) or set up their refs (if it is, see
+/// BVH_Range_Job), with all threads if there are enough objects to make it worth it.
+/// @param info Set to the bounds of the objects (when setting them up).
+static void bvh_range_jobs(const struct BVH_Builder *builder, int start, int end, const struct BVH_Box *centroids,
+                           struct BVH_Range_Info *info, struct BVH_Bin bins[3][BVH_BINS])
+{
+    int num_jobs = (end - start >= BVH_PARALLEL_SIZE) ? builder->num_threads : 1;
+    struct BVH_Range_Job single_job;
+    struct BVH_Range_Job *jobs = (num_jobs > 1) ? malloc(num_jobs * sizeof(struct BVH_Range_Job)) : NULL;
+    if (jobs == NULL)
+    {
+        // Only one job (or no memory for more): do it all on this thread.
+        num_jobs = 1;
+        jobs = &single_job;
+    }
+
+    for (int k = 0; k < num_jobs; k++)
+    {
+        jobs[k].builder = builder;
+        jobs[k].start = start + (int)((long long)(end - start) * k / num_jobs);
+        jobs[k].end = start + (int)((long long)(end - start) * (k + 1) / num_jobs);
+        jobs[k].centroids = centroids;
+    }
+
+    run_jobs(bvh_range_job, jobs, sizeof(struct BVH_Range_Job), num_jobs);
+
+    // Add the parts up (in the same order every time, though unions and counts don't depend on it).
+    if (centroids == NULL)
+    {
+        *info = jobs[0].info;
+        for (int k = 1; k < num_jobs; k++)
+        {
+            bvh_grow(&info->box, &jobs[k].info.box);
+            bvh_grow(&info->centroids, &jobs[k].info.centroids);
+        }
+    }
+    else
+    {
+        memcpy(bins, jobs[0].bins, sizeof(jobs[0].bins));
+        for (int k = 1; k < num_jobs; k++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int b = 0; b < BVH_BINS; b++)
+                {
+                    bvh_grow(&bins[axis][b].box, &jobs[k].bins[axis][b].box);
+                    bins[axis][b].count += jobs[k].bins[axis][b].count;
+                }
+            }
+        }
+    }
+
+    if (jobs != &single_job)
+    {
+        free(jobs);
+    }
+}
+
+/// @brief Split the objects refs[start, end) in half, at their median centroid along axis.
+/// @param left_info, right_info Set to the bounds of the two halves.
+/// @return Where the second half starts.
+static int bvh_split_median(struct BVH_Ref *refs, int start, int end, int axis, struct BVH_Range_Info *left_info,
+                            struct BVH_Range_Info *right_info)
+{
+    int mid = start + (end - start) / 2;
+    bvh_select_median(refs, start, end, mid, axis);
+    bvh_range_bounds(refs, start, mid, left_info);
+    bvh_range_bounds(refs, mid, end, right_info);
+    return mid;
+}
+
+/// @brief Decide how to split the objects refs[start, end) (whose bounds are in info),
+/// and reorder them so the left child's come first.
+/// @param left_info, right_info Set to the bounds of the children's objects (if the node is split).
+/// @return Where the right child's objects start (or start, to make the node a leaf).
+static int bvh_partition(const struct BVH_Builder *builder, int start, int end, int depth,
+                         const struct BVH_Range_Info *info, struct BVH_Range_Info *left_info,
+                         struct BVH_Range_Info *right_info)
+{
+    struct BVH_Ref *refs = builder->refs;
+    int count = end - start;
+    if (count <= BVH_MAX_LEAF_SIZE)
+    {
+        return start;
+    }
+
+    // The axis the centroids are spread the most along.
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+    {
+        if (bvh_box_extent(&info->centroids, a) > bvh_box_extent(&info->centroids, axis))
+        {
+            axis = a;
+        }
+    }
+
+    // If all the centroids are at the same point no plane separates them, so just split the objects in half.
+    // And deep down in a very uneven tree, split at the median instead (which halves the objects every level),
+    // so the tree never gets deeper than the traversal stack.
+    bool no_plane = bvh_box_extent(&info->centroids, axis) <= 0;
+    if (no_plane || depth >= BVH_MAX_DEPTH)
+    {
+        if (no_plane && count <= BVH_MAX_SAH_LEAF_SIZE)
+        {
+            return start;
+        }
+
+        return bvh_split_median(refs, start, end, axis, left_info, right_info);
+    }
+
+    struct BVH_Bin bins[3][BVH_BINS];
+    int num_bins = bvh_num_bins(count);
+    if (count >= BVH_PARALLEL_SIZE)
+    {
+        bvh_range_jobs(builder, start, end, &info->centroids, NULL, bins);
+    }
+    else
+    {
+        bvh_range_bins(refs, start, end, &info->centroids, num_bins, bins);
+    }
+
+    // Sweep the bins from the right, and then from the left, to get the cost of every plane between bins.
+    // (Costs are scaled by the node's surface area, which saves dividing by it.)
+    float best_cost = INFINITY;
+    int best_axis = -1, best_split = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        if (bvh_box_extent(&info->centroids, a) <= 0)
+        {
+            continue;
+        }
+
+        float right_cost[BVH_BINS];
+        struct BVH_Box right_box = BVH_BOX_EMPTY;
+        int right_count = 0;
+        for (int b = num_bins - 1; b > 0; b--)
+        {
+            bvh_grow(&right_box, &bins[a][b].box);
+            right_count += bins[a][b].count;
+            right_cost[b] = bvh_box_half_area(&right_box) * right_count;
+        }
+
+        struct BVH_Box left_box = BVH_BOX_EMPTY;
+        int left_count = 0;
+        for (int split = 1; split < num_bins; split++)
+        {
+            bvh_grow(&left_box, &bins[a][split - 1].box);
+            left_count += bins[a][split - 1].count;
+            if (left_count == 0 || left_count == count)
+            {
+                continue;
+            }
+
+            float cost = bvh_box_half_area(&left_box) * left_count + right_cost[split];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = a;
+                best_split = split;
+            }
+        }
+    }
+
+    // Every plane left one side empty (the centroids are too close together for the bins to tell them apart).
+    if (best_axis < 0)
+    {
+        return (count <= BVH_MAX_SAH_LEAF_SIZE) ? start : bvh_split_median(refs, start, end, axis, left_info,
+                                                                           right_info);
+    }
+
+    float area = bvh_box_half_area(&info->box);
+    best_cost = BVH_TRAVERSAL_COST * area + BVH_INTERSECT_COST * best_cost;
+    if (count <= BVH_MAX_SAH_LEAF_SIZE && best_cost >= BVH_INTERSECT_COST * count * area)
+    {
+        return start;
+    }
+
+    // Objects in the bins before the split go left (and we find the bounds of both sides on the way).
+    struct BVH_Binning binning = bvh_make_binning(&info->centroids, num_bins);
+    *left_info = *right_info = (struct BVH_Range_Info){.box = BVH_BOX_EMPTY, .centroids = BVH_BOX_EMPTY};
+
+    int i = start, j = end - 1;
+    while (i <= j)
+    {
+        int b[4];
+        bvh_float4 c = bvh_centroid(&refs[i]);
+        bvh_bin_indices(&binning, c, b);
+        if (b[best_axis] < best_split)
+        {
+            bvh_grow(&left_info->box, &refs[i].box);
+            bvh_grow4(&left_info->centroids, c, c);
+            i++;
+        }
+        else
+        {
+            bvh_grow(&right_info->box, &refs[i].box);
+            bvh_grow4(&right_info->centroids, c, c);
+            struct BVH_Ref temp = refs[i];
+            refs[i] = refs[j];
+            refs[j--] = temp;
+        }
+    }
+    return i;
+}
+
+/// @brief Make room for one more task.
+/// @return false if there is no memory for it (and the subtree is then built right away instead).
+static bool bvh_reserve_task(struct BVH_Builder *builder)
+{
+    if (builder->num_tasks < builder->tasks_capacity)
+    {
+        return true;
+    }
+    int capacity = (builder->tasks_capacity > 0) ? 2 * builder->tasks_capacity : 64;
+    struct BVH_Task *tasks = realloc(builder->tasks, capacity * sizeof(struct BVH_Task));
+    if (tasks == NULL)
+    {
+        return false;
+    }
+    builder->tasks = tasks;
+    builder->tasks_capacity = capacity;
+    return true;
+}
+
+/// @brief Recursively build the subtree for the objects refs[start, end) (whose bounds are in info) into nodes.
+/// @param top Whether this is near the root (where small enough subtrees become tasks, see BVH_Task).
+/// @return The index of the subtree root in nodes.
+static int bvh_build_node(struct BVH_Builder *builder, struct BVH_Node *nodes, int *num_nodes, int start, int end,
+                          int depth, const struct BVH_Range_Info *info, bool top)
+{
+    int node_index = (*num_nodes)++;
+    nodes[node_index].box = bvh_box_to_aabb(&info->box);
+
+    struct BVH_Range_Info child_info[2];
+    int mid = bvh_partition(builder, start, end, depth, info, &child_info[0], &child_info[1]);
+    if (mid == start)
+    {
+        nodes[node_index].left = nodes[node_index].right = 0;
+        nodes[node_index].first = start;
+        nodes[node_index].count = end - start;
+        return node_index;
+    }
+
+    nodes[node_index].first = 0;
+    nodes[node_index].count = 0;
+
+    int children[2];
+    int ranges[3] = {start, mid, end};
+    for (int c = 0; c < 2; c++)
+    {
+        if (top && ranges[c + 1] - ranges[c] <= BVH_TASK_SIZE && bvh_reserve_task(builder))
+        {
+            // The child is filled in once the task is done.
+            children[c] = -1;
+            builder->tasks[builder->num_tasks++] = (struct BVH_Task){
+                .start = ranges[c],
+                .end = ranges[c + 1],
+                .depth = depth + 1,
+                .info = child_info[c],
+                .parent = node_index,
+                .left = c == 0,
+            };
+        }
+        else
+        {
+            children[c] = bvh_build_node(builder, nodes, num_nodes, ranges[c], ranges[c + 1], depth + 1,
+                                         &child_info[c], top);
+        }
+    }
+
+    nodes[node_index].left = children[0];
+    nodes[node_index].right = children[1];
+    return node_index;
+}
+
+/// @brief Build tasks (see BVH_Task) until there are none left.
+static int bvh_task_worker(void *arg)
+{
+    struct BVH_Builder *builder = *(struct BVH_Builder **)arg;
+
+    for (int k = atomic_fetch_add(&builder->next_task, 1); k < builder->num_tasks;
+         k = atomic_fetch_add(&builder->next_task, 1))
+    {
+        struct BVH_Task *task = &builder->tasks[k];
+
+        // A binary tree with n leaves has 2n - 1 nodes (and we have at most n leaves).
+        task->nodes = malloc((2 * (task->end - task->start) - 1) * sizeof(struct BVH_Node));
+        if (task->nodes == NULL)
+        {
+            atomic_store(&builder->failed, true);
+            continue;
+        }
+
+        task->num_nodes = 0;
+        bvh_build_node(builder, task->nodes, &task->num_nodes, task->start, task->end, task->depth, &task->info,
+                       false);
+    }
+
+    return 0;
+}
+
+static inline void bvh_free(struct BVH *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->indices);
+    bvh->nodes = NULL;
+    bvh->indices = NULL;
+    bvh->num_nodes = 0;
+}
+
+/// @brief (Re)build the BVH over the world (with the binned SAH, see above). Call bvh_free once you are done with it.
+/// @param num_threads How many threads to build with (0 means one per hardware thread). The tree is the same
+/// for any number of threads.
+/// @return false if there was not enough memory to build it (the BVH is then freed).
+/// @remark The BVH does not copy the world, so the world must outlive it.
+/// bvh must be zero initialized before its first build. If it was already built for a world of the same length,
+/// its memory is reused (otherwise it is freed and allocated again).
+static inline bool bvh_build_with_threads(struct BVH *bvh, const struct Hittable *world, int world_length,
+                                          int num_threads)
+{
+    double start_time = seconds_now();
+    bool reuse = bvh->nodes != NULL && bvh->world_length == world_length;
+
+    bvh->world = world;
+    bvh->world_length = world_length;
+
+    if (!reuse)
+    {
+        free(bvh->nodes);
+        free(bvh->indices);
+
+        // A binary tree with n leaves has 2n - 1 nodes (and we have at most n leaves).
+        int max_nodes = (world_length > 0) ? 2 * world_length - 1 : 1;
+        bvh->nodes = malloc(max_nodes * sizeof(struct BVH_Node));
+        bvh->indices = malloc((world_length > 0 ? world_length : 1) * sizeof(int));
+    }
+
+    struct BVH_Builder builder = {
+        .world = world,
+        .refs = malloc((world_length > 0 ? world_length : 1) * sizeof(struct BVH_Ref)),
+        .num_threads = (num_threads > 0) ? num_threads : hardware_threads(),
+    };
+    atomic_init(&builder.next_task, 0);
+    atomic_init(&builder.failed, false);
+
+    if (bvh->nodes == NULL || bvh->indices == NULL || builder.refs == NULL)
+    {
+        free(builder.refs);
+        bvh_free(bvh);
+        return false;
+    }
+
+    struct BVH_Range_Info info;
+    bvh_range_jobs(&builder, 0, world_length, NULL, &info, NULL);
+
+    // The nodes near the root (and the tasks below them), or the whole tree if it is small.
+    bvh->num_nodes = 0;
+    bvh_build_node(&builder, bvh->nodes, &bvh->num_nodes, 0, world_length, 0, &info, world_length > BVH_TASK_SIZE);
+
+    if (builder.num_tasks > 0)
+    {
+        int num_workers = (builder.num_threads < builder.num_tasks) ? builder.num_threads : builder.num_tasks;
+        struct BVH_Builder *self = &builder;
+        struct BVH_Builder **workers = malloc(num_workers * sizeof(struct BVH_Builder *));
+        if (workers == NULL)
+        {
+            // Build all the tasks on this thread.
+            num_workers = 1;
+            workers = &self;
+        }
+        for (int k = 0; k < num_workers; k++)
+        {
+            workers[k] = &builder;
+        }
+        run_jobs(bvh_task_worker, workers, sizeof(struct BVH_Builder *), num_workers);
+        if (workers != &self)
+        {
+            free(workers);
+        }
+
+        if (atomic_load(&builder.failed))
+        {
+            for (int k = 0; k < builder.num_tasks; k++)
+            {
+                free(builder.tasks[k].nodes);
+            }
+            free(builder.tasks);
+            free(builder.refs);
+            bvh_free(bvh);
+            return false;
+        }
+
+        // Copy each task's nodes after the ones before it, and point its parent at its root.
+        for (int k = 0; k < builder.num_tasks; k++)
+        {
+            struct BVH_Task *task = &builder.tasks[k];
+            int offset = bvh->num_nodes;
+
+            for (int n = 0; n < task->num_nodes; n++)
+            {
+                struct BVH_Node node = task->nodes[n];
+                if (node.count == 0)
+                {
+                    node.left += offset;
+                    node.right += offset;
+                }
+                bvh->nodes[offset + n] = node;
+            }
+            bvh->num_nodes += task->num_nodes;
+
+            if (task->left)
+            {
+                bvh->nodes[task->parent].left = offset;
+            }
+            else
+            {
+                bvh->nodes[task->parent].right = offset;
+            }
+            free(task->nodes);
+        }
+    }
+
+    for (int i = 0; i < world_length; i++)
+    {
+        bvh->indices[i] = bvh_ref_index(&builder.refs[i]);
+    }
+
+    free(builder.tasks);
+    free(builder.refs);
+
+    bvh->built_cost = bvh_sah_cost(bvh);
+    bvh->build_seconds = seconds_now() - start_time;
+    return true;
+}
+
+/// @brief (Re)build the BVH over the world, with one thread per hardware thread (see bvh_build_with_threads).
+static inline bool bvh_build(struct BVH *bvh, const struct Hittable *world, int world_length)
+{
+    return bvh_build_with_threads(bvh, world, world_length, 0);
+}
+
+/// @brief Update the boxes of the tree to fit the objects where they are now (the tree structure stays the same).
+/// @remark This is much cheaper than a rebuild, but the tree gets worse as objects move further from
+/// where they were when it was built (see bvh_sah_cost).
+static inline void bvh_refit(struct BVH *bvh)
+{
+    // Children always come after their parent, so going backwards we always see children first.
+    for (int i = bvh->num_nodes - 1; i >= 0; i--)
+    {
+        struct BVH_Node *node = &bvh->nodes[i];
+
+        if (node->count > 0)
+        {
+            node->box = AABB_EMPTY;
+            for (int k = node->first; k < node->first + node->count; k++)
+            {
+                struct AABB box = hittable_bounding_box(&bvh->world[bvh->indices[k]]);
+                node->box = aabb_union(&node->box, &box);
+            }
+        }
+        else if (bvh->world_length > 0)
+        {
+            node->box = aabb_union(&bvh->nodes[node->left].box, &bvh->nodes[node->right].box);
+        }
+    }
+}
+
+/// @brief returns if any objects in the BVH are hit by the ray (the same as world_hit, but faster).
+/// @param ray
+/// @param ray_interval
+/// @param rec the Hit Record-- updated accordingly
+static inline bool bvh_hit(const struct BVH *bvh, const struct Ray *ray, struct Interval ray_interval, struct Hit_Record *rec)
+{
+    if (bvh->world_length == 0)
+    {
+        return false;
+    }
+
+    struct Hit_Record temp_rec;
+    bool hit_anything = false;
+    double closest_so_far = ray_interval.max;
+
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const struct BVH_Node *node = &bvh->nodes[stack[--stack_size]];
+
+        struct Interval node_interval = {.min = ray_interval.min, .max = closest_so_far};
+        if (!aabb_hit(&node->box, ray, &node_interval))
+        {
+            continue;
+        }
+
+        if (node->count > 0)
+        {
+            for (int k = node->first; k < node->first + node->count; k++)
+            {
+                const struct Hittable *object = &bvh->world[bvh->indices[k]];
+                if (hittable_hit(object, ray, (struct Interval){.min = ray_interval.min, .max = closest_so_far},
+                                 &temp_rec))
+                {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    *rec = temp_rec;
+                    rec->object = object;
+                }
+            }
+            continue;
+        }
+
+        // Visit the child the ray enters first before the other one (push it last),
+        // since a hit there lets us skip more of the other one.
+        struct Interval left_interval = {.min = ray_interval.min, .max = closest_so_far};
+        struct Interval right_interval = left_interval;
+        bool hit_left = aabb_hit(&bvh->nodes[node->left].box, ray, &left_interval);
+        bool hit_right = aabb_hit(&bvh->nodes[node->right].box, ray, &right_interval);
+
+        if (hit_left && hit_right)
+        {
+            bool left_first = left_interval.min <= right_interval.min;
+            stack[stack_size++] = left_first ? node->right : node->left;
+            stack[stack_size++] = left_first ? node->left : node->right;
+        }
+        else if (hit_left)
+        {
+            stack[stack_size++] = node->left;
+        }
+        else if (hit_right)
+        {
+            stack[stack_size++] = node->right;
+        }
+    }
+
+    return hit_anything;
+}
+
+/// @brief The BVH version of world_transmittance (any-hit: stops at the first solid object found).
+static inline double bvh_transmittance(const struct BVH *bvh, const struct Ray *ray, struct Interval ray_interval)
+{
+    if (bvh->world_length == 0)
+    {
+        return 1.0;
+    }
+
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const struct BVH_Node *node = &bvh->nodes[stack[--stack_size]];
+
+        struct Interval node_interval = ray_interval;
+        if (!aabb_hit(&node->box, ray, &node_interval))
+        {
+            continue;
+        }
+
+        if (node->count == 0)
+        {
+            stack[stack_size++] = node->left;
+            stack[stack_size++] = node->right;
+            continue;
+        }
+
+        for (int k = node->first; k < node->first + node->count; k++)
+        {
+            const struct Hittable *object = &bvh->world[bvh->indices[k]];
+
+            if (object->which == (enum Which_Hittable)Constant_Medium)
+            {
+                transmittance *= constant_medium_transmittance(&object->object.constant_medium, ray, ray_interval);
+                if (transmittance <= 0)
+                {
+                    return 0;
+                }
+            }
+            else if (hittable_hit(object, ray, ray_interval, &temp_rec))
+            {
+                return 0;
+            }
+        }
+    }
+
+    return transmittance;
+}
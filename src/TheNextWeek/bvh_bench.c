@@ -0,0 +1,325 @@
+#include "rtweekend.h"
+#include "camera.h"
+#include "scene.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "grid.h"
+#include "lazy_bvh.h"
+#include "ray_sort.h"
+#include "scene_file.h"
+
+#include <string.h>
+
+/*
+
+Compares how fast the binary BVH (see bvh.h), the 4 and 8 wide BVHs (see wide_bvh.h), the compressed BVH
+(see compressed_bvh.h), the grid (see grid.h) and the lazy BVH (see lazy_bvh.h) find hits, for the rays ray_color
+actually traces:
+
+    - Primary rays: one camera ray per pixel. Neighboring rays start at the same point and go in almost the
+      same direction, so they visit almost the same nodes (they are coherent).
+    - Bounce rays: the rays scattered off whatever the primary rays hit (as ray_color scatters them).
+      They start all over the scene and go every which way (they are incoherent).
+    - Sorted rays: the bounce rays, sorted as render_tile_batch sorts them (see ray_sort.h). It also prints how
+      fast they sort, and so whether sorting them before tracing them pays off.
+
+Each set of rays is traced (on one thread) with each of them, and they must all find exactly the same hits.
+It also prints how much memory each takes per object (its nodes or cells, and the indices of the objects),
+whether grid_suits would pick the grid for the scene, and how long it takes to build the binary BVH and trace
+the primary rays once (the first image) compared with the lazy BVH, which only splits the nodes they reach.
+
+    build\scene_gen.exe big.scene --count 1000000 --layout clustered
+    build\bvh_bench.exe big.scene
+
+Optionally pass the image width (the default is 320, so 320 x 180 rays of each kind) and how many seconds to
+trace each set for (the default is 1).
+
+*/
+
+/// @brief The first hit of each ray (to check that every BVH finds the same ones).
+struct Bench_Hit
+{
+    double t;
+    const struct Hittable *object; //< NULL if the ray hit nothing
+};
+
+/// @brief Trace all the rays (over and over, for at least seconds) and return how many million rays per second.
+static double bench_trace(const struct Scene *scene, const struct Ray *rays, int num_rays, double seconds,
+                          struct Bench_Hit *hits)
+{
+    long traced = 0;
+    double start = seconds_now();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < num_rays; i++)
+        {
+            struct Hit_Record rec;
+            bool hit = scene_hit(scene, &rays[i], (struct Interval){.min = 0.001, .max = infinity}, &rec);
+            hits[i] = (struct Bench_Hit){.t = hit ? rec.t : infinity, .object = hit ? rec.object : NULL};
+        }
+        traced += num_rays;
+        elapsed = seconds_now() - start;
+    } while (elapsed < seconds);
+
+    return traced / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Pass the scene file to trace (build\\bvh_bench.exe big.scene [width] [seconds])\n");
+        return EXIT_FAILURE;
+    }
+    int image_width = (argc > 2) ? atoi(argv[2]) : 320;
+    double seconds = (argc > 3) ? atof(argv[3]) : 1;
+
+    struct Scene_File file;
+    if (!scene_file_load(&file, argv[1], 0))
+    {
+        return EXIT_FAILURE;
+    }
+
+    struct Scene scene;
+    if (!scene_init(&scene, file.world, file.world_length))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct BVH bvh = {0};
+    if (!bvh_build(&bvh, file.world, file.world_length))
+    {
+        fprintf(stderr, "Could not allocate the BVH!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct Wide_BVH wide4 = {0}, wide8 = {0};
+    struct Compressed_BVH compressed = {0};
+    double start = seconds_now();
+    wide_bvh_build(&wide4, &bvh, 4);
+    double collapse4 = seconds_now() - start;
+    start = seconds_now();
+    wide_bvh_build(&wide8, &bvh, 8);
+    double collapse8 = seconds_now() - start;
+    start = seconds_now();
+    compressed_bvh_build(&compressed, &bvh);
+    double compress = seconds_now() - start;
+    struct Grid grid = {0};
+    grid_build(&grid, file.world, file.world_length);
+    struct Lazy_BVH lazy = {0};
+    lazy_bvh_build(&lazy, file.world, file.world_length);
+
+    double indices = (double)file.world_length * sizeof(int);
+    printf("%i spheres\n", file.world_length);
+    printf("  binary:     built in %.3f s, %9i nodes, %6.1f bytes per object\n", bvh.build_seconds, bvh.num_nodes,
+           (bvh.num_nodes * (double)sizeof(struct BVH_Node) + indices) / file.world_length);
+    printf("  4 wide:     built in %.3f s, %9i nodes, %6.1f bytes per object\n", collapse4, wide4.num_groups,
+           (wide4.num_groups * (double)sizeof(struct Wide_BVH_Group) + indices) / file.world_length);
+    printf("  8 wide:     built in %.3f s, %9i nodes, %6.1f bytes per object\n", collapse8, wide8.num_groups / 2,
+           (wide8.num_groups * (double)sizeof(struct Wide_BVH_Group) + indices) / file.world_length);
+    printf("  compressed: built in %.3f s, %9i nodes, %6.1f bytes per object\n", compress, compressed.num_nodes,
+           (double)compressed_bvh_memory(&compressed) / file.world_length);
+    printf("  grid:       built in %.3f s, %9lli cells, %6.1f bytes per object (%i levels, %.0f%% of objects in "
+           "dense cells, %i objects outside them, object sizes spread %.1fx: it %s the scene)\n",
+           grid.build_seconds, grid.num_cells,
+           (grid.num_cells * (double)sizeof(struct Grid_Cell) + grid.num_objects * (double)sizeof(int)) /
+               file.world_length,
+           grid.num_levels, 100 * grid.dense_fraction, grid.num_large, grid.size_spread,
+           grid_suits(&grid) ? "suits" : "does not suit");
+    printf("  lazy:       top built in %.3f s, %9i nodes\n", lazy.build_seconds, lazy_bvh_num_nodes(&lazy));
+#if defined(VEC4_AVX)
+    printf("Wide nodes are tested with AVX\n");
+#elif defined(VEC4_SSE2)
+    printf("Wide nodes are tested with SSE2\n");
+#else
+    printf("Wide nodes are tested with plain C\n");
+#endif
+
+    // The rays: one camera ray per pixel, and the rays scattered off what they hit.
+    const struct Scene_File_Header *header = &file.header;
+    struct Camera_Config cam = {
+        .aspect_ratio = 16.0 / 9.0,
+        .image_width = image_width,
+        .samples_per_pixel = 1,
+        .vfov = header->vfov,
+        .lookfrom = {header->lookfrom[0], header->lookfrom[1], header->lookfrom[2]},
+        .lookat = {header->lookat[0], header->lookat[1], header->lookat[2]},
+        .vup = {0, 1, 0},
+        .defocus_angle = header->defocus_angle,
+        .focus_dist = header->focus_dist,
+    };
+    struct Camera_Info cam_info;
+    camera_initialize(&cam, &cam_info);
+
+    int num_primary = image_width * cam_info.image_height;
+    struct Ray *primary = malloc(num_primary * sizeof(struct Ray));
+    struct Ray *bounce = malloc(num_primary * sizeof(struct Ray));
+    struct Bench_Hit *reference = malloc(num_primary * sizeof(struct Bench_Hit));
+    struct Bench_Hit *hits = malloc(num_primary * sizeof(struct Bench_Hit));
+    if (primary == NULL || bounce == NULL || reference == NULL || hits == NULL)
+    {
+        fprintf(stderr, "Could not allocate the rays!\n");
+        return EXIT_FAILURE;
+    }
+
+    random_seed(1);
+    scene.bvh = &bvh;
+    int num_bounce = 0;
+    for (int j = 0; j < cam_info.image_height; j++)
+    {
+        for (int i = 0; i < image_width; i++)
+        {
+            struct Ray *ray = &primary[j * image_width + i];
+            get_ray(ray, &cam_info, i, j, cam.defocus_angle);
+
+            struct Hit_Record rec;
+            struct Ray scattered;
+            color3 attenuation;
+            double pdf;
+            if (scene_hit(&scene, ray, (struct Interval){.min = 0.001, .max = infinity}, &rec) &&
+                material_scatter(ray, &rec, attenuation, &scattered, &pdf))
+            {
+                bounce[num_bounce++] = scattered;
+            }
+        }
+    }
+
+    // The bounce rays sorted (over and over, to time it).
+    struct Ray *sorted = malloc(num_primary * sizeof(struct Ray));
+    struct Ray_Sort_Item *order = malloc(num_primary * sizeof(struct Ray_Sort_Item));
+    struct Ray_Sort_Item *scratch = malloc(num_primary * sizeof(struct Ray_Sort_Item));
+    if (sorted == NULL || order == NULL || scratch == NULL)
+    {
+        fprintf(stderr, "Could not allocate the rays!\n");
+        return EXIT_FAILURE;
+    }
+    struct Ray_Sort_Cells cells = ray_sort_cells(&bvh.nodes[0].box);
+    long num_sorted = 0;
+    double sort_seconds;
+    start = seconds_now();
+    do
+    {
+        for (int i = 0; i < num_bounce; i++)
+        {
+            order[i] = (struct Ray_Sort_Item){.key = ray_sort_key(&cells, &bounce[i]), .index = i};
+        }
+        ray_sort(order, scratch, num_bounce);
+        num_sorted += num_bounce;
+        sort_seconds = seconds_now() - start;
+    } while (sort_seconds < seconds);
+    double sort_rate = num_sorted / sort_seconds / 1e6;
+    for (int i = 0; i < num_bounce; i++)
+    {
+        sorted[i] = bounce[order[i].index];
+    }
+
+    // The first image: the build, and the primary rays traced once (which is when the lazy BVH splits its nodes).
+    scene.bvh = NULL;
+    scene.lazy_bvh = &lazy;
+    start = seconds_now();
+    bench_trace(&scene, primary, num_primary, 0, hits);
+    double lazy_first = lazy.build_seconds + seconds_now() - start;
+    scene.lazy_bvh = NULL;
+    scene.bvh = &bvh;
+    start = seconds_now();
+    bench_trace(&scene, primary, num_primary, 0, reference);
+    double binary_first = bvh.build_seconds + seconds_now() - start;
+    printf("First image: %.3f s with the binary BVH, %.3f s with the lazy BVH (%.2fx faster, %i of %i nodes split)\n",
+           binary_first, lazy_first, binary_first / lazy_first, lazy_bvh_num_nodes(&lazy), bvh.num_nodes);
+
+    const struct
+    {
+        const char *name;
+        const struct Ray *rays;
+        int num_rays;
+    } ray_sets[] = {{"primary", primary, num_primary}, {"bounce", bounce, num_bounce}, {"sorted", sorted, num_bounce}};
+    const int num_ray_sets = sizeof(ray_sets) / sizeof(ray_sets[0]);
+
+    // The BVHs to compare with the binary one.
+    const struct
+    {
+        const char *name;
+        const struct Wide_BVH *wide_bvh;
+        const struct Compressed_BVH *compressed_bvh;
+        const struct Grid *grid;
+        const struct Lazy_BVH *lazy_bvh;
+    } others[] = {{"4 wide BVH", &wide4, NULL, NULL, NULL},
+                  {"8 wide BVH", &wide8, NULL, NULL, NULL},
+                  {"compressed BVH", NULL, &compressed, NULL, NULL},
+                  {"grid", NULL, NULL, &grid, NULL},
+                  {"lazy BVH", NULL, NULL, NULL, &lazy}};
+    const int num_others = sizeof(others) / sizeof(others[0]);
+
+    printf("\nMillion rays per second (and how much faster than the binary BVH):\n");
+    printf("%-8s %8s %14s %15s %15s %15s %15s %15s\n", "rays", "count", "binary", "4 wide", "8 wide", "compressed",
+           "grid", "lazy");
+    bool all_match = true;
+    double binary_rates[sizeof(ray_sets) / sizeof(ray_sets[0])];
+    for (int r = 0; r < num_ray_sets; r++)
+    {
+        scene.bvh = &bvh;
+        scene.wide_bvh = NULL;
+        scene.compressed_bvh = NULL;
+        scene.grid = NULL;
+        scene.lazy_bvh = NULL;
+        double binary = bench_trace(&scene, ray_sets[r].rays, ray_sets[r].num_rays, seconds, reference);
+        binary_rates[r] = binary;
+
+        double other[sizeof(others) / sizeof(others[0])];
+        for (int w = 0; w < num_others; w++)
+        {
+            scene.wide_bvh = others[w].wide_bvh;
+            scene.compressed_bvh = others[w].compressed_bvh;
+            scene.grid = others[w].grid;
+            scene.lazy_bvh = others[w].lazy_bvh;
+            other[w] = bench_trace(&scene, ray_sets[r].rays, ray_sets[r].num_rays, seconds, hits);
+
+            int mismatches = 0;
+            for (int i = 0; i < ray_sets[r].num_rays; i++)
+            {
+                mismatches += hits[i].t != reference[i].t || hits[i].object != reference[i].object;
+            }
+            if (mismatches > 0)
+            {
+                fprintf(stderr, "The %s found different hits than the binary BVH for %i %s rays!\n",
+                        others[w].name, mismatches, ray_sets[r].name);
+                all_match = false;
+            }
+        }
+
+        printf("%-8s %8i %7.3f Mray/s", ray_sets[r].name, ray_sets[r].num_rays, binary);
+        for (int w = 0; w < num_others; w++)
+        {
+            printf(" %7.3f (%.2fx)", other[w], other[w] / binary);
+        }
+        printf("\n");
+    }
+
+    // Sorting and then tracing takes the time of both (per ray).
+    double sort_and_trace = 1 / (1 / sort_rate + 1 / binary_rates[2]);
+    printf("\nSorting the bounce rays: %.3f million rays per second, so sorted and then traced with the binary BVH "
+           "they go at %.3f Mray/s (%.2fx unsorted): sorting %s\n",
+           sort_rate, sort_and_trace, sort_and_trace / binary_rates[1],
+           (sort_and_trace > binary_rates[1]) ? "pays off" : "does not pay off");
+
+    free(primary);
+    free(bounce);
+    free(sorted);
+    free(order);
+    free(scratch);
+    free(reference);
+    free(hits);
+    wide_bvh_free(&wide4);
+    wide_bvh_free(&wide8);
+    compressed_bvh_free(&compressed);
+    grid_free(&grid);
+    lazy_bvh_free(&lazy);
+    bvh_free(&bvh);
+    scene_free(&scene);
+    scene_file_free(&file);
+
+    return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
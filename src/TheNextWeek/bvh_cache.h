@@ -0,0 +1,369 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "mapped_file.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+Building the BVH of a scene of millions of objects takes a second or more, every run, though the scene
+rarely changes between runs. So we can save the built BVH to a file, and next time map the file (see
+mapped_file.h) and use its nodes right where they are instead of building them again:
+
+    build\theNextWeek.exe 6 big.scene --bvh-cache cache_dir > image.ppm
+
+The file is named after a hash of the scene (bvh_scene_hash): the boxes of its objects, in order, which is all
+the builder looks at. So a scene whose objects moved (or were added, or removed) has a different hash, and
+looks for a different file. The file is a fixed size header, then the nodes, then the indices, stored as they
+are in memory (nodes point at each other by index, so they work wherever the file is mapped). Like scene files,
+everything is in the byte order of the machine that wrote it.
+
+Before we use a file we check that it is one we can read, that it was saved for this very scene, and that its
+nodes make a tree over the world's objects (every index in range, children after their parents, every node
+but the root the child of exactly one node, no leaf bigger than the builder makes them, and no deeper than the
+traversal stack). A file that fails any check is stale (or broken), so we build the BVH and save it again.
+
+*/
+
+#define BVH_CACHE_MAGIC "RTBVHCA1"
+#define BVH_CACHE_VERSION 1
+#define BVH_CACHE_BYTE_ORDER 0x01020304u
+#define BVH_CACHE_ALIGNMENT 64     //< The nodes and indices start at multiples of this (a cache line)
+#define BVH_CACHE_HASH_CHUNK 65536 //< bvh_scene_hash hashes the objects in chunks of this many
+
+struct BVH_Cache_Header
+{
+    char magic[8];           //< BVH_CACHE_MAGIC (without its terminating 0)
+    uint32_t version;        //< BVH_CACHE_VERSION
+    uint32_t byte_order;     //< BVH_CACHE_BYTE_ORDER, as written by the machine that wrote the file
+    uint32_t node_size;      //< sizeof(struct BVH_Node) where the file was written
+    int32_t world_length;    //< How many objects the scene has
+    int32_t num_nodes;
+    uint32_t reserved0;      //< 0
+    uint64_t scene_hash;     //< bvh_scene_hash of the scene
+    uint64_t nodes_offset;   //< Where the nodes start in the file
+    uint64_t indices_offset; //< Where the indices start in the file
+    uint64_t file_size;
+    double built_cost;       //< The BVH's built_cost
+    uint32_t reserved[14];   //< 0 (room for later versions)
+};
+
+_Static_assert(sizeof(struct BVH_Cache_Header) == 128, "the BVH cache header must be 128 bytes");
+
+/// @brief A BVH loaded from a cache file (see bvh_cache_load).
+struct BVH_Cache
+{
+    struct Mapped_File file;
+    struct BVH bvh; //< Its nodes and indices are in the mapped file, so it is read only (see bvh_cache_load)
+};
+
+/// @brief A chunk of objects for bvh_scene_hash_job to hash.
+struct BVH_Hash_Job
+{
+    const struct Hittable *world;
+    int world_length;
+    int first_chunk; //< This job hashes chunks first_chunk, first_chunk + step, ...
+    int step;
+    uint64_t *chunk_hashes;
+};
+
+static int bvh_scene_hash_job(void *arg)
+{
+    const struct BVH_Hash_Job *job = arg;
+    int num_chunks = (job->world_length + BVH_CACHE_HASH_CHUNK - 1) / BVH_CACHE_HASH_CHUNK;
+    for (int c = job->first_chunk; c < num_chunks; c += job->step)
+    {
+        int start = c * BVH_CACHE_HASH_CHUNK;
+        int end = (job->world_length - start < BVH_CACHE_HASH_CHUNK) ? job->world_length : start + BVH_CACHE_HASH_CHUNK;
+
+        uint64_t hash = (uint64_t)c;
+        for (int i = start; i < end; i++)
+        {
+            struct AABB box = hittable_bounding_box(&job->world[i]);
+            const double bounds[6] = {box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max};
+            for (int k = 0; k < 6; k++)
+            {
+                uint64_t bits;
+                memcpy(&bits, &bounds[k], sizeof(bits));
+                hash = mix_bits(hash ^ bits);
+            }
+        }
+        job->chunk_hashes[c] = hash;
+    }
+    return 0;
+}
+
+/// @brief A hash of what the BVH of the world depends on: the boxes of its objects (in order), and the settings
+/// of the builder. The same for any number of threads.
+/// @param num_threads How many threads to hash with (0 means one per hardware thread).
+static inline uint64_t bvh_scene_hash(const struct Hittable *world, int world_length, int num_threads)
+{
+    int num_chunks = (world_length + BVH_CACHE_HASH_CHUNK - 1) / BVH_CACHE_HASH_CHUNK;
+    num_threads = (num_threads > 0) ? num_threads : hardware_threads();
+    num_threads = (num_threads < num_chunks) ? num_threads : (num_chunks > 0 ? num_chunks : 1);
+
+    uint64_t *chunk_hashes = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(uint64_t));
+    struct BVH_Hash_Job *jobs = malloc(num_threads * sizeof(struct BVH_Hash_Job));
+    if (chunk_hashes == NULL || jobs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the scene hash!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < num_threads; k++)
+    {
+        jobs[k] = (struct BVH_Hash_Job){.world = world,
+                                        .world_length = world_length,
+                                        .first_chunk = k,
+                                        .step = num_threads,
+                                        .chunk_hashes = chunk_hashes};
+    }
+    run_jobs(bvh_scene_hash_job, jobs, sizeof(struct BVH_Hash_Job), num_threads);
+
+    // Add up the chunks in order (so the hash doesn't depend on which thread did which).
+    const uint64_t settings[] = {world_length,  BVH_MAX_LEAF_SIZE, BVH_MAX_SAH_LEAF_SIZE,
+                                 BVH_BINS,      BVH_MAX_DEPTH,     sizeof(struct BVH_Node)};
+    uint64_t hash = 0;
+    for (size_t k = 0; k < sizeof(settings) / sizeof(settings[0]); k++)
+    {
+        hash = mix_bits(hash ^ settings[k]);
+    }
+    for (int c = 0; c < num_chunks; c++)
+    {
+        hash = mix_bits(hash ^ chunk_hashes[c]);
+    }
+
+    free(jobs);
+    free(chunk_hashes);
+    return hash;
+}
+
+/// @brief The path of the cache file for the scene with the given hash, in the directory dir.
+static inline void bvh_cache_path(char *path, size_t size, const char *dir, uint64_t scene_hash)
+{
+    snprintf(path, size, "%s/%016llx.bvh", dir, (unsigned long long)scene_hash);
+}
+
+static inline size_t bvh_cache_align(size_t offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+/// @brief Whether nodes and indices make a BVH over world_length objects we can safely walk (see above).
+/// @param why Set to what is wrong with them (if anything).
+static bool bvh_cache_tree_valid(const struct BVH_Node *nodes, int num_nodes, const int *indices, int world_length,
+                                 const char **why)
+{
+    for (int i = 0; i < world_length; i++)
+    {
+        if (indices[i] < 0 || indices[i] >= world_length)
+        {
+            *why = "an object index is out of range";
+            return false;
+        }
+    }
+
+    // Children come after their parents, so one pass forward finds every node's depth from its parent's.
+    // Each node must be reached exactly once (from the root, or as the child of one node), so the nodes make
+    // a tree (and not a graph whose shared nodes could hide paths deeper than the depths we checked).
+    // depth is 0 for nodes not reached yet, and one more than the depth of the node otherwise.
+    unsigned char *depth = calloc(num_nodes, 1);
+    if (depth == NULL)
+    {
+        *why = "could not allocate the check";
+        return false;
+    }
+    depth[0] = 1;
+    bool ok = true;
+    for (int n = 0; ok && n < num_nodes; n++)
+    {
+        const struct BVH_Node *node = &nodes[n];
+        *why = "a node is out of range";
+        if (depth[n] == 0)
+        {
+            *why = "a node is not in the tree";
+            ok = false;
+        }
+        else if (node->count > 0)
+        {
+            ok = node->first >= 0 && node->first <= world_length - node->count;
+            // The builder never makes bigger leaves (and the compressed BVH has a byte for their size).
+            if (ok && node->count > BVH_MAX_SAH_LEAF_SIZE)
+            {
+                *why = "a leaf is too big";
+                ok = false;
+            }
+        }
+        else if (node->count == 0)
+        {
+            ok = node->left > n && node->left < num_nodes && node->right > n && node->right < num_nodes;
+            if (ok && depth[n] >= BVH_STACK_SIZE)
+            {
+                *why = "the tree is too deep";
+                ok = false;
+            }
+            if (ok && (depth[node->left] != 0 || depth[node->right] != 0 || node->left == node->right))
+            {
+                *why = "a node has more than one parent";
+                ok = false;
+            }
+            if (ok)
+            {
+                depth[node->left] = depth[node->right] = depth[n] + 1;
+            }
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    free(depth);
+    return ok;
+}
+
+/// @brief Load the BVH of the world from the cache file at path, if the file was saved for this scene (see above).
+/// Call bvh_cache_close once done with it (and not bvh_free).
+/// @param scene_hash bvh_scene_hash of the world.
+/// @param why Set to why the file can't be used (if it can't).
+/// @return false if there is no such file, or it is stale (or broken). cache->bvh is then zero.
+/// @remark The BVH's nodes are in the mapped file (which is mapped read only), so don't refit or rebuild it.
+static inline bool bvh_cache_load(struct BVH_Cache *cache, const char *path, const struct Hittable *world,
+                                  int world_length, uint64_t scene_hash, const char **why)
+{
+    memset(cache, 0, sizeof(*cache));
+    double start_time = seconds_now();
+
+    if (!map_file(&cache->file, path))
+    {
+        *why = "no such file";
+        return false;
+    }
+
+    struct BVH_Cache_Header header = {0};
+    const struct Mapped_File *file = &cache->file;
+    if (file->size >= sizeof(header))
+    {
+        memcpy(&header, file->data, sizeof(header));
+    }
+
+    bool ok = false;
+    if (file->size < sizeof(header) || memcmp(header.magic, BVH_CACHE_MAGIC, 8) != 0)
+    {
+        *why = "not a BVH cache file";
+    }
+    else if (header.version != BVH_CACHE_VERSION || header.byte_order != BVH_CACHE_BYTE_ORDER ||
+             header.node_size != sizeof(struct BVH_Node))
+    {
+        *why = "written by another version or another kind of machine";
+    }
+    else if (header.scene_hash != scene_hash || header.world_length != world_length)
+    {
+        *why = "saved for another scene";
+    }
+    else if (header.file_size != file->size || header.num_nodes < 1 ||
+             header.num_nodes > ((world_length > 0) ? 2 * world_length - 1 : 1) ||
+             header.nodes_offset % BVH_CACHE_ALIGNMENT != 0 || header.indices_offset % BVH_CACHE_ALIGNMENT != 0 ||
+             header.nodes_offset < sizeof(header) ||
+             header.indices_offset < header.nodes_offset + (uint64_t)header.num_nodes * sizeof(struct BVH_Node) ||
+             header.indices_offset + (uint64_t)world_length * sizeof(int) > file->size)
+    {
+        *why = "the file size does not match its header (was it cut short?)";
+    }
+    else
+    {
+        // Mapped files start at a page boundary, so the nodes are aligned (see BVH_CACHE_ALIGNMENT).
+        const struct BVH_Node *nodes = (const struct BVH_Node *)(file->data + header.nodes_offset);
+        const int *indices = (const int *)(file->data + header.indices_offset);
+        ok = world_length == 0 || bvh_cache_tree_valid(nodes, header.num_nodes, indices, world_length, why);
+        if (ok)
+        {
+            cache->bvh = (struct BVH){
+                .world = world,
+                .world_length = world_length,
+                .nodes = (struct BVH_Node *)nodes,
+                .num_nodes = header.num_nodes,
+                .indices = (int *)indices,
+                .built_cost = header.built_cost,
+            };
+        }
+    }
+
+    if (!ok)
+    {
+        unmap_file(&cache->file);
+        memset(cache, 0, sizeof(*cache));
+        return false;
+    }
+
+#ifndef _WIN32
+    // Rays jump all over the nodes, so reading ahead (which map_file asks for) would only waste memory.
+    madvise((void *)file->data, file->size, MADV_RANDOM);
+#endif
+
+    cache->bvh.build_seconds = seconds_now() - start_time;
+    return true;
+}
+
+static inline void bvh_cache_close(struct BVH_Cache *cache)
+{
+    if (cache->file.data != NULL)
+    {
+        unmap_file(&cache->file);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+/// @brief Save the BVH to a cache file at path (see above), for the scene with the given hash.
+/// @return false if the file could not be written (the reason is printed to stderr).
+/// @remark The file is written under another name first and then renamed, so a run that loads it at the same
+/// time (or after this one was killed) never sees half a file.
+static inline bool bvh_cache_save(const struct BVH *bvh, const char *path, uint64_t scene_hash)
+{
+    struct BVH_Cache_Header header = {
+        .version = BVH_CACHE_VERSION,
+        .byte_order = BVH_CACHE_BYTE_ORDER,
+        .node_size = sizeof(struct BVH_Node),
+        .world_length = bvh->world_length,
+        .num_nodes = bvh->num_nodes,
+        .scene_hash = scene_hash,
+        .built_cost = bvh->built_cost,
+    };
+    memcpy(header.magic, BVH_CACHE_MAGIC, 8);
+    header.nodes_offset = bvh_cache_align(sizeof(header));
+    header.indices_offset = bvh_cache_align(header.nodes_offset + (size_t)bvh->num_nodes * sizeof(struct BVH_Node));
+    header.file_size = header.indices_offset + (size_t)bvh->world_length * sizeof(int);
+
+    char temp_path[4096];
+    int length = snprintf(temp_path, sizeof(temp_path), "%s.%016llx.tmp", path, (unsigned long long)random_run_seed());
+    FILE *out = (length > 0 && length < (int)sizeof(temp_path)) ? fopen(temp_path, "wb") : NULL;
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not write the BVH cache file %s\n", temp_path);
+        return false;
+    }
+
+    static const unsigned char padding[BVH_CACHE_ALIGNMENT] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(padding, 1, header.nodes_offset - sizeof(header), out) == header.nodes_offset - sizeof(header) &&
+              fwrite(bvh->nodes, sizeof(struct BVH_Node), bvh->num_nodes, out) == (size_t)bvh->num_nodes;
+    size_t gap = header.indices_offset - header.nodes_offset - (size_t)bvh->num_nodes * sizeof(struct BVH_Node);
+    ok = ok && fwrite(padding, 1, gap, out) == gap &&
+         fwrite(bvh->indices, sizeof(int), bvh->world_length, out) == (size_t)bvh->world_length;
+    ok = (fclose(out) == 0) && ok;
+
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows.
+    remove(path);
+#endif
+    if (!ok || rename(temp_path, path) != 0)
+    {
+        fprintf(stderr, "Could not write the BVH cache file %s\n", path);
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
@@ -5,11 +5,37 @@
 #include "sphere.h"
 #include "rtweekend.h"
 #include "material.h"
+#include "scene.h"
+#include "pdf.h"
+#include "vec4.h"
+#include "pfm.h"
+#include "accumulation.h"
+#include "ray_sort.h"
+#include "tile_order.h"
+#include "render_stats.h"
+#include "tile_queue.h"
+#include "tiled_image.h"
+#include "mapped_file.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+
+/// @brief The tile size of renders, if no other is given (tiled renders have their own, TILED_IMAGE_TILE_SIZE).
+#define CAMERA_TILE_SIZE 16
+
+/// @brief The file formats we can write a rendered image in.
+enum Image_Format
+{
+    Ppm_Image, //< 8 bit gamma corrected colors (the default)
+    Pfm_Image,          //< Linear float colors, to tonemap later (see pfm.h and tonemap.c)
+    Accumulation_Image, //< Sums of samples, to merge with other runs later (see accumulation.h)
+};
 
 struct Camera_Config
 {
     double aspect_ratio;   //< Ratio of image width over height
     int image_width;       //< Rendered image width in pixel count
+    int image_height;      //< Optional. If set (not 0) this is the image height (and aspect_ratio is ignored).
     int samples_per_pixel; //< Count of random samples for each pixel
     int max_depth;         //< Maximum number of ray bounces into scene
     double vfov;           //< Vertical view angle (field of view) in degrees. This is effectively our zoom in/out.
@@ -28,21 +54,58 @@ struct Camera_Config
     /// See section 13 (Defocus Blur) for more details.
     double defocus_angle;
     double focus_dist; //< Distance from camera lookfrom point to plane of perfect focus
+
+    int num_threads; //< How many threads to render with (0 means one per hardware thread)
+    int tile_size;   //< We render the image in square tiles of this many pixels across (0 means CAMERA_TILE_SIZE)
+    enum Tile_Order tile_order; //< The order the threads take the tiles in (see tile_order.h)
+
+    /// @brief If set (not 0), trace the samples of a tile this many paths at a time, one bounce at a time,
+    /// sorting the rays of each bounce after the first so they are traced in a coherent order
+    /// (see render_tile_batch and ray_sort.h).
+    /// @remark Each sample then gets its own random numbers, so the noise differs from an image rendered without it.
+    int ray_batch;
+
+    /// @brief The seed of the random numbers used for rendering.
+    /// The same seed (and scene and config) always renders the same image.
+    uint64_t seed;
+
+    enum Image_Format output_format; //< The format camera_render writes the image in
+
+    /// @brief Optional. If set (not 0), camera_render renders in passes over the whole image
+    /// (see camera_render_progressive) and stops before the render takes more than this many seconds.
+    double time_budget;
+
+    /// @brief Optional. If set (not 0), camera_render renders in passes over the whole image
+    /// (see camera_render_progressive) until the noise in the image (see progressive_noise) is at most this.
+    double noise_target;
+
+    /// @brief When rendering in passes: the most samples per pixel to take (0 means no limit).
+    /// samples_per_pixel is not used then.
+    int max_samples_per_pixel;
+
+    /// @brief Optional. Where to add up the cost of each pixel (see render_stats.h).
+    /// This is only recorded when the renderer is built with RENDER_STATS.
+    struct Render_Stats *stats;
+
+    /// @brief Optional. If set, camera_render records the stats and writes them as heatmaps to
+    /// heatmap_prefix_time.ppm and so on (see render_stats_write_heatmaps).
+    const char *heatmap_prefix;
 };
 
 /// @brief Store derived camera information.
 /// This is not meant to be accessed or modified from outside this file.
+/// @remark This holds vec4 values (see vec4.h), so it must not be malloc'd.
 struct Camera_Info
 {
     int image_height;           //< Rendered image height
     double pixel_samples_scale; // Color scale factor for a sum of pixel samples
-    point3 center;              //< Camera center
-    point3 pixel00_loc;         //< Location of pixel 0, 0
-    vec3 pixel_delta_u;         //< Offset to pixel to the right
-    vec3 pixel_delta_v;         //< Offset to pixel below
-    vec3 u, v, w;               //< Camera frame basis vectors
-    vec3 defocus_disk_u;        //< Defocus disk horizontal radius
-    vec3 defocus_disk_v;        //< Defocus disk vertical radius
+    vec4 center;                //< Camera center
+    vec4 pixel00_loc;           //< Location of pixel 0, 0
+    vec4 pixel_delta_u;         //< Offset to pixel to the right
+    vec4 pixel_delta_v;         //< Offset to pixel below
+    vec4 u, v, w;               //< Camera frame basis vectors
+    vec4 defocus_disk_u;        //< Defocus disk horizontal radius
+    vec4 defocus_disk_v;        //< Defocus disk vertical radius
 };
 
 /// @brief returns if any objects in the world are hit by the ray
@@ -51,8 +114,8 @@ struct Camera_Info
 /// @param ray_interval
 /// @param rec the Hit Record-- updated accordingly
 /// @return
-bool world_hit(const struct Hittable *world, int world_length, const struct Ray *ray,
-               struct Interval ray_interval, struct Hit_Record *rec)
+static inline bool world_hit(const struct Hittable *world, int world_length, const struct Ray *ray,
+                             struct Interval ray_interval, struct Hit_Record *rec)
 {
 
     struct Hit_Record temp_rec;
@@ -61,138 +124,361 @@ bool world_hit(const struct Hittable *world, int world_length, const struct Ray
 
     for (int i = 0; i < world_length; i++)
     {
-        // find out which Hittable object this is
-        switch (world[i].which)
+        if (hittable_hit(&world[i], ray,
+                         (struct Interval){.min = ray_interval.min, .max = closest_so_far}, &temp_rec))
+        {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            // set rec to temp_rec
+            *rec = temp_rec;
+            rec->object = &world[i];
+        }
+    }
+
+    return hit_anything;
+}
+
+/// @brief Returns the fraction of light that gets through along the ray (in ray_interval) (for shadow rays).
+/// @remark Unlike world_hit, we don't need the closest hit: this is an any-hit query that stops at the
+/// first solid object it finds (any solid object blocks all the light).
+/// Participating media only block some of the light, so they multiply the result by their transmittance.
+static inline double world_transmittance(const struct Hittable *world, int world_length, const struct Ray *ray,
+                                         struct Interval ray_interval)
+{
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+
+    for (int i = 0; i < world_length; i++)
+    {
+        if (world[i].which == (enum Which_Hittable)Constant_Medium)
         {
-        case (enum Which_Hittable)Sphere:
-            if (sphere_hit(&world[i].object.sphere, ray,
-                           (struct Interval){.min = ray_interval.min, .max = closest_so_far}, &temp_rec))
+            transmittance *= constant_medium_transmittance(&world[i].object.constant_medium, ray, ray_interval);
+            if (transmittance <= 0)
             {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                // set rec to temp_rec
-                *rec = temp_rec;
+                return 0;
             }
-            break;
-
-        default:
-            fprintf(stderr, "Could not identify Hittable!\n");
-            fflush(stderr);
-            break;
+        }
+        else if (hittable_hit(&world[i], ray, ray_interval, &temp_rec))
+        {
+            return 0;
         }
     }
 
-    return hit_anything;
+    return transmittance;
 }
 
-///@brief sets the color for a given scene ray
-void ray_color(color3 color, const struct Ray *ray, int depth, const struct Hittable *world, int world_length)
+/// @brief returns if any objects in the scene are hit by the ray (using the scene grid or BVH if it has one)
+static inline bool scene_hit(const struct Scene *scene, const struct Ray *ray, struct Interval ray_interval, struct Hit_Record *rec)
 {
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
+    if (scene->grid != NULL)
     {
-        color[0] = 0;
-        color[1] = 0;
-        color[2] = 0;
+        return grid_hit(scene->grid, ray, ray_interval, rec);
+    }
+    if (scene->compressed_bvh != NULL)
+    {
+        return compressed_bvh_hit(scene->compressed_bvh, ray, ray_interval, rec);
+    }
+    if (scene->wide_bvh != NULL)
+    {
+        return wide_bvh_hit(scene->wide_bvh, ray, ray_interval, rec);
+    }
+    if (scene->lazy_bvh != NULL)
+    {
+        return lazy_bvh_hit(scene->lazy_bvh, ray, ray_interval, rec);
+    }
+    if (scene->bvh != NULL)
+    {
+        return bvh_hit(scene->bvh, ray, ray_interval, rec);
+    }
+    return world_hit(scene->world, scene->world_length, ray, ray_interval, rec);
+}
+
+/// @brief Returns the fraction of light that gets through along the ray (see world_transmittance).
+static inline double scene_transmittance(const struct Scene *scene, const struct Ray *ray, struct Interval ray_interval)
+{
+    if (scene->grid != NULL)
+    {
+        return grid_transmittance(scene->grid, ray, ray_interval);
+    }
+    if (scene->compressed_bvh != NULL)
+    {
+        return compressed_bvh_transmittance(scene->compressed_bvh, ray, ray_interval);
+    }
+    if (scene->wide_bvh != NULL)
+    {
+        return wide_bvh_transmittance(scene->wide_bvh, ray, ray_interval);
+    }
+    if (scene->lazy_bvh != NULL)
+    {
+        return lazy_bvh_transmittance(scene->lazy_bvh, ray, ray_interval);
+    }
+    if (scene->bvh != NULL)
+    {
+        return bvh_transmittance(scene->bvh, ray, ray_interval);
+    }
+    return world_transmittance(scene->world, scene->world_length, ray, ray_interval);
+}
+
+/// @brief The multiple importance sampling (MIS) weight for a sample taken with a strategy of density pdf_a,
+/// when it could also have been taken with a strategy of density pdf_b (the power heuristic).
+/// @remark We use two strategies to find light: sampling the lights directly, and following the scattered ray
+/// (which may hit a light by chance). Each is good where the other is bad (a small light is rarely hit by chance,
+/// but a large light seen at a grazing angle is a poor fit for light sampling). Weighting each sample by this
+/// means the weights of the two strategies always sum to 1, so we can add both without counting light twice.
+static inline double power_heuristic(double pdf_a, double pdf_b)
+{
+    double a2 = pdf_a * pdf_a;
+    double b2 = pdf_b * pdf_b;
+    return (a2 + b2 > 0) ? a2 / (a2 + b2) : 0;
+}
+
+/// @brief Sets color to the light a ray that hits nothing sees.
+static void background_color(color3 color, const struct Ray *ray, const struct Scene *scene)
+{
+    if (scene->environment != NULL)
+    {
+        environment_radiance(scene->environment, ray->direction, color);
         return;
     }
 
-    struct Hit_Record rec;
+    if (scene->has_background)
+    {
+        memcpy(color, scene->background, 3 * sizeof(double));
+        return;
+    }
 
-    // Note that we are careful to set the min to 0.001 to get rid of shadow acne (see section 9.3).
-    if (world_hit(world, world_length, ray, (struct Interval){.min = 0.001, .max = infinity}, &rec))
+    vec4 unit_dir = v4_unit(v4_load(ray->direction));
+
+    double a = 0.5 * (unit_dir.e[1] + 1.0);
+    // white is (1.0, 1.0, 1.0) and blue is (0.5, 0.7, 1.0);
+    // We want a linear interpolation where the bottom is white and the top is blue.
+    color[0] = (1.0 - a) * 1 + a * 0.5;
+    color[1] = (1.0 - a) * 1 + a * 0.7;
+    color[2] = (1.0 - a) * 1 + a * 1;
+}
+
+/// @brief Next-event estimation: sets direct to the light arriving at the hit point straight from
+/// a (randomly picked) light, times the material's BSDF and cos(theta) (see material_eval).
+static void sample_direct_light(color3 direct, const struct Ray *r_in, const struct Hit_Record *rec,
+                                const struct Scene *scene)
+{
+    direct[0] = 0;
+    direct[1] = 0;
+    direct[2] = 0;
+
+    struct Ray shadow_ray;
+    memcpy(shadow_ray.origin, rec->p, 3 * sizeof(double));
+    shadow_ray.tm = r_in->tm;
+
+    struct Pdf lights_pdf = make_lights_pdf(scene, rec->p, r_in->tm);
+    if (!pdf_generate(&lights_pdf, shadow_ray.direction))
     {
+        return;
+    }
 
-        struct Ray scattered;
-        color3 attenuation;
+    color3 f_cos;
+    double scatter_pdf = material_eval(rec, shadow_ray.direction, f_cos);
+    if (scatter_pdf <= 0)
+    {
+        return; // e.g. the light is behind the surface.
+    }
 
-        switch (rec.mat_cfg->mat)
+    // Find the light the shadow ray hits (and how much light it emits there).
+    // If it hits none of the lights, it can still reach the environment map (which is behind everything).
+    struct Hit_Record light_rec;
+    bool hit_light = false;
+    for (int i = 0; i < scene->num_lights; i++)
+    {
+        if (sphere_hit(scene->lights[i], &shadow_ray,
+                       (struct Interval){.min = 0.001, .max = hit_light ? light_rec.t : infinity}, &light_rec))
         {
-        case (enum Material)Lambertian:
-            if (lambertian_scatter(ray, &rec, attenuation, &scattered))
-            {
-                ray_color(color, &scattered, depth - 1, world, world_length);
-                multiply(color, attenuation, color);
-                return;
-            }
+            hit_light = true;
+        }
+    }
+    if (!hit_light && scene->environment == NULL)
+    {
+        return;
+    }
 
-            // set to black
-            color[0] = 0;
-            color[1] = 0;
-            color[2] = 0;
-            return;
+    color3 emitted;
+    if (hit_light)
+    {
+        material_emitted(&light_rec, emitted);
+    }
+    else
+    {
+        environment_radiance(scene->environment, shadow_ray.direction, emitted);
+    }
 
-            break;
+    // Is the light visible from this point?
+    double transmittance = scene_transmittance(scene, &shadow_ray,
+                                               (struct Interval){.min = 0.001,
+                                                                 .max = hit_light ? light_rec.t - 0.001 : infinity});
+    if (transmittance <= 0)
+    {
+        return;
+    }
 
-        case (enum Material)Metal:
+    double light_pdf = pdf_value(&lights_pdf, shadow_ray.direction);
+    double weight = power_heuristic(light_pdf, scatter_pdf);
 
-            if (metal_scatter(ray, &rec, attenuation, &scattered))
-            {
-                ray_color(color, &scattered, depth - 1, world, world_length);
-                multiply(color, attenuation, color);
-                return;
-            }
+    // direct = f_cos * emitted * transmittance * weight / light_pdf
+    v4_store(direct, v4_scale(v4_mul(v4_load(f_cos), v4_load(emitted)), transmittance * weight / light_pdf));
+}
+
+/// @brief Sets color to the light a ray that hits nothing brings back.
+/// @param scatter_pdf See ray_color.
+static void miss_color(color3 color, const struct Ray *ray, const struct Scene *scene, double scatter_pdf)
+{
+    background_color(color, ray, scene);
+
+    // The environment map is one of the lights we sample directly, so weight it just like a light we hit.
+    if (scene->environment != NULL && scene->sampling == Sample_Lights_Mis && scatter_pdf > 0)
+    {
+        double light_pdf = scene_light_pdf(scene, ray->origin, ray->direction, ray->tm);
+        scale(color, color, power_heuristic(scatter_pdf, light_pdf));
+    }
+}
+
+/// @brief Everything ray_color does where a ray hits something, other than following the scattered ray:
+/// the light the surface emits, the light reaching it directly (see sample_direct_light), and the ray it scatters.
+/// The light the ray brings back is then emitted + direct + attenuation * (the light the scattered ray brings back).
+/// @param scatter_pdf See ray_color.
+/// @param pdf Set to the scatter_pdf of the scattered ray.
+/// @return false if the ray is not scattered (then emitted is all the light it brings back).
+static bool hit_scatter(const struct Ray *ray, const struct Hit_Record *rec, const struct Scene *scene,
+                        double scatter_pdf, color3 emitted, color3 direct, color3 attenuation, struct Ray *scattered,
+                        double *pdf)
+{
+    material_emitted(rec, emitted);
+
+    // If we could also have reached this light by sampling it directly (at the previous bounce),
+    // that sample already counted part of its light, so we weight this one accordingly.
+    if (scene->sampling == Sample_Lights_Mis && scatter_pdf > 0 && hittable_is_light(rec->object))
+    {
+        double light_pdf = scene_light_pdf(scene, ray->origin, ray->direction, ray->tm);
+        scale(emitted, emitted, power_heuristic(scatter_pdf, light_pdf));
+    }
 
-            // set to black
-            color[0] = 0;
-            color[1] = 0;
-            color[2] = 0;
-            return;
+    if (!material_scatter(ray, rec, attenuation, scattered, pdf))
+    {
+        return false;
+    }
 
+    direct[0] = 0;
+    direct[1] = 0;
+    direct[2] = 0;
+
+    // Specular materials (pdf is 0) can only follow their own scattered ray.
+    if (*pdf > 0 && scene_light_count(scene) > 0)
+    {
+        switch (scene->sampling)
+        {
+        case Sample_Lights_Mis:
+            sample_direct_light(direct, ray, rec, scene);
             break;
 
-        case (enum Material)Dielectric:
+        case Sample_Mixture:
+        {
+            // Replace the scattered direction with one from the mixture, and reweight it accordingly.
+            struct Pdf surface_pdf, lights_pdf, mixture_pdf;
+            material_pdf(&surface_pdf, rec);
+            lights_pdf = make_lights_pdf(scene, rec->p, ray->tm);
+            mixture_pdf = make_mixture_pdf(&lights_pdf, &surface_pdf, 0.5);
 
-            if (dielectric_scatter(ray, &rec, attenuation, &scattered))
+            // Like a material that does not scatter, a direction we can't sample ends the path here.
+            if (!pdf_generate(&mixture_pdf, scattered->direction))
             {
-                ray_color(color, &scattered, depth - 1, world, world_length);
-                multiply(color, attenuation, color);
-                return;
+                return false;
             }
+            *pdf = pdf_value(&mixture_pdf, scattered->direction);
 
-            // set to black
-            color[0] = 0;
-            color[1] = 0;
-            color[2] = 0;
-            return;
+            color3 f_cos;
+            material_eval(rec, scattered->direction, f_cos);
+            scale(attenuation, f_cos, (*pdf > 0) ? 1 / *pdf : 0);
 
+            // No light sampling happens at this bounce, so light we hit gets its full weight.
+            *pdf = 0;
             break;
+        }
 
+        case Sample_Material_Only:
         default:
-            fprintf(stderr, "Could not identify Material of object hit!\n");
-            fflush(stderr);
+            *pdf = 0;
             break;
         }
     }
 
-    vec3 unit_dir;
+    return true;
+}
 
-    // We know that this use won't actually modify ray->direction
-    unit(unit_dir, (double *)ray->direction);
+///@brief sets the color for a given scene ray
+/// @param scatter_pdf The probability density of the scattering that generated this ray,
+/// or 0 if light sampling could not have generated this ray (camera rays, specular bounces, ...).
+/// This is only used to weight light we hit (see sample_direct_light).
+static inline void ray_color(color3 color, const struct Ray *ray, int depth, const struct Scene *scene, double scatter_pdf)
+{
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth <= 0)
+    {
+        color[0] = 0;
+        color[1] = 0;
+        color[2] = 0;
+        return;
+    }
 
-    double a = 0.5 * (unit_dir[1] + 1.0);
-    // white is (1.0, 1.0, 1.0) and blue is (0.5, 0.7, 1.0);
-    // We want a linear interpolation where the bottom is white and the top is blue.
-    color[0] = (1.0 - a) * 1 + a * 0.5;
-    color[1] = (1.0 - a) * 1 + a * 0.7;
-    color[2] = (1.0 - a) * 1 + a * 1;
+    struct Hit_Record rec = {0};
+
+    RENDER_STATS_COUNT(rays);
+
+    // Note that we are careful to set the min to 0.001 to get rid of shadow acne (see section 9.3).
+    if (!scene_hit(scene, ray, (struct Interval){.min = 0.001, .max = infinity}, &rec))
+    {
+        miss_color(color, ray, scene, scatter_pdf);
+        return;
+    }
+
+    color3 emitted, direct, attenuation;
+    struct Ray scattered;
+    double pdf;
+
+    if (!hit_scatter(ray, &rec, scene, scatter_pdf, emitted, direct, attenuation, &scattered, &pdf))
+    {
+        memcpy(color, emitted, 3 * sizeof(double));
+        return;
+    }
+
+    ray_color(color, &scattered, depth - 1, scene, pdf);
+
+    // color = attenuation * color + direct + emitted
+    vec4 total = v4_mul(v4_load(attenuation), v4_load(color));
+    v4_store(color, v4_add(total, v4_add(v4_load(direct), v4_load(emitted))));
+}
+
+/// @brief Calculate the image height, and ensure that it's at least 1.
+static inline int camera_image_height(const struct Camera_Config *cfg)
+{
+    if (cfg->image_height > 0)
+    {
+        return cfg->image_height;
+    }
+
+    int image_height = (int)(cfg->image_width / cfg->aspect_ratio);
+    return (image_height < 1) ? 1 : image_height;
 }
 
 /// @brief Derive Camera_Info from the camera config.
 /// @param cfg
 /// @param cam_info
-void camera_initialize(const struct Camera_Config *cfg, struct Camera_Info *cam_info)
+static inline void camera_initialize(const struct Camera_Config *cfg, struct Camera_Info *cam_info)
 {
 
-    // Calculate the image height, and ensure that it's at least 1.
-
-    cam_info->image_height = (int)cfg->image_width / cfg->aspect_ratio;
-    cam_info->image_height = (cam_info->image_height < 1) ? 1 : cam_info->image_height;
+    cam_info->image_height = camera_image_height(cfg);
 
     cam_info->pixel_samples_scale = 1.0 / cfg->samples_per_pixel;
 
     // Set the camera center;
-    memcpy(cam_info->center, cfg->lookfrom, 3 * sizeof(double));
+    cam_info->center = v4_load(cfg->lookfrom);
 
     // Determine viewport dimensions.
     double theta = degrees_to_radians(cfg->vfov);
@@ -204,143 +490,1382 @@ void camera_initialize(const struct Camera_Config *cfg, struct Camera_Info *cam_
 
     // Calculate the u,v,w unit (orthonormal) basis vectors for the camera coordinate frame.
     // See section 12.2 for details.
-    vec3 temp;
-    unit(cam_info->w, subtract(temp, (double *)cfg->lookfrom, (double *)cfg->lookat));
-    unit(cam_info->u, cross(temp, (double *)cfg->vup, cam_info->w));
+    cam_info->w = v4_unit(v4_sub(v4_load(cfg->lookfrom), v4_load(cfg->lookat)));
+    cam_info->u = v4_unit(v4_cross(v4_load(cfg->vup), cam_info->w));
     // As w and u are perpendicular and are both unit vectors, their cross product will also be a unit vector.
-    cross(cam_info->v, cam_info->w, cam_info->u);
+    cam_info->v = v4_cross(cam_info->w, cam_info->u);
 
     // Calculate the vectors across the horizontal and down the vertical viewport edges.
-    vec3 viewport_u, viewport_v;
-    scale(viewport_u, cam_info->u, viewport_width); // Vector across viewport horizontal edge
-    // Vector *down* viewport vertical edge
-    scale(viewport_v, negate(viewport_v, cam_info->v), viewport_height);
+    vec4 viewport_u = v4_scale(cam_info->u, viewport_width);   // Vector across viewport horizontal edge
+    vec4 viewport_v = v4_scale(cam_info->v, -viewport_height); // Vector *down* viewport vertical edge
 
     // Calculate the horizontal and vertical delta vectors from pixel to pixel.
     // This is just viewport_u/image_width and viewport_v/image_height
-    scale(cam_info->pixel_delta_u, viewport_u, (1.0 / (double)cfg->image_width));
-    scale(cam_info->pixel_delta_v, viewport_v, (1.0 / (double)cam_info->image_height));
+    cam_info->pixel_delta_u = v4_scale(viewport_u, 1.0 / cfg->image_width);
+    cam_info->pixel_delta_v = v4_scale(viewport_v, 1.0 / cam_info->image_height);
 
     // Calculate the location of the upper left pixel.
     // viewport_upper_left = center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
-    point3 temp1, temp2;
-    point3 viewport_upper_left;
-    subtract(temp1, cam_info->center, scale(temp2, cam_info->w, cfg->focus_dist));
-    subtract(temp1, temp1, scale(temp2, viewport_u, (0.5)));
-    subtract(viewport_upper_left, temp1, scale(temp2, viewport_v, (0.5)));
+    vec4 viewport_upper_left = v4_add_scaled(cam_info->center, cam_info->w, -cfg->focus_dist);
+    viewport_upper_left = v4_add_scaled(viewport_upper_left, v4_add(viewport_u, viewport_v), -0.5);
 
     // pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v)
-    add(cam_info->pixel00_loc, viewport_upper_left,
-        scale(temp1,
-              add(temp1, cam_info->pixel_delta_u, cam_info->pixel_delta_v), 0.5));
+    cam_info->pixel00_loc = v4_add_scaled(viewport_upper_left,
+                                          v4_add(cam_info->pixel_delta_u, cam_info->pixel_delta_v), 0.5);
 
     // Calculate the camera defocus disk basis vectors.
     double defocus_radius = cfg->focus_dist * tan(degrees_to_radians(cfg->defocus_angle / 2.0));
-    scale(cam_info->defocus_disk_u, cam_info->u, defocus_radius);
-    scale(cam_info->defocus_disk_v, cam_info->v, defocus_radius);
+    cam_info->defocus_disk_u = v4_scale(cam_info->u, defocus_radius);
+    cam_info->defocus_disk_v = v4_scale(cam_info->v, defocus_radius);
 }
 
-/// @brief Sets the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-void sample_square(vec3 vec)
+/// @brief Returns a random point in the [-.5,-.5]-[+.5,+.5] unit square.
+static inline vec4 sample_square()
 {
-    vec[0] = random_zero_to_one() - 0.5;
-    vec[1] = random_zero_to_one() - 0.5;
-    vec[3] = 0;
+    double x = random_zero_to_one() - 0.5;
+    double y = random_zero_to_one() - 0.5;
+    return v4_make(x, y, 0);
 }
 
-/// @brief Sets point to a random point in the camera defocus disk.
-void defocus_disk_sample(point3 point, const struct Camera_Info *cam_info)
+/// @brief Returns a random point in the camera defocus disk.
+static inline vec4 defocus_disk_sample(const struct Camera_Info *cam_info)
 {
     vec3 p;
     random_in_unit_disk(p);
-    // point = cam_info->center + (p[0] * cam_info->defocus_disk_u) + (p[1] * cam_info->defocus_disk_v)
-    vec3 temp1, temp2;
-    scale(temp1, (double *)cam_info->defocus_disk_u, p[0]);
-    scale(temp2, (double *)cam_info->defocus_disk_v, p[1]);
-    add(temp1, temp1, temp2);
-    add(point, (double *)cam_info->center, temp1);
+    // center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v)
+    vec4 point = v4_add_scaled(cam_info->center, cam_info->defocus_disk_u, p[0]);
+    return v4_add_scaled(point, cam_info->defocus_disk_v, p[1]);
 }
 
 /// @brief Construct a camera ray originating from the defocus disk and directed at a randomly
 /// sampled point around the pixel location i, j.
-void get_ray(struct Ray *ray, const struct Camera_Info *cam_info, int i, int j, double defocus_angle)
+static inline void get_ray(struct Ray *ray, const struct Camera_Info *cam_info, int i, int j, double defocus_angle)
 {
 
     // calculate the pixel sample location
-    point3 offset;
-    sample_square(offset);
+    vec4 offset = sample_square();
+
+    // pixel_sample = pixel00_loc + (i + offset.x) * pixel_delta_u + (j + offset.y) * pixel_delta_v
+    vec4 pixel_sample = v4_add_scaled(cam_info->pixel00_loc, cam_info->pixel_delta_u, i + offset.e[0]);
+    pixel_sample = v4_add_scaled(pixel_sample, cam_info->pixel_delta_v, j + offset.e[1]);
+
+    // The ray origin is the camera center, unless we have defocus blur
+    vec4 origin = (defocus_angle <= 0) ? cam_info->center : defocus_disk_sample(cam_info);
+
+    v4_store(ray->origin, origin);
+    v4_store(ray->direction, v4_sub(pixel_sample, origin));
+
+    // Ray Time
+    ray->tm = random_zero_to_one();
+}
+
+/*
+
+We render the image in square tiles, with a pool of threads that each keep taking the next tile
+no one has started yet until there are none left. Pixels in a tile are close together on the screen,
+so their rays tend to hit the same objects (which keeps those objects in the cache).
+The tiles are taken row by row, or along a space-filling curve, or from the centre out (see tile_order.h).
+
+Every pixel reseeds the random number generator (see rtweekend.h), so the image is the same
+no matter how many threads render it or in which order the tiles are taken.
+
+Each finished tile is handed to a callback, so the caller decides where the pixels go
+(an image in memory, a file, a caller's buffer, ...).
+
+*/
+
+/// @brief What to do with the tiles as they are rendered (and with the render threads' spare time).
+struct Render_Callbacks
+{
+    /// @brief Called with each finished tile: its top left pixel (x, y), its size, and its pixels
+    /// (the average linear color of each pixel, row by row).
+    /// @remark This is called from the render threads, so it must be thread safe
+    /// (different threads never get the same tile).
+    void (*tile_done)(void *arg, int x, int y, int width, int height, const color3 *tile);
+
+    /// @brief Optional. Called after each tile with how many tiles are done so far (one call at a time).
+    /// Return false to cancel the render (the threads stop after the tiles they are rendering).
+    bool (*progress)(void *arg, int tiles_done, int num_tiles);
+
+    /// @brief Optional. Called once all the tiles are done (and the image was not cancelled), from the render thread
+    /// that did the last one (while the other threads go on with their tiles, see camera_render_many).
+    void (*image_done)(void *arg);
+
+    /// @brief Optional. Run once on one of the render threads, as soon as that thread finds no more tiles
+    /// to start, while the other threads finish their last tiles (e.g. to prepare the next frame of an animation).
+    void (*tail_task)(void *arg);
+
+    void *arg; //< Passed to all the callbacks
+};
+
+/// @brief Everything the render threads share for rendering one image.
+struct Render_Job
+{
+    const struct Scene *scene;
+    const struct Camera_Config *cfg;
+    const struct Render_Callbacks *callbacks;
+    int image_height;
+    struct Ray_Sort_Cells sort_cells; //< For sorting rays (if cfg->ray_batch is set)
+
+    int tile_size;
+    int tiles_x, tiles_y, num_tiles;
+    int *tile_sequence; //< The tiles in the order to render them (see tile_order.h), or NULL for scanline order
+    int first_tile;     //< Where the image's tiles start in the pool's (see Render_Pool)
+    int tiles_done;     //< For reporting progress (guarded by the pool's progress_lock)
+    atomic_bool cancelled;
+};
+
+/// @brief The images a pool of render threads renders together (see camera_render_many).
+/// The tiles of all the images are numbered one image after the other, and the threads take them in that order,
+/// so a thread that finds no more tiles of one image goes on to the next one right away.
+struct Render_Pool
+{
+    struct Render_Job *jobs;
+    int num_jobs;
+    int num_tiles;        //< Of all the images
+    int max_tile_size;    //< Of all the images (the size of each thread's tile buffer)
+    int max_ray_batch;    //< Of all the images (the size of each thread's batch, see render_tile_batch)
+    atomic_int next_tile; //< The next tile (of all the images) no thread has taken yet
+    mtx_t progress_lock;
+    atomic_flag tail_taken;
+};
+
+/*
+
+Batches: rather than following one path from the camera to its end before starting the next (as ray_color does),
+render_tile_batch starts a whole batch of paths (cfg->ray_batch of them) and takes them all one bounce further at a
+time. That way all the rays of a bounce are known before any of them is traced, so they can be sorted by where they
+start and where they go (see ray_sort.h), and traced in that order.
 
-    point3 temp1, temp2;
-    point3 pixel_sample;
-    scale(temp1, (double *)cam_info->pixel_delta_u, (i + offset[0]));
-    scale(temp2, (double *)cam_info->pixel_delta_v, (j + offset[1]));
-    add(pixel_sample, (double *)cam_info->pixel00_loc, add(temp1, temp1, temp2));
+Each path does exactly what ray_color does, with the light it has gathered so far and what the light it gathers
+next is multiplied by (the product of the attenuations so far) kept in its Path_State instead of on the stack.
+Each path also has its own random number generator state (seeded from its pixel and sample), so the order in which
+the paths are taken does not change the image.
 
-    if (defocus_angle <= 0)
+*/
+
+/// @brief One path of a batch (see render_tile_batch).
+struct Path_State
+{
+    struct Ray ray;       //< The ray to trace next
+    color3 throughput;    //< What the light the ray brings back is multiplied by on its way to the camera
+    color3 color;         //< The light gathered so far
+    double scatter_pdf;   //< See ray_color
+    int depth;            //< Bounces left (see ray_color)
+    int pixel;            //< The pixel in the tile (row by row)
+    uint64_t rng_state;   //< The path's own random number generator state (see rtweekend.h)
+    bool hit;             //< Whether the ray hit anything (and rec is where)
+    struct Hit_Record rec;
+};
+
+/// @brief What a render thread needs to render tiles in batches (see render_tile_batch).
+struct Path_Batch
+{
+    struct Path_State *paths;
+    struct Ray_Sort_Item *order;   //< The paths still going, in the order to take them
+    struct Ray_Sort_Item *scratch; //< For ray_sort
+    int capacity;                  //< How many paths fit
+};
+
+static inline bool path_batch_init(struct Path_Batch *batch, int capacity)
+{
+    batch->capacity = capacity;
+    batch->paths = malloc(capacity * sizeof(struct Path_State));
+    batch->order = malloc(capacity * sizeof(struct Ray_Sort_Item));
+    batch->scratch = malloc(capacity * sizeof(struct Ray_Sort_Item));
+    return batch->paths != NULL && batch->order != NULL && batch->scratch != NULL;
+}
+
+static inline void path_batch_free(struct Path_Batch *batch)
+{
+    free(batch->paths);
+    free(batch->order);
+    free(batch->scratch);
+}
+
+/// @brief The bounding box of everything in the scene (the box the rays are sorted in, see ray_sort.h).
+static struct AABB scene_bounding_box(const struct Scene *scene)
+{
+    if (scene->bvh != NULL && scene->bvh->num_nodes > 0)
     {
-        // The ray origin is the camera center (no defocus blur)
-        memcpy(ray->origin, cam_info->center, 3 * sizeof(double));
+        return scene->bvh->nodes[0].box;
     }
-    else
+
+    struct AABB bounds = AABB_EMPTY;
+    for (int i = 0; i < scene->world_length; i++)
     {
-        defocus_disk_sample(ray->origin, cam_info);
+        struct AABB box = hittable_bounding_box(&scene->world[i]);
+        bounds = aabb_union(&bounds, &box);
     }
+    return bounds;
+}
 
-    subtract(ray->direction, pixel_sample, ray->origin);
+/// @brief Take a path one bounce further (what one call of ray_color does), now that its ray has been traced.
+/// @return false if the path has ended.
+static bool path_step(struct Path_State *path, const struct Scene *scene)
+{
+    color3 emitted, direct, attenuation;
+    struct Ray scattered;
+    double pdf;
 
-    // Ray Time
-    ray->tm = random_zero_to_one();
+    if (!path->hit)
+    {
+        miss_color(emitted, &path->ray, scene, path->scatter_pdf);
+        v4_store(path->color, v4_add(v4_load(path->color), v4_mul(v4_load(path->throughput), v4_load(emitted))));
+        return false;
+    }
+
+    if (!hit_scatter(&path->ray, &path->rec, scene, path->scatter_pdf, emitted, direct, attenuation, &scattered,
+                     &pdf))
+    {
+        v4_store(path->color, v4_add(v4_load(path->color), v4_mul(v4_load(path->throughput), v4_load(emitted))));
+        return false;
+    }
+
+    // color += throughput * (direct + emitted), and the light the scattered ray brings back is also attenuated.
+    vec4 throughput = v4_load(path->throughput);
+    v4_store(path->color,
+             v4_add(v4_load(path->color), v4_mul(throughput, v4_add(v4_load(direct), v4_load(emitted)))));
+    v4_store(path->throughput, v4_mul(throughput, v4_load(attenuation)));
+
+    path->ray = scattered;
+    path->scatter_pdf = pdf;
+    path->depth--;
+    return path->depth > 0;
 }
 
-/// @brief Render the image
-/// @param world a list of Hittable objects
-void camera_render(const struct Hittable *world, const int world_length, const struct Camera_Config *cfg)
+/// @brief Render the pixels of the tile (i0, j0, width, height) into tile_pixels (row by row)
+/// in batches of paths (see the comment above Path_State).
+static void render_tile_batch(const struct Render_Job *job, const struct Camera_Info *cam_info,
+                              struct Path_Batch *batch, int i0, int j0, int width, int height, color3 *tile_pixels)
 {
+    const struct Camera_Config *cfg = job->cfg;
+    const int num_pixels = width * height;
+    const long num_paths = (long)num_pixels * cfg->samples_per_pixel;
 
-    struct Camera_Info cam_info;
-    camera_initialize(cfg, &cam_info);
-    // Render
-
-    printf("P3\n");                                             // This means the colors will be in ASCII
-    printf("%i %i\n", cfg->image_width, cam_info.image_height); // how many pixels to make
-    printf("255\n");                                            // Max color possible
+    for (int p = 0; p < num_pixels; p++)
+    {
+        tile_pixels[p][0] = 0;
+        tile_pixels[p][1] = 0;
+        tile_pixels[p][2] = 0;
+    }
 
-    // The book does this (j then i). So we follow that.
-    for (int j = 0; j < cam_info.image_height; j++)
+    // The paths go sample by sample, and pixel by pixel within a sample.
+    const int batch_size = (cfg->ray_batch < batch->capacity) ? cfg->ray_batch : batch->capacity;
+    for (long first = 0; first < num_paths; first += batch_size)
     {
-        fprintf(stderr, "\rLines scanned: %i out of %i", j + 1, cam_info.image_height);
-        fflush(stderr);
+        int count = (num_paths - first < batch_size) ? (int)(num_paths - first) : batch_size;
 
-        for (int i = 0; i < cfg->image_width; i++)
+        int num_going = 0;
+        for (int k = 0; k < count; k++)
         {
-            color3 pixel_color = {0};
-            struct Ray r;
+            struct Path_State *path = &batch->paths[k];
+            int sample = (int)((first + k) / num_pixels);
+            path->pixel = (int)((first + k) % num_pixels);
 
-            /*
-                For a single pixel composed of multiple samples,
-                we'll select samples from the area surrounding the pixel
-                and average the resulting light (color) values together. We do this to accomplish antialiasing
-                (smoothing out edges). **Remember a pixel is really a point sample**.
-            */
-            for (int sample = 0; sample < cfg->samples_per_pixel; sample++)
+            int i = i0 + path->pixel % width;
+            int j = j0 + path->pixel / width;
+            size_t pixel = (size_t)j * cfg->image_width + i;
+            random_seed(cfg->seed ^ mix_bits(mix_bits(pixel + 1) + sample));
+
+            get_ray(&path->ray, cam_info, i, j, cfg->defocus_angle);
+            path->rng_state = rng_state;
+            path->throughput[0] = 1;
+            path->throughput[1] = 1;
+            path->throughput[2] = 1;
+            path->color[0] = 0;
+            path->color[1] = 0;
+            path->color[2] = 0;
+            path->scatter_pdf = 0;
+            path->depth = cfg->max_depth;
+
+            if (path->depth > 0)
             {
-                get_ray(&r, &cam_info, i, j, cfg->defocus_angle);
+                batch->order[num_going++] = (struct Ray_Sort_Item){.key = 0, .index = k};
+            }
+        }
+
+        // The camera rays are coherent as they are (in pixel order), so only the later bounces are sorted.
+        for (int bounce = 0; num_going > 0; bounce++)
+        {
+            if (bounce > 0)
+            {
+                for (int k = 0; k < num_going; k++)
+                {
+                    batch->order[k].key = ray_sort_key(&job->sort_cells, &batch->paths[batch->order[k].index].ray);
+                }
+                ray_sort(batch->order, batch->scratch, num_going);
+            }
 
-                color3 temp;
-                ray_color(temp, &r, cfg->max_depth, world, world_length);
-                add(pixel_color, pixel_color, temp);
+            // Trace all the rays first (so the scene is walked in the sorted order), then shade them all.
+            for (int k = 0; k < num_going; k++)
+            {
+                struct Path_State *path = &batch->paths[batch->order[k].index];
+                path->hit = scene_hit(job->scene, &path->ray, (struct Interval){.min = 0.001, .max = infinity},
+                                      &path->rec);
             }
 
-            /*
-                By convention, each of the red/green/blue components are represented internally
-                by real-valued variables that range from 0.0 to 1.0.
-                These must be scaled to integer values between 0 and 255 before we print them out
-                (this happens in the write_color function).
-            */
-            scale(pixel_color, pixel_color, cam_info.pixel_samples_scale);
-            write_color(pixel_color);
+            int still_going = 0;
+            for (int k = 0; k < num_going; k++)
+            {
+                struct Path_State *path = &batch->paths[batch->order[k].index];
+                rng_state = path->rng_state;
+                bool going = path_step(path, job->scene);
+                path->rng_state = rng_state;
+
+                if (going)
+                {
+                    batch->order[still_going++] = batch->order[k];
+                }
+            }
+            num_going = still_going;
+        }
+
+        // Sum each pixel's samples in sample order, so the image does not depend on the order of the rays.
+        for (int k = 0; k < count; k++)
+        {
+            const struct Path_State *path = &batch->paths[k];
+            v4_store(tile_pixels[path->pixel], v4_add(v4_load(tile_pixels[path->pixel]), v4_load(path->color)));
         }
     }
 
-    fprintf(stderr, "\nRender done!");
-}
\ No newline at end of file
+    for (int p = 0; p < num_pixels; p++)
+    {
+        v4_store(tile_pixels[p], v4_scale(v4_load(tile_pixels[p]), cam_info->pixel_samples_scale));
+    }
+}
+
+/// @brief Render all the pixels of one tile into tile_pixels (row by row).
+/// @param batch If cfg->ray_batch is set (and it has paths), render in batches of them (see render_tile_batch).
+static void render_tile(const struct Render_Job *job, int tile, struct Path_Batch *batch, color3 *tile_pixels,
+                        int *x, int *y, int *width, int *height)
+{
+    const struct Camera_Config *cfg = job->cfg;
+
+    int i0 = (tile % job->tiles_x) * job->tile_size;
+    int j0 = (tile / job->tiles_x) * job->tile_size;
+    int i1 = (i0 + job->tile_size < cfg->image_width) ? i0 + job->tile_size : cfg->image_width;
+    int j1 = (j0 + job->tile_size < job->image_height) ? j0 + job->tile_size : job->image_height;
+
+    *x = i0;
+    *y = j0;
+    *width = i1 - i0;
+    *height = j1 - j0;
+
+    // The jobs are malloc'd, so they can't hold the vec4s of the Camera_Info (see vec4.h). It only takes a moment
+    // to make, next to rendering a tile.
+    struct Camera_Info cam_info;
+    camera_initialize(cfg, &cam_info);
+
+    if (cfg->ray_batch > 0 && batch->paths != NULL)
+    {
+        render_tile_batch(job, &cam_info, batch, i0, j0, *width, *height, tile_pixels);
+        return;
+    }
+
+    // The book does this (j then i). So we follow that (inside the tile).
+    for (int j = j0; j < j1; j++)
+    {
+        for (int i = i0; i < i1; i++)
+        {
+            size_t pixel = (size_t)j * cfg->image_width + i;
+            random_seed(cfg->seed ^ mix_bits(pixel + 1));
+
+#ifdef RENDER_STATS
+            uint64_t start_ticks = render_stats_ticks();
+            uint64_t start_object_tests = render_stats_object_tests;
+            uint64_t start_rays = render_stats_rays;
+#endif
+
+            vec4 pixel_color = v4_zero();
+            struct Ray r;
+
+            /*
+                For a single pixel composed of multiple samples,
+                we'll select samples from the area surrounding the pixel
+                and average the resulting light (color) values together. We do this to accomplish antialiasing
+                (smoothing out edges). **Remember a pixel is really a point sample**.
+            */
+            for (int sample = 0; sample < cfg->samples_per_pixel; sample++)
+            {
+                get_ray(&r, &cam_info, i, j, cfg->defocus_angle);
+
+                color3 sample_color;
+                ray_color(sample_color, &r, cfg->max_depth, job->scene, 0);
+                pixel_color = v4_add(pixel_color, v4_load(sample_color));
+            }
+
+            v4_store(tile_pixels[(j - j0) * (*width) + (i - i0)],
+                     v4_scale(pixel_color, cam_info.pixel_samples_scale));
+
+#ifdef RENDER_STATS
+            if (cfg->stats != NULL)
+            {
+                cfg->stats->ticks[pixel] += (double)(render_stats_ticks() - start_ticks);
+                cfg->stats->object_tests[pixel] += (double)(render_stats_object_tests - start_object_tests);
+                cfg->stats->rays[pixel] += (double)(render_stats_rays - start_rays);
+                cfg->stats->samples[pixel] += cfg->samples_per_pixel;
+            }
+#endif
+        }
+    }
+}
+
+/// @brief Do the tail tasks of all the images, unless a thread already took them.
+static void render_pool_tail_tasks(struct Render_Pool *pool)
+{
+    if (!atomic_flag_test_and_set(&pool->tail_taken))
+    {
+        for (int k = 0; k < pool->num_jobs; k++)
+        {
+            const struct Render_Callbacks *callbacks = pool->jobs[k].callbacks;
+            if (callbacks->tail_task != NULL)
+            {
+                callbacks->tail_task(callbacks->arg);
+            }
+        }
+    }
+}
+
+static int render_worker(void *arg)
+{
+    struct Render_Pool *pool = arg;
+
+    color3 *tile_pixels = malloc((size_t)pool->max_tile_size * pool->max_tile_size * sizeof(color3));
+    struct Path_Batch batch = {0};
+    if (tile_pixels == NULL || (pool->max_ray_batch > 0 && !path_batch_init(&batch, pool->max_ray_batch)))
+    {
+        // The other threads will render the tiles instead.
+        free(tile_pixels);
+        path_batch_free(&batch);
+        return 1;
+    }
+
+    // The tiles a thread takes only go up, so the image they are in does too.
+    int j = 0;
+    while (true)
+    {
+        int tile = atomic_fetch_add(&pool->next_tile, 1);
+        if (tile >= pool->num_tiles)
+        {
+            break;
+        }
+        while (tile >= pool->jobs[j].first_tile + pool->jobs[j].num_tiles)
+        {
+            j++;
+        }
+        struct Render_Job *job = &pool->jobs[j];
+        const struct Render_Callbacks *callbacks = job->callbacks;
+        if (atomic_load(&job->cancelled))
+        {
+            continue;
+        }
+
+        tile -= job->first_tile;
+        if (job->tile_sequence != NULL)
+        {
+            tile = job->tile_sequence[tile];
+        }
+
+        int x, y, width, height;
+        render_tile(job, tile, &batch, tile_pixels, &x, &y, &width, &height);
+        callbacks->tile_done(callbacks->arg, x, y, width, height, tile_pixels);
+
+        mtx_lock(&pool->progress_lock);
+        job->tiles_done++;
+        bool last = job->tiles_done == job->num_tiles;
+        if (callbacks->progress != NULL && !callbacks->progress(callbacks->arg, job->tiles_done, job->num_tiles))
+        {
+            atomic_store(&job->cancelled, true);
+        }
+        mtx_unlock(&pool->progress_lock);
+
+        if (last && callbacks->image_done != NULL && !atomic_load(&job->cancelled))
+        {
+            callbacks->image_done(callbacks->arg);
+        }
+    }
+
+    free(tile_pixels);
+    path_batch_free(&batch);
+
+    // No tiles are left to start, so this thread would otherwise just wait for the others.
+    render_pool_tail_tasks(pool);
+
+    return 0;
+}
+
+/// @brief Set up the job of rendering one image (see camera_render_many).
+static void render_job_init(struct Render_Job *job, const struct Scene *scene, const struct Camera_Config *cfg,
+                            const struct Render_Callbacks *callbacks)
+{
+    *job = (struct Render_Job){.scene = scene, .cfg = cfg, .callbacks = callbacks};
+    job->image_height = camera_image_height(cfg);
+    if (cfg->ray_batch > 0)
+    {
+        struct AABB bounds = scene_bounding_box(scene);
+        job->sort_cells = ray_sort_cells(&bounds);
+    }
+
+    job->tile_size = (cfg->tile_size > 0) ? cfg->tile_size : CAMERA_TILE_SIZE;
+    job->tiles_x = (cfg->image_width + job->tile_size - 1) / job->tile_size;
+    job->tiles_y = (job->image_height + job->tile_size - 1) / job->tile_size;
+    job->num_tiles = job->tiles_x * job->tiles_y;
+    atomic_init(&job->cancelled, false);
+
+    // If we can't allocate the order, scanline order works just as well (only slower).
+    if (cfg->tile_order != Scanline_Tiles)
+    {
+        job->tile_sequence = malloc(job->num_tiles * sizeof(int));
+        if (job->tile_sequence != NULL && !tile_order_make(cfg->tile_order, job->tiles_x, job->tiles_y,
+                                                           job->tile_sequence))
+        {
+            free(job->tile_sequence);
+            job->tile_sequence = NULL;
+        }
+    }
+}
+
+/// @brief Render several images (of the same scene) with one pool of threads, one tile at a time
+/// (see Render_Callbacks; each image has its own). The threads go from the tiles of one image straight on to the
+/// next image, so they are all kept busy until the last tiles of the last image (rather than waiting for each other
+/// at the end of each image).
+/// @param cfgs The cameras of the images, num_images of them. All the images are rendered with the threads of
+/// the first one (cfgs[0].num_threads); the num_threads of the others are not used.
+/// @param callbacks The callbacks of each image, num_images of them.
+/// @param finished Optional (may be NULL). Set to whether each image was finished (not cancelled).
+/// @return false if any of the renders was cancelled (or could not run at all).
+/// The tail tasks (if there are any) are always done when this returns.
+static inline bool camera_render_many(const struct Scene *scene, int num_images, const struct Camera_Config *cfgs,
+                                      const struct Render_Callbacks *callbacks, bool *finished)
+{
+    struct Render_Pool pool = {.num_jobs = num_images, .jobs = calloc(num_images, sizeof(struct Render_Job))};
+    if (pool.jobs == NULL || mtx_init(&pool.progress_lock, mtx_plain) != thrd_success)
+    {
+        // Nothing is rendered, but the tail tasks are still done.
+        for (int k = 0; k < num_images; k++)
+        {
+            if (finished != NULL)
+            {
+                finished[k] = false;
+            }
+            if (callbacks[k].tail_task != NULL)
+            {
+                callbacks[k].tail_task(callbacks[k].arg);
+            }
+        }
+        free(pool.jobs);
+        return false;
+    }
+
+    for (int k = 0; k < num_images; k++)
+    {
+        render_job_init(&pool.jobs[k], scene, &cfgs[k], &callbacks[k]);
+        pool.jobs[k].first_tile = pool.num_tiles;
+        pool.num_tiles += pool.jobs[k].num_tiles;
+        pool.max_tile_size = (pool.jobs[k].tile_size > pool.max_tile_size) ? pool.jobs[k].tile_size
+                                                                            : pool.max_tile_size;
+        pool.max_ray_batch = (cfgs[k].ray_batch > pool.max_ray_batch) ? cfgs[k].ray_batch : pool.max_ray_batch;
+    }
+    atomic_init(&pool.next_tile, 0);
+    atomic_flag_clear(&pool.tail_taken);
+
+    int num_threads = (num_images > 0 && cfgs[0].num_threads > 0) ? cfgs[0].num_threads : hardware_threads();
+
+    thrd_t *threads = malloc(num_threads * sizeof(thrd_t));
+
+    // If we can't start a thread, the threads we did start (or this thread) will just do more tiles.
+    int started = 0;
+    for (int t = 0; threads != NULL && t < num_threads; t++)
+    {
+        if (thrd_create(&threads[started], render_worker, &pool) == thrd_success)
+        {
+            started++;
+        }
+    }
+
+    int result = 0;
+    for (int t = 0; t < started; t++)
+    {
+        int worker_result;
+        thrd_join(threads[t], &worker_result);
+        result |= worker_result;
+    }
+
+    // Finish whatever tiles are left here (if no thread could start, or they could not allocate their tile).
+    // If this thread can't allocate its tile either, the tiles left are not rendered, but the tail tasks are
+    // still done.
+    if (started == 0 || result != 0)
+    {
+        render_worker(&pool);
+        render_pool_tail_tasks(&pool);
+    }
+
+    bool all_finished = true;
+    for (int k = 0; k < num_images; k++)
+    {
+        const struct Render_Job *job = &pool.jobs[k];
+        bool done = !atomic_load(&job->cancelled) && job->tiles_done == job->num_tiles;
+        if (finished != NULL)
+        {
+            finished[k] = done;
+        }
+        all_finished &= done;
+        free(job->tile_sequence);
+    }
+
+    free(threads);
+    free(pool.jobs);
+    mtx_destroy(&pool.progress_lock);
+
+    return all_finished;
+}
+
+/// @brief Render the image, one tile at a time, with a pool of threads (see Render_Callbacks).
+/// @return false if the render was cancelled (or could not run at all).
+/// The tail task (if there is one) is always done when this returns.
+static inline bool camera_render_tiles(const struct Scene *scene, const struct Camera_Config *cfg,
+                                       const struct Render_Callbacks *callbacks)
+{
+    return camera_render_many(scene, 1, cfg, callbacks, NULL);
+}
+
+/// @brief Where camera_render_pixels puts the tiles.
+struct Pixels_Target
+{
+    color3 *pixels;
+    int image_width;
+    void (*tail_task)(void *arg);
+    void *tail_arg;
+};
+
+static void pixels_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Pixels_Target *target = arg;
+    for (int row = 0; row < height; row++)
+    {
+        memcpy(target->pixels[(size_t)(y + row) * target->image_width + x], tile[row * width],
+               width * sizeof(color3));
+    }
+}
+
+/// @brief How often to report the progress of a render, in seconds (printing and flushing it after every tile
+/// would hold up the render threads, which report one at a time).
+#define PROGRESS_INTERVAL 0.25
+
+static bool print_progress(void *arg, int tiles_done, int num_tiles)
+{
+    (void)arg;
+    static double last_report = 0; // Only one thread reports at a time
+
+    double now = seconds_now();
+    if (tiles_done == num_tiles || now - last_report >= PROGRESS_INTERVAL)
+    {
+        last_report = now;
+        fprintf(stderr, "\rTiles rendered: %i out of %i", tiles_done, num_tiles);
+        fflush(stderr);
+    }
+    return true;
+}
+
+static void pixels_tail_task(void *arg)
+{
+    struct Pixels_Target *target = arg;
+    target->tail_task(target->tail_arg);
+}
+
+/// @brief Render the image into pixels (the average linear color of each pixel, row by row).
+/// @param pixels Must have room for image_width * camera_image_height(cfg) colors.
+/// @param tail_task Optional (may be NULL). See Render_Callbacks.
+static inline void camera_render_pixels(const struct Scene *scene, const struct Camera_Config *cfg, color3 *pixels,
+                                        void (*tail_task)(void *arg), void *tail_arg)
+{
+    struct Pixels_Target target = {.pixels = pixels, .image_width = cfg->image_width,
+                                   .tail_task = tail_task, .tail_arg = tail_arg};
+    struct Render_Callbacks callbacks = {.tile_done = pixels_tile_done,
+                                         .progress = print_progress,
+                                         .tail_task = (tail_task != NULL) ? pixels_tail_task : NULL,
+                                         .arg = &target};
+
+    camera_render_tiles(scene, cfg, &callbacks);
+}
+
+/// @brief Write the header of a (plain, ASCII) ppm file.
+static inline void write_ppm_header(FILE *out, int image_width, int image_height)
+{
+    fprintf(out, "P3\n");                               // This means the colors will be in ASCII
+    fprintf(out, "%i %i\n", image_width, image_height); // how many pixels to make
+    fprintf(out, "255\n");                              // Max color possible
+}
+
+/// @brief Write the pixels of (part of) a ppm file, after the header.
+static inline void write_ppm_pixels(FILE *out, const color3 *pixels, size_t num_pixels)
+{
+    /*
+        By convention, each of the red/green/blue components are represented internally
+        by real-valued variables that range from 0.0 to 1.0.
+        These must be scaled to integer values between 0 and 255 before we print them out
+        (this happens in the write_color function).
+    */
+    for (size_t pixel = 0; pixel < num_pixels; pixel++)
+    {
+        write_color(out, (double *)pixels[pixel]);
+    }
+}
+
+/// @brief Write the image as a (plain, ASCII) ppm file.
+static inline void write_ppm(FILE *out, const color3 *pixels, int image_width, int image_height)
+{
+    write_ppm_header(out, image_width, image_height);
+    write_ppm_pixels(out, pixels, (size_t)image_width * image_height);
+}
+
+/// @brief Write the image in cfg->output_format.
+/// @remark out must be opened in binary mode (for the binary formats).
+static inline void write_image(FILE *out, const struct Camera_Config *cfg, const color3 *pixels,
+                               int image_width, int image_height)
+{
+    bool ok = true;
+
+    switch (cfg->output_format)
+    {
+    case Pfm_Image:
+        ok = write_pfm(out, pixels, image_width, image_height);
+        break;
+
+    case Accumulation_Image:
+        ok = write_accumulation(out, pixels, image_width, image_height, cfg->samples_per_pixel, cfg->seed);
+        break;
+
+    default:
+        write_ppm(out, pixels, image_width, image_height);
+        break;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "\nCould not write the image!\n");
+    }
+}
+
+/*
+
+Writing the image while it renders: writing a big ppm image (formatting every pixel as text) takes a good
+while, and if we only start once the last tile is done, the whole time is added to the render. Instead, an
+image writer thread writes each row of tiles as soon as all of its tiles are done, while the render threads go
+on with the rest of the image, so by the time the last tile is done, little is left to write.
+
+The render threads put each tile they finish on a lock-free queue (see tile_queue.h) and go straight on to the
+next tile; the writer takes the tiles off, counts them per row of tiles, and writes the rows of tiles in order
+(top to bottom) as they fill up. In scanline order, each row of tiles gets a buffer when its first tile is
+done, and the writer frees it once it has written it, so only the rows still rendering (or done, but waiting
+for a row above them) take memory: a row or two of tiles, however tall the image is. The other orders (see
+tile_order.h) finish the top rows last, so the writer would end up holding almost every row anyway: for them it
+takes a buffer for the whole image up front (as a render without the writer does), and still writes the rows
+as soon as they are done.
+
+When the queue is empty the writer sleeps until a render thread wakes it (see image_writer_wake). Only a thread
+that finds the writer asleep takes the lock to wake it, so the render threads still never wait for each other.
+
+The writer thread also reports the progress (every PROGRESS_INTERVAL seconds), so the render threads never
+print (or wait to print) anything.
+
+PFM files go from the bottom row up, so they are only written once the whole image is done (see write_pfm).
+
+*/
+
+/// @brief Writes the image (in cfg->output_format) as it renders (see the comment above).
+struct Image_Writer
+{
+    FILE *out;
+    const struct Camera_Config *cfg;
+    int image_height;
+    int tile_size, tiles_y, num_tiles;
+
+    _Atomic(color3 *) *rows; //< The pixels of each row of tiles (NULL until its first tile is done, and once written)
+    color3 *image;           //< The pixels of the whole image, which rows point into (NULL in scanline order)
+    atomic_bool out_of_memory; //< Set if a row of tiles could not be allocated (its tiles are lost)
+
+    struct Tile_Queue queue; //< The rows of tiles (y / tile_size) of the tiles done
+    int *tiles_left;         //< How many tiles of each row of tiles are not done yet (only the writer touches this)
+    int rows_written;        //< How many rows of tiles are written
+    atomic_bool render_done; //< Set once every tile is on the queue
+    bool ok;                 //< false if the image could not be written
+
+    mtx_t lock;          //< Held by the writer while it goes to sleep (and by whoever wakes it)
+    cnd_t wake;          //< Signalled when a tile is put on the queue (or the render is done) while the writer sleeps
+    atomic_bool waiting; //< Whether the writer is (about to go) asleep
+    bool threaded;       //< Whether the writer thread is running
+    thrd_t thread;
+};
+
+/// @brief How many rows of pixels the row of tiles has (the last one may have fewer than tile_size).
+static inline int image_writer_row_height(const struct Image_Writer *writer, int row)
+{
+    int j0 = row * writer->tile_size;
+    return (writer->image_height - j0 < writer->tile_size) ? writer->image_height - j0 : writer->tile_size;
+}
+
+/// @brief Write the rows of tiles that are done (and not written yet), in order, and free them.
+/// @param all Whether to write all the rows left, done or not (the tiles that are not done are black).
+static void image_writer_write_rows(struct Image_Writer *writer, bool all)
+{
+    const struct Camera_Config *cfg = writer->cfg;
+    const int image_width = cfg->image_width;
+
+    while (writer->rows_written < writer->tiles_y && (all || writer->tiles_left[writer->rows_written] == 0))
+    {
+        int row = writer->rows_written++;
+        size_t num_pixels = (size_t)image_width * image_writer_row_height(writer, row);
+
+        // No tile of the row was done (the render was cancelled), or it could not be allocated.
+        color3 *pixels = atomic_exchange(&writer->rows[row], NULL);
+        if (pixels == NULL)
+        {
+            pixels = calloc(num_pixels, sizeof(color3));
+        }
+        if (pixels == NULL)
+        {
+            writer->ok = false;
+            continue;
+        }
+
+        if (cfg->output_format == Accumulation_Image)
+        {
+            writer->ok &= write_accumulation_pixels(writer->out, pixels, num_pixels, cfg->samples_per_pixel);
+        }
+        else
+        {
+            write_ppm_pixels(writer->out, pixels, num_pixels);
+        }
+        if (writer->image == NULL)
+        {
+            free(pixels);
+        }
+    }
+}
+
+/// @brief Sleep until a tile is put on the queue or the render is done (or for no reason: check again after).
+static void image_writer_sleep(struct Image_Writer *writer)
+{
+    mtx_lock(&writer->lock);
+    atomic_store(&writer->waiting, true);
+
+    // A render thread that put its tile on the queue before it could see waiting won't wake us, so look again
+    // (the fences make sure that either it sees waiting, or we see its tile).
+    atomic_thread_fence(memory_order_seq_cst);
+    if (tile_queue_empty(&writer->queue) && !atomic_load(&writer->render_done))
+    {
+        cnd_wait(&writer->wake, &writer->lock);
+    }
+
+    atomic_store(&writer->waiting, false);
+    mtx_unlock(&writer->lock);
+}
+
+/// @brief Wake the writer, if it is asleep (after putting a tile on the queue, or once the render is done).
+static void image_writer_wake(struct Image_Writer *writer)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&writer->waiting))
+    {
+        mtx_lock(&writer->lock);
+        cnd_signal(&writer->wake);
+        mtx_unlock(&writer->lock);
+    }
+}
+
+static int image_writer_run(void *arg)
+{
+    struct Image_Writer *writer = arg;
+    int tiles_done = 0;
+    double last_report = 0;
+
+    while (true)
+    {
+        // If the render was done before we looked, every tile is on the queue, so once it is empty we are done.
+        bool render_done = atomic_load(&writer->render_done);
+        int row;
+        if (!tile_queue_pop(&writer->queue, &row))
+        {
+            if (render_done)
+            {
+                break;
+            }
+            image_writer_sleep(writer);
+            continue;
+        }
+
+        tiles_done++;
+        writer->tiles_left[row]--;
+        image_writer_write_rows(writer, false);
+
+        double now = seconds_now();
+        if (tiles_done == writer->num_tiles || now - last_report >= PROGRESS_INTERVAL)
+        {
+            last_report = now;
+            fprintf(stderr, "\rTiles rendered: %i out of %i", tiles_done, writer->num_tiles);
+            fflush(stderr);
+        }
+    }
+    return 0;
+}
+
+/// @brief Take a tile from the render threads: put it in its row of tiles, and on the writer's queue.
+static void image_writer_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Image_Writer *writer = arg;
+    const int image_width = writer->cfg->image_width;
+    int row = y / writer->tile_size;
+
+    // The first tile of the row to be done allocates the row (if two threads race to it, one of them frees its own).
+    color3 *pixels = atomic_load(&writer->rows[row]);
+    if (pixels == NULL)
+    {
+        color3 *allocated = calloc((size_t)image_width * image_writer_row_height(writer, row), sizeof(color3));
+        if (allocated == NULL)
+        {
+            // Another thread may have allocated the row in the meantime.
+            pixels = atomic_load(&writer->rows[row]);
+        }
+        else if (!atomic_compare_exchange_strong(&writer->rows[row], &pixels, allocated))
+        {
+            free(allocated);
+        }
+        else
+        {
+            pixels = allocated;
+        }
+    }
+
+    if (pixels != NULL)
+    {
+        for (int j = 0; j < height; j++)
+        {
+            memcpy(pixels[(size_t)j * image_width + x], tile[j * width], width * sizeof(color3));
+        }
+    }
+    else
+    {
+        atomic_store(&writer->out_of_memory, true);
+    }
+
+    tile_queue_push(&writer->queue, row);
+    image_writer_wake(writer);
+}
+
+/// @brief Write the header of the image and start the writer thread, to write the image as it renders
+/// (use image_writer_tile_done as the tile_done callback, with the writer as its arg).
+/// @return false if the writer could not be allocated (nothing is written then).
+static inline bool image_writer_start(struct Image_Writer *writer, FILE *out, const struct Camera_Config *cfg)
+{
+    *writer = (struct Image_Writer){
+        .out = out,
+        .cfg = cfg,
+        .image_height = camera_image_height(cfg),
+        .tile_size = (cfg->tile_size > 0) ? cfg->tile_size : CAMERA_TILE_SIZE,
+        .ok = true,
+    };
+    const int tiles_x = (cfg->image_width + writer->tile_size - 1) / writer->tile_size;
+    writer->tiles_y = (writer->image_height + writer->tile_size - 1) / writer->tile_size;
+    writer->num_tiles = tiles_x * writer->tiles_y;
+    atomic_init(&writer->out_of_memory, false);
+    atomic_init(&writer->render_done, false);
+    atomic_init(&writer->waiting, false);
+
+    writer->rows = malloc(writer->tiles_y * sizeof(*writer->rows));
+    writer->tiles_left = malloc(writer->tiles_y * sizeof(int));
+    if (cfg->tile_order != Scanline_Tiles)
+    {
+        writer->image = calloc((size_t)cfg->image_width * writer->image_height, sizeof(color3));
+    }
+    bool have_lock = mtx_init(&writer->lock, mtx_plain) == thrd_success;
+    bool have_wake = cnd_init(&writer->wake) == thrd_success;
+    if (writer->rows == NULL || writer->tiles_left == NULL ||
+        (cfg->tile_order != Scanline_Tiles && writer->image == NULL) || !have_lock || !have_wake ||
+        !tile_queue_init(&writer->queue, writer->num_tiles))
+    {
+        free(writer->rows);
+        free(writer->tiles_left);
+        free(writer->image);
+        tile_queue_free(&writer->queue);
+        if (have_lock)
+        {
+            mtx_destroy(&writer->lock);
+        }
+        if (have_wake)
+        {
+            cnd_destroy(&writer->wake);
+        }
+        return false;
+    }
+    for (int row = 0; row < writer->tiles_y; row++)
+    {
+        color3 *pixels = (writer->image != NULL) ? writer->image + (size_t)row * writer->tile_size * cfg->image_width
+                                                 : NULL;
+        atomic_init(&writer->rows[row], pixels);
+        writer->tiles_left[row] = tiles_x;
+    }
+
+    if (cfg->output_format == Accumulation_Image)
+    {
+        struct Accumulation_Header header = make_accumulation_header(cfg->image_width, writer->image_height,
+                                                                     cfg->seed);
+        writer->ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    else
+    {
+        write_ppm_header(out, cfg->image_width, writer->image_height);
+    }
+
+    // Without the thread, image_writer_finish writes the whole image at the end (as if there were no writer).
+    writer->threaded = thrd_create(&writer->thread, image_writer_run, writer) == thrd_success;
+    return true;
+}
+
+/// @brief Once the render is done: wait for the writer to write the rest of the image.
+/// @return false if the image could not be written.
+static inline bool image_writer_finish(struct Image_Writer *writer)
+{
+    atomic_store(&writer->render_done, true);
+    if (writer->threaded)
+    {
+        image_writer_wake(writer);
+        thrd_join(writer->thread, NULL);
+    }
+
+    // Every tile is done by now (unless the render was cancelled), so this only writes anything if some weren't.
+    image_writer_write_rows(writer, true);
+
+    free(writer->rows);
+    free(writer->tiles_left);
+    free(writer->image);
+    tile_queue_free(&writer->queue);
+    mtx_destroy(&writer->lock);
+    cnd_destroy(&writer->wake);
+    return writer->ok && !atomic_load(&writer->out_of_memory);
+}
+
+/*
+
+Progressive rendering: when the time a render may take (or how clean it has to be) matters more than how many
+samples it takes, camera_render_progressive renders the whole image over and over in passes, and adds up the
+passes. After each pass it knows how long a sample per pixel takes (on this machine, for this scene), so it
+can tell how many more samples fit in the time left, and how noisy the image still is.
+
+Passes double in size (1, 1, 2, 4, 8, ... samples per pixel), so measuring takes little of the time, and are cut
+down to what fits in the time left (or to what the noise target needs). A pass that runs past the deadline anyway
+is cancelled and left out, so every pixel always has the same number of samples. The first pass is never
+cancelled, so there is always an image.
+
+The noise is estimated from how much the passes differ: a pass of k samples per pixel gives each pixel a mean m
+whose variance is sigma^2 / k (sigma^2 being the variance of a single sample), so the sum over the passes of
+k * (m - mean)^2 is about (passes - 1) * sigma^2. This only needs two sums per pixel.
+
+*/
+
+/// @brief The sums of the passes so far (see camera_render_progressive).
+struct Progressive_Sums
+{
+    struct Pixels_Target pass; //< Where the pass being rendered goes
+    color3 *sums;              //< The sum of each pixel's samples
+    double *luminance_sq;      //< The sum over the passes of k * (the pixel's mean luminance in the pass)^2
+    double deadline;           //< When to cancel a pass (seconds_now), or 0 to never cancel it
+};
+
+static void progressive_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Progressive_Sums *sums = arg;
+    pixels_tile_done(&sums->pass, x, y, width, height, tile);
+}
+
+static bool progressive_progress(void *arg, int tiles_done, int num_tiles)
+{
+    (void)tiles_done;
+    (void)num_tiles;
+    const struct Progressive_Sums *sums = arg;
+    return sums->deadline == 0 || seconds_now() < sums->deadline;
+}
+
+/// @brief Add the pass (of samples per pixel) to the sums.
+static void progressive_add_pass(struct Progressive_Sums *sums, size_t num_pixels, int samples)
+{
+    for (size_t p = 0; p < num_pixels; p++)
+    {
+        vec4 mean = v4_load(sums->pass.pixels[p]);
+        v4_store(sums->sums[p], v4_add(v4_load(sums->sums[p]), v4_scale(mean, samples)));
+
+        double luminance = color_luminance(sums->pass.pixels[p]);
+        sums->luminance_sq[p] += samples * luminance * luminance;
+    }
+}
+
+/// @brief How noisy the image is after passes passes of samples samples per pixel in all:
+/// the root mean square of the standard errors of the pixels' luminances, over the mean luminance of the image.
+/// This is 0.01 when the pixels are typically 1% off (in luminance) from what infinitely many samples would give.
+/// @return infinity if there are not enough passes to tell.
+static double progressive_noise(const struct Progressive_Sums *sums, size_t num_pixels, int samples, int passes)
+{
+    if (passes < 2)
+    {
+        return infinity;
+    }
+
+    double variance_sum = 0;
+    double luminance_sum = 0;
+    for (size_t p = 0; p < num_pixels; p++)
+    {
+        double mean = color_luminance(sums->sums[p]) / samples;
+        double sample_variance = (sums->luminance_sq[p] - samples * mean * mean) / (passes - 1);
+        variance_sum += (sample_variance > 0) ? sample_variance / samples : 0;
+        luminance_sum += mean;
+    }
+
+    double mean_luminance = luminance_sum / num_pixels;
+    return (mean_luminance > 0) ? sqrt(variance_sum / num_pixels) / mean_luminance : 0;
+}
+
+/// @brief Render the image in passes (see the comment above) into pixels (the average linear color of each pixel),
+/// until cfg->time_budget seconds are used up, the noise is down to cfg->noise_target,
+/// or there are cfg->max_samples_per_pixel samples per pixel (whichever comes first).
+/// @param pixels Must have room for image_width * camera_image_height(cfg) colors.
+/// @return How many samples per pixel were taken (0 if the memory for the passes could not be allocated).
+static inline int camera_render_progressive(const struct Scene *scene, const struct Camera_Config *cfg,
+                                            color3 *pixels)
+{
+    const double start_time = seconds_now();
+    const size_t num_pixels = (size_t)cfg->image_width * camera_image_height(cfg);
+    const int max_samples = (cfg->max_samples_per_pixel > 0) ? cfg->max_samples_per_pixel : INT_MAX / 2;
+
+    struct Progressive_Sums sums = {
+        .pass = {.pixels = malloc(num_pixels * sizeof(color3)), .image_width = cfg->image_width},
+        .sums = calloc(num_pixels, sizeof(color3)),
+        .luminance_sq = calloc(num_pixels, sizeof(double)),
+    };
+    struct Render_Callbacks callbacks = {.tile_done = progressive_tile_done, .progress = progressive_progress,
+                                         .arg = &sums};
+
+    if (sums.pass.pixels == NULL || sums.sums == NULL || sums.luminance_sq == NULL)
+    {
+        fprintf(stderr, "Could not allocate the passes!\n");
+        free(sums.pass.pixels);
+        free(sums.sums);
+        free(sums.luminance_sq);
+        return 0;
+    }
+
+    int samples = 0;
+    struct Camera_Config pass_cfg = *cfg;
+    int pass_samples = 1;
+    for (int passes = 0;; passes++)
+    {
+        // Each pass needs its own random numbers (as each pixel reseeds the generator from the seed).
+        pass_cfg.samples_per_pixel = pass_samples;
+        pass_cfg.seed = mix_bits(cfg->seed + passes);
+        sums.deadline = (passes > 0 && cfg->time_budget > 0) ? start_time + cfg->time_budget : 0;
+        if (!camera_render_tiles(scene, &pass_cfg, &callbacks))
+        {
+            if (passes > 0)
+            {
+                fprintf(stderr, "\nPass %i cancelled at the deadline (and left out)", passes + 1);
+            }
+            break;
+        }
+        progressive_add_pass(&sums, num_pixels, pass_samples);
+        samples += pass_samples;
+
+        double now = seconds_now();
+        double seconds_per_sample = (now - start_time) / samples;
+        double noise = progressive_noise(&sums, num_pixels, samples, passes + 1);
+        fprintf(stderr, "\rPass %i: %i samples per pixel in %.2f seconds (noise %.4f)", passes + 1, samples,
+                now - start_time, noise);
+
+        if (samples >= max_samples || (cfg->noise_target > 0 && noise <= cfg->noise_target))
+        {
+            break;
+        }
+
+        // Double the samples, but take no more than we need, or than there is time for.
+        pass_samples = (samples < max_samples - samples) ? samples : max_samples - samples;
+        if (cfg->noise_target > 0 && isfinite(noise))
+        {
+            // The noise goes down with the square root of the samples.
+            double needed = ceil(samples * (noise / cfg->noise_target) * (noise / cfg->noise_target)) - samples;
+            if (needed < pass_samples)
+            {
+                pass_samples = (needed > 1) ? (int)needed : 1;
+            }
+        }
+        if (cfg->time_budget > 0)
+        {
+            double fits = floor((start_time + cfg->time_budget - now) / seconds_per_sample);
+            if (fits < 1)
+            {
+                break;
+            }
+            if (fits < pass_samples)
+            {
+                pass_samples = (int)fits;
+            }
+        }
+    }
+
+    for (size_t p = 0; samples > 0 && p < num_pixels; p++)
+    {
+        v4_store(pixels[p], v4_scale(v4_load(sums.sums[p]), 1.0 / samples));
+    }
+
+    free(sums.pass.pixels);
+    free(sums.sums);
+    free(sums.luminance_sq);
+    return samples;
+}
+
+/// @brief Render the image and write it to out (in cfg->output_format).
+/// If cfg->time_budget or cfg->noise_target is set, this renders in passes (see camera_render_progressive).
+/// @param scene the Hittable objects and lights (see scene.h)
+static inline void camera_render_to(FILE *out, const struct Scene *scene, const struct Camera_Config *cfg)
+{
+    int image_height = camera_image_height(cfg);
+
+    // What was rendered (the samples per pixel may be up to the passes).
+    struct Camera_Config rendered = *cfg;
+
+    struct Render_Stats stats = {0};
+    if (cfg->heatmap_prefix != NULL)
+    {
+#ifdef RENDER_STATS
+        if (render_stats_init(&stats, cfg->image_width, image_height))
+        {
+            rendered.stats = &stats;
+        }
+        else
+        {
+            fprintf(stderr, "Could not allocate the render stats (rendering without them)\n");
+        }
+#else
+        fprintf(stderr, "Heatmaps need a renderer built with render stats (-DENABLE_RENDER_STATS=ON)\n");
+#endif
+    }
+
+    // Write the image as it renders (see Image_Writer), unless the passes decide the samples (which are in the
+    // header of an accumulation file) or it is a PFM (whose rows go from the bottom up).
+    bool progressive = cfg->time_budget > 0 || cfg->noise_target > 0;
+    struct Image_Writer writer;
+    bool streaming = !progressive && cfg->output_format != Pfm_Image && image_writer_start(&writer, out, &rendered);
+
+    // Only the image writer keeps the pixels itself (see Image_Writer), otherwise we need the whole image here.
+    color3 *pixels = NULL;
+    if (!streaming)
+    {
+        pixels = malloc((size_t)cfg->image_width * image_height * sizeof(color3));
+        if (pixels == NULL)
+        {
+            fprintf(stderr, "Could not allocate the image!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start_time = seconds_now();
+    if (progressive)
+    {
+        rendered.samples_per_pixel = camera_render_progressive(scene, &rendered, pixels);
+        if (rendered.samples_per_pixel == 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (streaming)
+    {
+        struct Render_Callbacks callbacks = {.tile_done = image_writer_tile_done, .arg = &writer};
+        camera_render_tiles(scene, &rendered, &callbacks);
+    }
+    else
+    {
+        camera_render_pixels(scene, &rendered, pixels, NULL, NULL);
+    }
+
+    // Report how long the render took, so the cost of different scenes can be compared.
+    double elapsed = seconds_now() - start_time;
+    if (streaming && !image_writer_finish(&writer))
+    {
+        fprintf(stderr, "\nCould not write the image!\n");
+    }
+    double samples = (double)cfg->image_width * image_height * rendered.samples_per_pixel;
+    fprintf(stderr, "\nRender done! (%.2f seconds, %.0f samples per second)", elapsed, samples / elapsed);
+
+    if (!streaming)
+    {
+        write_image(out, &rendered, pixels, cfg->image_width, image_height);
+    }
+
+    if (rendered.stats != NULL)
+    {
+        fprintf(stderr, "\n");
+        render_stats_write_heatmaps(&stats, cfg->heatmap_prefix);
+    }
+
+    render_stats_free(&stats);
+    free(pixels);
+}
+
+/// @brief Where camera_render_tiled puts the tiles.
+struct Tiled_Target
+{
+    struct Mapped_File file;
+    struct Tiled_Image_Header header;
+};
+
+static void tiled_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Tiled_Target *target = arg;
+    const struct Tiled_Image_Header *header = &target->header;
+    uint64_t offset = tiled_image_tile_offset(header, x / header->tile_size, y / header->tile_size);
+
+    tiled_image_store_tile(target->file.writable + offset, header, tile, width, height);
+    mapped_file_write_back(&target->file, offset, header->tile_stride);
+}
+
+/// @brief Render the image into a tiled image file at path (see tiled_image.h), tile by tile, without ever
+/// holding the whole image in memory. The tiles are cfg->tile_size pixels across (TILED_IMAGE_TILE_SIZE if it
+/// is not set).
+/// @return false if the file could not be made (or the image is too big for this machine to map).
+static inline bool camera_render_tiled(const struct Scene *scene, const struct Camera_Config *cfg, const char *path,
+                                       enum Tiled_Format format)
+{
+    struct Camera_Config tiled = *cfg;
+    tiled.tile_size = (cfg->tile_size > 0) ? cfg->tile_size : TILED_IMAGE_TILE_SIZE;
+    int image_height = camera_image_height(&tiled);
+
+    struct Tiled_Target target = {
+        .header = make_tiled_image_header(tiled.image_width, image_height, tiled.tile_size, format,
+                                          tiled.samples_per_pixel, tiled.seed, (uint32_t)mapped_file_page_size()),
+    };
+    uint64_t size = tiled_image_file_size(&target.header);
+    if (size > SIZE_MAX || !create_mapped_file(&target.file, path, (size_t)size))
+    {
+        fprintf(stderr, "Could not make the tiled image %s (%.1f MB)\n", path, size / 1e6);
+        return false;
+    }
+    memcpy(target.file.writable, &target.header, sizeof(target.header));
+
+    struct Render_Callbacks callbacks = {.tile_done = tiled_tile_done, .progress = print_progress, .arg = &target};
+
+    double start_time = seconds_now();
+    camera_render_tiles(scene, &tiled, &callbacks);
+    double elapsed = seconds_now() - start_time;
+
+    double samples = (double)tiled.image_width * image_height * tiled.samples_per_pixel;
+    fprintf(stderr, "\nRender done! (%.2f seconds, %.0f samples per second, %.1f MB written to %s)", elapsed,
+            samples / elapsed, size / 1e6, path);
+
+    unmap_file(&target.file);
+    return true;
+}
+
+/// @brief Render the image (to stdout)
+/// @param scene the Hittable objects and lights (see scene.h)
+static inline void camera_render(const struct Scene *scene, const struct Camera_Config *cfg)
+{
+    camera_render_to(stdout, scene, cfg);
+}
@@ -0,0 +1,395 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "camera.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+
+A camera manifest lists many views of one scene to render in one go (say, a thumbnail, a preview and the
+final frame, or the same shot from a dozen places), so the scene is loaded and its BVH (or grid) built once
+for all of them, instead of once per run:
+
+    build\theNextWeek.exe 6 big.scene --cameras shots.txt
+
+The manifest has one camera per line, as key=value pairs separated by spaces. Everything after a # is a comment.
+
+    # thumbnail and final frame
+    output=thumb.ppm width=320 height=180 spp=16
+    output=final.pfm width=1920 height=1080 spp=256 lookfrom=13,2,3 lookat=0,0,0 vfov=20 defocus=0.6 focus=10
+
+The keys are
+
+    output     the file to write the image to (required). Ending in .pfm it is written as a PFM image,
+               ending in .acc as an accumulation file, and otherwise in the format given on the command line.
+    width, height, aspect (the ratio of width over height, if there is no height)
+    spp (samples per pixel), depth (the most bounces), seed
+    vfov, lookfrom=x,y,z, lookat=x,y,z, vup=x,y,z, defocus (the defocus angle), focus (the focus distance)
+
+and what a line leaves out is what the scene's own camera has.
+
+All the cameras are rendered by one pool of threads (see camera_render_many): the threads go from the tiles of
+one image straight on to the tiles of the next, so they are all busy until the very end, and each image is
+written as soon as its last tile is done (and its pixels freed).
+
+*/
+
+/// @brief One of the cameras of a manifest, and where its image goes.
+struct Manifest_Camera
+{
+    struct Camera_Config cfg;
+    char *output; //< The path to write the image to
+};
+
+struct Camera_Manifest
+{
+    struct Manifest_Camera *cameras;
+    int num_cameras;
+};
+
+/// @brief Parse "x,y,z" into v.
+/// @return false if it is not three numbers.
+static inline bool manifest_parse_vec3(const char *text, double v[3])
+{
+    char *end;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        v[axis] = strtod(text, &end);
+        if (end == text || *end != ((axis < 2) ? ',' : '\0'))
+        {
+            return false;
+        }
+        text = end + 1;
+    }
+    return true;
+}
+
+/// @brief Parse a number that must be all of text.
+/// @return false if it is not one.
+static inline bool manifest_parse_number(const char *text, double *value)
+{
+    char *end;
+    *value = strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+/// @brief Set the key of the camera to value.
+/// @return false if there is no such key, or the value is not valid for it.
+static inline bool manifest_set(struct Manifest_Camera *camera, const char *key, const char *value)
+{
+    struct Camera_Config *cfg = &camera->cfg;
+    double number = 0;
+
+    if (strcmp(key, "output") == 0)
+    {
+        free(camera->output);
+        camera->output = (*value != '\0') ? malloc(strlen(value) + 1) : NULL;
+        if (camera->output == NULL)
+        {
+            return false;
+        }
+        strcpy(camera->output, value);
+
+        size_t length = strlen(value);
+        const char *extension = (length >= 4) ? value + length - 4 : "";
+        cfg->output_format = (strcmp(extension, ".pfm") == 0)   ? Pfm_Image
+                             : (strcmp(extension, ".acc") == 0) ? Accumulation_Image
+                             : (strcmp(extension, ".ppm") == 0) ? Ppm_Image
+                                                                : cfg->output_format;
+        return true;
+    }
+    if (strcmp(key, "lookfrom") == 0)
+    {
+        return manifest_parse_vec3(value, cfg->lookfrom);
+    }
+    if (strcmp(key, "lookat") == 0)
+    {
+        return manifest_parse_vec3(value, cfg->lookat);
+    }
+    if (strcmp(key, "vup") == 0)
+    {
+        return manifest_parse_vec3(value, cfg->vup);
+    }
+    if (strcmp(key, "seed") == 0)
+    {
+        char *end;
+        cfg->seed = strtoull(value, &end, 10);
+        return end != value && *end == '\0';
+    }
+
+    if (!manifest_parse_number(value, &number))
+    {
+        return false;
+    }
+    if (strcmp(key, "width") == 0)
+    {
+        cfg->image_width = (int)number;
+        return cfg->image_width > 0;
+    }
+    if (strcmp(key, "height") == 0)
+    {
+        cfg->image_height = (int)number;
+        return cfg->image_height > 0;
+    }
+    if (strcmp(key, "aspect") == 0)
+    {
+        cfg->aspect_ratio = number;
+        cfg->image_height = 0;
+        return number > 0;
+    }
+    if (strcmp(key, "spp") == 0)
+    {
+        cfg->samples_per_pixel = (int)number;
+        return cfg->samples_per_pixel > 0;
+    }
+    if (strcmp(key, "depth") == 0)
+    {
+        cfg->max_depth = (int)number;
+        return cfg->max_depth > 0;
+    }
+    if (strcmp(key, "vfov") == 0)
+    {
+        cfg->vfov = number;
+        return number > 0 && number < 180;
+    }
+    if (strcmp(key, "defocus") == 0)
+    {
+        cfg->defocus_angle = number;
+        return number >= 0;
+    }
+    if (strcmp(key, "focus") == 0)
+    {
+        cfg->focus_dist = number;
+        return number > 0;
+    }
+    return false;
+}
+
+static inline void camera_manifest_free(struct Camera_Manifest *manifest)
+{
+    for (int c = 0; c < manifest->num_cameras; c++)
+    {
+        free(manifest->cameras[c].output);
+    }
+    free(manifest->cameras);
+    *manifest = (struct Camera_Manifest){0};
+}
+
+/// @brief Load the cameras of a manifest (see the comment above).
+/// @param defaults The camera of the scene: what each line starts from.
+/// @return false (after saying why, with the line) if the file could not be read or has a mistake in it.
+static inline bool camera_manifest_load(struct Camera_Manifest *manifest, const char *path,
+                                        const struct Camera_Config *defaults)
+{
+    *manifest = (struct Camera_Manifest){0};
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Could not open the camera manifest %s\n", path);
+        return false;
+    }
+
+    int capacity = 0;
+    bool ok = true;
+    char line[4096];
+    for (int line_number = 1; ok && fgets(line, sizeof(line), in) != NULL; line_number++)
+    {
+        if (strchr(line, '\n') == NULL && !feof(in))
+        {
+            fprintf(stderr, "%s:%i: the line is too long\n", path, line_number);
+            ok = false;
+            break;
+        }
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        struct Manifest_Camera camera = {.cfg = *defaults};
+        bool any = false;
+        for (char *token = strtok(line, " \t\r\n"); ok && token != NULL; token = strtok(NULL, " \t\r\n"))
+        {
+            any = true;
+            char *equals = strchr(token, '=');
+            if (equals == NULL)
+            {
+                fprintf(stderr, "%s:%i: %s is not a key=value pair\n", path, line_number, token);
+                ok = false;
+                break;
+            }
+            *equals = '\0';
+            if (!manifest_set(&camera, token, equals + 1))
+            {
+                fprintf(stderr, "%s:%i: bad %s (%s)\n", path, line_number, token, equals + 1);
+                ok = false;
+            }
+        }
+
+        // A line with nothing but a comment (or nothing at all) is not a camera.
+        if (ok && any && camera.output == NULL)
+        {
+            fprintf(stderr, "%s:%i: the camera has no output\n", path, line_number);
+            ok = false;
+        }
+        if (!ok || !any)
+        {
+            free(camera.output);
+            continue;
+        }
+
+        if (manifest->num_cameras == capacity)
+        {
+            capacity = (capacity > 0) ? 2 * capacity : 16;
+            struct Manifest_Camera *cameras = realloc(manifest->cameras, capacity * sizeof(struct Manifest_Camera));
+            if (cameras == NULL)
+            {
+                fprintf(stderr, "Could not allocate the cameras!\n");
+                free(camera.output);
+                ok = false;
+                break;
+            }
+            manifest->cameras = cameras;
+        }
+        manifest->cameras[manifest->num_cameras++] = camera;
+    }
+    fclose(in);
+
+    if (ok && manifest->num_cameras == 0)
+    {
+        fprintf(stderr, "The camera manifest %s has no cameras\n", path);
+        ok = false;
+    }
+    if (!ok)
+    {
+        camera_manifest_free(manifest);
+    }
+    return ok;
+}
+
+/// @brief How far the whole manifest is (guarded by the render pool's progress lock, like all progress calls).
+struct Manifest_Progress
+{
+    int tiles_done, num_tiles;
+    double last_report; //< When the progress was last printed
+    atomic_int images_written;
+    atomic_bool failed; //< If any image could not be written
+};
+
+/// @brief The image of one of the cameras, while it is rendered (see camera_manifest_render).
+struct Manifest_Target
+{
+    struct Pixels_Target pixels;
+    const struct Manifest_Camera *camera;
+    struct Manifest_Progress *progress;
+};
+
+static bool manifest_progress(void *arg, int tiles_done, int num_tiles)
+{
+    (void)tiles_done;
+    (void)num_tiles;
+    struct Manifest_Progress *progress = ((struct Manifest_Target *)arg)->progress;
+    progress->tiles_done++;
+
+    double now = seconds_now();
+    if (progress->tiles_done == progress->num_tiles || now - progress->last_report >= PROGRESS_INTERVAL)
+    {
+        progress->last_report = now;
+        fprintf(stderr, "\rTiles rendered: %i out of %i (%i images written)", progress->tiles_done,
+                progress->num_tiles, atomic_load(&progress->images_written));
+        fflush(stderr);
+    }
+    return true;
+}
+
+/// @brief Write the camera's image (and free its pixels): all its tiles are done.
+static void manifest_image_done(void *arg)
+{
+    struct Manifest_Target *target = arg;
+    const struct Camera_Config *cfg = &target->camera->cfg;
+
+    FILE *out = fopen(target->camera->output, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "\nCould not open %s to write the image to!\n", target->camera->output);
+        atomic_store(&target->progress->failed, true);
+    }
+    else
+    {
+        write_image(out, cfg, target->pixels.pixels, cfg->image_width, camera_image_height(cfg));
+        if (fclose(out) != 0)
+        {
+            atomic_store(&target->progress->failed, true);
+        }
+        atomic_fetch_add(&target->progress->images_written, 1);
+    }
+
+    free(target->pixels.pixels);
+    target->pixels.pixels = NULL;
+}
+
+/// @brief Render every camera of the manifest (all with the same pool of threads, see camera_render_many)
+/// and write each image to its output.
+/// @return false if any image could not be rendered or written.
+static inline bool camera_manifest_render(const struct Scene *scene, const struct Camera_Manifest *manifest)
+{
+    const int n = manifest->num_cameras;
+    struct Camera_Config *cfgs = malloc(n * sizeof(struct Camera_Config));
+    struct Render_Callbacks *callbacks = malloc(n * sizeof(struct Render_Callbacks));
+    struct Manifest_Target *targets = calloc(n, sizeof(struct Manifest_Target));
+    struct Manifest_Progress progress = {0};
+    atomic_init(&progress.images_written, 0);
+    atomic_init(&progress.failed, false);
+
+    bool ok = cfgs != NULL && callbacks != NULL && targets != NULL;
+    double samples = 0;
+    for (int c = 0; ok && c < n; c++)
+    {
+        cfgs[c] = manifest->cameras[c].cfg;
+        int image_width = cfgs[c].image_width;
+        int image_height = camera_image_height(&cfgs[c]);
+        int tile_size = (cfgs[c].tile_size > 0) ? cfgs[c].tile_size : CAMERA_TILE_SIZE;
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int tiles_y = (image_height + tile_size - 1) / tile_size;
+        progress.num_tiles += tiles_x * tiles_y;
+        samples += (double)image_width * image_height * cfgs[c].samples_per_pixel;
+
+        // Every image is in memory until it is written (so a manifest of huge images needs a lot of it).
+        targets[c] = (struct Manifest_Target){
+            .pixels = {.pixels = malloc((size_t)image_width * image_height * sizeof(color3)),
+                       .image_width = image_width},
+            .camera = &manifest->cameras[c],
+            .progress = &progress,
+        };
+        callbacks[c] = (struct Render_Callbacks){.tile_done = pixels_tile_done,
+                                                 .progress = manifest_progress,
+                                                 .image_done = manifest_image_done,
+                                                 .arg = &targets[c]};
+        ok = targets[c].pixels.pixels != NULL;
+    }
+
+    if (ok)
+    {
+        double start_time = seconds_now();
+        ok = camera_render_many(scene, n, cfgs, callbacks, NULL) && !atomic_load(&progress.failed);
+
+        double elapsed = seconds_now() - start_time;
+        fprintf(stderr, "\nRender done! (%i images, %.2f seconds, %.0f samples per second)\n",
+                atomic_load(&progress.images_written), elapsed, samples / elapsed);
+    }
+    else
+    {
+        fprintf(stderr, "Could not allocate the images!\n");
+    }
+
+    for (int c = 0; targets != NULL && c < n; c++)
+    {
+        free(targets[c].pixels.pixels);
+    }
+    free(targets);
+    free(callbacks);
+    free(cfgs);
+    return ok;
+}
@@ -29,9 +29,16 @@ static inline double linear_to_gamma(double linear_component)
     return (linear_component > 0) ? sqrt(linear_component) : 0;
 }
 
+/// @brief The brightness of a (linear) color (its luminance).
+static inline double color_luminance(const color3 color)
+{
+    return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+}
+
 /// @brief Write out a color to the output stream.
+/// @param out
 /// @param color
-void write_color(color3 color)
+static inline void write_color(FILE *out, color3 color)
 {
     double r = color[0];
     double g = color[1];
@@ -43,10 +50,10 @@ void write_color(color3 color)
     b = linear_to_gamma(b);
 
     // Translate the component values in the range [0,1] to the byte range [0,255].
-    int rbyte = (int)255.999 * interval_clamp(&intensity, r);
-    int gbyte = (int)255.999 * interval_clamp(&intensity, g);
-    int bbyte = (int)255.999 * interval_clamp(&intensity, b);
+    int rbyte = (int)(256 * interval_clamp(&intensity, r));
+    int gbyte = (int)(256 * interval_clamp(&intensity, g));
+    int bbyte = (int)(256 * interval_clamp(&intensity, b));
 
     // Write out the color components
-    printf("%i %i %i\n", rbyte, gbyte, bbyte);
+    fprintf(out, "%i %i %i\n", rbyte, gbyte, bbyte);
 }
@@ -0,0 +1,539 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+For scenes of millions of objects the BVH is much larger than the CPU caches, and finding a hit is mostly
+waiting for nodes to come in from memory: a binary BVH node is 64 bytes for one box (six doubles),
+and a 4 wide node (see wide_bvh.h) is 224 bytes for four.
+
+A compressed node holds four children in one 64 byte cache line. Rather than six doubles, each child box is
+six bytes: its planes are stored on a grid of 255 steps across the node's own box (the union of its
+children's boxes). The node keeps where that grid starts (three floats) and how big a step is on each axis
+(a power of two, so a plane comes back exactly with a multiply and an add), and each child plane is rounded
+outward to the grid (min down, max up), so a child's stored box always contains its real box. The stored boxes
+are a bit larger (by less than a step, 1/255 of the node's box, on each side), so rays hit a few more of them,
+but a whole node is one cache line to fetch.
+
+The planes are tested in floats (four children in one SSE register). A box that is slightly too large only
+costs an extra test, but one that is slightly too small could lose a hit, so each child box is also padded by
+a tiny margin (1/2^16 of its node's box) and each slab test is widened by a tiny fraction of the distance:
+both more than the rounding errors of testing in floats.
+
+The nodes are laid out depth first (each node is followed by the subtree of its first child), so going down
+the tree mostly reads nodes that are next to each other in memory. The node array starts on a cache line,
+so no node straddles two.
+
+The compressed BVH is made from a binary BVH, so build (or refit) the binary BVH first, then compress it with
+compressed_bvh_build. Unlike the wide BVH it keeps its own copy of the indices, so once it is built the binary
+BVH can be freed (and for the scenes it is meant for, the binary BVH's nodes are most of the memory).
+
+*/
+
+#define COMPRESSED_BVH_WIDTH 4   //< Children per node
+#define COMPRESSED_BVH_STEPS 255 //< Grid steps across a node's box (the largest plane a byte can hold)
+#define COMPRESSED_BVH_CACHE_LINE 64
+
+// How much child boxes are padded (times the largest extent of their node's box), and slab tests widened
+// (times the distance), see above. Testing in floats is off by a few times 2^-24 of those.
+#define COMPRESSED_BVH_MARGIN (1.0 / 65536)
+#define COMPRESSED_BVH_WIDEN (1.0f / 262144)
+
+// The compressed tree is the 4 wide tree, so it is no deeper.
+#define COMPRESSED_BVH_STACK_SIZE (BVH_STACK_SIZE * (COMPRESSED_BVH_WIDTH - 1) + 1)
+
+_Static_assert(BVH_MAX_SAH_LEAF_SIZE <= UINT8_MAX, "leaf sizes must fit in Compressed_BVH_Node.count");
+_Static_assert(COMPRESSED_BVH_WIDTH == WIDE_BVH_GROUP_SIZE, "a compressed node is made from one wide group");
+
+/// @brief Four children in one cache line (see above).
+/// @remark Unused children have their bit of used clear (and empty boxes).
+struct Compressed_BVH_Node
+{
+    float origin[3];                        //< Where the grid starts (at or below the node's box)
+    int8_t exponent[3];                     //< A step is 2^exponent on each axis
+    uint8_t used;                           //< Bit c is set if child c is used
+    uint8_t count[COMPRESSED_BVH_WIDTH];    //< How many objects a leaf child has. 0 for internal children.
+    uint8_t q_min[3][COMPRESSED_BVH_WIDTH]; //< q_min[axis][child]: the child's min plane, in steps from origin
+    uint8_t q_max[3][COMPRESSED_BVH_WIDTH]; //< q_max[axis][child]: the child's max plane, in steps from origin
+    int32_t child[COMPRESSED_BVH_WIDTH];    //< Internal child: the index of its node. Leaf: its first index
+    uint32_t reserved;                      //< 0 (pads the node to a cache line)
+};
+
+_Static_assert(sizeof(struct Compressed_BVH_Node) == COMPRESSED_BVH_CACHE_LINE,
+               "a compressed node must be one cache line");
+
+struct Compressed_BVH
+{
+    const struct Hittable *world; //< The objects the BVH is built over (not owned by the BVH)
+    int world_length;
+    int *indices; //< Indices into world, grouped by leaf (a copy of the binary BVH's)
+
+    struct Compressed_BVH_Node *nodes; //< Depth first, nodes[0] is the root. Starts on a cache line.
+    int num_nodes;
+    void *allocation; //< What nodes points into (malloc doesn't promise cache line alignment)
+};
+
+/// @brief 2^exponent as a float (exponent is at least -126, so this is a normal float).
+static inline float compressed_bvh_step(int exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float step;
+    memcpy(&step, &bits, sizeof(step));
+    return step;
+}
+
+/// @brief Where plane q of the grid is, computed in floats (q * step is exact, since step is a power of two).
+static inline double compressed_bvh_plane(float origin, float step, int q)
+{
+    float plane = origin + (float)q * step;
+    return plane;
+}
+
+/// @brief The largest float at or below x.
+static inline float compressed_bvh_float_down(double x)
+{
+    float f = (float)x;
+    return (f > x) ? nextafterf(f, -INFINITY) : f;
+}
+
+/// @brief The smallest float at or above x.
+static inline float compressed_bvh_float_up(double x)
+{
+    float f = (float)x;
+    return (f < x) ? nextafterf(f, INFINITY) : f;
+}
+
+/// @brief Set up the grid of node and its children's quantized boxes, from the boxes of a wide BVH group.
+/// (Which children are leaves, and where they point, is up to the caller.)
+static inline void compressed_bvh_quantize(struct Compressed_BVH_Node *node, const struct Wide_BVH_Group *group,
+                                           uint8_t used)
+{
+    double lo[3], hi[3];
+    double largest_extent = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        lo[axis] = infinity;
+        hi[axis] = -infinity;
+        for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+        {
+            if (used & (1 << c))
+            {
+                lo[axis] = (group->min[axis][c] < lo[axis]) ? group->min[axis][c] : lo[axis];
+                hi[axis] = (group->max[axis][c] > hi[axis]) ? group->max[axis][c] : hi[axis];
+            }
+        }
+        if (hi[axis] - lo[axis] > largest_extent)
+        {
+            largest_extent = hi[axis] - lo[axis];
+        }
+    }
+    double margin = largest_extent * COMPRESSED_BVH_MARGIN;
+
+    memset(node, 0, sizeof(*node));
+    node->used = used;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (used == 0)
+        {
+            memset(node->q_min[axis], COMPRESSED_BVH_STEPS, COMPRESSED_BVH_WIDTH);
+            continue;
+        }
+
+        // The smallest step whose grid reaches past the node's box (the first guess is usually it).
+        float origin = compressed_bvh_float_down(lo[axis] - margin);
+        double top = hi[axis] + margin;
+        double span = (top - origin) / COMPRESSED_BVH_STEPS;
+        int exponent = (span > 0) ? (int)ceil(log2(span)) : -126;
+        exponent = (exponent < -126) ? -126 : (exponent > 127) ? 127 : exponent;
+        while (exponent < 127 &&
+               compressed_bvh_plane(origin, compressed_bvh_step(exponent), COMPRESSED_BVH_STEPS) < top)
+        {
+            exponent++;
+        }
+        float step = compressed_bvh_step(exponent);
+        node->origin[axis] = origin;
+        node->exponent[axis] = (int8_t)exponent;
+
+        for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+        {
+            if (!(used & (1 << c)))
+            {
+                // An empty box (min past max), which no ray hits.
+                node->q_min[axis][c] = COMPRESSED_BVH_STEPS;
+                node->q_max[axis][c] = 0;
+                continue;
+            }
+
+            // Round outward, then step further out if rounding in floats went the wrong way.
+            double min = group->min[axis][c] - margin;
+            double max = group->max[axis][c] + margin;
+            double q_min = floor((min - origin) / step);
+            double q_max = ceil((max - origin) / step);
+            int q0 = (q_min < 0) ? 0 : (q_min > COMPRESSED_BVH_STEPS) ? COMPRESSED_BVH_STEPS : (int)q_min;
+            int q1 = (q_max < 0) ? 0 : (q_max > COMPRESSED_BVH_STEPS) ? COMPRESSED_BVH_STEPS : (int)q_max;
+            while (q0 > 0 && compressed_bvh_plane(origin, step, q0) > min)
+            {
+                q0--;
+            }
+            while (q1 < COMPRESSED_BVH_STEPS && compressed_bvh_plane(origin, step, q1) < max)
+            {
+                q1++;
+            }
+            node->q_min[axis][c] = (uint8_t)q0;
+            node->q_max[axis][c] = (uint8_t)q1;
+        }
+    }
+}
+
+/// @brief (Re)build the compressed BVH from a binary one (see above). Call compressed_bvh_free once you are done
+/// with it.
+/// @remark The compressed BVH does not copy the world, so the world must outlive it (the binary BVH need not).
+/// Compress again after refitting (or rebuilding) the binary BVH. compressed must be zero initialized before its
+/// first build.
+static inline void compressed_bvh_build(struct Compressed_BVH *compressed, const struct BVH *bvh)
+{
+    // Collapse to 4 wide first: each wide node (one group) becomes one compressed node.
+    struct Wide_BVH wide = {0};
+    wide_bvh_build(&wide, bvh, COMPRESSED_BVH_WIDTH);
+    int num_nodes = wide.num_groups;
+
+    free(compressed->allocation);
+    free(compressed->indices);
+    compressed->allocation = malloc(num_nodes * sizeof(struct Compressed_BVH_Node) + COMPRESSED_BVH_CACHE_LINE);
+    compressed->indices = malloc((bvh->world_length > 0 ? bvh->world_length : 1) * sizeof(int));
+    int *position = malloc(num_nodes * sizeof(int));
+    int *stack = malloc(num_nodes * sizeof(int));
+    if (compressed->allocation == NULL || compressed->indices == NULL || position == NULL || stack == NULL)
+    {
+        fprintf(stderr, "Could not allocate the compressed BVH!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uintptr_t address = (uintptr_t)compressed->allocation;
+    address = (address + COMPRESSED_BVH_CACHE_LINE - 1) & ~(uintptr_t)(COMPRESSED_BVH_CACHE_LINE - 1);
+    compressed->nodes = (struct Compressed_BVH_Node *)address;
+    compressed->num_nodes = num_nodes;
+    compressed->world = bvh->world;
+    compressed->world_length = bvh->world_length;
+    memcpy(compressed->indices, bvh->indices, bvh->world_length * sizeof(int));
+
+    // Number the wide nodes depth first: each node, then the subtree of its first child, and so on.
+    // (An internal child is one with no objects that points past the root, see Wide_BVH_Group.)
+    int next = 0;
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0)
+    {
+        int k = stack[--stack_size];
+        position[k] = next++;
+
+        const struct Wide_BVH_Group *group = &wide.groups[k];
+        for (int c = COMPRESSED_BVH_WIDTH - 1; c >= 0; c--)
+        {
+            if (group->count[c] == 0 && group->child[c] > 0)
+            {
+                stack[stack_size++] = group->child[c];
+            }
+        }
+    }
+
+    for (int k = 0; k < num_nodes; k++)
+    {
+        const struct Wide_BVH_Group *group = &wide.groups[k];
+        struct Compressed_BVH_Node *node = &compressed->nodes[position[k]];
+
+        uint8_t used = 0;
+        for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+        {
+            used |= (group->count[c] > 0 || group->child[c] > 0) << c;
+        }
+        compressed_bvh_quantize(node, group, used);
+
+        for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+        {
+            node->count[c] = (uint8_t)group->count[c];
+            node->child[c] = (group->count[c] == 0 && group->child[c] > 0) ? position[group->child[c]]
+                                                                            : group->child[c];
+        }
+    }
+
+    free(stack);
+    free(position);
+    wide_bvh_free(&wide);
+}
+
+static inline void compressed_bvh_free(struct Compressed_BVH *compressed)
+{
+    free(compressed->allocation);
+    free(compressed->indices);
+    compressed->allocation = NULL;
+    compressed->indices = NULL;
+    compressed->nodes = NULL;
+    compressed->num_nodes = 0;
+}
+
+/// @brief The bytes the compressed BVH takes (its nodes and its indices).
+static inline size_t compressed_bvh_memory(const struct Compressed_BVH *compressed)
+{
+    return (size_t)compressed->num_nodes * sizeof(struct Compressed_BVH_Node) +
+           (size_t)compressed->world_length * sizeof(int);
+}
+
+/// @brief What the traversal needs to know about a ray, set up once per ray.
+struct Compressed_BVH_Ray
+{
+    double origin[3];                //< In doubles: every node's grid is moved to the ray's origin in doubles
+    bvh_float4 inverse_direction[3]; //< 1 / each coordinate of the direction, in all lanes
+    bool negative[3];                //< Whether the ray goes toward -axis (so it enters a box through its max)
+};
+
+static inline struct Compressed_BVH_Ray compressed_bvh_ray(const struct Ray *ray)
+{
+    struct Compressed_BVH_Ray ret;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // Division by zero gives +-infinity here, which the slab test handles (like wide_bvh_ray).
+        float inverse = (float)(1.0 / ray->direction[axis]);
+        ret.origin[axis] = ray->origin[axis];
+        ret.inverse_direction[axis].e[0] = ret.inverse_direction[axis].e[1] = inverse;
+        ret.inverse_direction[axis].e[2] = ret.inverse_direction[axis].e[3] = inverse;
+        ret.negative[axis] = inverse < 0;
+    }
+    return ret;
+}
+
+/// @brief Four quantized planes (one per child) as floats.
+static inline bvh_float4 compressed_bvh_planes(const uint8_t q[COMPRESSED_BVH_WIDTH])
+{
+    bvh_float4 ret;
+#if defined(BVH_SSE)
+    int32_t bytes;
+    memcpy(&bytes, q, sizeof(bytes));
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+    ret.v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+#else
+    for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+    {
+        ret.e[c] = q[c];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Slab test of the ray against the four children of the node (see above).
+/// @param ray_interval Must start at 0 or later (all of ours start a little after 0).
+/// @param t_enter Set to (at most) where the ray enters each box (only meaningful for the boxes it hits).
+/// @return A bit mask of the boxes the ray is inside of for some t in ray_interval.
+static inline int compressed_bvh_node_hit(const struct Compressed_BVH_Node *node, const struct Compressed_BVH_Ray *ray,
+                                          struct Interval ray_interval, float t_enter[COMPRESSED_BVH_WIDTH])
+{
+    // The interval is rounded outward to floats, like everything else here.
+    float t_min = compressed_bvh_float_down(ray_interval.min);
+    float t_max = compressed_bvh_float_up(ray_interval.max);
+
+#if defined(BVH_SSE)
+    __m128 entry = _mm_set1_ps(-INFINITY);
+    __m128 exit = _mm_set1_ps(INFINITY);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // The grid, moved so the ray starts at 0.
+        __m128 origin = _mm_set1_ps((float)(node->origin[axis] - ray->origin[axis]));
+        __m128 step = _mm_set1_ps(compressed_bvh_step(node->exponent[axis]));
+
+        const uint8_t *near = ray->negative[axis] ? node->q_max[axis] : node->q_min[axis];
+        const uint8_t *far = ray->negative[axis] ? node->q_min[axis] : node->q_max[axis];
+        __m128 near_plane = _mm_add_ps(origin, _mm_mul_ps(compressed_bvh_planes(near).v, step));
+        __m128 far_plane = _mm_add_ps(origin, _mm_mul_ps(compressed_bvh_planes(far).v, step));
+
+        // max and min return their second operand if the first is NaN (see wide_lanes_max).
+        entry = _mm_max_ps(_mm_mul_ps(near_plane, ray->inverse_direction[axis].v), entry);
+        exit = _mm_min_ps(_mm_mul_ps(far_plane, ray->inverse_direction[axis].v), exit);
+    }
+
+    // Widen the test (a box entered before 0 is clamped to t_min, so only the entry and exit after 0 matter).
+    entry = _mm_max_ps(_mm_mul_ps(entry, _mm_set1_ps(1 - COMPRESSED_BVH_WIDEN)), _mm_set1_ps(t_min));
+    exit = _mm_min_ps(_mm_mul_ps(exit, _mm_set1_ps(1 + COMPRESSED_BVH_WIDEN)), _mm_set1_ps(t_max));
+
+    _mm_storeu_ps(t_enter, entry);
+    return _mm_movemask_ps(_mm_cmplt_ps(entry, exit)) & node->used;
+#else
+    float exit[COMPRESSED_BVH_WIDTH];
+    for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+    {
+        t_enter[c] = -INFINITY;
+        exit[c] = INFINITY;
+    }
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float origin = (float)(node->origin[axis] - ray->origin[axis]);
+        float step = compressed_bvh_step(node->exponent[axis]);
+        float inverse = ray->inverse_direction[axis].e[0];
+
+        const uint8_t *near = ray->negative[axis] ? node->q_max[axis] : node->q_min[axis];
+        const uint8_t *far = ray->negative[axis] ? node->q_min[axis] : node->q_max[axis];
+        for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+        {
+            float t0 = (origin + near[c] * step) * inverse;
+            float t1 = (origin + far[c] * step) * inverse;
+            t_enter[c] = (t0 > t_enter[c]) ? t0 : t_enter[c];
+            exit[c] = (t1 < exit[c]) ? t1 : exit[c];
+        }
+    }
+
+    int mask = 0;
+    for (int c = 0; c < COMPRESSED_BVH_WIDTH; c++)
+    {
+        float entry = t_enter[c] * (1 - COMPRESSED_BVH_WIDEN);
+        float leave = exit[c] * (1 + COMPRESSED_BVH_WIDEN);
+        t_enter[c] = (entry > t_min) ? entry : t_min;
+        leave = (leave < t_max) ? leave : t_max;
+        mask |= (t_enter[c] < leave) << c;
+    }
+    return mask & node->used;
+#endif
+}
+
+/// @brief Test the ray against the children of node, and push the ones it hits onto the stack, the nearest last
+/// (so it is visited first).
+static inline void compressed_bvh_push_children(const struct Compressed_BVH_Node *node,
+                                                const struct Compressed_BVH_Ray *ray, struct Interval ray_interval,
+                                                struct Wide_BVH_Entry *stack, int *stack_size)
+{
+    float t_enter[COMPRESSED_BVH_WIDTH];
+    int mask = compressed_bvh_node_hit(node, ray, ray_interval, t_enter);
+
+    struct Wide_BVH_Entry *hits = stack + *stack_size;
+    int num_hits = 0;
+    for (; mask != 0; mask &= mask - 1)
+    {
+        int lane = 0;
+        while (!(mask & (1 << lane)))
+        {
+            lane++;
+        }
+
+        // Insertion sort, farthest first.
+        struct Wide_BVH_Entry entry = {node->child[lane], node->count[lane], t_enter[lane]};
+        int i = num_hits++;
+        while (i > 0 && hits[i - 1].t < entry.t)
+        {
+            hits[i] = hits[i - 1];
+            i--;
+        }
+        hits[i] = entry;
+    }
+    *stack_size += num_hits;
+}
+
+/// @brief returns if any objects in the compressed BVH are hit by the ray (the same as bvh_hit).
+/// @param rec the Hit Record-- updated accordingly
+static inline bool compressed_bvh_hit(const struct Compressed_BVH *compressed, const struct Ray *ray,
+                                      struct Interval ray_interval, struct Hit_Record *rec)
+{
+    if (compressed->world_length == 0)
+    {
+        return false;
+    }
+
+    struct Compressed_BVH_Ray compressed_ray = compressed_bvh_ray(ray);
+    struct Hit_Record temp_rec;
+    bool hit_anything = false;
+    double closest_so_far = ray_interval.max;
+
+    struct Wide_BVH_Entry stack[COMPRESSED_BVH_STACK_SIZE];
+    int stack_size = 0;
+    compressed_bvh_push_children(&compressed->nodes[0], &compressed_ray, ray_interval, stack, &stack_size);
+
+    while (stack_size > 0)
+    {
+        struct Wide_BVH_Entry entry = stack[--stack_size];
+
+        // We found a hit closer than this box since we pushed it.
+        if (entry.t >= closest_so_far)
+        {
+            continue;
+        }
+
+        if (entry.count == 0)
+        {
+            struct Interval interval = {.min = ray_interval.min, .max = closest_so_far};
+            compressed_bvh_push_children(&compressed->nodes[entry.child], &compressed_ray, interval, stack,
+                                         &stack_size);
+            continue;
+        }
+
+        for (int k = entry.child; k < entry.child + entry.count; k++)
+        {
+            const struct Hittable *object = &compressed->world[compressed->indices[k]];
+            if (hittable_hit(object, ray, (struct Interval){.min = ray_interval.min, .max = closest_so_far},
+                             &temp_rec))
+            {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                *rec = temp_rec;
+                rec->object = object;
+            }
+        }
+    }
+
+    return hit_anything;
+}
+
+/// @brief The compressed BVH version of bvh_transmittance (any-hit: stops at the first solid object found).
+static inline double compressed_bvh_transmittance(const struct Compressed_BVH *compressed, const struct Ray *ray,
+                                                  struct Interval ray_interval)
+{
+    if (compressed->world_length == 0)
+    {
+        return 1.0;
+    }
+
+    struct Compressed_BVH_Ray compressed_ray = compressed_bvh_ray(ray);
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+
+    struct Wide_BVH_Entry stack[COMPRESSED_BVH_STACK_SIZE];
+    int stack_size = 0;
+    compressed_bvh_push_children(&compressed->nodes[0], &compressed_ray, ray_interval, stack, &stack_size);
+
+    while (stack_size > 0)
+    {
+        struct Wide_BVH_Entry entry = stack[--stack_size];
+
+        if (entry.count == 0)
+        {
+            compressed_bvh_push_children(&compressed->nodes[entry.child], &compressed_ray, ray_interval, stack,
+                                         &stack_size);
+            continue;
+        }
+
+        for (int k = entry.child; k < entry.child + entry.count; k++)
+        {
+            const struct Hittable *object = &compressed->world[compressed->indices[k]];
+
+            if (object->which == (enum Which_Hittable)Constant_Medium)
+            {
+                transmittance *= constant_medium_transmittance(&object->object.constant_medium, ray, ray_interval);
+                if (transmittance <= 0)
+                {
+                    return 0;
+                }
+            }
+            else if (hittable_hit(object, ray, ray_interval, &temp_rec))
+            {
+                return 0;
+            }
+        }
+    }
+
+    return transmittance;
+}
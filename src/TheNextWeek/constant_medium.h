@@ -0,0 +1,185 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "ray.h"
+#include "aabb.h"
+
+/*
+
+Participating media (smoke, fog, mist) are modeled as a volume where a ray can scatter at any point inside.
+As the ray passes through the volume, the probability that it scatters in any small distance dL is
+C * dL, where C is proportional to the optical density of the volume.
+Solving this gives an exponential distribution for the distance the ray travels before scattering,
+which we can sample directly (analytically) from a single random number.
+See section 9 (Volumes) of TheNextWeek for more details.
+
+For a medium whose density varies from point to point there is no such closed form.
+We then use delta tracking (also called Woodcock tracking): we pretend the medium is homogeneous
+with the *maximum* density (the majorant), take exponential steps according to it,
+and at each tentative collision accept it as a real one with probability density(p) / majorant.
+Rejected collisions are "null collisions" that leave the ray unchanged.
+Either way we only need to intersect the boundary twice (to find where the ray enters and leaves the volume),
+never once per step.
+
+*/
+
+// Forward declare Hittable (a Constant_Medium's boundary is itself a Hittable).
+struct Hittable;
+
+static inline bool hittable_hit(const struct Hittable *object, const struct Ray *ray,
+                                struct Interval ray_interval, struct Hit_Record *rec);
+static inline struct AABB hittable_bounding_box(const struct Hittable *object);
+
+struct Constant_Medium
+{
+    /// @brief The shape of the volume (a Sphere or a Box). Must be a closed (convex) shape.
+    const struct Hittable *boundary;
+
+    /// @brief For a homogeneous medium this is its density.
+    /// For a heterogeneous medium this is the maximum density anywhere in it (the majorant).
+    double density;
+
+    /// @brief Optional. Returns the density at point p as a fraction of density (in [0,1]).
+    /// Leave as NULL for a homogeneous medium.
+    double (*density_fraction)(const point3 p);
+
+    const struct Material_Cfg *phase_function; //< The material config for the medium (should be Isotropic).
+};
+
+/// @brief Find the part of the ray [t_enter, t_exit] that is inside the medium boundary, clamped to ray_interval.
+/// @return false if the ray does not pass through the medium in ray_interval.
+static bool constant_medium_span(const struct Constant_Medium *medium, const struct Ray *ray,
+                                 struct Interval ray_interval, double *t_enter, double *t_exit)
+{
+    struct Hit_Record rec1, rec2;
+
+    // Note that we look for the entry point on the entire ray (and not just ray_interval),
+    // so that this also works if the ray origin is inside the volume.
+    if (!hittable_hit(medium->boundary, ray, INTERVAL_UNIVERSE, &rec1))
+    {
+        return false;
+    }
+
+    if (!hittable_hit(medium->boundary, ray, (struct Interval){.min = rec1.t + 0.0001, .max = infinity}, &rec2))
+    {
+        return false;
+    }
+
+    *t_enter = fmax(rec1.t, ray_interval.min);
+    *t_exit = fmin(rec2.t, ray_interval.max);
+
+    if (*t_enter >= *t_exit)
+    {
+        return false;
+    }
+
+    *t_enter = fmax(*t_enter, 0.0);
+
+    return true;
+}
+
+/// @brief Sample the distance (in units of the ray direction length) to the next tentative collision
+/// in a medium with the given density.
+static inline double sample_free_flight(double density, double ray_length)
+{
+    // 1 - random_zero_to_one() is in (0,1], so the log is always finite.
+    return -log(1.0 - random_zero_to_one()) / (density * ray_length);
+}
+
+/// @brief detect if the ray scatters inside the medium
+/// @param ray
+/// @param ray_interval
+/// @param rec the Hit_Record
+/// @return bool if the ray scattered inside the medium
+static inline bool constant_medium_hit(const struct Constant_Medium *medium, const struct Ray *ray,
+                                       struct Interval ray_interval, struct Hit_Record *rec)
+{
+    double t_enter, t_exit;
+    if (!constant_medium_span(medium, ray, ray_interval, &t_enter, &t_exit))
+    {
+        return false;
+    }
+
+    const double ray_length = len(ray->direction);
+    double t = t_enter;
+
+    if (medium->density_fraction == NULL)
+    {
+        // Homogeneous: the scattering distance is sampled analytically.
+        t += sample_free_flight(medium->density, ray_length);
+        if (t >= t_exit)
+        {
+            return false;
+        }
+        ray_at(rec->p, ray, t);
+    }
+    else
+    {
+        // Heterogeneous: delta tracking against the majorant.
+        while (true)
+        {
+            t += sample_free_flight(medium->density, ray_length);
+            if (t >= t_exit)
+            {
+                return false;
+            }
+
+            ray_at(rec->p, ray, t);
+            if (random_zero_to_one() < medium->density_fraction(rec->p))
+            {
+                break; // A real collision.
+            }
+        }
+    }
+
+    rec->t = t;
+
+    // The normal and front_face are arbitrary for a volume (the phase function does not use them).
+    rec->normal[0] = 1;
+    rec->normal[1] = 0;
+    rec->normal[2] = 0;
+    rec->front_face = true;
+
+    rec->mat_cfg = (struct Material_Cfg *)medium->phase_function;
+
+    return true;
+}
+
+/// @brief Estimate the fraction of light that passes through the medium along the ray (in ray_interval)
+/// without scattering.
+/// @remark For a homogeneous medium this is exact (Beer-Lambert law).
+/// For a heterogeneous medium we use ratio tracking: take the same steps as delta tracking,
+/// but instead of randomly stopping at a collision we multiply by the probability of it being a null collision.
+/// This is an unbiased estimate with much less variance than a binary (hit/no hit) estimate.
+static inline double constant_medium_transmittance(const struct Constant_Medium *medium, const struct Ray *ray,
+                                                   struct Interval ray_interval)
+{
+    double t_enter, t_exit;
+    if (!constant_medium_span(medium, ray, ray_interval, &t_enter, &t_exit))
+    {
+        return 1.0;
+    }
+
+    const double ray_length = len(ray->direction);
+
+    if (medium->density_fraction == NULL)
+    {
+        return exp(-medium->density * (t_exit - t_enter) * ray_length);
+    }
+
+    double transmittance = 1.0;
+    double t = t_enter;
+    point3 p;
+
+    while (true)
+    {
+        t += sample_free_flight(medium->density, ray_length);
+        if (t >= t_exit)
+        {
+            return transmittance;
+        }
+
+        transmittance *= 1.0 - medium->density_fraction(ray_at(p, ray, t));
+    }
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "pfm.h"
+#include "hdr.h"
+
+#include <string.h>
+
+/*
+
+An environment map is the light arriving from infinitely far away in every direction (the sky, the sun,
+the distant landscape), stored as a latitude-longitude HDR image: each row is a latitude (from straight up at the
+top to straight down at the bottom), each column a longitude (all the way around).
+
+Rays that hit nothing see the map. That alone (hoping to hit the sun by chance) is very noisy: a sun covers
+a tiny fraction of the sky but gives most of the light. So we also sample the map as a light (see scene.h):
+we pick pixels with a probability proportional to how much light they give (their brightness times the solid
+angle they cover, which shrinks toward the poles), so bright pixels are sampled all the time.
+
+To pick pixels quickly we use the alias method: every pixel gets a bucket of equal probability 1 / n, filled
+partly with the pixel itself (keep) and the rest with another pixel (alias). Picking is then just choosing
+a bucket uniformly and choosing between its two pixels, in constant time no matter how big the map is.
+
+Directions: y is up, and the center column of the map looks toward +x (longitude goes around from -x, past -z,
++x and +z, back to -x) (the same as the book's sphere texture coordinates).
+
+*/
+
+/// @brief One bucket of the alias table (see above).
+struct Environment_Alias
+{
+    float keep; //< The probability of picking this bucket's own pixel (rather than the alias)
+    int alias;  //< The other pixel in the bucket
+};
+
+struct Environment_Map
+{
+    int width;
+    int height;
+    float *rgb; //< The pixels (3 floats each), row by row from the top
+
+    float *pixel_pdf;                //< The probability of picking each pixel (they sum to 1)
+    struct Environment_Alias *table; //< The alias table (one bucket per pixel)
+};
+
+/// @brief The brightness of a color (its luminance).
+static inline double environment_luminance(const float *rgb)
+{
+    return 0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2];
+}
+
+/// @brief Build the alias table from the pixel probabilities (Vose's method).
+/// @return false if we could not allocate the work lists.
+static inline bool environment_build_alias(struct Environment_Map *map)
+{
+    int n = map->width * map->height;
+
+    // Pixels with less than the average probability fill their bucket with a pixel with more than the average.
+    int *small = malloc(n * sizeof(int));
+    int *large = malloc(n * sizeof(int));
+    double *scaled = malloc(n * sizeof(double));
+    if (small == NULL || large == NULL || scaled == NULL)
+    {
+        free(small);
+        free(large);
+        free(scaled);
+        return false;
+    }
+
+    int num_small = 0, num_large = 0;
+    for (int i = 0; i < n; i++)
+    {
+        scaled[i] = (double)map->pixel_pdf[i] * n;
+        if (scaled[i] < 1)
+        {
+            small[num_small++] = i;
+        }
+        else
+        {
+            large[num_large++] = i;
+        }
+    }
+
+    while (num_small > 0 && num_large > 0)
+    {
+        int s = small[--num_small];
+        int l = large[--num_large];
+
+        map->table[s].keep = (float)scaled[s];
+        map->table[s].alias = l;
+
+        // l gave away the rest of s's bucket.
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+        {
+            small[num_small++] = l;
+        }
+        else
+        {
+            large[num_large++] = l;
+        }
+    }
+
+    // What's left fills its own bucket (up to rounding errors).
+    while (num_large > 0)
+    {
+        int l = large[--num_large];
+        map->table[l] = (struct Environment_Alias){.keep = 1, .alias = l};
+    }
+    while (num_small > 0)
+    {
+        int s = small[--num_small];
+        map->table[s] = (struct Environment_Alias){.keep = 1, .alias = s};
+    }
+
+    free(small);
+    free(large);
+    free(scaled);
+    return true;
+}
+
+/// @brief Set up an environment map from its pixels (and build its sampling tables).
+/// @param rgb width * height pixels (3 floats each, row by row from the top). The map takes ownership of them
+/// (they must be malloc'd, and are freed by environment_free).
+/// @param intensity What to multiply the pixels by.
+/// @return false if we could not allocate the tables (rgb is freed either way).
+static inline bool environment_init(struct Environment_Map *map, float *rgb, int width, int height,
+                                    double intensity)
+{
+    map->width = width;
+    map->height = height;
+    map->rgb = rgb;
+
+    size_t n = (size_t)width * height;
+    map->pixel_pdf = malloc(n * sizeof(float));
+    map->table = malloc(n * sizeof(struct Environment_Alias));
+    if (map->pixel_pdf == NULL || map->table == NULL)
+    {
+        free(map->rgb);
+        free(map->pixel_pdf);
+        free(map->table);
+        return false;
+    }
+
+    // Weight each pixel by the light it gives: its brightness times the solid angle it covers
+    // (which is proportional to sin(theta), the angle from straight up, at its row).
+    double total = 0;
+    for (int j = 0; j < height; j++)
+    {
+        double sin_theta = sin(pi * (j + 0.5) / height);
+        for (int i = 0; i < width; i++)
+        {
+            size_t k = (size_t)j * width + i;
+            float *pixel = rgb + 3 * k;
+            pixel[0] *= (float)intensity;
+            pixel[1] *= (float)intensity;
+            pixel[2] *= (float)intensity;
+
+            double weight = fmax(environment_luminance(pixel), 0) * sin_theta;
+            map->pixel_pdf[k] = (float)weight;
+            total += weight;
+        }
+    }
+
+    // A black map gives no light to sample, but we still need a valid distribution.
+    for (size_t k = 0; k < n; k++)
+    {
+        map->pixel_pdf[k] = (total > 0) ? (float)(map->pixel_pdf[k] / total) : 1.0f / n;
+    }
+
+    if (!environment_build_alias(map))
+    {
+        free(map->rgb);
+        free(map->pixel_pdf);
+        free(map->table);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Load an environment map from a latitude-longitude PFM (.pfm) or Radiance HDR (.hdr) image.
+/// @return false if the file could not be read (the reason is printed to stderr).
+static inline bool environment_load(struct Environment_Map *map, const char *path, double intensity)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Could not open the environment map %s\n", path);
+        return false;
+    }
+
+    size_t path_length = strlen(path);
+    bool pfm = path_length >= 4 && strcmp(path + path_length - 4, ".pfm") == 0;
+
+    float *rgb = NULL;
+    int width, height;
+    bool ok = pfm ? read_pfm(in, &rgb, &width, &height) : read_hdr(in, &rgb, &width, &height);
+    fclose(in);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Could not read the environment map %s (it must be a color .pfm or .hdr image)\n", path);
+        return false;
+    }
+    if (!environment_init(map, rgb, width, height, intensity))
+    {
+        fprintf(stderr, "Could not allocate the environment map sampling tables!\n");
+        return false;
+    }
+    return true;
+}
+
+static inline void environment_free(struct Environment_Map *map)
+{
+    free(map->rgb);
+    free(map->pixel_pdf);
+    free(map->table);
+    map->rgb = NULL;
+    map->pixel_pdf = NULL;
+    map->table = NULL;
+}
+
+/// @brief Find the pixel the (not necessarily unit) direction falls in.
+/// @param sin_theta Set to the sine of the direction's angle from straight up.
+static inline size_t environment_pixel(const struct Environment_Map *map, const vec3 direction, double *sin_theta)
+{
+    double length = len(direction);
+    double y = direction[1] / length;
+
+    double theta = acos(fmin(fmax(y, -1), 1));
+    double phi = atan2(-direction[2], direction[0]) + pi;
+    *sin_theta = sin(theta);
+
+    int i = (int)(phi / (2 * pi) * map->width);
+    int j = (int)(theta / pi * map->height);
+    i = (i < 0) ? 0 : (i >= map->width) ? map->width - 1 : i;
+    j = (j < 0) ? 0 : (j >= map->height) ? map->height - 1 : j;
+    return (size_t)j * map->width + i;
+}
+
+/// @brief Sets color to the light arriving from the environment along direction.
+static inline void environment_radiance(const struct Environment_Map *map, const vec3 direction, color3 color)
+{
+    double sin_theta;
+    const float *pixel = map->rgb + 3 * environment_pixel(map, direction, &sin_theta);
+    color[0] = pixel[0];
+    color[1] = pixel[1];
+    color[2] = pixel[2];
+}
+
+/// @brief The probability density (over solid angle) that environment_sample returns direction.
+static inline double environment_pdf(const struct Environment_Map *map, const vec3 direction)
+{
+    double sin_theta;
+    size_t k = environment_pixel(map, direction, &sin_theta);
+    if (sin_theta <= 0)
+    {
+        return 0;
+    }
+
+    // Within a pixel we sample uniformly in (theta, phi), and a pixel covers (pi / height) * (2 pi / width)
+    // of those, while a solid angle is sin(theta) times the area in (theta, phi).
+    return map->pixel_pdf[k] * map->width * map->height / (2 * pi * pi * sin_theta);
+}
+
+/// @brief Sample a (unit) direction toward the environment, with a density proportional to the light from it.
+static inline void environment_sample(const struct Environment_Map *map, vec3 direction)
+{
+    // Pick a bucket, and then its own pixel or its alias.
+    size_t n = (size_t)map->width * map->height;
+    size_t bucket = (size_t)(random_zero_to_one() * n);
+    bucket = (bucket < n) ? bucket : n - 1;
+    size_t k = (random_zero_to_one() < map->table[bucket].keep) ? bucket : (size_t)map->table[bucket].alias;
+
+    // A uniformly random point in the pixel (in theta and phi).
+    int i = (int)(k % map->width);
+    int j = (int)(k / map->width);
+    double u = (i + random_zero_to_one()) / map->width;  // phi / (2 pi)
+    double v = (j + random_zero_to_one()) / map->height; // theta / pi
+
+    double sin_phi, cos_phi, sin_theta, cos_theta;
+    sin_cos_turns(u, &sin_phi, &cos_phi);
+    sin_cos_turns(0.5 * v, &sin_theta, &cos_theta);
+
+    // The inverse of environment_pixel (phi is measured from -x).
+    direction[0] = -sin_theta * cos_phi;
+    direction[1] = cos_theta;
+    direction[2] = sin_theta * sin_phi;
+}
@@ -0,0 +1,737 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+
+A grid is the other classic way (besides a BVH) to skip most of the objects: split the box around the scene
+into equal cells, list in each cell the objects that overlap it, and walk a ray through the cells it passes,
+nearest first (a 3D DDA: from each cell, step into whichever neighbor the ray reaches first). Once a cell is
+done, if we found a hit before the ray leaves it, that is the closest hit and we can stop.
+
+For the scenes it suits (lots of similar sized objects spread evenly, like the book's final scene grown,
+see the grid layout of scene_gen.c), a grid beats a BVH: building it is a couple of passes over the objects
+(count the objects of each cell, then list them), done by many threads, and walking it is a few adds per cell.
+For uneven scenes a BVH is much better: a grid fine enough for the dense places wastes most of its cells
+on the empty ones, and one coarse enough for the empty places puts thousands of objects in a dense cell.
+grid_suits looks at a grid (once built) to tell which kind of scene it has.
+
+Two things help a grid with scenes that are only almost even:
+
+    - Cells with many objects (more than GRID_DENSE_CELL) get a finer grid of their own,
+      which the walk goes through when it reaches them (a two level grid).
+    - Objects far bigger than most (like a ground made of a huge sphere) would be in thousands of cells,
+      so they are kept out of the cells and tested by every ray, like world_hit does. So are volumes
+      (Constant_Medium), which must be tested once per ray (a ray that tested one twice would count
+      its fog twice in grid_transmittance).
+
+An object in several cells can be tested several times by the same ray. The walk remembers the last
+GRID_MAILBOX objects it tested, which skips most of the repeats (testing one again finds the same hit).
+
+*/
+
+#define GRID_CELLS_PER_OBJECT 2.0  //< About how many cells (of the top level) per object
+#define GRID_MAX_RESOLUTION 2048   //< The most cells along an axis of the top level
+#define GRID_MAX_CELLS (1 << 25)   //< The most cells of the top level
+#define GRID_DENSE_CELL 16         //< Cells with more objects than this get a finer grid of their own
+#define GRID_MAX_SUB_RESOLUTION 8  //< The most cells along an axis of a finer grid
+#define GRID_LARGE_OBJECT 16.0     //< Objects this many times bigger than the median are kept out of the cells
+#define GRID_MAILBOX 8             //< How many of the objects it tested the walk remembers
+
+// What grid_suits allows (see grid_suits).
+#define GRID_MAX_SIZE_SPREAD 4.0
+#define GRID_MAX_LARGE_FRACTION 0.01
+#define GRID_MAX_DENSE_FRACTION 0.1
+
+/// @brief A cell: a range of Grid.objects, or a finer grid.
+struct Grid_Cell
+{
+    int first; //< Index of its first object in Grid.objects, or (if count is -1) of its finer grid in Grid.levels
+    int count; //< How many objects it has, or -1 if it has a finer grid
+};
+
+/// @brief A grid of cells: the top level, or the finer grid of a dense cell.
+struct Grid_Level
+{
+    double min[3];               //< The min corner of the grid's box
+    double cell_size[3];         //< How big a cell is along each axis
+    double inverse_cell_size[3]; //< 1 / cell_size
+    int resolution[3];           //< How many cells along each axis
+    long long first_cell;        //< Index of its first cell in Grid.cells (x fastest, then y, then z)
+};
+
+struct Grid
+{
+    const struct Hittable *world; //< The objects the grid is built over (not owned by the grid)
+    int world_length;
+
+    struct AABB bounds;        //< The box of the top level
+    struct Grid_Level *levels; //< levels[0] is the top level, the rest are the finer grids of dense cells
+    int num_levels;
+    struct Grid_Cell *cells;
+    long long num_cells;
+    int *objects; //< Indices into world, grouped by cell
+    int num_objects;
+
+    int *large; //< Indices into world of the objects kept out of the cells (see above)
+    int num_large;
+
+    // What grid_suits looks at.
+    double size_spread;    //< How much bigger the 90th percentile object is than the 10th
+    double dense_fraction; //< The fraction of the objects in the top level's cells that are in dense ones
+
+    double build_seconds; //< How long the last build took
+};
+
+/// @brief The size of a box (its largest extent), or 0 for an empty box.
+static inline double grid_box_size(const struct AABB *box)
+{
+    double size = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double extent = interval_size(aabb_axis_interval(box, axis));
+        size = (extent > size) ? extent : size;
+    }
+    return size;
+}
+
+/// @brief The k-th smallest of the n values (this reorders them).
+static inline double grid_select(double *values, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while (lo < hi)
+    {
+        double pivot = values[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j)
+        {
+            while (values[i] < pivot)
+            {
+                i++;
+            }
+            while (values[j] > pivot)
+            {
+                j--;
+            }
+            if (i <= j)
+            {
+                double swap = values[i];
+                values[i++] = values[j];
+                values[j--] = swap;
+            }
+        }
+        if (k <= j)
+        {
+            hi = j;
+        }
+        else if (k >= i)
+        {
+            lo = i;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return values[k];
+}
+
+/// @brief Set up level to cover box with about GRID_CELLS_PER_OBJECT cells per object (for count objects),
+/// as close to cubes as the caps allow.
+static inline void grid_level_init(struct Grid_Level *level, const struct AABB *box, double count,
+                                   int max_resolution, long long max_cells)
+{
+    // A flat box (like a layer of spheres on the ground) still gets cells along its thin axis, just not many:
+    // every axis counts as at least a thousandth of the longest one.
+    double size = grid_box_size(box);
+    double extent[3];
+    double volume = 1;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        extent[axis] = interval_size(aabb_axis_interval(box, axis));
+        double padded = (extent[axis] > size * 1e-3) ? extent[axis] : size * 1e-3;
+        volume *= (padded > 0) ? padded : 1;
+    }
+
+    double cells_per_unit = cbrt(GRID_CELLS_PER_OBJECT * count / volume);
+    long long num_cells;
+    do
+    {
+        num_cells = 1;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double cells = ceil(extent[axis] * cells_per_unit);
+            level->resolution[axis] = (cells < 1) ? 1 : (cells > max_resolution) ? max_resolution : (int)cells;
+            num_cells *= level->resolution[axis];
+        }
+        cells_per_unit *= 0.9;
+    } while (num_cells > max_cells);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        level->min[axis] = aabb_axis_interval(box, axis)->min;
+        level->cell_size[axis] = (extent[axis] > 0) ? extent[axis] / level->resolution[axis] : 1;
+        level->inverse_cell_size[axis] = 1 / level->cell_size[axis];
+    }
+    level->first_cell = 0;
+}
+
+static inline long long grid_level_cells(const struct Grid_Level *level)
+{
+    return (long long)level->resolution[0] * level->resolution[1] * level->resolution[2];
+}
+
+static inline long long grid_cell_index(const struct Grid_Level *level, const int cell[3])
+{
+    return level->first_cell + ((long long)cell[2] * level->resolution[1] + cell[1]) * level->resolution[0] + cell[0];
+}
+
+/// @brief The cells of level that box overlaps (clamped to the level): lo to hi (inclusive) along each axis.
+/// @param pad Grow the box by this much first (see grid_build_with_threads).
+static inline void grid_cell_range(const struct Grid_Level *level, const struct AABB *box, double pad, int lo[3],
+                                   int hi[3])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const struct Interval *extent = aabb_axis_interval(box, axis);
+        double a = floor((extent->min - pad - level->min[axis]) * level->inverse_cell_size[axis]);
+        double b = floor((extent->max + pad - level->min[axis]) * level->inverse_cell_size[axis]);
+        int last = level->resolution[axis] - 1;
+        lo[axis] = (a < 0) ? 0 : (a > last) ? last : (int)a;
+        hi[axis] = (b < 0) ? 0 : (b > last) ? last : (int)b;
+    }
+}
+
+/// @brief A range of work for a build thread (see grid_build_with_threads).
+struct Grid_Job
+{
+    struct Grid *grid;
+    struct AABB *boxes;      //< Every object's box
+    const bool *in_cells;    //< Whether each object goes in the cells (rather than Grid.large)
+    atomic_int *counts;      //< How many objects each top level cell has (so far)
+    const long long *dense;  //< The top level cells with finer grids (dense[l - 1] has levels[l])
+    double pad;              //< See grid_cell_range
+    bool list;               //< Whether to list the objects of the cells (rather than count them)
+    long long start, end;    //< The objects, cells or finer grids of this job
+};
+
+/// @brief Split count things into ranges, one per thread, and run fn on each (with job as the template).
+static inline void grid_run_jobs(int (*fn)(void *), struct Grid_Job job, long long count, int num_threads)
+{
+    int num_jobs = (count < num_threads) ? (int)(count > 0 ? count : 1) : num_threads;
+    struct Grid_Job *jobs = malloc(num_jobs * sizeof(struct Grid_Job));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the grid build jobs!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < num_jobs; k++)
+    {
+        jobs[k] = job;
+        jobs[k].start = count * k / num_jobs;
+        jobs[k].end = count * (k + 1) / num_jobs;
+    }
+    run_jobs(fn, jobs, sizeof(struct Grid_Job), num_jobs);
+    free(jobs);
+}
+
+static int grid_boxes_job(void *arg)
+{
+    struct Grid_Job *job = arg;
+    for (long long i = job->start; i < job->end; i++)
+    {
+        job->boxes[i] = hittable_bounding_box(&job->grid->world[i]);
+    }
+    return 0;
+}
+
+/// @brief Count (or list) the objects of each top level cell.
+static int grid_cells_job(void *arg)
+{
+    struct Grid_Job *job = arg;
+    struct Grid *grid = job->grid;
+    const struct Grid_Level *top = &grid->levels[0];
+
+    for (long long i = job->start; i < job->end; i++)
+    {
+        if (!job->in_cells[i])
+        {
+            continue;
+        }
+        int lo[3], hi[3], cell[3];
+        grid_cell_range(top, &job->boxes[i], job->pad, lo, hi);
+        for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+        {
+            for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+            {
+                for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+                {
+                    long long c = grid_cell_index(top, cell);
+                    int k = atomic_fetch_add_explicit(&job->counts[c], 1, memory_order_relaxed);
+                    if (job->list)
+                    {
+                        grid->objects[grid->cells[c].first + k] = (int)i;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int grid_compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Sort the objects of each top level cell. Threads list them in any order, and this puts them back in
+/// order, so the grid (and the hits it finds) is the same every time.
+static int grid_sort_job(void *arg)
+{
+    struct Grid_Job *job = arg;
+    struct Grid *grid = job->grid;
+    for (long long c = job->start; c < job->end; c++)
+    {
+        int *objects = grid->objects + grid->cells[c].first;
+        int count = grid->cells[c].count;
+        if (count > 32)
+        {
+            qsort(objects, count, sizeof(int), grid_compare_ints);
+            continue;
+        }
+        for (int i = 1; i < count; i++)
+        {
+            int object = objects[i];
+            int j = i;
+            for (; j > 0 && objects[j - 1] > object; j--)
+            {
+                objects[j] = objects[j - 1];
+            }
+            objects[j] = object;
+        }
+    }
+    return 0;
+}
+
+/// @brief Count (or list) the objects of each cell of the finer grids, from the objects of their dense cells.
+/// (Each finer grid only has its own cells, so no other thread touches them.)
+static int grid_refine_job(void *arg)
+{
+    struct Grid_Job *job = arg;
+    struct Grid *grid = job->grid;
+    for (long long l = job->start + 1; l < job->end + 1; l++)
+    {
+        const struct Grid_Level *level = &grid->levels[l];
+        const struct Grid_Cell *dense = &grid->cells[job->dense[l - 1]];
+        for (int k = dense->first; k < dense->first + dense->count; k++)
+        {
+            int object = grid->objects[k];
+            int lo[3], hi[3], cell[3];
+            grid_cell_range(level, &job->boxes[object], job->pad, lo, hi);
+            for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+            {
+                for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+                {
+                    for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+                    {
+                        struct Grid_Cell *sub = &grid->cells[grid_cell_index(level, cell)];
+                        if (job->list)
+                        {
+                            grid->objects[sub->first + sub->count] = object;
+                        }
+                        sub->count++;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/// @brief Reallocate (or exit if we can't).
+static inline void *grid_realloc(void *pointer, size_t size)
+{
+    void *ret = realloc(pointer, size > 0 ? size : 1);
+    if (ret == NULL)
+    {
+        fprintf(stderr, "Could not allocate the grid!\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static inline void grid_free(struct Grid *grid)
+{
+    free(grid->levels);
+    free(grid->cells);
+    free(grid->objects);
+    free(grid->large);
+    grid->levels = NULL;
+    grid->cells = NULL;
+    grid->objects = NULL;
+    grid->large = NULL;
+    grid->num_levels = grid->num_large = grid->num_objects = 0;
+    grid->num_cells = 0;
+}
+
+/// @brief (Re)build the grid over the world (see above). Call grid_free once you are done with it.
+/// @param num_threads How many threads build it (0 means one per hardware thread). The grid is the same
+/// however many build it.
+/// @remark grid must be zero initialized before its first build.
+static inline void grid_build_with_threads(struct Grid *grid, const struct Hittable *world, int world_length,
+                                           int num_threads)
+{
+    double start_time = seconds_now();
+    if (num_threads <= 0)
+    {
+        num_threads = hardware_threads();
+    }
+
+    grid_free(grid);
+    grid->world = world;
+    grid->world_length = world_length;
+
+    struct AABB *boxes = grid_realloc(NULL, world_length * sizeof(struct AABB));
+    double *sizes = grid_realloc(NULL, world_length * sizeof(double));
+    bool *in_cells = grid_realloc(NULL, world_length * sizeof(bool));
+
+    struct Grid_Job job = {.grid = grid, .boxes = boxes, .in_cells = in_cells};
+    grid_run_jobs(grid_boxes_job, job, world_length, num_threads);
+
+    // Which objects are too big for the cells (far bigger than the median), and how spread out the sizes are.
+    for (int i = 0; i < world_length; i++)
+    {
+        sizes[i] = grid_box_size(&boxes[i]);
+    }
+    double median = (world_length > 0) ? grid_select(sizes, world_length, world_length / 2) : 0;
+    double low = (world_length > 0) ? grid_select(sizes, world_length, world_length / 10) : 0;
+    double high = (world_length > 0) ? grid_select(sizes, world_length, world_length - 1 - world_length / 10) : 0;
+    grid->size_spread = (low > 0) ? high / low : (high > 0) ? infinity : 1;
+
+    grid->large = grid_realloc(NULL, world_length * sizeof(int));
+    grid->bounds = AABB_EMPTY;
+    int num_in_cells = 0;
+    for (int i = 0; i < world_length; i++)
+    {
+        double size = grid_box_size(&boxes[i]);
+        in_cells[i] = world[i].which != (enum Which_Hittable)Constant_Medium && size <= GRID_LARGE_OBJECT * median &&
+                      isfinite(size);
+        if (in_cells[i])
+        {
+            grid->bounds = aabb_union(&grid->bounds, &boxes[i]);
+            num_in_cells++;
+        }
+        else
+        {
+            grid->large[grid->num_large++] = i;
+        }
+    }
+    if (num_in_cells == 0)
+    {
+        grid->bounds = (struct AABB){.x = {0, 1}, .y = {0, 1}, .z = {0, 1}};
+    }
+
+    // Every box is grown by a tiny bit (for the cells, and the grid's own box), so a ray the walk sees passing
+    // just outside a cell (because of rounding) still finds the objects it hits just inside it.
+    job.pad = 1e-9 * grid_box_size(&grid->bounds);
+    grid->bounds.x = (struct Interval){.min = grid->bounds.x.min - job.pad, .max = grid->bounds.x.max + job.pad};
+    grid->bounds.y = (struct Interval){.min = grid->bounds.y.min - job.pad, .max = grid->bounds.y.max + job.pad};
+    grid->bounds.z = (struct Interval){.min = grid->bounds.z.min - job.pad, .max = grid->bounds.z.max + job.pad};
+
+    // The top level: count the objects of each cell, make room for them, list them (and sort the lists).
+    grid->num_levels = 1;
+    grid->levels = grid_realloc(NULL, sizeof(struct Grid_Level));
+    grid_level_init(&grid->levels[0], &grid->bounds, num_in_cells, GRID_MAX_RESOLUTION, GRID_MAX_CELLS);
+    long long num_top_cells = grid_level_cells(&grid->levels[0]);
+
+    job.counts = calloc(num_top_cells, sizeof(atomic_int));
+    grid->cells = grid_realloc(NULL, num_top_cells * sizeof(struct Grid_Cell));
+    if (job.counts == NULL)
+    {
+        fprintf(stderr, "Could not allocate the grid!\n");
+        exit(EXIT_FAILURE);
+    }
+    grid_run_jobs(grid_cells_job, job, world_length, num_threads);
+
+    long long num_objects = 0;
+    for (long long c = 0; c < num_top_cells; c++)
+    {
+        int count = atomic_load_explicit(&job.counts[c], memory_order_relaxed);
+        grid->cells[c] = (struct Grid_Cell){.first = (int)num_objects, .count = count};
+        num_objects += count;
+        atomic_store_explicit(&job.counts[c], 0, memory_order_relaxed);
+    }
+    if (num_objects > INT_MAX)
+    {
+        fprintf(stderr, "Too many objects in the grid's cells!\n");
+        exit(EXIT_FAILURE);
+    }
+    grid->objects = grid_realloc(NULL, num_objects * sizeof(int));
+    job.list = true;
+    grid_run_jobs(grid_cells_job, job, world_length, num_threads);
+    grid_run_jobs(grid_sort_job, job, num_top_cells, num_threads);
+    free(job.counts);
+    job.counts = NULL;
+
+    // The finer grids of the dense cells: set them up, then count and list the objects of their cells
+    // (the same way, except that each finer grid is done by one thread).
+    long long *dense = grid_realloc(NULL, sizeof(long long));
+    int num_dense = 0;
+    long long num_cells = num_top_cells;
+    long long num_in_dense = 0;
+    for (long long c = 0; c < num_top_cells; c++)
+    {
+        if (grid->cells[c].count <= GRID_DENSE_CELL)
+        {
+            continue;
+        }
+        num_in_dense += grid->cells[c].count;
+        const struct Grid_Level *top = &grid->levels[0];
+        int cell[3] = {(int)(c % top->resolution[0]), (int)(c / top->resolution[0] % top->resolution[1]),
+                       (int)(c / top->resolution[0] / top->resolution[1])};
+        double lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = top->min[axis] + cell[axis] * top->cell_size[axis];
+            hi[axis] = lo[axis] + top->cell_size[axis];
+        }
+        struct AABB box = aabb_from_points(lo, hi);
+
+        dense = grid_realloc(dense, (num_dense + 1) * sizeof(long long));
+        grid->levels = grid_realloc(grid->levels, (grid->num_levels + 1) * sizeof(struct Grid_Level));
+        struct Grid_Level *level = &grid->levels[grid->num_levels++];
+        grid_level_init(level, &box, grid->cells[c].count, GRID_MAX_SUB_RESOLUTION,
+                        (long long)GRID_MAX_SUB_RESOLUTION * GRID_MAX_SUB_RESOLUTION * GRID_MAX_SUB_RESOLUTION);
+        level->first_cell = num_cells;
+        num_cells += grid_level_cells(level);
+        dense[num_dense++] = c;
+    }
+
+    grid->dense_fraction = (num_objects > 0) ? (double)num_in_dense / num_objects : 0;
+    grid->cells = grid_realloc(grid->cells, num_cells * sizeof(struct Grid_Cell));
+    memset(grid->cells + num_top_cells, 0, (num_cells - num_top_cells) * sizeof(struct Grid_Cell));
+    job.dense = dense;
+    job.list = false;
+    grid_run_jobs(grid_refine_job, job, num_dense, num_threads);
+
+    for (long long c = num_top_cells; c < num_cells; c++)
+    {
+        grid->cells[c].first = (int)num_objects;
+        num_objects += grid->cells[c].count;
+        grid->cells[c].count = 0;
+    }
+    if (num_objects > INT_MAX)
+    {
+        fprintf(stderr, "Too many objects in the grid's cells!\n");
+        exit(EXIT_FAILURE);
+    }
+    grid->objects = grid_realloc(grid->objects, num_objects * sizeof(int));
+    job.list = true;
+    grid_run_jobs(grid_refine_job, job, num_dense, num_threads);
+
+    // The dense cells now point to their finer grids (their own lists stay, unused).
+    for (int l = 1; l < grid->num_levels; l++)
+    {
+        grid->cells[dense[l - 1]] = (struct Grid_Cell){.first = l, .count = -1};
+    }
+
+    grid->num_cells = num_cells;
+    grid->num_objects = (int)num_objects;
+    free(dense);
+    free(in_cells);
+    free(sizes);
+    free(boxes);
+    grid->build_seconds = seconds_now() - start_time;
+}
+
+/// @brief (Re)build the grid over the world, with one thread per hardware thread (see grid_build_with_threads).
+static inline void grid_build(struct Grid *grid, const struct Hittable *world, int world_length)
+{
+    grid_build_with_threads(grid, world, world_length, 0);
+}
+
+/// @brief Whether the scene the grid was built over suits a grid better than a BVH (see above): its objects are
+/// about the same size, only a few are too big for the cells, and few are crowded into dense cells.
+/// @remark Empty cells alone don't rule a grid out: they cost the walk a few adds each (a curved ground
+/// leaves most of the cells above it empty, and the grid still wins there), while a crowded cell costs it
+/// a finer grid or many object tests.
+static inline bool grid_suits(const struct Grid *grid)
+{
+    return grid->size_spread <= GRID_MAX_SIZE_SPREAD &&
+           grid->num_large <= 8 + GRID_MAX_LARGE_FRACTION * grid->world_length &&
+           grid->dense_fraction <= GRID_MAX_DENSE_FRACTION;
+}
+
+/// @brief A ray on its way through the grid.
+struct Grid_Query
+{
+    const struct Ray *ray;
+    struct Interval ray_interval;
+    bool any_hit; //< Stop at the first hit (for grid_transmittance), rather than look for the closest one
+
+    bool hit_anything;
+    double closest_so_far;
+    struct Hit_Record *rec;
+
+    int mailbox[GRID_MAILBOX]; //< The last objects tested (see above)
+    int next_mail;
+};
+
+/// @brief Test the ray against the objects (indices into the world).
+/// @return true if the query is done (it wanted any hit, and found one).
+static inline bool grid_test_objects(const struct Grid *grid, const int *objects, int count, struct Grid_Query *query)
+{
+    struct Hit_Record temp_rec;
+    for (int k = 0; k < count; k++)
+    {
+        int index = objects[k];
+        bool tested = false;
+        for (int m = 0; m < GRID_MAILBOX; m++)
+        {
+            tested |= query->mailbox[m] == index;
+        }
+        if (tested)
+        {
+            continue;
+        }
+        query->mailbox[query->next_mail] = index;
+        query->next_mail = (query->next_mail + 1) % GRID_MAILBOX;
+
+        const struct Hittable *object = &grid->world[index];
+        if (hittable_hit(object, query->ray,
+                         (struct Interval){.min = query->ray_interval.min, .max = query->closest_so_far}, &temp_rec))
+        {
+            query->hit_anything = true;
+            if (query->any_hit)
+            {
+                return true;
+            }
+            query->closest_so_far = temp_rec.t;
+            *query->rec = temp_rec;
+            query->rec->object = object;
+        }
+    }
+    return false;
+}
+
+/// @brief Walk the ray through the cells of level, from t_start to t_end (see above).
+/// @return true if the query is done (it found the closest hit, or any hit if that is what it wanted).
+static inline bool grid_walk(const struct Grid *grid, const struct Grid_Level *level, struct Grid_Query *query,
+                             double t_start, double t_end)
+{
+    const struct Ray *ray = query->ray;
+    int cell[3], step[3];
+    double t_next[3], t_delta[3];
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double p = ray->origin[axis] + t_start * ray->direction[axis];
+        double c = floor((p - level->min[axis]) * level->inverse_cell_size[axis]);
+        int last = level->resolution[axis] - 1;
+        cell[axis] = (c < 0) ? 0 : (c > last) ? last : (int)c;
+
+        // Where the ray leaves the cell along this axis, and how far it goes between planes.
+        double d = ray->direction[axis];
+        double plane = level->min[axis] + (cell[axis] + (d > 0)) * level->cell_size[axis];
+        step[axis] = (d > 0) ? 1 : (d < 0) ? -1 : 0;
+        t_next[axis] = (d != 0) ? (plane - ray->origin[axis]) / d : infinity;
+        t_delta[axis] = (d != 0) ? level->cell_size[axis] / fabs(d) : infinity;
+    }
+
+    double t_enter = t_start;
+    for (;;)
+    {
+        int axis = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+        double t_exit = (t_next[axis] < t_end) ? t_next[axis] : t_end;
+
+        const struct Grid_Cell *c = &grid->cells[grid_cell_index(level, cell)];
+        if (c->count < 0)
+        {
+            if (grid_walk(grid, &grid->levels[c->first], query, t_enter, t_exit))
+            {
+                return true;
+            }
+        }
+        else if (c->count > 0 && grid_test_objects(grid, grid->objects + c->first, c->count, query))
+        {
+            return true;
+        }
+
+        // A hit before the ray leaves this cell is closer than anything in the cells after it.
+        if (query->closest_so_far <= t_exit || t_next[axis] >= t_end)
+        {
+            return query->closest_so_far <= t_exit;
+        }
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= level->resolution[axis])
+        {
+            return false;
+        }
+        t_enter = t_next[axis];
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+/// @brief returns if any objects in the grid are hit by the ray (the same as bvh_hit).
+/// @param rec the Hit Record-- updated accordingly
+static inline bool grid_hit(const struct Grid *grid, const struct Ray *ray, struct Interval ray_interval,
+                            struct Hit_Record *rec)
+{
+    struct Grid_Query query = {.ray = ray, .ray_interval = ray_interval, .closest_so_far = ray_interval.max,
+                               .rec = rec};
+    memset(query.mailbox, -1, sizeof(query.mailbox));
+
+    // The objects outside the cells first (the closest hit so far makes the walk shorter).
+    grid_test_objects(grid, grid->large, grid->num_large, &query);
+
+    struct Interval inside = {.min = ray_interval.min, .max = query.closest_so_far};
+    if (grid->num_objects > 0 && aabb_hit(&grid->bounds, ray, &inside))
+    {
+        grid_walk(grid, &grid->levels[0], &query, inside.min, inside.max);
+    }
+    return query.hit_anything;
+}
+
+/// @brief The grid version of bvh_transmittance (any-hit: stops at the first solid object found).
+static inline double grid_transmittance(const struct Grid *grid, const struct Ray *ray, struct Interval ray_interval)
+{
+    // Volumes are never in the cells (see above), so only the objects outside them need the general case.
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+    for (int k = 0; k < grid->num_large; k++)
+    {
+        const struct Hittable *object = &grid->world[grid->large[k]];
+        if (object->which == (enum Which_Hittable)Constant_Medium)
+        {
+            transmittance *= constant_medium_transmittance(&object->object.constant_medium, ray, ray_interval);
+            if (transmittance <= 0)
+            {
+                return 0;
+            }
+        }
+        else if (hittable_hit(object, ray, ray_interval, &temp_rec))
+        {
+            return 0;
+        }
+    }
+
+    struct Grid_Query query = {.ray = ray, .ray_interval = ray_interval, .any_hit = true,
+                               .closest_so_far = ray_interval.max, .rec = &temp_rec};
+    memset(query.mailbox, -1, sizeof(query.mailbox));
+
+    struct Interval inside = ray_interval;
+    if (grid->num_objects > 0 && aabb_hit(&grid->bounds, ray, &inside))
+    {
+        grid_walk(grid, &grid->levels[0], &query, inside.min, inside.max);
+    }
+    return query.hit_anything ? 0 : transmittance;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <string.h>
+
+/*
+
+The Radiance HDR (.hdr) image format, which is how most HDR environment maps are shared.
+
+The header is text lines (ending with an empty line), then a line like "-Y 512 +X 1024" (rows from the top,
+pixels from left to right). Every pixel is 4 bytes: a shared exponent for its red, green and blue mantissas (RGBE),
+so the colors have a huge range in little space. Rows are usually run length encoded, one channel at a time.
+
+*/
+
+/// @brief Read the pixels of one row (RGBE, 4 bytes per pixel) into row.
+static inline bool hdr_read_row(FILE *in, unsigned char *row, int image_width)
+{
+    unsigned char start[4];
+    if (fread(start, 1, 4, in) != 4)
+    {
+        return false;
+    }
+
+    // Rows that are not run length encoded (too short or too long to be) just start with their first pixel.
+    bool encoded = image_width >= 8 && image_width < 0x8000 && start[0] == 2 && start[1] == 2 &&
+                   ((start[2] << 8) | start[3]) == image_width;
+    if (!encoded)
+    {
+        memcpy(row, start, 4);
+        return fread(row + 4, 4, image_width - 1, in) == (size_t)image_width - 1;
+    }
+
+    // Each of the 4 channels is encoded on its own: runs of one byte repeated, or spans of bytes as they are.
+    for (int channel = 0; channel < 4; channel++)
+    {
+        int x = 0;
+        while (x < image_width)
+        {
+            int count = fgetc(in);
+            if (count == EOF || count == 0)
+            {
+                return false;
+            }
+
+            bool run = count > 128;
+            count = run ? count - 128 : count;
+            if (x + count > image_width)
+            {
+                return false;
+            }
+
+            for (int k = 0; k < count; k++)
+            {
+                int value = (run && k > 0) ? row[4 * (x - 1) + channel] : fgetc(in);
+                if (value == EOF)
+                {
+                    return false;
+                }
+                row[4 * x++ + channel] = (unsigned char)value;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// @brief Read a Radiance HDR (.hdr) file.
+/// @param rgb Set to the image (3 floats per pixel, row by row from the top). free it once done.
+/// @return false if the file is not an HDR file we can read (or could not be read).
+static inline bool read_hdr(FILE *in, float **rgb, int *image_width, int *image_height)
+{
+    char line[256];
+    if (fgets(line, sizeof(line), in) == NULL || strncmp(line, "#?", 2) != 0)
+    {
+        return false;
+    }
+
+    // The header ends with an empty line.
+    do
+    {
+        if (fgets(line, sizeof(line), in) == NULL)
+        {
+            return false;
+        }
+        if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line, "FORMAT=32-bit_rle_rgbe", 22) != 0)
+        {
+            return false; // XYZE images
+        }
+    } while (line[0] != '\n');
+
+    // We only read the standard orientation (rows from the top, pixels from left to right).
+    if (fgets(line, sizeof(line), in) == NULL ||
+        sscanf(line, "-Y %i +X %i", image_height, image_width) != 2 || *image_width <= 0 || *image_height <= 0)
+    {
+        return false;
+    }
+
+    *rgb = malloc((size_t)*image_width * *image_height * 3 * sizeof(float));
+    unsigned char *row = malloc((size_t)*image_width * 4);
+    if (*rgb == NULL || row == NULL)
+    {
+        free(*rgb);
+        free(row);
+        *rgb = NULL;
+        return false;
+    }
+
+    for (int j = 0; j < *image_height; j++)
+    {
+        if (!hdr_read_row(in, row, *image_width))
+        {
+            free(*rgb);
+            free(row);
+            *rgb = NULL;
+            return false;
+        }
+
+        float *out = *rgb + (size_t)j * *image_width * 3;
+        for (int i = 0; i < *image_width; i++)
+        {
+            const unsigned char *rgbe = row + 4 * i;
+            // The exponent is stored + 128, and the mantissas are 8 bit fractions.
+            float scale = (rgbe[3] == 0) ? 0 : ldexpf(1, rgbe[3] - (128 + 8));
+            out[3 * i + 0] = (rgbe[0] + 0.5f) * scale;
+            out[3 * i + 1] = (rgbe[1] + 0.5f) * scale;
+            out[3 * i + 2] = (rgbe[2] + 0.5f) * scale;
+        }
+    }
+
+    free(row);
+    return true;
+}
@@ -2,8 +2,9 @@
 #include "vec3.h"
 #include <stdbool.h>
 
-// Forward declare Material_Cfg.
+// Forward declare Material_Cfg and Hittable.
 struct Material_Cfg;
+struct Hittable;
 
 struct Hit_Record
 {
@@ -12,6 +13,7 @@ struct Hit_Record
     struct Material_Cfg *mat_cfg; //< The material config for the object we hit.
     bool front_face;              //< If the ray hits the front_face of the object or the back_face.
     double t;
+    const struct Hittable *object; //< The world object we hit (set by world_hit).
 };
 
 // int hit_example(const struct Ray* ray, struct Interval ray_interval, struct Hit_Record* rec) {
@@ -3,6 +3,9 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "sphere.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "render_stats.h"
 
 /// @brief An enum of all possible hittable objects (we can then have an array of the type [Hittable]
 /// for a list of hittalbe objects).
@@ -10,12 +13,16 @@
 /// [Hittable]: https://github.com/Tomer-Eliahu/Ray-Tracing/blob/main/src/InOneWeekend/hittable_list.h
 enum Which_Hittable
 {
-    Sphere
+    Sphere,
+    Box,
+    Constant_Medium,
 };
 
 union Hittable_Object
 {
     struct Sphere sphere;
+    struct Box box;
+    struct Constant_Medium constant_medium;
 };
 
 struct Hittable
@@ -23,3 +30,53 @@ struct Hittable
     enum Which_Hittable which;
     union Hittable_Object object;
 };
+
+/// @brief detect if the ray hits the Hittable object (whichever kind of object it is)
+/// @param ray
+/// @param ray_interval
+/// @param rec the Hit_Record
+/// @return bool if the object was hit by given ray
+static inline bool hittable_hit(const struct Hittable *object, const struct Ray *ray,
+                                struct Interval ray_interval, struct Hit_Record *rec)
+{
+    RENDER_STATS_COUNT(object_tests);
+
+    switch (object->which)
+    {
+    case (enum Which_Hittable)Sphere:
+        return sphere_hit(&object->object.sphere, ray, ray_interval, rec);
+
+    case (enum Which_Hittable)Box:
+        return box_hit(&object->object.box, ray, ray_interval, rec);
+
+    case (enum Which_Hittable)Constant_Medium:
+        return constant_medium_hit(&object->object.constant_medium, ray, ray_interval, rec);
+
+    default:
+        fprintf(stderr, "Could not identify Hittable!\n");
+        fflush(stderr);
+        return false;
+    }
+}
+
+/// @brief The bounding box of the Hittable object (whichever kind of object it is).
+static inline struct AABB hittable_bounding_box(const struct Hittable *object)
+{
+    switch (object->which)
+    {
+    case (enum Which_Hittable)Sphere:
+        return sphere_bounding_box(&object->object.sphere);
+
+    case (enum Which_Hittable)Box:
+        return object->object.box.bounds;
+
+    case (enum Which_Hittable)Constant_Medium:
+        // A ray can only scatter inside the boundary.
+        return hittable_bounding_box(object->object.constant_medium.boundary);
+
+    default:
+        fprintf(stderr, "Could not identify Hittable!\n");
+        fflush(stderr);
+        return AABB_EMPTY;
+    }
+}
@@ -0,0 +1,913 @@
+#include "rt.h"
+#include "rtweekend.h"
+#include "pfm.h"
+
+#include <string.h>
+
+/*
+
+Checks that the renderer still renders the same images, for when we change it to make it faster:
+
+    build\image_check.exe                    compare against the references in images/reference
+    build\image_check.exe --update           render new references (after a change that is *meant* to change the images)
+
+Two renders of a scene with different seeds are never the same, so comparing pixels exactly tells us nothing
+(and neither does a tolerance on each pixel: too tight and the noise fails it, too loose and it misses a 5% bias).
+Instead the reference of each scene is the mean of several runs (each with its own seed) *and* the variance of
+a single run at each pixel. A new render then differs from the reference mean by noise whose size we know:
+
+    z = (new - mean) / sqrt(variance * (1 + 1 / runs))
+
+Noise gives z around 0 (mostly within +-3), in both directions. A bias (an error in the expected value,
+like a wrong pdf or a light sampled twice) pushes z the same way over many pixels, so we add the differences up:
+
+    - over the whole image (for each color channel), which finds a small bias anywhere in the image, and
+    - over blocks of 8x8 pixels, which finds a bigger bias in part of the image (a wrong shadow, a missing caustic).
+
+A sum of n differences has n times the variance, so these are z scores too, and noise keeps them small.
+Fireflies (a pixel that found a very bright path by chance, say a caustic of the sun) break this: their
+variance is mostly a few rare, huge samples, so neither the references nor the new render estimate it well,
+and one of them can give z = 200. So we clamp each pixel's difference to 5 standard deviations before adding
+it up. (That hides a bias confined to a pixel or two, which we couldn't tell from a firefly anyway.)
+
+We also report the PSNR and SSIM of the (gamma corrected) image against the reference, since they are what
+people usually look at. Their values depend on the noise level, so we check them against what a render with
+a different seed got when the reference was made: more noise (say, a sampling change that makes the image
+noisier without biasing it) lowers them, even when the z scores pass.
+
+The light sampling modes (see RT_Sampling) are checked the same way: the small light room rendered with the
+mixture (or only the material) must converge to the small light reference. These renders are noisier, so their
+z scores are taken against the reference's variance times how much noisier they are (see check_noise), and
+they are not failed for being noisier or slower: how much noisier, and in how much time, is what they report.
+
+And we time each render, against the time the reference took (on whatever machine that was, with an optimized
+(Release) build: a Debug build takes several times as long).
+
+*/
+
+#define CHECK_BLOCK_SIZE 8
+
+/// @brief The seed of the render we check (the references use seeds 1 to runs).
+#define CHECK_SEED 0x5eed5eedULL
+
+/// @brief The thresholds for a scene to pass (see above).
+#define MAX_PIXEL_Z 5.0  //< What a single pixel's difference is clamped to before adding it up
+#define MAX_IMAGE_Z 5.0  //< For the differences summed over the whole image
+#define MAX_BLOCK_Z 6.0  //< For the differences summed over a block (there are hundreds of blocks)
+#define PSNR_MARGIN 3.0  //< How many dB below the PSNR of the reference's check render we accept (3 dB: twice the noise)
+#define SSIM_MARGIN 0.02 //< And how much below its SSIM
+
+struct Check_Scene
+{
+    const char *name;
+    int image_width;
+    int image_height;
+    int samples_per_pixel;
+
+    /// @brief Builds the scene (and sets its camera, with the samples per pixel above).
+    /// @return false if it could not be built.
+    bool (*build)(struct RT_Scene *scene, struct RT_Camera *cam);
+
+    enum RT_Sampling sampling;
+
+    /// @brief The scene whose reference this one is checked against, or NULL for a reference of its own.
+    /// A scene rendered another way (another sampling, with more samples for about the same noise) must
+    /// converge to the same image, so it is checked for bias against the reference of the usual way, and its
+    /// time against that reference's time shows which way is quicker (it is not failed for being slower).
+    const char *reference;
+};
+
+/// @brief What the reference of a scene recorded (one line of the manifest).
+struct Check_Record
+{
+    int image_width, image_height, samples_per_pixel, runs;
+    double seconds; //< How long one render took
+    double psnr;    //< Of a render with CHECK_SEED against the reference
+    double ssim;
+};
+
+/// @brief A random number in [0,1) for placing objects (the same every run).
+static double scene_random(uint64_t *state)
+{
+    *state += 0x9e3779b97f4a7c15ULL;
+    return (mix_bits(*state) >> 11) * 0x1.0p-53;
+}
+
+// The scenes. Each is small enough to render in about a second, and exercises a different part of the renderer.
+
+/// @brief Every surface material, under the default sky, with defocus blur.
+static bool build_materials(struct RT_Scene *scene, struct RT_Camera *cam)
+{
+    int ground = rt_add_lambertian(scene, 0.5, 0.5, 0.5);
+    int diffuse = rt_add_lambertian(scene, 0.1, 0.2, 0.5);
+    int glass = rt_add_dielectric(scene, 1.5);
+    int bubble = rt_add_dielectric(scene, 1.0 / 1.5);
+    int shiny = rt_add_metal(scene, 0.8, 0.8, 0.8, 0.0);
+    int fuzzy = rt_add_metal(scene, 0.8, 0.6, 0.2, 0.4);
+
+    bool ok = rt_add_sphere(scene, (double[3]){0, -1000.5, -1}, 1000, ground) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0, 0, -1.2}, 0.5, diffuse) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){-1, 0, -1}, 0.5, glass) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){-1, 0, -1}, 0.4, bubble) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){1, 0, -1}, 0.5, fuzzy) == RT_Ok &&
+              rt_add_box(scene, (double[3]){0.3, -0.5, 0.2}, (double[3]){0.8, 0, 0.7}, shiny) == RT_Ok;
+
+    *cam = (struct RT_Camera){
+        .lookfrom = {-2, 2, 1},
+        .lookat = {0, 0, -1},
+        .vup = {0, 1, 0},
+        .vfov = 40,
+        .defocus_angle = 3,
+        .focus_dist = 3.4,
+        .max_depth = 20,
+    };
+    return ok;
+}
+
+/// @brief A closed room lit only by a small light (next-event estimation and shadows), with a glass sphere.
+static bool build_small_light(struct RT_Scene *scene, struct RT_Camera *cam)
+{
+    int white = rt_add_lambertian(scene, 0.73, 0.73, 0.73);
+    int red = rt_add_lambertian(scene, 0.65, 0.05, 0.05);
+    int green = rt_add_lambertian(scene, 0.12, 0.45, 0.15);
+    int glass = rt_add_dielectric(scene, 1.5);
+    int light = rt_add_diffuse_light(scene, 6, 6, 6);
+
+    // The walls are thin boxes.
+    bool ok = rt_add_box(scene, (double[3]){-2, -0.1, -2}, (double[3]){2, 0, 2}, white) == RT_Ok &&
+              rt_add_box(scene, (double[3]){-2, 3, -2}, (double[3]){2, 3.1, 2}, white) == RT_Ok &&
+              rt_add_box(scene, (double[3]){-2, 0, -2.1}, (double[3]){2, 3, -2}, white) == RT_Ok &&
+              rt_add_box(scene, (double[3]){-2.1, 0, -2}, (double[3]){-2, 3, 2}, red) == RT_Ok &&
+              rt_add_box(scene, (double[3]){2, 0, -2}, (double[3]){2.1, 3, 2}, green) == RT_Ok &&
+              rt_add_box(scene, (double[3]){-1.2, 0, -1.2}, (double[3]){-0.2, 1.6, -0.4}, white) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0.8, 0.6, 0}, 0.6, glass) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0, 2.5, 0}, 0.35, light) == RT_Ok;
+
+    rt_set_background(scene, 0, 0, 0);
+
+    *cam = (struct RT_Camera){
+        .lookfrom = {0, 1.5, 5.5},
+        .lookat = {0, 1.4, 0},
+        .vup = {0, 1, 0},
+        .vfov = 45,
+        .focus_dist = 10,
+        .max_depth = 20,
+    };
+    return ok;
+}
+
+/// @brief Fog and smoke (media and the isotropic phase function), lit by a sphere light and a dim background.
+static bool build_fog(struct RT_Scene *scene, struct RT_Camera *cam)
+{
+    int ground = rt_add_lambertian(scene, 0.48, 0.83, 0.53);
+    int smoke = rt_add_isotropic(scene, 0.9, 0.9, 0.9);
+    int haze = rt_add_isotropic(scene, 0.2, 0.4, 0.9);
+    int light = rt_add_diffuse_light(scene, 12, 10, 8);
+
+    bool ok = rt_add_sphere(scene, (double[3]){0, -1000, 0}, 1000, ground) == RT_Ok &&
+              rt_add_sphere_medium(scene, (double[3]){-0.8, 0.7, 0}, 0.7, 1.5, smoke) == RT_Ok &&
+              rt_add_box_medium(scene, (double[3]){0.2, 0, -0.6}, (double[3]){1.4, 1.2, 0.6}, 0.8, haze) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0, 2.5, 1}, 0.4, light) == RT_Ok;
+
+    rt_set_background(scene, 0.05, 0.05, 0.08);
+
+    *cam = (struct RT_Camera){
+        .lookfrom = {0, 1.5, 5},
+        .lookat = {0, 0.6, 0},
+        .vup = {0, 1, 0},
+        .vfov = 40,
+        .focus_dist = 10,
+        .max_depth = 20,
+    };
+    return ok;
+}
+
+/// @brief Spheres under an environment map with a small, very bright sun (importance sampled environment).
+static bool build_environment(struct RT_Scene *scene, struct RT_Camera *cam)
+{
+    const int width = 256, height = 128;
+    float *rgb = malloc((size_t)width * height * 3 * sizeof(float));
+    if (rgb == NULL)
+    {
+        return false;
+    }
+
+    // A blue sky, brown ground, and a sun 4 degrees across (bigger than the real one, so its highlights converge).
+    double sun[3] = {-0.6, 0.6, -0.4};
+    double sun_length = sqrt(sun[0] * sun[0] + sun[1] * sun[1] + sun[2] * sun[2]);
+    double sun_cos_radius = cos(degrees_to_radians(2));
+    for (int j = 0; j < height; j++)
+    {
+        double theta = pi * (j + 0.5) / height;
+        for (int i = 0; i < width; i++)
+        {
+            double phi = 2 * pi * (i + 0.5) / width;
+            double direction[3] = {-sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)};
+
+            float *pixel = rgb + 3 * ((size_t)j * width + i);
+            bool up = direction[1] > 0;
+            pixel[0] = up ? 0.5f : 0.3f;
+            pixel[1] = up ? 0.7f : 0.25f;
+            pixel[2] = up ? 1.0f : 0.2f;
+
+            double cos_sun = (direction[0] * sun[0] + direction[1] * sun[1] + direction[2] * sun[2]) / sun_length;
+            if (cos_sun > sun_cos_radius)
+            {
+                pixel[0] = 300;
+                pixel[1] = 280;
+                pixel[2] = 250;
+            }
+        }
+    }
+
+    enum RT_Status status = rt_set_environment(scene, rgb, width, height, 1.0);
+    free(rgb);
+
+    int ground = rt_add_lambertian(scene, 0.45, 0.42, 0.38);
+    int red = rt_add_lambertian(scene, 0.7, 0.15, 0.1);
+    int gold = rt_add_metal(scene, 0.9, 0.7, 0.3, 0.3);
+
+    bool ok = status == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0, -1000, 0}, 1000, ground) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){-0.6, 0.5, 0}, 0.5, red) == RT_Ok &&
+              rt_add_sphere(scene, (double[3]){0.6, 0.5, 0}, 0.5, gold) == RT_Ok;
+
+    *cam = (struct RT_Camera){
+        .lookfrom = {0, 1.2, 4},
+        .lookat = {0, 0.4, 0},
+        .vup = {0, 1, 0},
+        .vfov = 35,
+        .focus_dist = 10,
+        .max_depth = 20,
+    };
+    return ok;
+}
+
+/// @brief Hundreds of small spheres, some moving (the BVH and motion blur), under the default sky.
+static bool build_many_spheres(struct RT_Scene *scene, struct RT_Camera *cam)
+{
+    int ground = rt_add_lambertian(scene, 0.5, 0.5, 0.5);
+    int glass = rt_add_dielectric(scene, 1.5);
+    bool ok = ground >= 0 && glass >= 0 &&
+              rt_add_sphere(scene, (double[3]){0, -1000, 0}, 1000, ground) == RT_Ok;
+
+    uint64_t state = 1;
+    for (int a = -11; ok && a < 11; a++)
+    {
+        for (int b = -11; ok && b < 11; b++)
+        {
+            double center[3] = {a + 0.9 * scene_random(&state), 0.2, b + 0.9 * scene_random(&state)};
+            double choose = scene_random(&state);
+            double r = scene_random(&state), g = scene_random(&state), bl = scene_random(&state);
+
+            if (choose < 0.6)
+            {
+                int diffuse = rt_add_lambertian(scene, r * r, g * g, bl * bl);
+                double center1[3] = {center[0], center[1] + 0.3 * scene_random(&state), center[2]};
+                ok = diffuse >= 0 && rt_add_moving_sphere(scene, center, center1, 0.2, diffuse) == RT_Ok;
+            }
+            else if (choose < 0.9)
+            {
+                int metal = rt_add_metal(scene, 0.5 + 0.5 * r, 0.5 + 0.5 * g, 0.5 + 0.5 * bl, 0.5 * scene_random(&state));
+                ok = metal >= 0 && rt_add_sphere(scene, center, 0.2, metal) == RT_Ok;
+            }
+            else
+            {
+                ok = rt_add_sphere(scene, center, 0.2, glass) == RT_Ok;
+            }
+        }
+    }
+
+    *cam = (struct RT_Camera){
+        .lookfrom = {13, 2, 3},
+        .lookat = {0, 0, 0},
+        .vup = {0, 1, 0},
+        .vfov = 20,
+        .defocus_angle = 0.6,
+        .focus_dist = 10,
+        .max_depth = 20,
+    };
+    return ok;
+}
+
+static const struct Check_Scene check_scenes[] = {
+    {"materials", 128, 72, 32, build_materials, RT_Sampling_Mis, NULL},
+    {"small_light", 72, 72, 32, build_small_light, RT_Sampling_Mis, NULL},
+    {"fog", 128, 72, 32, build_fog, RT_Sampling_Mis, NULL},
+    {"environment", 128, 72, 16, build_environment, RT_Sampling_Mis, NULL},
+    {"many_spheres", 128, 72, 16, build_many_spheres, RT_Sampling_Mis, NULL},
+    {"small_light_mixture", 72, 72, 64, build_small_light, RT_Sampling_Mixture, "small_light"},
+    {"small_light_material", 72, 72, 128, build_small_light, RT_Sampling_Material, "small_light"},
+};
+
+#define NUM_CHECK_SCENES ((int)(sizeof(check_scenes) / sizeof(check_scenes[0])))
+
+/// @brief Render the scene with the given seed into rgb (width * height * 3 floats).
+/// @param seconds Set to how long the render took (not counting building the scene).
+/// @return false if the scene could not be built or rendered.
+static bool check_render(const struct Check_Scene *check, uint64_t seed, int num_threads, float *rgb, double *seconds)
+{
+    struct RT_Scene *scene = rt_scene_create();
+    if (scene == NULL)
+    {
+        return false;
+    }
+
+    struct RT_Camera cam;
+    bool ok = check->build(scene, &cam);
+    if (ok)
+    {
+        cam.samples_per_pixel = check->samples_per_pixel;
+        cam.num_threads = num_threads;
+        cam.seed = seed;
+        rt_scene_set_camera(scene, &cam);
+        rt_set_sampling(scene, check->sampling);
+
+        double start_time = seconds_now();
+        ok = rt_render(scene, rgb, check->image_width, check->image_height, NULL, NULL) == RT_Ok;
+        *seconds = seconds_now() - start_time;
+    }
+
+    rt_scene_destroy(scene);
+    return ok;
+}
+
+/// @brief The gamma corrected value of a linear color component, clamped to [0,1] (what we see).
+static inline double check_display(double x)
+{
+    return (x > 0) ? sqrt(fmin(x, 1)) : 0;
+}
+
+/// @brief The PSNR (in dB) of the gamma corrected image against the gamma corrected reference.
+static double check_psnr(const float *image, const float *reference, size_t count)
+{
+    double sum = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        double d = check_display(image[k]) - check_display(reference[k]);
+        sum += d * d;
+    }
+    double mse = sum / count;
+    return (mse > 0) ? 10 * log10(1 / mse) : 99;
+}
+
+/// @brief The mean SSIM of the gamma corrected image against the gamma corrected reference,
+/// over 8x8 windows (every 4 pixels) of each color channel.
+static double check_ssim(const float *image, const float *reference, int width, int height)
+{
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    const int n = CHECK_BLOCK_SIZE * CHECK_BLOCK_SIZE;
+
+    double sum = 0;
+    int windows = 0;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        for (int y0 = 0; y0 + CHECK_BLOCK_SIZE <= height; y0 += CHECK_BLOCK_SIZE / 2)
+        {
+            for (int x0 = 0; x0 + CHECK_BLOCK_SIZE <= width; x0 += CHECK_BLOCK_SIZE / 2)
+            {
+                double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+                for (int y = y0; y < y0 + CHECK_BLOCK_SIZE; y++)
+                {
+                    for (int x = x0; x < x0 + CHECK_BLOCK_SIZE; x++)
+                    {
+                        size_t k = 3 * ((size_t)y * width + x) + channel;
+                        double a = check_display(image[k]), b = check_display(reference[k]);
+                        sx += a;
+                        sy += b;
+                        sxx += a * a;
+                        syy += b * b;
+                        sxy += a * b;
+                    }
+                }
+
+                double mx = sx / n, my = sy / n;
+                double vx = sxx / n - mx * mx, vy = syy / n - my * my, cov = sxy / n - mx * my;
+                sum += ((2 * mx * my + c1) * (2 * cov + c2)) / ((mx * mx + my * my + c1) * (vx + vy + c2));
+                windows++;
+            }
+        }
+    }
+    return sum / windows;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief How many times the variance of a render with the reference's samples per pixel the noise of image is,
+/// for a scene checked against the reference of another (see Check_Scene.reference).
+/// @remark The squared difference from the reference mean, over the variance, of a pixel component is
+/// (mostly) noise, and its median over the image is 0.455 for noise the size of the reference's (the median of a
+/// squared normal). We take the median rather than the mean so fireflies don't count for more than other pixels.
+/// @return 0 if it could not be allocated.
+static double check_noise(const float *image, const float *mean, const float *variance, int runs, size_t count)
+{
+    double *ratios = malloc(count * sizeof(double));
+    if (ratios == NULL)
+    {
+        return 0;
+    }
+    for (size_t k = 0; k < count; k++)
+    {
+        double d = (double)image[k] - mean[k];
+        ratios[k] = d * d / fmax(variance[k], 1e-12);
+    }
+    qsort(ratios, count, sizeof(double), compare_doubles);
+    double noise = ratios[count / 2] / 0.455 - 1.0 / runs;
+    free(ratios);
+    return fmax(noise, 1);
+}
+
+/// @brief The z scores of an image against a reference (see the top of the file).
+struct Check_Scores
+{
+    double image_z[3];   //< For the differences summed over the whole image, per color channel
+    double max_block_z;  //< The largest (in magnitude) of any block and channel
+    int worst_block_x;   //< Where that block is (its top left pixel)
+    int worst_block_y;
+    double outliers;     //< The fraction of pixel components with |z| > 3 (about 0.3% for pure noise)
+};
+
+/// @param noise How many times the reference's variance the image's noise is (1 for a render of the scene the
+/// reference was made for, see check_noise).
+static struct Check_Scores check_scores(const float *image, const float *mean, const float *variance,
+                                        int runs, double noise, int width, int height)
+{
+    struct Check_Scores scores = {0};
+    double scale = noise + 1.0 / runs; // The reference mean has noise of its own
+
+    double image_sum[3] = {0}, image_var[3] = {0};
+    size_t outliers = 0;
+
+    for (int y0 = 0; y0 < height; y0 += CHECK_BLOCK_SIZE)
+    {
+        for (int x0 = 0; x0 < width; x0 += CHECK_BLOCK_SIZE)
+        {
+            double block_sum[3] = {0}, block_var[3] = {0};
+            for (int y = y0; y < y0 + CHECK_BLOCK_SIZE && y < height; y++)
+            {
+                for (int x = x0; x < x0 + CHECK_BLOCK_SIZE && x < width; x++)
+                {
+                    for (int c = 0; c < 3; c++)
+                    {
+                        size_t k = 3 * ((size_t)y * width + x) + c;
+                        double d = (double)image[k] - mean[k];
+                        // Pixels that see no noise at all (a flat background) still get a tiny variance,
+                        // so any real difference in them stands out without dividing by zero.
+                        double v = fmax(variance[k] * scale, 1e-12);
+                        outliers += d * d > 9 * v;
+
+                        // A firefly (see the top of the file) alone would swamp the sums, so no pixel may count
+                        // for more than MAX_PIXEL_Z standard deviations.
+                        double limit = MAX_PIXEL_Z * sqrt(v);
+                        d = fmin(fmax(d, -limit), limit);
+
+                        block_sum[c] += d;
+                        block_var[c] += v;
+                    }
+                }
+            }
+
+            for (int c = 0; c < 3; c++)
+            {
+                image_sum[c] += block_sum[c];
+                image_var[c] += block_var[c];
+
+                double z = block_sum[c] / sqrt(block_var[c]);
+                if (fabs(z) > fabs(scores.max_block_z))
+                {
+                    scores.max_block_z = z;
+                    scores.worst_block_x = x0;
+                    scores.worst_block_y = y0;
+                }
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        scores.image_z[c] = image_sum[c] / sqrt(image_var[c]);
+    }
+    scores.outliers = (double)outliers / ((size_t)width * height * 3);
+    return scores;
+}
+
+/// @brief Write a float image as a PFM file in dir (named after the scene).
+static bool check_write_image(const char *dir, const char *name, const char *suffix, const float *rgb,
+                              int width, int height)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s%s.pfm", dir, name, suffix);
+
+    size_t count = (size_t)width * height;
+    color3 *pixels = malloc(count * sizeof(color3));
+    FILE *out = fopen(path, "wb");
+    bool ok = pixels != NULL && out != NULL;
+    if (ok)
+    {
+        for (size_t k = 0; k < count; k++)
+        {
+            pixels[k][0] = rgb[3 * k + 0];
+            pixels[k][1] = rgb[3 * k + 1];
+            pixels[k][2] = rgb[3 * k + 2];
+        }
+        ok = write_pfm(out, pixels, width, height);
+    }
+
+    if (out != NULL)
+    {
+        ok = (fclose(out) == 0) && ok;
+    }
+    free(pixels);
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    return ok;
+}
+
+/// @return The image (free it once done), or NULL if it is missing or not the expected size.
+static float *check_read_image(const char *dir, const char *name, const char *suffix, int width, int height)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s%s.pfm", dir, name, suffix);
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Could not open %s (run with --update to make the references)\n", path);
+        return NULL;
+    }
+
+    float *rgb = NULL;
+    int file_width, file_height;
+    bool ok = read_pfm(in, &rgb, &file_width, &file_height);
+    fclose(in);
+
+    if (!ok || file_width != width || file_height != height)
+    {
+        fprintf(stderr, "%s is not a %ix%i PFM image (run with --update to make the references)\n", path, width, height);
+        free(rgb);
+        return NULL;
+    }
+    return rgb;
+}
+
+/// @brief Find the record of the named scene in the manifest (one line per scene, see check_update).
+static bool check_read_record(const char *dir, const char *name, struct Check_Record *record)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/manifest.txt", dir);
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+    {
+        return false;
+    }
+
+    char line[512], scene_name[128];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), in) != NULL)
+    {
+        found = line[0] != '#' &&
+                sscanf(line, "%127s %i %i %i %i %lf %lf %lf", scene_name, &record->image_width,
+                       &record->image_height, &record->samples_per_pixel, &record->runs, &record->seconds,
+                       &record->psnr, &record->ssim) == 8 &&
+                strcmp(scene_name, name) == 0;
+    }
+
+    fclose(in);
+    return found;
+}
+
+static void check_write_record(FILE *manifest, const char *name, const struct Check_Record *record)
+{
+    fprintf(manifest, "%s %i %i %i %i %.4f %.3f %.5f\n", name, record->image_width, record->image_height,
+            record->samples_per_pixel, record->runs, record->seconds, record->psnr, record->ssim);
+}
+
+/// @brief Render the references of the scenes (the mean and per pixel variance of runs renders each), and a
+/// render with CHECK_SEED to record the PSNR and SSIM a good render gets, and write the manifest.
+static bool check_update(const char *dir, const char *only, int runs, int num_threads)
+{
+    // Keep the records of the scenes we don't update.
+    struct Check_Record kept[NUM_CHECK_SCENES];
+    bool have_kept[NUM_CHECK_SCENES];
+    for (int s = 0; s < NUM_CHECK_SCENES; s++)
+    {
+        have_kept[s] = only != NULL && strcmp(only, check_scenes[s].name) != 0 &&
+                       check_read_record(dir, check_scenes[s].name, &kept[s]);
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/manifest.txt", dir);
+    FILE *manifest = fopen(path, "w");
+    if (manifest == NULL)
+    {
+        fprintf(stderr, "Could not write %s (does the directory exist?)\n", path);
+        return false;
+    }
+    fprintf(manifest, "# scene width height samples_per_pixel runs seconds psnr ssim\n");
+
+    bool ok = true;
+    for (int s = 0; ok && s < NUM_CHECK_SCENES; s++)
+    {
+        const struct Check_Scene *check = &check_scenes[s];
+        struct Check_Record record;
+        if (check->reference != NULL)
+        {
+            continue; // It has no reference of its own
+        }
+        if (only != NULL && strcmp(only, check->name) != 0)
+        {
+            if (have_kept[s])
+            {
+                check_write_record(manifest, check->name, &kept[s]);
+            }
+            continue;
+        }
+
+        size_t count = (size_t)check->image_width * check->image_height * 3;
+        float *rgb = malloc(count * sizeof(float));
+        float *mean = calloc(count, sizeof(float));
+        float *variance = calloc(count, sizeof(float));
+        double *m2 = calloc(count, sizeof(double));
+        double *m = calloc(count, sizeof(double));
+        ok = rgb != NULL && mean != NULL && variance != NULL && m2 != NULL && m != NULL;
+
+        // The mean and variance of the runs (Welford's method, which doesn't lose precision to cancellation).
+        for (int run = 1; ok && run <= runs; run++)
+        {
+            double seconds;
+            ok = check_render(check, (uint64_t)run, num_threads, rgb, &seconds);
+            for (size_t k = 0; ok && k < count; k++)
+            {
+                double delta = rgb[k] - m[k];
+                m[k] += delta / run;
+                m2[k] += delta * (rgb[k] - m[k]);
+            }
+            fprintf(stderr, "\r%s: run %i of %i", check->name, run, runs);
+        }
+
+        if (ok)
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                mean[k] = (float)m[k];
+                variance[k] = (float)(m2[k] / (runs - 1));
+            }
+
+            record = (struct Check_Record){
+                .image_width = check->image_width,
+                .image_height = check->image_height,
+                .samples_per_pixel = check->samples_per_pixel,
+                .runs = runs,
+            };
+            ok = check_render(check, CHECK_SEED, num_threads, rgb, &record.seconds) &&
+                 check_write_image(dir, check->name, "", mean, check->image_width, check->image_height) &&
+                 check_write_image(dir, check->name, "_variance", variance, check->image_width,
+                                   check->image_height);
+        }
+
+        if (ok)
+        {
+            record.psnr = check_psnr(rgb, mean, count);
+            record.ssim = check_ssim(rgb, mean, check->image_width, check->image_height);
+            check_write_record(manifest, check->name, &record);
+            fprintf(stderr, "\r%s: %i runs, %.2f seconds per run, PSNR %.2f dB, SSIM %.4f\n", check->name, runs,
+                    record.seconds, record.psnr, record.ssim);
+        }
+        else
+        {
+            fprintf(stderr, "\n%s: could not render the reference!\n", check->name);
+        }
+
+        free(rgb);
+        free(mean);
+        free(variance);
+        free(m2);
+        free(m);
+    }
+
+    return (fclose(manifest) == 0) && ok;
+}
+
+/// @brief Render each scene with seed (usually CHECK_SEED) and compare it against its reference.
+/// @return The number of scenes that failed (or could not be checked).
+static int check_all(const char *dir, const char *only, uint64_t seed, int num_threads, double max_slowdown)
+{
+    int failed = 0;
+    double total_seconds = 0, total_reference_seconds = 0;
+
+    printf("%-20s %7s %7s %7s %8s %8s %7s %7s %8s %6s  %s\n", "scene", "z red", "z green", "z blue", "block z",
+           "outliers", "PSNR", "SSIM", "seconds", "ratio", "result");
+
+    for (int s = 0; s < NUM_CHECK_SCENES; s++)
+    {
+        const struct Check_Scene *check = &check_scenes[s];
+        if (only != NULL && strcmp(only, check->name) != 0)
+        {
+            continue;
+        }
+
+        const char *reference = (check->reference != NULL) ? check->reference : check->name;
+        struct Check_Record record;
+        if (!check_read_record(dir, reference, &record) || record.image_width != check->image_width ||
+            record.image_height != check->image_height ||
+            (check->reference == NULL && record.samples_per_pixel != check->samples_per_pixel))
+        {
+            fprintf(stderr, "%s: no matching reference in %s/manifest.txt (run with --update)\n", check->name, dir);
+            failed++;
+            continue;
+        }
+
+        size_t count = (size_t)check->image_width * check->image_height * 3;
+        float *mean = check_read_image(dir, reference, "", check->image_width, check->image_height);
+        float *variance = check_read_image(dir, reference, "_variance", check->image_width, check->image_height);
+        float *rgb = malloc(count * sizeof(float));
+        double seconds;
+        if (mean == NULL || variance == NULL || rgb == NULL ||
+            !check_render(check, seed, num_threads, rgb, &seconds))
+        {
+            fprintf(stderr, "%s: could not be checked!\n", check->name);
+            free(mean);
+            free(variance);
+            free(rgb);
+            failed++;
+            continue;
+        }
+
+        double noise = (check->reference != NULL) ? check_noise(rgb, mean, variance, record.runs, count) : 1;
+        struct Check_Scores scores =
+            check_scores(rgb, mean, variance, record.runs, noise, check->image_width, check->image_height);
+        double psnr = check_psnr(rgb, mean, count);
+        double ssim = check_ssim(rgb, mean, check->image_width, check->image_height);
+        double ratio = seconds / record.seconds;
+
+        // Why the scene failed (if it did).
+        const char *result = "ok";
+        if (noise == 0)
+        {
+            result = "FAIL (could not be checked)";
+        }
+        else if (fmax(fmax(fabs(scores.image_z[0]), fabs(scores.image_z[1])), fabs(scores.image_z[2])) > MAX_IMAGE_Z)
+        {
+            result = "FAIL (biased image)";
+        }
+        else if (fabs(scores.max_block_z) > MAX_BLOCK_Z)
+        {
+            result = "FAIL (biased block)";
+        }
+        else if (check->reference == NULL && (psnr < record.psnr - PSNR_MARGIN || ssim < record.ssim - SSIM_MARGIN))
+        {
+            result = "FAIL (noisier)";
+        }
+        else if (check->reference == NULL && max_slowdown > 0 && ratio > max_slowdown)
+        {
+            result = "FAIL (slower)";
+        }
+
+        printf("%-20s %7.2f %7.2f %7.2f %8.2f %7.2f%% %7.2f %7.4f %8.3f %6.2f  %s", check->name, scores.image_z[0],
+               scores.image_z[1], scores.image_z[2], scores.max_block_z, 100 * scores.outliers, psnr, ssim, seconds,
+               ratio, result);
+        if (strcmp(result, "FAIL (biased block)") == 0)
+        {
+            printf(" at pixel (%i, %i)", scores.worst_block_x, scores.worst_block_y);
+        }
+        else if (strcmp(result, "FAIL (noisier)") == 0)
+        {
+            printf(" (the reference's render got PSNR %.2f, SSIM %.4f)", record.psnr, record.ssim);
+        }
+        if (check->reference != NULL)
+        {
+            printf(" (%.2f times the variance of %s, in %.2f times its time)", noise, reference, ratio);
+        }
+        printf("\n");
+
+        // Keep the failed render, to look at next to the reference.
+        if (strcmp(result, "ok") != 0)
+        {
+            check_write_image(dir, check->name, "_failed", rgb, check->image_width, check->image_height);
+        }
+
+        failed += strcmp(result, "ok") != 0;
+        if (check->reference == NULL)
+        {
+            total_seconds += seconds;
+            total_reference_seconds += record.seconds;
+        }
+
+        free(mean);
+        free(variance);
+        free(rgb);
+    }
+
+    if (total_reference_seconds > 0)
+    {
+        printf("Total %.3f seconds (%.3f for the references, ratio %.2f)\n", total_seconds, total_reference_seconds,
+               total_seconds / total_reference_seconds);
+    }
+    return failed;
+}
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "Usage: image_check [--update] [--dir images/reference] [--scene name] [--runs 16] [--threads n]\n"
+            "                   [--seed n] [--max-slowdown ratio]\n"
+            "  --update        Render new references (the mean and variance of --runs renders of each scene)\n"
+            "  --dir           Where the references are\n"
+            "  --scene         Only check (or update) this scene:");
+    for (int s = 0; s < NUM_CHECK_SCENES; s++)
+    {
+        fprintf(stderr, " %s", check_scenes[s].name);
+    }
+    fprintf(stderr, "\n"
+                    "  --threads       Render threads (default one per hardware thread)\n"
+                    "  --seed          Check a render with this seed (to see how often noise alone fails a scene)\n"
+                    "  --max-slowdown  Also fail scenes that take more than ratio times as long as their reference\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool update = false;
+    const char *dir = "images/reference";
+    const char *only = NULL;
+    int runs = 16;
+    int num_threads = 0;
+    double max_slowdown = 0;
+    uint64_t seed = CHECK_SEED;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--update") == 0)
+        {
+            update = true;
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && has_value)
+        {
+            dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--scene") == 0 && has_value)
+        {
+            only = argv[++i];
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && has_value)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+        {
+            seed = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--max-slowdown") == 0 && has_value)
+        {
+            max_slowdown = atof(argv[++i]);
+        }
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (runs < 2 || num_threads < 0)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (only != NULL)
+    {
+        bool known = false;
+        for (int s = 0; s < NUM_CHECK_SCENES; s++)
+        {
+            known = known || strcmp(only, check_scenes[s].name) == 0;
+        }
+        if (!known)
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (update)
+    {
+        return check_update(dir, only, runs, num_threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    int failed = check_all(dir, only, seed, num_threads, max_slowdown);
+    if (failed > 0)
+    {
+        printf("%i scene%s failed\n", failed, (failed == 1) ? "" : "s");
+        return EXIT_FAILURE;
+    }
+    printf("All scenes match their references\n");
+    return EXIT_SUCCESS;
+}
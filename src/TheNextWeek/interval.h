@@ -10,7 +10,7 @@ struct Interval
     double max;
 };
 
-void make_empty_interval(struct Interval *interval)
+static inline void make_empty_interval(struct Interval *interval)
 {
     interval->min = infinity;
     interval->max = -infinity;
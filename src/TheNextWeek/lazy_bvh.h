@@ -0,0 +1,328 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "bvh.h"
+
+#include <stdatomic.h>
+
+/*
+
+A lazy BVH is a BVH (see bvh.h) that is only built where rays go. Building the whole tree before the first
+pixel is wasted time when the camera only sees a small part of a huge scene (and annoying in a preview).
+So lazy_bvh_build only splits the top LAZY_BVH_EAGER_DEPTH levels, and leaves the nodes below them unsplit:
+a box around a range of objects. The first ray to reach an unsplit node splits it (exactly the way bvh_build
+would, with bvh_partition), and goes on into its children, which are again unsplit until some ray reaches them.
+Parts of the scene no ray reaches are never split at all.
+
+The render threads split nodes while other threads walk the tree, so a node's state is atomic:
+
+    - Unsplit:  it has a box and a range of objects, nothing more.
+    - Claimed:  a thread is splitting it. Rays that reach it wait (this takes about as long as splitting a node
+                of the full build, so they don't wait long).
+    - Split:    its two children are set up (their boxes, and their ranges of objects).
+    - Leaf:     splitting it didn't pay off, so it keeps its objects.
+
+A thread claims a node by changing its state from unsplit to claimed (a compare and swap, so only one thread
+wins). Only that thread touches the node's objects (reordering them into its children's ranges), and it writes
+the children before it sets the state to split (or leaf) with a release store. A thread that reads that state
+with an acquire load (which every thread does before it looks at a node's children or objects) is then sure
+to see all of it.
+
+Nodes are taken from one array (with room for every node the tree could have) by an atomic counter, two at a
+time (the children of a node are next to each other). Since bvh_partition is deterministic, the tree is the
+same as the one bvh_build makes, whichever threads split which nodes (only where the nodes are in the array
+changes), so a lazy BVH finds exactly the same hits.
+
+*/
+
+#define LAZY_BVH_EAGER_DEPTH 6 //< How many levels lazy_bvh_build splits up front
+
+/// @brief The states of a lazy BVH node (see above).
+enum Lazy_BVH_State
+{
+    Lazy_BVH_Unsplit,
+    Lazy_BVH_Claimed,
+    Lazy_BVH_Split,
+    Lazy_BVH_Leaf,
+};
+
+struct Lazy_BVH_Node
+{
+    struct AABB box;
+    int left;         //< (Split nodes) Index of the left child in Lazy_BVH.nodes. The right child is left + 1.
+    int first;        //< Index of the node's first object in Lazy_BVH.builder.refs
+    int count;        //< How many objects it has
+    int depth;        //< How deep it is in the tree (bvh_partition splits very deep nodes differently)
+    atomic_int state; //< See enum Lazy_BVH_State
+};
+
+struct Lazy_BVH
+{
+    const struct Hittable *world; //< The objects the BVH is built over (not owned by the BVH)
+    int world_length;
+
+    struct Lazy_BVH_Node *nodes; //< nodes[0] is the root. Has room for every node the tree could have.
+    atomic_int *num_nodes;       //< How many nodes are in use (allocated, so that a const BVH can still grow)
+
+    struct BVH_Builder builder; //< Its refs are the objects, grouped by leaf where the tree is split
+
+    double build_seconds; //< How long lazy_bvh_build took (the splits after it are not counted)
+};
+
+/// @brief Set up node n as an unsplit node for the objects refs[start, end), whose bounds are box.
+static void lazy_bvh_init_node(const struct Lazy_BVH *bvh, int n, int start, int end, int depth,
+                               const struct BVH_Box *box)
+{
+    struct Lazy_BVH_Node *node = &bvh->nodes[n];
+    node->box = bvh_box_to_aabb(box);
+    node->left = 0;
+    node->first = start;
+    node->count = end - start;
+    node->depth = depth;
+    atomic_init(&node->state, Lazy_BVH_Unsplit);
+}
+
+/// @brief Make sure the node is split (or a leaf): split it (if no other thread is already doing that),
+/// or wait for the thread that is.
+/// @return The node's state: Lazy_BVH_Split or Lazy_BVH_Leaf.
+static int lazy_bvh_split(const struct Lazy_BVH *bvh, struct Lazy_BVH_Node *node)
+{
+    int state = Lazy_BVH_Unsplit;
+    if (!atomic_compare_exchange_strong_explicit(&node->state, &state, Lazy_BVH_Claimed, memory_order_acquire,
+                                                 memory_order_acquire))
+    {
+        while (state == Lazy_BVH_Claimed)
+        {
+            thrd_yield();
+            state = atomic_load_explicit(&node->state, memory_order_acquire);
+        }
+        return state;
+    }
+
+    int start = node->first, end = node->first + node->count;
+    struct BVH_Range_Info info, child_info[2];
+    bvh_range_bounds(bvh->builder.refs, start, end, &info);
+
+    int mid = bvh_partition(&bvh->builder, start, end, node->depth, &info, &child_info[0], &child_info[1]);
+    if (mid == start)
+    {
+        atomic_store_explicit(&node->state, Lazy_BVH_Leaf, memory_order_release);
+        return Lazy_BVH_Leaf;
+    }
+
+    int left = atomic_fetch_add_explicit(bvh->num_nodes, 2, memory_order_relaxed);
+    lazy_bvh_init_node(bvh, left, start, mid, node->depth + 1, &child_info[0].box);
+    lazy_bvh_init_node(bvh, left + 1, mid, end, node->depth + 1, &child_info[1].box);
+    node->left = left;
+
+    atomic_store_explicit(&node->state, Lazy_BVH_Split, memory_order_release);
+    return Lazy_BVH_Split;
+}
+
+/// @brief The node's state once it is split (or a leaf), splitting it first if it isn't.
+static inline int lazy_bvh_ready(const struct Lazy_BVH *bvh, struct Lazy_BVH_Node *node)
+{
+    int state = atomic_load_explicit(&node->state, memory_order_acquire);
+    return (state >= Lazy_BVH_Split) ? state : lazy_bvh_split(bvh, node);
+}
+
+/// @brief Split node n and its descendants down to levels more levels.
+static void lazy_bvh_split_levels(const struct Lazy_BVH *bvh, int n, int levels)
+{
+    if (levels > 0 && lazy_bvh_ready(bvh, &bvh->nodes[n]) == Lazy_BVH_Split)
+    {
+        lazy_bvh_split_levels(bvh, bvh->nodes[n].left, levels - 1);
+        lazy_bvh_split_levels(bvh, bvh->nodes[n].left + 1, levels - 1);
+    }
+}
+
+static inline void lazy_bvh_free(struct Lazy_BVH *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->num_nodes);
+    free(bvh->builder.refs);
+    *bvh = (struct Lazy_BVH){0};
+}
+
+/// @brief Build the top of a lazy BVH over the world (see above). Call lazy_bvh_free once you are done with it.
+/// @param num_threads How many threads to split the top levels with (0 means one per hardware thread).
+/// @remark The BVH does not copy the world, so the world must outlive it.
+/// bvh must be zero initialized before its first build (a rebuild frees what the last build allocated).
+static inline void lazy_bvh_build_with_threads(struct Lazy_BVH *bvh, const struct Hittable *world, int world_length,
+                                               int num_threads)
+{
+    double start_time = seconds_now();
+    lazy_bvh_free(bvh);
+
+    bvh->world = world;
+    bvh->world_length = world_length;
+
+    // A binary tree with n leaves has 2n - 1 nodes (and we have at most n leaves).
+    int max_nodes = (world_length > 0) ? 2 * world_length - 1 : 1;
+    bvh->nodes = malloc(max_nodes * sizeof(struct Lazy_BVH_Node));
+    bvh->num_nodes = malloc(sizeof(atomic_int));
+    bvh->builder = (struct BVH_Builder){
+        .world = world,
+        .refs = malloc((world_length > 0 ? world_length : 1) * sizeof(struct BVH_Ref)),
+        .num_threads = (num_threads > 0) ? num_threads : hardware_threads(),
+    };
+    if (bvh->nodes == NULL || bvh->num_nodes == NULL || bvh->builder.refs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the BVH!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct BVH_Range_Info info;
+    bvh_range_jobs(&bvh->builder, 0, world_length, NULL, &info, NULL);
+    lazy_bvh_init_node(bvh, 0, 0, world_length, 0, &info.box);
+    atomic_init(bvh->num_nodes, 1);
+
+    if (world_length > 0)
+    {
+        lazy_bvh_split_levels(bvh, 0, LAZY_BVH_EAGER_DEPTH);
+    }
+
+    // The rest is split by the render threads (each node by the one thread that claims it).
+    bvh->builder.num_threads = 1;
+
+    bvh->build_seconds = seconds_now() - start_time;
+}
+
+/// @brief Build the top of a lazy BVH, with one thread per hardware thread (see lazy_bvh_build_with_threads).
+static inline void lazy_bvh_build(struct Lazy_BVH *bvh, const struct Hittable *world, int world_length)
+{
+    lazy_bvh_build_with_threads(bvh, world, world_length, 0);
+}
+
+/// @brief How many nodes the lazy BVH has so far (the full tree has the num_nodes of a BVH built by bvh_build).
+static inline int lazy_bvh_num_nodes(const struct Lazy_BVH *bvh)
+{
+    return (bvh->num_nodes != NULL) ? atomic_load_explicit(bvh->num_nodes, memory_order_relaxed) : 0;
+}
+
+/// @brief bvh_hit for a lazy BVH: splits the nodes the ray reaches that aren't split yet.
+static inline bool lazy_bvh_hit(const struct Lazy_BVH *bvh, const struct Ray *ray, struct Interval ray_interval,
+                                struct Hit_Record *rec)
+{
+    if (bvh->world_length == 0)
+    {
+        return false;
+    }
+
+    struct Hit_Record temp_rec;
+    bool hit_anything = false;
+    double closest_so_far = ray_interval.max;
+
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        struct Lazy_BVH_Node *node = &bvh->nodes[stack[--stack_size]];
+
+        struct Interval node_interval = {.min = ray_interval.min, .max = closest_so_far};
+        if (!aabb_hit(&node->box, ray, &node_interval))
+        {
+            continue;
+        }
+
+        if (lazy_bvh_ready(bvh, node) == Lazy_BVH_Leaf)
+        {
+            for (int k = node->first; k < node->first + node->count; k++)
+            {
+                const struct Hittable *object = &bvh->world[bvh_ref_index(&bvh->builder.refs[k])];
+                if (hittable_hit(object, ray, (struct Interval){.min = ray_interval.min, .max = closest_so_far},
+                                 &temp_rec))
+                {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    *rec = temp_rec;
+                    rec->object = object;
+                }
+            }
+            continue;
+        }
+
+        // Visit the child the ray enters first before the other one (push it last), like bvh_hit.
+        int left = node->left, right = node->left + 1;
+        struct Interval left_interval = {.min = ray_interval.min, .max = closest_so_far};
+        struct Interval right_interval = left_interval;
+        bool hit_left = aabb_hit(&bvh->nodes[left].box, ray, &left_interval);
+        bool hit_right = aabb_hit(&bvh->nodes[right].box, ray, &right_interval);
+
+        if (hit_left && hit_right)
+        {
+            bool left_first = left_interval.min <= right_interval.min;
+            stack[stack_size++] = left_first ? right : left;
+            stack[stack_size++] = left_first ? left : right;
+        }
+        else if (hit_left)
+        {
+            stack[stack_size++] = left;
+        }
+        else if (hit_right)
+        {
+            stack[stack_size++] = right;
+        }
+    }
+
+    return hit_anything;
+}
+
+/// @brief bvh_transmittance for a lazy BVH: splits the nodes the ray reaches that aren't split yet.
+static inline double lazy_bvh_transmittance(const struct Lazy_BVH *bvh, const struct Ray *ray,
+                                            struct Interval ray_interval)
+{
+    if (bvh->world_length == 0)
+    {
+        return 1.0;
+    }
+
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        struct Lazy_BVH_Node *node = &bvh->nodes[stack[--stack_size]];
+
+        struct Interval node_interval = ray_interval;
+        if (!aabb_hit(&node->box, ray, &node_interval))
+        {
+            continue;
+        }
+
+        if (lazy_bvh_ready(bvh, node) == Lazy_BVH_Split)
+        {
+            stack[stack_size++] = node->left;
+            stack[stack_size++] = node->left + 1;
+            continue;
+        }
+
+        for (int k = node->first; k < node->first + node->count; k++)
+        {
+            const struct Hittable *object = &bvh->world[bvh_ref_index(&bvh->builder.refs[k])];
+
+            if (object->which == (enum Which_Hittable)Constant_Medium)
+            {
+                transmittance *= constant_medium_transmittance(&object->object.constant_medium, ray, ray_interval);
+                if (transmittance <= 0)
+                {
+                    return 0;
+                }
+            }
+            else if (hittable_hit(object, ray, ray_interval, &temp_rec))
+            {
+                return 0;
+            }
+        }
+    }
+
+    return transmittance;
+}
@@ -1,10 +1,23 @@
 #include "rtweekend.h"
 
 #include "camera.h"
+#include "camera_manifest.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "material.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "scene.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "grid.h"
+#include "lazy_bvh.h"
+#include "bvh_cache.h"
+#include "animation.h"
+#include "environment.h"
+#include "scene_file.h"
 
 /// How many hittable objects there could possibly be in the world.
 /// If we write past the end of an array with this size, the OS throws an exception for us.
@@ -13,26 +26,260 @@
 /// Enable truly random results that vary from run to run.
 #define WANT_TRUE_RANDOM
 
-#ifdef WANT_TRUE_RANDOM
-#include <time.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
 #endif
 
-int main()
+/// The seed for everything random (set in main).
+static uint64_t seed = 0;
+
+/// The format images are written in (set in main).
+static enum Image_Format output_format = Ppm_Image;
+
+/// The environment map the outdoor scenes are lit by, if one was given with --env (set in main).
+static struct Environment_Map environment_map;
+static const struct Environment_Map *environment = NULL;
+
+/// How many children the BVH nodes have: 2 for the binary BVH (the default), or 4 or 8 for a wide BVH
+/// collapsed from it (set in main with --bvh-width, see wide_bvh.h).
+static int bvh_width = 2;
+
+/// Whether to find hits with a compressed BVH made from the BVH (set in main with --compressed-bvh,
+/// see compressed_bvh.h). This takes the place of bvh_width.
+static bool use_compressed_bvh = false;
+
+/// The directory to keep built BVHs in (set in main with --bvh-cache, see bvh_cache.h), or NULL to always build.
+static const char *bvh_cache_dir = NULL;
+
+/// How many paths to trace at a time, sorting the rays of each bounce (set in main with --ray-batch,
+/// see Camera_Config.ray_batch), or 0 to trace each path on its own.
+static int ray_batch = 0;
+
+/// How many pixels across the tiles are (0 for the default) and the order they are rendered in
+/// (set in main with --tile-size and --tile-order, see tile_order.h).
+static int tile_size = 0;
+static enum Tile_Order tile_order = Scanline_Tiles;
+
+/// When rendering in passes (set in main with --time-budget, --noise-target and --max-spp, see
+/// camera_render_progressive): how many seconds the render may take, how noisy the image may be,
+/// and the most samples per pixel to take (0 for each means no limit).
+static double time_budget = 0;
+static double noise_target = 0;
+static int max_samples_per_pixel = 0;
+
+/// Where to write the heatmaps of the render's cost (set in main with --heatmaps, see render_stats.h), or NULL.
+static const char *heatmap_prefix = NULL;
+
+/// The size to render the still scenes at (set in main with --size), or 0 for the scene's own size.
+static int image_width = 0;
+static int image_height = 0;
+
+/// The tiled image file to render the still scenes into (set in main with --tiled, see tiled_image.h), or NULL,
+/// and what to store its pixels as (--half for halfs).
+static const char *tiled_path = NULL;
+static enum Tiled_Format tiled_format = Tiled_Float;
+
+/// The cameras to render the still scenes with (set in main with --cameras, see camera_manifest.h), or NULL to
+/// render the scene's own camera to stdout.
+static const char *cameras_path = NULL;
+
+/// How the light arriving at a surface is found in every scene (set in main with --sampling, see Light_Sampling
+/// in scene.h).
+static enum Light_Sampling light_sampling = Sample_Lights_Mis;
+
+/// What finds the hits in the scenes with many objects (1 and 6), set in main with --accel.
+enum Accelerator
 {
+    Auto_Accelerator, //< A grid if the scene suits one (see grid_suits), otherwise a BVH
+    Bvh_Accelerator,
+    Grid_Accelerator,
+    Lazy_Accelerator, //< A lazy BVH (see lazy_bvh.h), for a quick first look at a huge scene
+    No_Accelerator, //< Test every object (world_hit)
+};
 
-#ifdef WANT_TRUE_RANDOM
-    // Seed the random number generator (which rand() uses) with the current time.
-    srand((unsigned int)time(NULL));
-#endif
+static enum Accelerator accelerator = Auto_Accelerator;
 
-    /*
-        We will render images (run build\theNextWeek.exe > image.ppm).
-        We use the ppm format of writing some numbers to a file to describe the image.
+/// @brief Everything a scene may find its hits with (see scene_accelerate).
+struct Accelerators
+{
+    struct BVH bvh;
+    struct Wide_BVH wide_bvh;
+    struct Compressed_BVH compressed_bvh;
+    struct Grid grid;
+    struct Lazy_BVH lazy_bvh;
+    struct BVH_Cache bvh_cache; //< The BVH, if it was loaded from a cache file (instead of built into bvh)
+};
 
-        You can use https://jumpshare.com/viewer/ppm to view the image (no download needed)
-        or this extension (PBM/PPM/PGM Viewer for Visual Studio Code -- what I am using).
-    */
+/// @brief Build what the scene finds its hits with (as chosen with --accel, --bvh-width and --compressed-bvh).
+/// Call accelerators_free once done with the scene.
+static void scene_accelerate(struct Scene *scene, struct Accelerators *accelerators)
+{
+    *accelerators = (struct Accelerators){0};
+
+    // Asking for a kind of BVH means a BVH.
+    enum Accelerator which = accelerator;
+    if (which == Auto_Accelerator && (bvh_width > 2 || use_compressed_bvh))
+    {
+        which = Bvh_Accelerator;
+    }
+
+    // A BVH saved for this scene is quicker to load than a grid is to build (and there is only one if a BVH was
+    // chosen for the scene before).
+    const struct BVH *bvh = NULL;
+    uint64_t scene_hash = 0;
+    char cache_path[4096];
+    if (bvh_cache_dir != NULL && (which == Auto_Accelerator || which == Bvh_Accelerator))
+    {
+        double start_time = seconds_now();
+        scene_hash = bvh_scene_hash(scene->world, scene->world_length, 0);
+        double hash_seconds = seconds_now() - start_time;
+        bvh_cache_path(cache_path, sizeof(cache_path), bvh_cache_dir, scene_hash);
+
+        const char *why;
+        if (bvh_cache_load(&accelerators->bvh_cache, cache_path, scene->world, scene->world_length, scene_hash,
+                           &why))
+        {
+            bvh = &accelerators->bvh_cache.bvh;
+            fprintf(stderr, "BVH loaded from %s in %.2f seconds (and %.2f seconds to hash the scene)\n", cache_path,
+                    bvh->build_seconds, hash_seconds);
+        }
+        else
+        {
+            fprintf(stderr, "No BVH to load from %s (%s)\n", cache_path, why);
+        }
+    }
+
+    if (bvh == NULL && (which == Auto_Accelerator || which == Grid_Accelerator))
+    {
+        struct Grid *grid = &accelerators->grid;
+        grid_build(grid, scene->world, scene->world_length);
+        bool suits = grid_suits(grid);
+        fprintf(stderr,
+                "Grid built in %.2f seconds (%lli cells, %.0f%% of objects in dense ones, %i objects outside them, "
+                "object sizes spread %.1fx): it %s the scene\n",
+                grid->build_seconds, grid->num_cells, 100 * grid->dense_fraction, grid->num_large,
+                grid->size_spread, suits ? "suits" : "does not suit");
+        if (suits || which == Grid_Accelerator)
+        {
+            scene->grid = grid;
+            return;
+        }
+        grid_free(grid);
+    }
+
+    if (which == No_Accelerator)
+    {
+        return;
+    }
+
+    if (which == Lazy_Accelerator)
+    {
+        struct Lazy_BVH *lazy_bvh = &accelerators->lazy_bvh;
+        lazy_bvh_build(lazy_bvh, scene->world, scene->world_length);
+        fprintf(stderr, "Top of the lazy BVH built in %.2f seconds (%i nodes)\n", lazy_bvh->build_seconds,
+                lazy_bvh_num_nodes(lazy_bvh));
+        scene->lazy_bvh = lazy_bvh;
+        return;
+    }
 
+    if (bvh == NULL)
+    {
+        if (!bvh_build(&accelerators->bvh, scene->world, scene->world_length))
+        {
+            fprintf(stderr, "Could not allocate the BVH!\n");
+            exit(EXIT_FAILURE);
+        }
+        bvh = &accelerators->bvh;
+        fprintf(stderr, "BVH built in %.2f seconds (%.2f million objects per second, SAH cost %.2f)\n",
+                bvh->build_seconds, scene->world_length / bvh->build_seconds / 1e6, bvh->built_cost);
+        if (bvh_cache_dir != NULL && bvh_cache_save(bvh, cache_path, scene_hash))
+        {
+            fprintf(stderr, "BVH saved to %s\n", cache_path);
+        }
+    }
+
+    scene->bvh = bvh;
+    if (use_compressed_bvh)
+    {
+        struct Compressed_BVH *compressed = &accelerators->compressed_bvh;
+        compressed_bvh_build(compressed, bvh);
+        scene->compressed_bvh = compressed;
+
+        // The compressed BVH has its own copy of the indices, so the binary BVH (which takes several times its
+        // memory) can go.
+        scene->bvh = NULL;
+        bvh_free(&accelerators->bvh);
+        bvh_cache_close(&accelerators->bvh_cache);
+        fprintf(stderr, "BVH compressed (%i nodes, %.1f MB, %.1f bytes per object)\n", compressed->num_nodes,
+                compressed_bvh_memory(compressed) / 1e6,
+                (double)compressed_bvh_memory(compressed) / ((scene->world_length > 0) ? scene->world_length : 1));
+    }
+    else if (bvh_width > 2)
+    {
+        wide_bvh_build(&accelerators->wide_bvh, bvh, bvh_width);
+        scene->wide_bvh = &accelerators->wide_bvh;
+    }
+}
+
+static void accelerators_free(struct Accelerators *accelerators)
+{
+    lazy_bvh_free(&accelerators->lazy_bvh);
+    grid_free(&accelerators->grid);
+    compressed_bvh_free(&accelerators->compressed_bvh);
+    wide_bvh_free(&accelerators->wide_bvh);
+    bvh_free(&accelerators->bvh);
+    bvh_cache_close(&accelerators->bvh_cache);
+}
+
+/// @brief Render the scene with its camera (to stdout, or into the tiled image given with --tiled), or with every
+/// camera of the manifest given with --cameras (each starting from the scene's camera), all with the same BVH or
+/// grid.
+static void render_scene(const struct Scene *scene, const struct Camera_Config *scene_cam)
+{
+    struct Scene sampled_scene = *scene;
+    sampled_scene.sampling = light_sampling;
+    scene = &sampled_scene;
+
+    struct Camera_Config cam = *scene_cam;
+    if (image_width > 0)
+    {
+        cam.image_width = image_width;
+        cam.image_height = image_height;
+    }
+
+    if (cameras_path == NULL && tiled_path != NULL)
+    {
+        if (!camera_render_tiled(scene, &cam, tiled_path, tiled_format))
+        {
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (cameras_path == NULL)
+    {
+        camera_render(scene, &cam);
+        return;
+    }
+
+    struct Camera_Manifest manifest;
+    if (!camera_manifest_load(&manifest, cameras_path, &cam))
+    {
+        exit(EXIT_FAILURE);
+    }
+    bool ok = camera_manifest_render(scene, &manifest);
+    camera_manifest_free(&manifest);
+    if (!ok)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/// @brief The final scene of book one, with the small spheres bouncing (moving upward during the shot).
+void bouncing_spheres()
+{
     // World
 
     // Materials
@@ -159,9 +406,846 @@ int main()
 
             .defocus_angle = 0.6,
             .focus_dist = 10.0,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
+        };
+
+    struct Scene scene;
+    if (!scene_init(&scene, world, actual_world_len))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene.environment = environment;
+
+    struct Accelerators accelerators;
+    scene_accelerate(&scene, &accelerators);
+
+    render_scene(&scene, &cam);
+
+    accelerators_free(&accelerators);
+    scene_free(&scene);
+}
+
+/// @brief A cloud whose density falls off from its center and is modulated by a wavy pattern.
+/// (Used as the density_fraction of a heterogeneous Constant_Medium.)
+static double cloud_density(const point3 p)
+{
+    const point3 cloud_center = {0, 1.2, 0};
+    vec3 offset;
+    double falloff = 1.0 - len(subtract(offset, (double *)p, (double *)cloud_center)) / 1.2;
+    double waves = 0.5 + 0.5 * sin(5 * p[0]) * sin(5 * p[1]) * sin(5 * p[2]);
+    return (falloff > 0) ? falloff * waves : 0;
+}
+
+/// @brief Volumes: a smoke box, a dark smoke sphere and a heterogeneous cloud, inside a thin mist
+/// (that the camera is also inside of).
+/// Compare its render time to bouncing_spheres to see the cost of participating media.
+void fog_volumes()
+{
+    // Materials
+
+    const struct Material_Cfg ground_material = {.mat = Lambertian, .albedo = {0.5, 0.5, 0.5}};
+    const struct Material_Cfg glass_material = {.mat = Dielectric, .refraction_index = 1.5};
+    const struct Material_Cfg white_smoke = {.mat = Isotropic, .albedo = {1, 1, 1}};
+    const struct Material_Cfg black_smoke = {.mat = Isotropic, .albedo = {0, 0, 0}};
+    const struct Material_Cfg cloud = {.mat = Isotropic, .albedo = {0.9, 0.8, 0.7}};
+
+    // Volume boundaries (these are not part of the world themselves).
+
+    const struct Hittable box_boundary =
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-3.5, 0, -1}, (point3){-2, 1.5, 1}, NULL)};
+
+    const struct Hittable sphere_boundary =
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {3, 0.8, 0}, .direction = {0}}, .radius = 0.8}};
+
+    const struct Hittable cloud_boundary =
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, 1.2, 0}, .direction = {0}}, .radius = 1.2}};
+
+    const struct Hittable mist_boundary =
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, 0, 0}, .direction = {0}}, .radius = 50}};
+
+    // World
+
+    struct Hittable world[] = {
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0.0, -1000.0, 0.0}, .direction = {0}},
+                           .radius = 1000.0,
+                           .mat_cfg = &ground_material}},
+
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {1.2, 0.4, 2.2}, .direction = {0}},
+                           .radius = 0.4,
+                           .mat_cfg = &glass_material}},
+
+        {.which = (enum Which_Hittable)Constant_Medium,
+         .object.constant_medium = {.boundary = &box_boundary, .density = 1.5, .phase_function = &white_smoke}},
+
+        {.which = (enum Which_Hittable)Constant_Medium,
+         .object.constant_medium = {.boundary = &sphere_boundary, .density = 2.0, .phase_function = &black_smoke}},
+
+        {.which = (enum Which_Hittable)Constant_Medium,
+         .object.constant_medium = {.boundary = &cloud_boundary,
+                                    .density = 6.0,
+                                    .density_fraction = cloud_density,
+                                    .phase_function = &cloud}},
+
+        {.which = (enum Which_Hittable)Constant_Medium,
+         .object.constant_medium = {.boundary = &mist_boundary, .density = 0.01, .phase_function = &white_smoke}},
+    };
+
+    struct Camera_Config cam =
+        {
+            .aspect_ratio = 16.0 / 9.0,
+            .image_width = 400,
+            .samples_per_pixel = 100,
+            .max_depth = 50,
+
+            .vfov = 30,
+            .lookfrom = {0, 2, 12},
+            .lookat = {0, 0.8, 0},
+            .vup = {0, 1, 0},
+
+            .defocus_angle = 0,
+            .focus_dist = 10.0,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
+        };
+
+    struct Scene scene;
+    if (!scene_init(&scene, world, sizeof(world) / sizeof(world[0])))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene.environment = environment;
+
+    render_scene(&scene, &cam);
+
+    scene_free(&scene);
+}
+
+/// @brief A closed room (open only toward the camera) lit by nothing but a small spherical light
+/// near the ceiling. Without explicitly sampling the light this needs thousands of samples per pixel.
+void small_light_room()
+{
+    // Materials
+
+    const struct Material_Cfg red = {.mat = Lambertian, .albedo = {0.65, 0.05, 0.05}};
+    const struct Material_Cfg white = {.mat = Lambertian, .albedo = {0.73, 0.73, 0.73}};
+    const struct Material_Cfg green = {.mat = Lambertian, .albedo = {0.12, 0.45, 0.15}};
+    const struct Material_Cfg mirror = {.mat = Metal, .albedo = {0.8, 0.85, 0.88}, .fuzz = 0.0};
+    const struct Material_Cfg glass = {.mat = Dielectric, .refraction_index = 1.5};
+    const struct Material_Cfg light = {.mat = Diffuse_Light, .emit = {60, 60, 60}};
+
+    // World (the walls are thin boxes)
+
+    struct Hittable world[] = {
+        // left, right, floor, ceiling and back walls
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-1.05, -1, -1}, (point3){-1, 1, 1}, &red)},
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){1, -1, -1}, (point3){1.05, 1, 1}, &green)},
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-1, -1.05, -1}, (point3){1, -1, 1}, &white)},
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-1, 1, -1}, (point3){1, 1.05, 1}, &white)},
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-1, -1, -1.05}, (point3){1, 1, -1}, &white)},
+
+        // contents
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-0.7, -1, -0.7}, (point3){-0.1, 0.2, -0.1}, &white)},
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0.45, -0.65, 0.2}, .direction = {0}},
+                           .radius = 0.35,
+                           .mat_cfg = &glass}},
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0.5, -0.8, -0.55}, .direction = {0}},
+                           .radius = 0.2,
+                           .mat_cfg = &mirror}},
+
+        // the light
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, 0.8, 0}, .direction = {0}},
+                           .radius = 0.08,
+                           .mat_cfg = &light}},
+    };
+
+    struct Camera_Config cam =
+        {
+            .aspect_ratio = 1.0,
+            .image_width = 300,
+            .samples_per_pixel = 64,
+            .max_depth = 50,
+
+            .vfov = 40,
+            .lookfrom = {0, 0, 3.8},
+            .lookat = {0, 0, 0},
+            .vup = {0, 1, 0},
+
+            .defocus_angle = 0,
+            .focus_dist = 10.0,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
+        };
+
+    struct Scene scene;
+    if (!scene_init(&scene, world, sizeof(world) / sizeof(world[0])))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The room is only lit by the light inside it.
+    scene.has_background = true;
+    memcpy(scene.background, (color3){0, 0, 0}, 3 * sizeof(double));
+
+    render_scene(&scene, &cam);
+
+    scene_free(&scene);
+}
+
+#define ORBITING_SPHERES 12
+
+/// @brief Sets up a frame of orbiting_spheres: the small spheres orbit the center
+/// (and bob up and down), while the camera turns around the whole scene (a turntable).
+static void orbiting_spheres_update(struct Hittable *world, int world_length, struct Camera_Config *cam,
+                                    int frame, void *user_data)
+{
+    (void)world_length;
+    (void)user_data;
+
+    double t = frame / 48.0; // One full turn every 48 frames.
+
+    for (int k = 0; k < ORBITING_SPHERES; k++)
+    {
+        double angle = 2 * pi * (t + (double)k / ORBITING_SPHERES);
+        double *center = world[2 + k].object.sphere.center.origin;
+        center[0] = 2.5 * cos(angle);
+        center[1] = 0.4 + 0.3 * fabs(sin(2 * pi * t * 3 + k));
+        center[2] = 2.5 * sin(angle);
+    }
+
+    double camera_angle = -2 * pi * t / 4; // The camera turns a quarter as fast.
+    cam->lookfrom[0] = 10 * sin(camera_angle);
+    cam->lookfrom[1] = 3;
+    cam->lookfrom[2] = 10 * cos(camera_angle);
+}
+
+/// @brief An animation (written to frame_XXXX.ppm files): small spheres orbiting a large glass sphere.
+void orbiting_spheres(int first_frame, int last_frame)
+{
+    // Materials
+
+    const struct Material_Cfg ground_material = {.mat = Lambertian, .albedo = {0.5, 0.5, 0.5}};
+    const struct Material_Cfg glass_material = {.mat = Dielectric, .refraction_index = 1.5};
+
+    struct Material_Cfg materials[ORBITING_SPHERES];
+
+    // World
+
+    struct Hittable world[2 + ORBITING_SPHERES] = {
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0.0, -1000.0, 0.0}, .direction = {0}},
+                           .radius = 1000.0,
+                           .mat_cfg = &ground_material}},
+
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, 1, 0}, .direction = {0}},
+                           .radius = 1.0,
+                           .mat_cfg = &glass_material}},
+    };
+
+    for (int k = 0; k < ORBITING_SPHERES; k++)
+    {
+        if (k % 3 == 0)
+        {
+            materials[k] = (struct Material_Cfg){.mat = Metal, .fuzz = random_in_range(0, 0.3)};
+            vec_rand_in_range(materials[k].albedo, 0.5, 1);
+        }
+        else
+        {
+            materials[k] = (struct Material_Cfg){.mat = Lambertian};
+            vec_rand_in_range(materials[k].albedo, 0.1, 0.9);
+        }
+
+        // The centers are set by orbiting_spheres_update.
+        world[2 + k] = (struct Hittable){.which = (enum Which_Hittable)Sphere,
+                                         .object.sphere = {.center.direction = {0},
+                                                           .radius = 0.4,
+                                                           .mat_cfg = &materials[k]}};
+    }
+
+    struct Camera_Config cam =
+        {
+            .aspect_ratio = 16.0 / 9.0,
+            .image_width = 400,
+            .samples_per_pixel = 32,
+            .max_depth = 50,
+
+            .vfov = 30,
+            .lookfrom = {0, 3, 10},
+            .lookat = {0, 0.5, 0},
+            .vup = {0, 1, 0},
+
+            .defocus_angle = 0,
+            .focus_dist = 10.0,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
+        };
+
+    struct Animation anim = {
+        .first_frame = first_frame,
+        .last_frame = last_frame,
+        .update = orbiting_spheres_update,
+        .output_pattern = (output_format == Pfm_Image)            ? "frame_%04d.pfm"
+                          : (output_format == Accumulation_Image) ? "frame_%04d.acc"
+                                                                  : "frame_%04d.ppm",
+    };
+
+    struct Scene scene_template;
+    if (!scene_init(&scene_template, world, sizeof(world) / sizeof(world[0])))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene_template.environment = environment;
+    scene_template.sampling = light_sampling;
+
+    animation_render(world, sizeof(world) / sizeof(world[0]), &scene_template, &cam, &anim);
+
+    scene_free(&scene_template);
+}
+
+/// @brief Make a latitude-longitude map of a clear sky with the sun high in it (see environment.h),
+/// for when no environment map is given with --env.
+static bool make_sunny_sky(struct Environment_Map *map)
+{
+    const int width = 1024, height = 512;
+    float *rgb = malloc((size_t)width * height * 3 * sizeof(float));
+    if (rgb == NULL)
+    {
+        return false;
+    }
+
+    // The sun is 1 degree across (so it covers about 0.002% of the sky), 40 degrees above the horizon.
+    vec3 sun_direction = {-0.6, sin(degrees_to_radians(40)), -0.4};
+    unit(sun_direction, sun_direction);
+    double sun_cos_radius = cos(degrees_to_radians(0.5));
+    const color3 sun = {4000, 3700, 3300};
+
+    for (int j = 0; j < height; j++)
+    {
+        double theta = pi * (j + 0.5) / height;
+        for (int i = 0; i < width; i++)
+        {
+            double phi = 2 * pi * (i + 0.5) / width;
+            vec3 direction = {-sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)};
+
+            // Deep blue overhead, paler toward the horizon, and a dull brown below it.
+            double up = direction[1];
+            color3 color = {0.3, 0.25, 0.2};
+            if (up > 0)
+            {
+                double a = sqrt(up);
+                color[0] = (1 - a) * 0.9 + a * 0.25;
+                color[1] = (1 - a) * 0.95 + a * 0.45;
+                color[2] = (1 - a) * 1.0 + a * 0.9;
+            }
+            if (dot(direction, sun_direction) > sun_cos_radius)
+            {
+                memcpy(color, sun, 3 * sizeof(double));
+            }
+
+            float *pixel = rgb + 3 * ((size_t)j * width + i);
+            pixel[0] = (float)color[0];
+            pixel[1] = (float)color[1];
+            pixel[2] = (float)color[2];
+        }
+    }
+
+    return environment_init(map, rgb, width, height, 1.0);
+}
+
+/// @brief A few spheres and a box outdoors, lit by the sky and a small, very bright sun
+/// (the environment map given with --env, or a made up sunny sky).
+/// Without sampling the environment map as a light, the sun is only found by chance and the image is full of
+/// fireflies; with it, this converges at a few samples per pixel.
+void sunny_day()
+{
+    // Materials
+
+    const struct Material_Cfg ground = {.mat = Lambertian, .albedo = {0.45, 0.42, 0.38}};
+    const struct Material_Cfg red = {.mat = Lambertian, .albedo = {0.7, 0.15, 0.1}};
+    const struct Material_Cfg white = {.mat = Lambertian, .albedo = {0.8, 0.8, 0.8}};
+    const struct Material_Cfg gold = {.mat = Metal, .albedo = {0.9, 0.7, 0.3}, .fuzz = 0.15};
+    const struct Material_Cfg glass = {.mat = Dielectric, .refraction_index = 1.5};
+
+    // World
+
+    struct Hittable world[] = {
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, -1000, 0}, .direction = {0}},
+                           .radius = 1000,
+                           .mat_cfg = &ground}},
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {0, 1, 0}, .direction = {0}},
+                           .radius = 1,
+                           .mat_cfg = &glass}},
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {-2.2, 1, -0.5}, .direction = {0}},
+                           .radius = 1,
+                           .mat_cfg = &red}},
+        {.which = (enum Which_Hittable)Sphere,
+         .object.sphere = {.center = (struct Ray){.origin = {2.2, 1, -0.5}, .direction = {0}},
+                           .radius = 1,
+                           .mat_cfg = &gold}},
+        {.which = (enum Which_Hittable)Box,
+         .object.box = make_box((point3){-0.6, 0, 1.4}, (point3){0.4, 0.7, 2.1}, &white)},
+    };
+
+    struct Camera_Config cam =
+        {
+            .aspect_ratio = 16.0 / 9.0,
+            .image_width = 400,
+            .samples_per_pixel = 16,
+            .max_depth = 50,
+
+            .vfov = 35,
+            .lookfrom = {1, 2.5, 9},
+            .lookat = {0, 0.8, 0},
+            .vup = {0, 1, 0},
+
+            .defocus_angle = 0,
+            .focus_dist = 10.0,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
+        };
+
+    struct Environment_Map sky;
+    const struct Environment_Map *map = environment;
+    if (map == NULL)
+    {
+        if (!make_sunny_sky(&sky))
+        {
+            fprintf(stderr, "Could not allocate the sky!\n");
+            exit(EXIT_FAILURE);
+        }
+        map = &sky;
+    }
+
+    struct Scene scene;
+    if (!scene_init(&scene, world, sizeof(world) / sizeof(world[0])))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene.environment = map;
+
+    render_scene(&scene, &cam);
+
+    scene_free(&scene);
+    if (map == &sky)
+    {
+        environment_free(&sky);
+    }
+}
+
+/// @brief A scene loaded from a scene file (see scene_file.h; make big ones with scene_gen).
+void scene_from_file(const char *path)
+{
+    double start_time = seconds_now();
+
+    struct Scene_File file;
+    if (!scene_file_load(&file, path, 0))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Loaded %i spheres in %.2f seconds\n", file.world_length, seconds_now() - start_time);
+
+    const struct Scene_File_Header *header = &file.header;
+    struct Camera_Config cam =
+        {
+            .aspect_ratio = 16.0 / 9.0,
+            .image_width = 400,
+            .samples_per_pixel = 32,
+            .max_depth = 50,
+
+            .vfov = header->vfov,
+            .lookfrom = {header->lookfrom[0], header->lookfrom[1], header->lookfrom[2]},
+            .lookat = {header->lookat[0], header->lookat[1], header->lookat[2]},
+            .vup = {0, 1, 0},
+
+            .defocus_angle = header->defocus_angle,
+            .focus_dist = header->focus_dist,
+
+            .seed = seed,
+            .output_format = output_format,
+            .ray_batch = ray_batch,
+            .tile_size = tile_size,
+            .tile_order = tile_order,
+            .time_budget = time_budget,
+            .noise_target = noise_target,
+            .max_samples_per_pixel = max_samples_per_pixel,
+            .heatmap_prefix = heatmap_prefix,
         };
 
-    camera_render(world, actual_world_len, &cam);
+    struct Scene scene;
+    if (!scene_init(&scene, file.world, file.world_length))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene.has_background = header->has_background != 0;
+    scene.background[0] = header->background[0];
+    scene.background[1] = header->background[1];
+    scene.background[2] = header->background[2];
+    scene.environment = environment;
+
+    struct Accelerators accelerators;
+    scene_accelerate(&scene, &accelerators);
+
+    render_scene(&scene, &cam);
+
+    accelerators_free(&accelerators);
+    scene_free(&scene);
+    scene_file_free(&file);
+}
+
+/*
+    Choose the scene to render by passing its number as the first argument
+    (run build\theNextWeek.exe 2 > image.ppm). The default is scene 1.
+
+    1. bouncing_spheres
+    2. fog_volumes
+    3. small_light_room
+    4. orbiting_spheres (an animation; pass the first and last frame as the next arguments,
+       like build\theNextWeek.exe 4 0 47, and it writes frame_0000.ppm ... frame_0047.ppm)
+    5. sunny_day
+    6. scene_from_file (pass the scene file as the next argument, like build\theNextWeek.exe 6 big.scene;
+       make one with build\scene_gen.exe, see scene_gen.c)
+
+    Pass --env sky.hdr (a latitude-longitude .hdr or .pfm image) to light the outdoor scenes (1, 2, 4 and 5)
+    with an environment map instead of the plain sky (see environment.h).
+
+    Pass --accel grid (or bvh, or none) to choose what finds the hits in the scenes with many objects (1 and 6):
+    a grid (see grid.h), a BVH (see bvh.h) or nothing (every ray tests every object). The default, --accel auto,
+    builds a grid and keeps it if the scene suits one (see grid_suits), and builds a BVH otherwise.
+    Pass --accel lazy for a BVH that is only built where the rays go (see lazy_bvh.h): the first pixels come
+    much sooner for a huge scene the camera only sees a small part of.
+
+    Pass --sampling mixture (or material) to find the light arriving at each surface by sampling a 50/50 mixture
+    of the lights and the material (or only the material, finding the lights by chance) instead of sampling both
+    and weighting them with multiple importance sampling (--sampling mis, the default), see Light_Sampling in
+    scene.h. They all converge to the same image, with different noise for the time they take
+    (build\image_check.exe compares them on a small light room, see small_light_mixture there).
+
+    Pass --bvh-width 4 (or 8) to find hits with a 4 (or 8) wide BVH rather than the binary one
+    in the scenes with a BVH, see wide_bvh.h. Or pass --compressed-bvh to use a compressed BVH
+    (4 children per 64 byte node, much smaller for scenes of millions of objects), see compressed_bvh.h.
+
+    Pass --bvh-cache dir to save the BVH of the scene to a file in the directory dir, and load it from there
+    (instead of building it again) next time the same scene is rendered, see bvh_cache.h.
+
+    Pass --ray-batch 4096 to trace the paths 4096 at a time, one bounce at a time, sorting the rays of each bounce
+    by where they start and which way they go before tracing them (see ray_sort.h). The rays scattered off diffuse
+    surfaces then walk the scene in a coherent order, which pays off in scenes too big for the cache
+    (but the noise is not the same as without it, as each sample gets its own random numbers).
+
+    Pass --tile-order hilbert (or morton, or center) to render the tiles along a space-filling curve, which keeps
+    the tiles rendered at about the same time close together, or from the centre of the image out, which shows
+    the subject first (see tile_order.h). The default is scanline (row by row). Pass --tile-size n to render
+    tiles of n x n pixels (the default is 16).
+
+    Pass --time-budget 60 to render for at most 60 seconds, and --noise-target 0.01 to render until the noise is
+    down to 1% (see progressive_noise), or both (it stops at whichever comes first). The image is then rendered in
+    passes, each with the same number of samples for every pixel, as many as fit (see camera_render_progressive),
+    instead of with the scene's samples per pixel. Pass --max-spp n to take no more than n samples per pixel.
+    (This is for the still images, not the animation.)
+
+    Pass --heatmaps cost to also write where the render spent its time, as images with a colour ramp:
+    cost_time.ppm (time per sample), cost_tests.ppm (objects tested per sample) and cost_rays.ppm (rays per
+    sample, the average path length), see render_stats.h. This needs a build with -DENABLE_RENDER_STATS=ON
+    (which makes rendering a little slower, so it is off by default).
+
+    Pass --size 1920x1080 to render the scene (any but the animation) at that size instead of its own.
+
+    Pass --tiled pano.tiles to render the scene into a tiled image file instead (see tiled_image.h): each tile is
+    written to the file as soon as it is done (and dropped from memory), so even a gigapixel image takes no more
+    memory than a small one. Pass --half too to store halfs instead of floats (half the size). Turn the file
+    into an image with build\tiled_convert.exe (see tiled_convert.c):
+
+        build\theNextWeek.exe 6 big.scene --size 65536x32768 --tiled pano.tiles --half
+        build\tiled_convert.exe pano.tiles pano.pfm
+
+    Pass --cameras shots.txt to render the scene (any but the animation) with each of the cameras listed in
+    shots.txt, writing each image to its own file, rather than with the scene's camera to stdout
+    (see camera_manifest.h for how to write the list). The scene and its BVH (or grid) are only made once,
+    and all the images are rendered by the same threads, one after the other without waiting in between.
+    (Rendering in passes and heatmaps are only for the scene's own camera.)
+
+    Pass --pfm (anywhere) to write linear float PFM images instead of ppm images
+    (run build\theNextWeek.exe 3 --pfm > image.pfm), which build\tonemap.exe can then
+    turn into a ppm or png image with any exposure and tonemapping curve, without rendering again.
+
+    Pass --accum to write an accumulation file instead (the sum and count of each pixel's samples),
+    which build\accumulate_merge.exe can merge with the accumulation files of other runs of the same scene
+    (say, on other machines) into one image with all their samples. Every run picks its own seed,
+    or pass --seed n to choose it.
+*/
+int main(int argc, char *argv[])
+{
+
+#ifdef WANT_TRUE_RANDOM
+    // Seed the random number generator differently for every run
+    // (even for runs started at the same time on different machines, so their images can be merged).
+    seed = random_run_seed();
+#endif
+
+    /*
+        We will render images (run build\theNextWeek.exe > image.ppm).
+        We use the ppm format of writing some numbers to a file to describe the image.
+
+        You can use https://jumpshare.com/viewer/ppm to view the image (no download needed)
+        or this extension (PBM/PPM/PGM Viewer for Visual Studio Code -- what I am using).
+    */
+
+    // Take out the flags, so the other arguments keep their positions.
+    int num_args = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--pfm") == 0)
+        {
+            output_format = Pfm_Image;
+        }
+        else if (strcmp(argv[i], "--accum") == 0)
+        {
+            output_format = Accumulation_Image;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--bvh-width") == 0 && i + 1 < argc)
+        {
+            bvh_width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--compressed-bvh") == 0)
+        {
+            use_compressed_bvh = true;
+        }
+        else if (strcmp(argv[i], "--bvh-cache") == 0 && i + 1 < argc)
+        {
+            bvh_cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ray-batch") == 0 && i + 1 < argc)
+        {
+            ray_batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc)
+        {
+            tile_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tile-order") == 0 && i + 1 < argc)
+        {
+            if (!tile_order_parse(argv[++i], &tile_order))
+            {
+                fprintf(stderr, "Unknown tile order %s (pass scanline, morton, hilbert or center)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc)
+        {
+            time_budget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--noise-target") == 0 && i + 1 < argc)
+        {
+            noise_target = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-spp") == 0 && i + 1 < argc)
+        {
+            max_samples_per_pixel = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--heatmaps") == 0 && i + 1 < argc)
+        {
+            heatmap_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%ix%i", &image_width, &image_height) != 2 || image_width <= 0 || image_height <= 0)
+            {
+                fprintf(stderr, "Bad size %s (pass it as widthxheight, like 1920x1080)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--tiled") == 0 && i + 1 < argc)
+        {
+            tiled_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--half") == 0)
+        {
+            tiled_format = Tiled_Half;
+        }
+        else if (strcmp(argv[i], "--cameras") == 0 && i + 1 < argc)
+        {
+            cameras_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "auto") == 0)
+            {
+                accelerator = Auto_Accelerator;
+            }
+            else if (strcmp(name, "bvh") == 0)
+            {
+                accelerator = Bvh_Accelerator;
+            }
+            else if (strcmp(name, "grid") == 0)
+            {
+                accelerator = Grid_Accelerator;
+            }
+            else if (strcmp(name, "lazy") == 0)
+            {
+                accelerator = Lazy_Accelerator;
+            }
+            else if (strcmp(name, "none") == 0)
+            {
+                accelerator = No_Accelerator;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown accelerator %s (pass auto, bvh, grid, lazy or none)\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--sampling") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "mis") == 0)
+            {
+                light_sampling = Sample_Lights_Mis;
+            }
+            else if (strcmp(name, "mixture") == 0)
+            {
+                light_sampling = Sample_Mixture;
+            }
+            else if (strcmp(name, "material") == 0)
+            {
+                light_sampling = Sample_Material_Only;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown sampling %s (pass mis, mixture or material)\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc)
+        {
+            if (!environment_load(&environment_map, argv[++i], 1.0))
+            {
+                return EXIT_FAILURE;
+            }
+            environment = &environment_map;
+        }
+        else
+        {
+            argv[++num_args] = argv[i];
+        }
+    }
+    argc = num_args + 1;
+
+#ifdef _WIN32
+    // The PFM format is binary, so stdout must not turn "\n" into "\r\n".
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    random_seed(seed);
+
+    int scene = (argc > 1) ? atoi(argv[1]) : 1;
+
+    switch (scene)
+    {
+    case 2:
+        fog_volumes();
+        break;
+
+    case 3:
+        small_light_room();
+        break;
+
+    case 4:
+        orbiting_spheres((argc > 2) ? atoi(argv[2]) : 0, (argc > 3) ? atoi(argv[3]) : 47);
+        break;
+
+    case 5:
+        sunny_day();
+        break;
+
+    case 6:
+        if (argc < 3)
+        {
+            fprintf(stderr, "Pass the scene file to render (build\\theNextWeek.exe 6 big.scene)\n");
+            return EXIT_FAILURE;
+        }
+        scene_from_file(argv[2]);
+        break;
+
+    default:
+        bouncing_spheres();
+        break;
+    }
+
+    if (environment != NULL)
+    {
+        environment_free(&environment_map);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
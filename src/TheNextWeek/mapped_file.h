@@ -0,0 +1,239 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+
+Memory mapping a file lets us read it as if it were an array in memory, without reading it all in first:
+the operating system loads the pages we touch (and can drop them again whenever it needs the memory),
+so even a file much bigger than memory can be read through a constant amount of it.
+
+The same goes for writing: a file created with create_mapped_file can be written as an array, and the pages we
+are done with (see mapped_file_write_back) are written out to the file and dropped from memory.
+
+*/
+
+/// @brief A file mapped (read only, or to write with create_mapped_file) into memory.
+struct Mapped_File
+{
+    const unsigned char *data;
+    unsigned char *writable; //< The same as data for a file made with create_mapped_file (otherwise NULL)
+    size_t size;
+
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+/// @brief Map the whole file at path into memory (read only). Call unmap_file once you are done with it.
+/// @return false if the file could not be opened or mapped (or is empty).
+static inline bool map_file(struct Mapped_File *mapped, const char *path)
+{
+    memset(mapped, 0, sizeof(*mapped));
+
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(mapped->file);
+        return false;
+    }
+    mapped->size = (size_t)size.QuadPart;
+
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapped->mapping == NULL)
+    {
+        CloseHandle(mapped->file);
+        return false;
+    }
+
+    mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (mapped->data == NULL)
+    {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return false;
+    }
+#else
+    mapped->fd = open(path, O_RDONLY);
+    if (mapped->fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(mapped->fd, &info) != 0 || info.st_size == 0)
+    {
+        close(mapped->fd);
+        return false;
+    }
+    mapped->size = (size_t)info.st_size;
+
+    void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, mapped->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(mapped->fd);
+        return false;
+    }
+    mapped->data = data;
+
+    // We read the file from start to end, so the OS can read ahead (and drop pages behind us).
+    madvise(data, mapped->size, MADV_SEQUENTIAL);
+#endif
+
+    return true;
+}
+
+/// @brief Create the file at path (or overwrite it) with size bytes, all 0, and map it into memory to write
+/// (through mapped->writable). Call unmap_file once you are done with it.
+/// @return false if the file could not be created or mapped (or size is 0).
+static inline bool create_mapped_file(struct Mapped_File *mapped, const char *path, size_t size)
+{
+    memset(mapped, 0, sizeof(*mapped));
+    if (size == 0)
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // Mapping more than the file has makes the file that big.
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+                                         (DWORD)size, NULL);
+    if (mapped->mapping == NULL)
+    {
+        CloseHandle(mapped->file);
+        return false;
+    }
+
+    mapped->writable = MapViewOfFile(mapped->mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (mapped->writable == NULL)
+    {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return false;
+    }
+#else
+    mapped->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (mapped->fd < 0)
+    {
+        return false;
+    }
+
+    // Take the disk space now: running out of it later, while writing through the map, would crash us (with
+    // SIGBUS) rather than fail a write we could report.
+    if (posix_fallocate(mapped->fd, 0, (off_t)size) != 0)
+    {
+        close(mapped->fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapped->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(mapped->fd);
+        return false;
+    }
+    mapped->writable = data;
+#endif
+
+    mapped->data = mapped->writable;
+    mapped->size = size;
+    return true;
+}
+
+/// @brief The size of a page of memory (what the OS maps files in, and what mapped_file_write_back takes).
+static inline size_t mapped_file_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (size_t)info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/// @brief Tell the OS we are done writing [offset, offset + length) of a file made with create_mapped_file
+/// (offset and length a multiple of mapped_file_page_size), so it can write those pages out to the file whenever
+/// it likes and drop them from our memory (they are read back from the file if we touch them again).
+static inline void mapped_file_write_back(const struct Mapped_File *mapped, size_t offset, size_t length)
+{
+#ifdef _WIN32
+    // Start writing the pages out, then take them out of our working set (unlocking pages that are not locked
+    // does that, and fails with ERROR_NOT_LOCKED, which is what we expect).
+    FlushViewOfFile(mapped->writable + offset, length);
+    VirtualUnlock(mapped->writable + offset, length);
+#else
+    madvise(mapped->writable + offset, length, MADV_DONTNEED);
+#endif
+}
+
+/// @brief Tell the OS we are done with the bytes of the file before offset + length (when reading it from
+/// start to end), so it can drop them from memory (they are read back from the file if we touch them again).
+/// @remark The OS maps the pages around the one we touch along with it, so pages we already released can be
+/// mapped again a little later. That's why we release a bit more than [offset, offset + length) every time.
+static inline void mapped_file_release(const struct Mapped_File *mapped, size_t offset, size_t length)
+{
+#ifdef _WIN32
+    (void)mapped;
+    (void)offset;
+    (void)length;
+#else
+    const size_t lookbehind = 4 << 20;
+
+    // madvise needs a page aligned start.
+    size_t page = mapped_file_page_size();
+    size_t start = (offset > lookbehind) ? offset - lookbehind : 0;
+    start = (start / page) * page;
+
+    size_t end = offset + length;
+    if (end > mapped->size)
+    {
+        end = mapped->size;
+    }
+    if (end > start)
+    {
+        madvise((void *)(mapped->data + start), end - start, MADV_DONTNEED);
+    }
+#endif
+}
+
+static inline void unmap_file(struct Mapped_File *mapped)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap((void *)mapped->data, mapped->size);
+    close(mapped->fd);
+#endif
+    mapped->data = NULL;
+    mapped->writable = NULL;
+    mapped->size = 0;
+}
@@ -2,6 +2,8 @@
 
 #include "vec3.h"
 #include "hittable.h"
+#include "onb.h"
+#include "vec4.h"
 
 /*
 
@@ -13,11 +15,25 @@ can also vary with incident viewing direction (the direction of the incoming ray
 
 */
 
+/*
+
+Each scatter function also reports the probability density (pdf, over solid angle) of the direction it sampled.
+With it (and the *_eval functions, which give the material's BSDF times cos(theta) for any direction)
+we can combine a material's own sampling with other strategies (like sampling toward the lights; see pdf.h).
+The attenuation a scatter function returns is always BSDF * cos(theta) / pdf for the direction it sampled.
+
+Metal and dielectric materials scatter (almost) all their light into a single direction,
+so their density is not a useful quantity; for them the pdf is set to 0, which means "specular".
+
+*/
+
 enum Material
 {
     Lambertian,
     Metal,
     Dielectric,
+    Isotropic, //< The phase function of a participating medium (see constant_medium.h).
+    Diffuse_Light,
 };
 
 struct Material_Cfg
@@ -29,6 +45,7 @@ struct Material_Cfg
     /// representing the fraction of sunlight (or other radiation) that is reflected,
     /// ranging from 0 (no reflection, black) to 1 (total reflection, white).
     /// Note that this is done across RGB (color3) as opposed to the x-y-z axes.
+    /// (For Isotropic this is the color of the medium.)
     color3 albedo;
     double fuzz; //< Controls how fuzzy the reflection is (only for Metal).
 
@@ -36,65 +53,92 @@ struct Material_Cfg
     /// Refractive index in vacuum or air, or the ratio of the material's refractive index over
     /// the refractive index of the enclosing media
     double refraction_index;
+
+    /// (For Diffuse_Light)
+    /// The emitted radiance. Note this can be (and for small lights usually is) greater than 1.
+    color3 emit;
 };
 
 /// @brief Lambertian (diffuse) material reflectance
 /// @param r_in Incoming ray
 /// @param attenuation The intensity of light lost
 /// @param scattered The outbound ray from hitting this material
+/// @param pdf The probability density of the scattered direction
 /// @return
-bool lambertian_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
-                        color3 attenuation, struct Ray *scattered)
+static inline bool lambertian_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
+                                      color3 attenuation, struct Ray *scattered, double *pdf)
 {
+    // Find scatter direction (cosine weighted around the normal)
+    vec4 normal = v4_load(rec->normal);
+    struct ONB onb;
+    onb_build_v4(&onb, normal);
 
-    // Unused
-    (void)r_in;
-
-    // Find scatter direction
-    random_unit_vector(scattered->direction);
-    add(scattered->direction, (double *)rec->normal, scattered->direction);
-
-    // Catch degenerate scatter direction (if the random vector is almost exactly the opposite of the normal)
-    if (near_zero(scattered->direction))
-    {
-        memcpy(scattered->direction, rec->normal, 3 * sizeof(double));
-    }
+    vec3 local;
+    random_cosine_direction(local);
+    vec4 direction = onb_local(&onb, v4_load(local));
 
+    v4_store(scattered->direction, direction);
     memcpy(scattered->origin, rec->p, 3 * sizeof(double));
     scattered->tm = r_in->tm;
 
+    // The BRDF is albedo / pi, so BRDF * cos(theta) / pdf is just the albedo.
+    *pdf = v4_dot(normal, direction) / pi;
     memcpy(attenuation, rec->mat_cfg->albedo, 3 * sizeof(double));
-    return true;
+
+    // Catch degenerate scatter direction (almost exactly along the surface)
+    return *pdf > 0;
+}
+
+/// @brief The probability density (over solid angle) that lambertian_scatter generates direction.
+/// @remark This is a cosine weighted distribution (cos(theta) / pi).
+static inline double lambertian_pdf(const struct Hit_Record *rec, const vec3 direction)
+{
+    vec4 dir = v4_load(direction);
+    double cosine = v4_dot(v4_load(rec->normal), dir) / v4_len(dir);
+    return (cosine > 0) ? cosine / pi : 0;
+}
+
+/// @brief Evaluate the Lambertian BRDF times cos(theta) for scattering into direction.
+/// @return The probability density of lambertian_scatter generating direction.
+static inline double lambertian_eval(const struct Hit_Record *rec, const vec3 direction, color3 f_cos)
+{
+    double pdf = lambertian_pdf(rec, direction);
+
+    // albedo / pi * cos(theta) and cos(theta) / pi is the pdf.
+    scale(f_cos, rec->mat_cfg->albedo, pdf);
+    return pdf;
 }
 
 /// @brief Metal material reflectance
 /// @param r_in Incoming ray
 /// @param attenuation The intensity of light lost
 /// @param scattered The outbound ray from hitting this material
+/// @param pdf Always 0 (specular)
 /// @return
-bool metal_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
-                   color3 attenuation, struct Ray *scattered)
+static inline bool metal_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
+                                 color3 attenuation, struct Ray *scattered, double *pdf)
 {
-    vec3 reflected;
-    reflect(reflected, (double *)r_in->direction, rec->normal);
+    *pdf = 0;
+
+    vec4 normal = v4_load(rec->normal);
+    vec4 reflected = v4_reflect(v4_load(r_in->direction), normal);
 
     // In order for the fuzz sphere to make sense,
     // it needs to be consistently scaled compared to the reflection vector,
     // we thus normalize the reflected ray.
-    vec3 fuzz_applied;
-    random_unit_vector(fuzz_applied);
-    add(reflected, unit(reflected, reflected),
-        scale(fuzz_applied, fuzz_applied, rec->mat_cfg->fuzz));
+    vec3 fuzz;
+    random_unit_vector(fuzz);
+    reflected = v4_add_scaled(v4_unit(reflected), v4_load(fuzz), rec->mat_cfg->fuzz);
 
     memcpy(scattered->origin, rec->p, 3 * sizeof(double));
-    memcpy(scattered->direction, reflected, 3 * sizeof(double));
+    v4_store(scattered->direction, reflected);
     scattered->tm = r_in->tm;
 
     memcpy(attenuation, rec->mat_cfg->albedo, 3 * sizeof(double));
 
     // Return true only if we scatter above the surface (adding fuzz may mean we scatter below it).
     // If we scatter below, we simply will absorb the incoming ray.
-    return (dot(scattered->direction, rec->normal) > 0);
+    return (v4_dot(reflected, normal) > 0);
 }
 
 /// @brief Use Schlick's approximation for reflectance.
@@ -120,9 +164,12 @@ static double reflectance(double cosine, double refraction_index)
 /// @param r_in Incoming ray
 /// @param attenuation The intensity of light lost
 /// @param scattered The outbound ray from hitting this material
-bool dielectric_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
-                        color3 attenuation, struct Ray *scattered)
+/// @param pdf Always 0 (specular)
+static inline bool dielectric_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
+                                      color3 attenuation, struct Ray *scattered, double *pdf)
 {
+    *pdf = 0;
+
     // Set to white
     attenuation[0] = 1.0;
     attenuation[1] = 1.0;
@@ -130,26 +177,122 @@ bool dielectric_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
 
     double ri = rec->front_face ? (1.0 / rec->mat_cfg->refraction_index) : rec->mat_cfg->refraction_index;
 
-    vec3 unit_direction;
-    unit(unit_direction, (double *)r_in->direction);
+    vec4 unit_direction = v4_unit(v4_load(r_in->direction));
+    vec4 normal = v4_load(rec->normal);
 
-    vec3 temp;
-    double cos_theta = fmin(dot(negate(temp, unit_direction), rec->normal), 1.0);
+    double cos_theta = fmin(-v4_dot(unit_direction, normal), 1.0);
     double sin_theta = sqrt(1.0 - (cos_theta * cos_theta));
 
     bool cannot_refract = ri * sin_theta > 1.0;
 
     if (cannot_refract || reflectance(cos_theta, ri) > random_zero_to_one())
     {
-        reflect(scattered->direction, unit_direction, rec->normal);
+        v4_store(scattered->direction, v4_reflect(unit_direction, normal));
     }
     else
     {
-        refract(scattered->direction, unit_direction, rec->normal, ri);
+        v4_store(scattered->direction, v4_refract(unit_direction, normal, ri));
     }
 
     memcpy(scattered->origin, rec->p, 3 * sizeof(double));
     scattered->tm = r_in->tm;
 
     return true;
-}
\ No newline at end of file
+}
+
+/// @brief Isotropic phase function: a ray that scatters inside a medium leaves in a uniformly random direction.
+/// @param r_in Incoming ray
+/// @param attenuation The intensity of light lost
+/// @param scattered The outbound ray from scattering inside the medium
+/// @param pdf The probability density of the scattered direction (uniform over the unit sphere)
+static inline bool isotropic_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
+                                     color3 attenuation, struct Ray *scattered, double *pdf)
+{
+    random_unit_vector(scattered->direction);
+
+    memcpy(scattered->origin, rec->p, 3 * sizeof(double));
+    scattered->tm = r_in->tm;
+
+    // The phase function is albedo / (4 * pi) and so is the pdf.
+    *pdf = 1 / (4 * pi);
+    memcpy(attenuation, rec->mat_cfg->albedo, 3 * sizeof(double));
+    return true;
+}
+
+/// @brief Evaluate the isotropic phase function for scattering into direction.
+/// @return The probability density of isotropic_scatter generating direction.
+static inline double isotropic_eval(const struct Hit_Record *rec, const vec3 direction, color3 f_cos)
+{
+    (void)direction; // Every direction is equally likely.
+
+    scale(f_cos, rec->mat_cfg->albedo, 1 / (4 * pi));
+    return 1 / (4 * pi);
+}
+
+/// @brief Scatter the incoming ray off whatever material was hit.
+/// @param pdf The probability density of the scattered direction (0 for specular materials).
+/// @return false if the ray was absorbed (or the material does not scatter at all, like Diffuse_Light).
+static inline bool material_scatter(const struct Ray *r_in, const struct Hit_Record *rec,
+                                    color3 attenuation, struct Ray *scattered, double *pdf)
+{
+    switch (rec->mat_cfg->mat)
+    {
+    case (enum Material)Lambertian:
+        return lambertian_scatter(r_in, rec, attenuation, scattered, pdf);
+
+    case (enum Material)Metal:
+        return metal_scatter(r_in, rec, attenuation, scattered, pdf);
+
+    case (enum Material)Dielectric:
+        return dielectric_scatter(r_in, rec, attenuation, scattered, pdf);
+
+    case (enum Material)Isotropic:
+        return isotropic_scatter(r_in, rec, attenuation, scattered, pdf);
+
+    case (enum Material)Diffuse_Light:
+        // Lights don't scatter, they only emit.
+        return false;
+
+    default:
+        fprintf(stderr, "Could not identify Material of object hit!\n");
+        fflush(stderr);
+        return false;
+    }
+}
+
+/// @brief Evaluate the material's BSDF times cos(theta) for scattering into direction (f_cos).
+/// @return The probability density that material_scatter generates direction.
+/// Specular materials (and lights) always return 0 (and set f_cos to black), since a random direction
+/// has no chance of being their exact scattering direction.
+static inline double material_eval(const struct Hit_Record *rec, const vec3 direction, color3 f_cos)
+{
+    switch (rec->mat_cfg->mat)
+    {
+    case (enum Material)Lambertian:
+        return lambertian_eval(rec, direction, f_cos);
+
+    case (enum Material)Isotropic:
+        return isotropic_eval(rec, direction, f_cos);
+
+    default:
+        f_cos[0] = 0;
+        f_cos[1] = 0;
+        f_cos[2] = 0;
+        return 0;
+    }
+}
+
+/// @brief Light emitted by a Diffuse_Light (and black for anything else).
+/// @remark A Diffuse_Light only emits from its front face (for a sphere this is its outside).
+static inline void material_emitted(const struct Hit_Record *rec, color3 emitted)
+{
+    if (rec->mat_cfg->mat == Diffuse_Light && rec->front_face)
+    {
+        memcpy(emitted, rec->mat_cfg->emit, 3 * sizeof(double));
+        return;
+    }
+
+    emitted[0] = 0;
+    emitted[1] = 0;
+    emitted[2] = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "vec3.h"
+#include "vec4.h"
+
+/*
+
+An orthonormal basis (ONB) is a collection of three mutually orthogonal unit vectors.
+It is convenient to generate random directions relative to the z axis (in "local" coordinates),
+and then transform them to be relative to some other direction (like a surface normal) using an ONB
+where w is that direction.
+
+*/
+
+/// @remark This holds vec4 values (see vec4.h), so it must not be malloc'd.
+struct ONB
+{
+    vec4 u, v, w;
+};
+
+/// @brief Build an orthonormal basis whose w axis points in the direction n.
+/// @remark n does not need to be a unit vector (but must not be a zero vector).
+static inline void onb_build_v4(struct ONB *onb, vec4 n)
+{
+    onb->w = v4_unit(n);
+
+    // Pick any vector that is not parallel to w to start the cross products from.
+    vec4 a = (fabs(onb->w.e[0]) > 0.9) ? v4_make(0, 1, 0) : v4_make(1, 0, 0);
+
+    onb->v = v4_unit(v4_cross(onb->w, a));
+    onb->u = v4_cross(onb->w, onb->v);
+}
+
+/// @brief Build an orthonormal basis whose w axis points in the direction n.
+static inline void onb_build(struct ONB *onb, const vec3 n)
+{
+    onb_build_v4(onb, v4_load(n));
+}
+
+/// @brief Returns the vector given in the basis coordinates (a.x * u + a.y * v + a.z * w).
+static inline vec4 onb_local(const struct ONB *onb, vec4 a)
+{
+    vec4 ret = v4_scale(onb->u, a.e[0]);
+    ret = v4_add_scaled(ret, onb->v, a.e[1]);
+    return v4_add_scaled(ret, onb->w, a.e[2]);
+}
+
+/// @brief Transform a vector given in the basis coordinates (a[0] * u + a[1] * v + a[2] * w).
+/// @remark Note that ret can potentially be equal to a (this would mean we modify a in place).
+static inline double *onb_transform(vec3 ret, const struct ONB *onb, const vec3 a)
+{
+    return v4_store(ret, onb_local(onb, v4_load(a)));
+}
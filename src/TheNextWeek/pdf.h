@@ -0,0 +1,143 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "onb.h"
+#include "scene.h"
+
+/*
+
+A probability density function (pdf) over directions lets us sample directions however we like,
+as long as we weight each sample by BSDF * cos(theta) / pdf(direction) (this is importance sampling).
+The closer the pdf is to the shape of the light arriving, the less noise.
+
+We can also mix strategies: pick one of two pdfs at random (with probability weight and 1 - weight),
+and sample from it. The density of the mixture is then the weighted sum of the two densities,
+so it is never 0 where either of them is not 0.
+For example, a mixture of sampling toward the lights and cosine sampling the surface gets us the best of both:
+small lights are found much more often, while the rest of the hemisphere is still sampled.
+
+*/
+
+enum Which_Pdf
+{
+    Uniform_Sphere_Pdf, //< Uniform over all directions (isotropic media).
+    Cosine_Pdf,         //< Cosine weighted around an axis (Lambertian surfaces).
+    Lights_Pdf,         //< Toward the lights of a scene (see scene_sample_light).
+    Mixture_Pdf,        //< Either of two pdfs.
+};
+
+struct Pdf
+{
+    enum Which_Pdf which;
+
+    struct ONB onb; //< (For Cosine_Pdf) w is the axis we sample around.
+
+    const struct Scene *scene; //< (For Lights_Pdf) whose lights we sample
+    point3 origin;             //< (For Lights_Pdf) where we sample the lights from
+    double time;               //< (For Lights_Pdf) the time of the ray (lights can move)
+
+    const struct Pdf *a; //< (For Mixture_Pdf)
+    const struct Pdf *b; //< (For Mixture_Pdf)
+    double weight_a;     //< (For Mixture_Pdf) the probability of sampling from a
+};
+
+/// @brief Make a pdf that samples directions cosine weighted around the axis n.
+static inline struct Pdf make_cosine_pdf(const vec3 n)
+{
+    struct Pdf pdf = {.which = Cosine_Pdf};
+    onb_build(&pdf.onb, n);
+    return pdf;
+}
+
+/// @brief Make a pdf that samples directions toward the lights of the scene, from origin.
+static inline struct Pdf make_lights_pdf(const struct Scene *scene, const point3 origin, double time)
+{
+    struct Pdf pdf = {.which = Lights_Pdf, .scene = scene, .time = time};
+    memcpy(pdf.origin, origin, 3 * sizeof(double));
+    return pdf;
+}
+
+/// @brief Make a pdf that samples from a with probability weight_a and from b otherwise.
+/// @remark The mixture only keeps pointers to a and b, so they must outlive it.
+static inline struct Pdf make_mixture_pdf(const struct Pdf *a, const struct Pdf *b, double weight_a)
+{
+    return (struct Pdf){.which = Mixture_Pdf, .a = a, .b = b, .weight_a = weight_a};
+}
+
+/// @brief Make the pdf a material samples its scattered direction from (see material_scatter).
+/// @return false for specular materials (and lights), whose scattering has no useful density.
+static inline bool material_pdf(struct Pdf *pdf, const struct Hit_Record *rec)
+{
+    switch (rec->mat_cfg->mat)
+    {
+    case (enum Material)Lambertian:
+        *pdf = make_cosine_pdf(rec->normal);
+        return true;
+
+    case (enum Material)Isotropic:
+        *pdf = (struct Pdf){.which = Uniform_Sphere_Pdf};
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/// @brief The probability density that pdf_generate returns direction.
+static inline double pdf_value(const struct Pdf *pdf, const vec3 direction)
+{
+    switch (pdf->which)
+    {
+    case Uniform_Sphere_Pdf:
+        return 1 / (4 * pi);
+
+    case Cosine_Pdf:
+    {
+        double cosine = v4_dot(pdf->onb.w, v4_load(direction)) / len(direction);
+        return (cosine > 0) ? cosine / pi : 0;
+    }
+
+    case Lights_Pdf:
+        return scene_light_pdf(pdf->scene, pdf->origin, direction, pdf->time);
+
+    case Mixture_Pdf:
+        return pdf->weight_a * pdf_value(pdf->a, direction) +
+               (1 - pdf->weight_a) * pdf_value(pdf->b, direction);
+
+    default:
+        return 0;
+    }
+}
+
+/// @brief Sample a direction from the pdf.
+/// @return false if no direction could be sampled (e.g. there are no lights to sample toward).
+static inline bool pdf_generate(const struct Pdf *pdf, vec3 direction)
+{
+    switch (pdf->which)
+    {
+    case Uniform_Sphere_Pdf:
+        random_unit_vector(direction);
+        return true;
+
+    case Cosine_Pdf:
+        random_cosine_direction(direction);
+        onb_transform(direction, &pdf->onb, direction);
+        return true;
+
+    case Lights_Pdf:
+    {
+        const struct Sphere *light;
+        return scene_sample_light(pdf->scene, pdf->origin, pdf->time, direction, &light);
+    }
+
+    case Mixture_Pdf:
+        if (random_zero_to_one() < pdf->weight_a)
+        {
+            return pdf_generate(pdf->a, direction);
+        }
+        return pdf_generate(pdf->b, direction);
+
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+
+Hardware performance counters (cache references, cache misses and instructions), for the benchmarks.
+
+They are counted for this thread and every thread it starts while counting (so for all the render threads),
+with the Linux perf_event_open system call. Elsewhere, or when the kernel does not let us (see
+/proc/sys/kernel/perf_event_paranoid) or the CPU has no counters to give (as in many virtual machines),
+the counters are not available and the benchmarks only report times.
+
+*/
+
+/// @brief The counters we count.
+enum Perf_Counter
+{
+    Perf_Cache_References, //< Accesses to the last level cache
+    Perf_Cache_Misses,     //< Accesses to the last level cache that went to memory
+    Perf_Instructions,
+    Perf_Num_Counters,
+};
+
+struct Perf_Counters
+{
+    int fds[Perf_Num_Counters]; //< -1 for the counters that are not available
+};
+
+/// @brief Start counting (in this thread, and the threads it starts from now on).
+/// @return false if none of the counters are available.
+static inline bool perf_counters_start(struct Perf_Counters *counters)
+{
+    bool any = false;
+    for (int c = 0; c < Perf_Num_Counters; c++)
+    {
+        counters->fds[c] = -1;
+#ifdef __linux__
+        static const uint64_t configs[Perf_Num_Counters] = {
+            PERF_COUNT_HW_CACHE_REFERENCES,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+        };
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(struct perf_event_attr),
+            .config = configs[c],
+            .disabled = 1,
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        counters->fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[c] >= 0)
+        {
+            ioctl(counters->fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+            any = true;
+        }
+#endif
+    }
+    return any;
+}
+
+/// @brief Stop counting (once the threads started since perf_counters_start have ended, so their counts are in).
+/// @param values Set to the counts, or to -1 for the counters that are not available.
+static inline void perf_counters_stop(struct Perf_Counters *counters, int64_t values[Perf_Num_Counters])
+{
+    for (int c = 0; c < Perf_Num_Counters; c++)
+    {
+        values[c] = -1;
+#ifdef __linux__
+        if (counters->fds[c] < 0)
+        {
+            continue;
+        }
+        ioctl(counters->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(counters->fds[c], &value, sizeof(value)) == sizeof(value))
+        {
+            values[c] = (int64_t)value;
+        }
+        close(counters->fds[c]);
+        counters->fds[c] = -1;
+#endif
+    }
+}
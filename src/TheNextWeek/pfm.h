@@ -0,0 +1,120 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+A ppm file stores each color as a gamma corrected byte, clamped to [0,1].
+That throws away everything brighter than white (and most of the precision in the dark parts),
+so changing the exposure or the tonemapping of an image means rendering it again.
+
+Instead we can save the linear radiance itself, as a PFM (Portable Float Map) file:
+a short text header ("PF", the width and height, and a scale whose sign gives the byte order;
+negative means little endian), followed by 3 floats per pixel. Rows go from the *bottom* of the image up.
+Any tonemapping can then be applied later (see tonemap.c), in milliseconds instead of a new render.
+
+*/
+
+/// @brief Whether this machine stores floats little endian (the byte order we write PFM files in).
+static inline bool pfm_little_endian()
+{
+    const uint32_t one = 1;
+    unsigned char first_byte;
+    memcpy(&first_byte, &one, 1);
+    return first_byte == 1;
+}
+
+/// @brief Reverse the byte order of each of the count floats.
+static inline void pfm_swap_bytes(float *values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t bits;
+        memcpy(&bits, &values[i], 4);
+        bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+        memcpy(&values[i], &bits, 4);
+    }
+}
+
+/// @brief Write the image (linear colors, row by row from the top) as a PFM file.
+/// @remark out must be opened in binary mode.
+/// @return false if the image could not be written.
+static inline bool write_pfm(FILE *out, const color3 *pixels, int image_width, int image_height)
+{
+    float *row = malloc((size_t)image_width * 3 * sizeof(float));
+    if (row == NULL)
+    {
+        return false;
+    }
+
+    bool ok = fprintf(out, "PF\n%i %i\n-1.0\n", image_width, image_height) > 0;
+
+    // PFM rows go from the bottom up.
+    for (int j = image_height - 1; ok && j >= 0; j--)
+    {
+        for (int i = 0; i < image_width; i++)
+        {
+            const double *color = pixels[(size_t)j * image_width + i];
+            row[3 * i + 0] = (float)color[0];
+            row[3 * i + 1] = (float)color[1];
+            row[3 * i + 2] = (float)color[2];
+        }
+
+        if (!pfm_little_endian())
+        {
+            pfm_swap_bytes(row, (size_t)image_width * 3);
+        }
+
+        ok = fwrite(row, sizeof(float), (size_t)image_width * 3, out) == (size_t)image_width * 3;
+    }
+
+    free(row);
+    return ok;
+}
+
+/// @brief Read a (color) PFM file.
+/// @param rgb Set to the image (3 floats per pixel, row by row from the *top*). free it once done.
+/// @return false if the file is not a color PFM file (or could not be read).
+static inline bool read_pfm(FILE *in, float **rgb, int *image_width, int *image_height)
+{
+    char magic[3] = {0};
+    double scale;
+
+    if (fscanf(in, "%2s %i %i %lf", magic, image_width, image_height, &scale) != 4 ||
+        strcmp(magic, "PF") != 0 || *image_width <= 0 || *image_height <= 0)
+    {
+        return false;
+    }
+
+    // Exactly one whitespace character separates the header from the pixels.
+    fgetc(in);
+
+    size_t row_length = (size_t)*image_width * 3;
+    *rgb = malloc(row_length * *image_height * sizeof(float));
+    if (*rgb == NULL)
+    {
+        return false;
+    }
+
+    for (int j = *image_height - 1; j >= 0; j--)
+    {
+        if (fread(*rgb + j * row_length, sizeof(float), row_length, in) != row_length)
+        {
+            free(*rgb);
+            *rgb = NULL;
+            return false;
+        }
+    }
+
+    bool file_little_endian = scale < 0;
+    if (file_little_endian != pfm_little_endian())
+    {
+        pfm_swap_bytes(*rgb, row_length * *image_height);
+    }
+
+    return true;
+}
@@ -43,7 +43,7 @@ have if we were averaging complete images (we just average less of them than in
 */
 
 /// @brief Computes dest: the point the ray will be at t (P(t)= Origin+t* Direction).
-double *ray_at(vec3 dest, const struct Ray *ray, double t)
+static inline double *ray_at(vec3 dest, const struct Ray *ray, double t)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "ray.h"
+
+#include <string.h>
+
+/*
+
+Sorting rays so that rays traced one after the other go to the same parts of the scene.
+
+Camera rays are coherent on their own: neighboring pixels shoot almost the same ray. The rays scattered at the
+first bounce (and every bounce after it) are not: diffuse and fuzzy surfaces send them every which way, so two
+rays traced one after the other visit unrelated BVH nodes and objects, and most node visits miss the cache.
+
+Given a whole batch of such rays (see render_tile_batch in camera.h), we sort them by a key made of
+
+    - the cell their origin is in, on a 1024 x 1024 x 1024 lattice over the scene's bounding box, as a Morton code
+      (the bits of the three cell coordinates interleaved, in the high 30 bits). Cells with close Morton codes
+      are close in space, so rays sorted by it start close to each other and touch the same nodes near the leaves.
+    - then the octant of their direction (the signs of x, y and z, in the low 3 bits): rays going the same way
+      visit the children of a node in the same order.
+
+We tried the octant first too (as some papers do), but then rays that start next to each other (say, the bounce
+rays of neighboring pixels, which are in order to begin with) end up far apart, and the rays were traced slower
+than not sorting them at all.
+
+The keys are sorted with a radix sort (3 passes over 11 bit digits), which is stable and takes linear time.
+It is only worth it when the rays traced afterwards are faster by more than the sort costs: bvh_bench.c measures
+both for the bounce rays of a scene.
+
+*/
+
+/// @brief Bits per axis of the origin cell in a key (so there are 2^RAY_SORT_CELL_BITS cells along each axis).
+#define RAY_SORT_CELL_BITS 10
+
+/// @brief Bits per radix sort pass (3 passes cover the 33 bits of a key).
+#define RAY_SORT_DIGIT_BITS 11
+
+/// @brief Maps ray origins to the cells of the lattice over the scene (see ray_sort_cells).
+struct Ray_Sort_Cells
+{
+    double min[3];   //< The lower corner of the scene
+    double scale[3]; //< Cells per unit of length along each axis (0 for a flat or unbounded axis)
+};
+
+/// @brief The key of a ray (see ray_sort_key) and where the ray is, in the caller's array.
+struct Ray_Sort_Item
+{
+    uint64_t key;
+    int index;
+};
+
+/// @brief Make the lattice of cells over the (bounding box of the) scene.
+static inline struct Ray_Sort_Cells ray_sort_cells(const struct AABB *bounds)
+{
+    struct Ray_Sort_Cells cells;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const struct Interval *ax = aabb_axis_interval(bounds, axis);
+        double size = ax->max - ax->min;
+
+        // An axis we can't divide into cells just puts every origin in cell 0 along it.
+        bool usable = isfinite(size) && size > 0;
+        cells.min[axis] = usable ? ax->min : 0;
+        cells.scale[axis] = usable ? (1 << RAY_SORT_CELL_BITS) / size : 0;
+    }
+    return cells;
+}
+
+/// @brief Spread the low 10 bits of x out to every third bit (bit i goes to bit 3i).
+static inline uint64_t ray_sort_spread_bits(uint64_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+/// @brief The sort key of a ray: the Morton code of the cell its origin is in, then its direction octant.
+static inline uint64_t ray_sort_key(const struct Ray_Sort_Cells *cells, const struct Ray *ray)
+{
+    uint64_t key = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // Origins outside the scene (say, the camera) go in the nearest cell.
+        double cell = (ray->origin[axis] - cells->min[axis]) * cells->scale[axis];
+        const double last = (1 << RAY_SORT_CELL_BITS) - 1;
+        uint64_t c = (cell > 0) ? (uint64_t)((cell < last) ? cell : last) : 0;
+
+        key |= ray_sort_spread_bits(c) << (3 + axis);
+        key |= (uint64_t)(ray->direction[axis] < 0) << axis;
+    }
+    return key;
+}
+
+/// @brief Sort items[0..n) by key (stable: items with the same key keep their order).
+/// @param scratch Room for n items, which this overwrites.
+static inline void ray_sort(struct Ray_Sort_Item *items, struct Ray_Sort_Item *scratch, int n)
+{
+    enum
+    {
+        Num_Buckets = 1 << RAY_SORT_DIGIT_BITS
+    };
+    const int key_bits = 3 * RAY_SORT_CELL_BITS + 3;
+
+    struct Ray_Sort_Item *from = items;
+    struct Ray_Sort_Item *to = scratch;
+    for (int shift = 0; shift < key_bits; shift += RAY_SORT_DIGIT_BITS)
+    {
+        int offsets[Num_Buckets] = {0};
+        for (int i = 0; i < n; i++)
+        {
+            offsets[(from[i].key >> shift) & (Num_Buckets - 1)]++;
+        }
+
+        // If every item has the same digit, this pass would not move anything.
+        if (n == 0 || offsets[(from[0].key >> shift) & (Num_Buckets - 1)] == n)
+        {
+            continue;
+        }
+
+        int start = 0;
+        for (int b = 0; b < Num_Buckets; b++)
+        {
+            int count = offsets[b];
+            offsets[b] = start;
+            start += count;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            to[offsets[(from[i].key >> shift) & (Num_Buckets - 1)]++] = from[i];
+        }
+
+        struct Ray_Sort_Item *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != items)
+    {
+        memcpy(items, from, n * sizeof(struct Ray_Sort_Item));
+    }
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+
+Render statistics: where in the image the render spends its time. For each pixel we record
+
+    - how long its samples took (in CPU timestamp counter ticks, or nanoseconds where there is no such counter),
+    - how many objects its rays were tested against (by whatever finds the hits, see hittable_hit),
+    - how many rays its paths traced (so how long its paths are).
+
+and write each of them as an image with a colour ramp (see render_stats_write_heatmaps), so hot spots stand
+out: deep paths through glass, the blur of defocus, dense clusters of objects, ...
+
+Counting costs time in the innermost loops, so it is only compiled in when RENDER_STATS is defined
+(configure with -DENABLE_RENDER_STATS=ON). Otherwise the counting macros below are empty and there is no
+overhead at all. Either way, the stats are only recorded when Camera_Config.stats is set.
+
+The stats only cover the default way of rendering (not --ray-batch, whose paths are interleaved).
+
+*/
+
+#ifdef RENDER_STATS
+
+/// @brief The objects tested by this thread so far (see RENDER_STATS_COUNT).
+static thread_local uint64_t render_stats_object_tests = 0;
+
+/// @brief The rays traced by this thread so far (see RENDER_STATS_COUNT).
+static thread_local uint64_t render_stats_rays = 0;
+
+/// @brief Count one more of what (object_tests or rays) for the calling thread.
+#define RENDER_STATS_COUNT(what) (render_stats_##what++)
+
+#else
+
+#define RENDER_STATS_COUNT(what) ((void)0)
+
+#endif
+
+/// @brief A timestamp, in ticks of the CPU's timestamp counter (or in nanoseconds without one).
+static inline uint64_t render_stats_ticks()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/// @brief The stats of every pixel (sums over all its samples, so they add up over several renders).
+struct Render_Stats
+{
+    int image_width, image_height;
+    double *ticks;        //< How long the pixel's samples took
+    double *object_tests; //< How many objects its rays were tested against
+    double *rays;         //< How many rays its paths traced
+    double *samples;      //< How many samples it has
+};
+
+/// @brief Allocate the (zeroed) stats of an image.
+/// @return false if they could not be allocated.
+static inline bool render_stats_init(struct Render_Stats *stats, int image_width, int image_height)
+{
+    size_t num_pixels = (size_t)image_width * image_height;
+    *stats = (struct Render_Stats){
+        .image_width = image_width,
+        .image_height = image_height,
+        .ticks = calloc(num_pixels, sizeof(double)),
+        .object_tests = calloc(num_pixels, sizeof(double)),
+        .rays = calloc(num_pixels, sizeof(double)),
+        .samples = calloc(num_pixels, sizeof(double)),
+    };
+    return stats->ticks != NULL && stats->object_tests != NULL && stats->rays != NULL && stats->samples != NULL;
+}
+
+static inline void render_stats_free(struct Render_Stats *stats)
+{
+    free(stats->ticks);
+    free(stats->object_tests);
+    free(stats->rays);
+    free(stats->samples);
+    *stats = (struct Render_Stats){0};
+}
+
+/// @brief A colour ramp from black through blue, purple, red and orange to pale yellow (like "inferno"),
+/// for x in [0, 1]. It gets brighter all the way, so it also reads in grey.
+static inline void render_stats_ramp(double x, unsigned char rgb[3])
+{
+    static const double stops[6][3] = {
+        {0.00, 0.00, 0.02}, {0.16, 0.04, 0.38}, {0.55, 0.10, 0.50},
+        {0.87, 0.27, 0.23}, {0.99, 0.60, 0.05}, {0.99, 1.00, 0.64},
+    };
+    x = (x < 0) ? 0 : (x > 1) ? 1 : x;
+    double position = x * 5;
+    int stop = (position < 4) ? (int)position : 4;
+    double t = position - stop;
+    for (int c = 0; c < 3; c++)
+    {
+        rgb[c] = (unsigned char)(255.999 * ((1 - t) * stops[stop][c] + t * stops[stop + 1][c]));
+    }
+}
+
+static int render_stats_compare(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/// @brief Write the values (one per pixel, per sample) as a (binary) ppm image with the colour ramp.
+/// The ramp goes up to the 99th percentile, so a few very hot pixels don't make the rest of the image black.
+/// @return false if the file could not be written.
+static inline bool render_stats_write_heatmap(const char *path, const char *what, const double *values,
+                                              const double *samples, int image_width, int image_height)
+{
+    size_t num_pixels = (size_t)image_width * image_height;
+    double *sorted = malloc(num_pixels * sizeof(double));
+    FILE *out = fopen(path, "wb");
+    bool ok = sorted != NULL && out != NULL;
+
+    double sum = 0;
+    for (size_t p = 0; ok && p < num_pixels; p++)
+    {
+        sorted[p] = (samples[p] > 0) ? values[p] / samples[p] : 0;
+        sum += sorted[p];
+    }
+    if (ok)
+    {
+        qsort(sorted, num_pixels, sizeof(double), render_stats_compare);
+        double top = sorted[(size_t)(0.99 * (num_pixels - 1))];
+        double scale = (top > 0) ? 1 / top : 0;
+        fprintf(stderr, "%s per sample: mean %.1f, 99th percentile %.1f, max %.1f (%s)\n", what, sum / num_pixels,
+                top, sorted[num_pixels - 1], path);
+
+        ok = fprintf(out, "P6\n%i %i\n255\n", image_width, image_height) > 0;
+        for (size_t p = 0; ok && p < num_pixels; p++)
+        {
+            unsigned char rgb[3];
+            render_stats_ramp(((samples[p] > 0) ? values[p] / samples[p] : 0) * scale, rgb);
+            ok = fwrite(rgb, 1, 3, out) == 3;
+        }
+    }
+
+    if (out != NULL && fclose(out) != 0)
+    {
+        ok = false;
+    }
+    free(sorted);
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write the heatmap %s!\n", path);
+    }
+    return ok;
+}
+
+/// @brief Write the heatmaps: prefix_time.ppm (ticks per sample), prefix_tests.ppm (objects tested per sample)
+/// and prefix_rays.ppm (rays per sample, which is the average path length).
+/// @return false if any could not be written.
+static inline bool render_stats_write_heatmaps(const struct Render_Stats *stats, const char *prefix)
+{
+    char path[4096];
+    bool ok = true;
+
+    snprintf(path, sizeof(path), "%s_time.ppm", prefix);
+    ok &= render_stats_write_heatmap(path, "Ticks", stats->ticks, stats->samples, stats->image_width,
+                                     stats->image_height);
+    snprintf(path, sizeof(path), "%s_tests.ppm", prefix);
+    ok &= render_stats_write_heatmap(path, "Object tests", stats->object_tests, stats->samples,
+                                     stats->image_width, stats->image_height);
+    snprintf(path, sizeof(path), "%s_rays.ppm", prefix);
+    ok &= render_stats_write_heatmap(path, "Rays (path length)", stats->rays, stats->samples, stats->image_width,
+                                     stats->image_height);
+    return ok;
+}
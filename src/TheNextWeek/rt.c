@@ -0,0 +1,477 @@
+#include "rt.h"
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "scene.h"
+#include "bvh.h"
+
+#include <string.h>
+
+/*
+
+The library keeps its own copy of everything the caller adds.
+Objects point at their materials (and media at their boundaries), so those are allocated one at a time
+and never move, while the world itself is a growing array of Hittable objects (which we can move freely,
+as nothing points into it until we render).
+
+The BVH is built on the first render and kept for later renders, until an object is added.
+
+*/
+
+struct RT_Scene
+{
+    struct Material_Cfg **materials;
+    int num_materials;
+    int materials_capacity;
+
+    struct Hittable *world;
+    int world_length;
+    int world_capacity;
+
+    struct Hittable **boundaries; //< The boundaries of the media in world
+    int num_boundaries;
+    int boundaries_capacity;
+
+    bool has_background;
+    color3 background;
+
+    bool has_environment;
+    struct Environment_Map environment;
+
+    enum Light_Sampling sampling;
+
+    struct Camera_Config cam;
+
+    struct BVH bvh;
+    bool bvh_dirty; //< If objects were added since the BVH was built
+};
+
+/// @brief Make sure the array has room for one more element (doubling its capacity if not).
+/// @return false if it could not be grown (the array is then unchanged).
+static bool grow(void **array, int length, int *capacity, size_t element_size)
+{
+    if (length < *capacity)
+    {
+        return true;
+    }
+
+    int new_capacity = (*capacity > 0) ? 2 * *capacity : 16;
+    void *grown = realloc(*array, new_capacity * element_size);
+    if (grown == NULL)
+    {
+        return false;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+struct RT_Camera rt_camera_defaults(void)
+{
+    return (struct RT_Camera){
+        .lookfrom = {0, 0, 1},
+        .lookat = {0, 0, 0},
+        .vup = {0, 1, 0},
+        .vfov = 90,
+        .defocus_angle = 0,
+        .focus_dist = 10,
+
+        .samples_per_pixel = 100,
+        .max_depth = 50,
+        .num_threads = 0,
+        .tile_size = 0,
+        .seed = 0,
+    };
+}
+
+struct RT_Scene *rt_scene_create(void)
+{
+    struct RT_Scene *scene = calloc(1, sizeof(struct RT_Scene));
+    if (scene == NULL)
+    {
+        return NULL;
+    }
+
+    struct RT_Camera defaults = rt_camera_defaults();
+    rt_scene_set_camera(scene, &defaults);
+    scene->sampling = Sample_Lights_Mis;
+
+    return scene;
+}
+
+void rt_scene_destroy(struct RT_Scene *scene)
+{
+    if (scene == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < scene->num_materials; i++)
+    {
+        free(scene->materials[i]);
+    }
+    for (int i = 0; i < scene->num_boundaries; i++)
+    {
+        free(scene->boundaries[i]);
+    }
+
+    free(scene->materials);
+    free(scene->boundaries);
+    free(scene->world);
+    bvh_free(&scene->bvh);
+    if (scene->has_environment)
+    {
+        environment_free(&scene->environment);
+    }
+    free(scene);
+}
+
+static int add_material(struct RT_Scene *scene, struct Material_Cfg cfg)
+{
+    if (scene == NULL ||
+        !grow((void **)&scene->materials, scene->num_materials, &scene->materials_capacity,
+              sizeof(struct Material_Cfg *)))
+    {
+        return -1;
+    }
+
+    struct Material_Cfg *material = malloc(sizeof(struct Material_Cfg));
+    if (material == NULL)
+    {
+        return -1;
+    }
+
+    *material = cfg;
+    scene->materials[scene->num_materials] = material;
+    return scene->num_materials++;
+}
+
+int rt_add_lambertian(struct RT_Scene *scene, double r, double g, double b)
+{
+    return add_material(scene, (struct Material_Cfg){.mat = Lambertian, .albedo = {r, g, b}});
+}
+
+int rt_add_metal(struct RT_Scene *scene, double r, double g, double b, double fuzz)
+{
+    return add_material(scene, (struct Material_Cfg){.mat = Metal, .albedo = {r, g, b}, .fuzz = fuzz});
+}
+
+int rt_add_dielectric(struct RT_Scene *scene, double refraction_index)
+{
+    return add_material(scene, (struct Material_Cfg){.mat = Dielectric, .refraction_index = refraction_index});
+}
+
+int rt_add_diffuse_light(struct RT_Scene *scene, double r, double g, double b)
+{
+    return add_material(scene, (struct Material_Cfg){.mat = Diffuse_Light, .emit = {r, g, b}});
+}
+
+int rt_add_isotropic(struct RT_Scene *scene, double r, double g, double b)
+{
+    return add_material(scene, (struct Material_Cfg){.mat = Isotropic, .albedo = {r, g, b}});
+}
+
+/// @brief Add the object to the world (its material must already be set).
+static enum RT_Status add_object(struct RT_Scene *scene, struct Hittable object)
+{
+    if (!grow((void **)&scene->world, scene->world_length, &scene->world_capacity, sizeof(struct Hittable)))
+    {
+        return RT_Out_Of_Memory;
+    }
+
+    scene->world[scene->world_length++] = object;
+    scene->bvh_dirty = true;
+    return RT_Ok;
+}
+
+/// @brief Returns the material with the given id (or NULL if there is none).
+static const struct Material_Cfg *find_material(const struct RT_Scene *scene, int material)
+{
+    if (scene == NULL || material < 0 || material >= scene->num_materials)
+    {
+        return NULL;
+    }
+    return scene->materials[material];
+}
+
+static struct Hittable make_sphere_object(const double center0[3], const double center1[3], double radius,
+                                          const struct Material_Cfg *mat_cfg)
+{
+    struct Hittable object = {.which = (enum Which_Hittable)Sphere};
+    object.object.sphere.radius = fmax(0, radius);
+    object.object.sphere.mat_cfg = mat_cfg;
+    memcpy(object.object.sphere.center.origin, center0, 3 * sizeof(double));
+    subtract(object.object.sphere.center.direction, (double *)center1, (double *)center0);
+    return object;
+}
+
+enum RT_Status rt_add_sphere(struct RT_Scene *scene, const double center[3], double radius, int material)
+{
+    return rt_add_moving_sphere(scene, center, center, radius, material);
+}
+
+enum RT_Status rt_add_moving_sphere(struct RT_Scene *scene, const double center0[3], const double center1[3],
+                                    double radius, int material)
+{
+    const struct Material_Cfg *mat_cfg = find_material(scene, material);
+    if (mat_cfg == NULL || center0 == NULL || center1 == NULL)
+    {
+        return RT_Invalid_Argument;
+    }
+
+    return add_object(scene, make_sphere_object(center0, center1, radius, mat_cfg));
+}
+
+enum RT_Status rt_add_box(struct RT_Scene *scene, const double a[3], const double b[3], int material)
+{
+    const struct Material_Cfg *mat_cfg = find_material(scene, material);
+    if (mat_cfg == NULL || a == NULL || b == NULL)
+    {
+        return RT_Invalid_Argument;
+    }
+
+    return add_object(scene, (struct Hittable){.which = (enum Which_Hittable)Box,
+                                               .object.box = make_box(a, b, mat_cfg)});
+}
+
+/// @brief Add a homogeneous medium inside the given boundary (which is copied).
+static enum RT_Status add_medium(struct RT_Scene *scene, struct Hittable boundary, double density,
+                                 const struct Material_Cfg *phase_function)
+{
+    if (!grow((void **)&scene->boundaries, scene->num_boundaries, &scene->boundaries_capacity,
+              sizeof(struct Hittable *)))
+    {
+        return RT_Out_Of_Memory;
+    }
+
+    struct Hittable *stable_boundary = malloc(sizeof(struct Hittable));
+    if (stable_boundary == NULL)
+    {
+        return RT_Out_Of_Memory;
+    }
+    *stable_boundary = boundary;
+
+    enum RT_Status status =
+        add_object(scene, (struct Hittable){.which = (enum Which_Hittable)Constant_Medium,
+                                            .object.constant_medium = {.boundary = stable_boundary,
+                                                                       .density = density,
+                                                                       .phase_function = phase_function}});
+    if (status != RT_Ok)
+    {
+        free(stable_boundary);
+        return status;
+    }
+
+    scene->boundaries[scene->num_boundaries++] = stable_boundary;
+    return RT_Ok;
+}
+
+enum RT_Status rt_add_sphere_medium(struct RT_Scene *scene, const double center[3], double radius,
+                                    double density, int material)
+{
+    const struct Material_Cfg *mat_cfg = find_material(scene, material);
+    if (mat_cfg == NULL || center == NULL || !(density > 0))
+    {
+        return RT_Invalid_Argument;
+    }
+
+    return add_medium(scene, make_sphere_object(center, center, radius, NULL), density, mat_cfg);
+}
+
+enum RT_Status rt_add_box_medium(struct RT_Scene *scene, const double a[3], const double b[3],
+                                 double density, int material)
+{
+    const struct Material_Cfg *mat_cfg = find_material(scene, material);
+    if (mat_cfg == NULL || a == NULL || b == NULL || !(density > 0))
+    {
+        return RT_Invalid_Argument;
+    }
+
+    return add_medium(scene, (struct Hittable){.which = (enum Which_Hittable)Box, .object.box = make_box(a, b, NULL)},
+                      density, mat_cfg);
+}
+
+void rt_set_background(struct RT_Scene *scene, double r, double g, double b)
+{
+    if (scene == NULL)
+    {
+        return;
+    }
+
+    scene->has_background = true;
+    scene->background[0] = r;
+    scene->background[1] = g;
+    scene->background[2] = b;
+}
+
+enum RT_Status rt_set_environment(struct RT_Scene *scene, const float *rgb, int width, int height,
+                                  double intensity)
+{
+    if (scene == NULL || rgb == NULL || width <= 0 || height <= 0)
+    {
+        return RT_Invalid_Argument;
+    }
+
+    size_t size = (size_t)width * height * 3 * sizeof(float);
+    float *copy = malloc(size);
+    if (copy == NULL)
+    {
+        return RT_Out_Of_Memory;
+    }
+    memcpy(copy, rgb, size);
+
+    struct Environment_Map environment;
+    if (!environment_init(&environment, copy, width, height, intensity))
+    {
+        return RT_Out_Of_Memory;
+    }
+
+    if (scene->has_environment)
+    {
+        environment_free(&scene->environment);
+    }
+    scene->environment = environment;
+    scene->has_environment = true;
+    return RT_Ok;
+}
+
+enum RT_Status rt_set_sampling(struct RT_Scene *scene, enum RT_Sampling sampling)
+{
+    if (scene == NULL)
+    {
+        return RT_Invalid_Argument;
+    }
+
+    switch (sampling)
+    {
+    case RT_Sampling_Mis:
+        scene->sampling = Sample_Lights_Mis;
+        return RT_Ok;
+    case RT_Sampling_Mixture:
+        scene->sampling = Sample_Mixture;
+        return RT_Ok;
+    case RT_Sampling_Material:
+        scene->sampling = Sample_Material_Only;
+        return RT_Ok;
+    default:
+        return RT_Invalid_Argument;
+    }
+}
+
+void rt_scene_set_camera(struct RT_Scene *scene, const struct RT_Camera *camera)
+{
+    if (scene == NULL || camera == NULL)
+    {
+        return;
+    }
+
+    struct Camera_Config *cam = &scene->cam;
+
+    memcpy(cam->lookfrom, camera->lookfrom, 3 * sizeof(double));
+    memcpy(cam->lookat, camera->lookat, 3 * sizeof(double));
+    memcpy(cam->vup, camera->vup, 3 * sizeof(double));
+    cam->vfov = camera->vfov;
+    cam->defocus_angle = camera->defocus_angle;
+    cam->focus_dist = camera->focus_dist;
+
+    cam->samples_per_pixel = (camera->samples_per_pixel > 0) ? camera->samples_per_pixel : 1;
+    cam->max_depth = camera->max_depth;
+    cam->num_threads = camera->num_threads;
+    cam->tile_size = camera->tile_size;
+    cam->seed = camera->seed;
+}
+
+/// @brief Where rt_render puts the tiles (and who it reports progress to).
+struct Buffer_Target
+{
+    float *rgb;
+    int width;
+    RT_Progress_Fn progress;
+    void *user_data;
+    bool cancelled; //< Whether progress asked to stop
+};
+
+static void buffer_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Buffer_Target *target = arg;
+
+    for (int row = 0; row < height; row++)
+    {
+        float *out = &target->rgb[3 * ((size_t)(y + row) * target->width + x)];
+        const color3 *in = &tile[row * width];
+
+        for (int i = 0; i < width; i++)
+        {
+            out[3 * i + 0] = (float)in[i][0];
+            out[3 * i + 1] = (float)in[i][1];
+            out[3 * i + 2] = (float)in[i][2];
+        }
+    }
+}
+
+static bool buffer_progress(void *arg, int tiles_done, int num_tiles)
+{
+    struct Buffer_Target *target = arg;
+    if (target->progress(target->user_data, tiles_done, num_tiles) != 0)
+    {
+        target->cancelled = true;
+    }
+    return !target->cancelled;
+}
+
+enum RT_Status rt_render(struct RT_Scene *scene, float *rgb, int width, int height,
+                         RT_Progress_Fn progress, void *user_data)
+{
+    if (scene == NULL || rgb == NULL || width <= 0 || height <= 0)
+    {
+        return RT_Invalid_Argument;
+    }
+
+    if (scene->bvh_dirty || scene->bvh.nodes == NULL)
+    {
+        if (!bvh_build(&scene->bvh, scene->world, scene->world_length))
+        {
+            return RT_Out_Of_Memory;
+        }
+        scene->bvh_dirty = false;
+    }
+
+    struct Scene render_scene;
+    if (!scene_init(&render_scene, scene->world, scene->world_length))
+    {
+        return RT_Out_Of_Memory;
+    }
+    render_scene.bvh = &scene->bvh;
+    render_scene.has_background = scene->has_background;
+    memcpy(render_scene.background, scene->background, 3 * sizeof(double));
+    render_scene.environment = scene->has_environment ? &scene->environment : NULL;
+    render_scene.sampling = scene->sampling;
+
+    struct Camera_Config cam = scene->cam;
+    cam.image_width = width;
+    cam.image_height = height;
+    cam.aspect_ratio = (double)width / height;
+
+    struct Buffer_Target target = {.rgb = rgb, .width = width, .progress = progress, .user_data = user_data};
+    struct Render_Callbacks callbacks = {.tile_done = buffer_tile_done,
+                                         .progress = (progress != NULL) ? buffer_progress : NULL,
+                                         .arg = &target};
+
+    bool finished = camera_render_tiles(&render_scene, &cam, &callbacks);
+
+    scene_free(&render_scene);
+
+    if (finished)
+    {
+        return RT_Ok;
+    }
+    // Otherwise either progress stopped it, or the render threads could not allocate their buffers.
+    return target.cancelled ? RT_Cancelled : RT_Out_Of_Memory;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+
+The public interface of the renderer as a library (librt), for embedding it in other programs.
+
+Unlike main.c (which sets up a scene in code and writes a ppm file to stdout), a program using the library
+builds its scene through these functions and gets the image back in its own buffer.
+The library never writes to stdout, and reports progress (and lets the caller cancel) through a callback.
+
+This is the only header a program using the library includes (it does not expose any of the renderer's internals).
+
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// @brief A scene (its materials, objects, background and camera). Create one with rt_scene_create.
+struct RT_Scene;
+
+enum RT_Status
+{
+    RT_Ok,
+    RT_Cancelled,        //< The progress callback asked to stop the render.
+    RT_Out_Of_Memory,
+    RT_Invalid_Argument,
+};
+
+/// @brief How the light arriving at a surface is found (see Light_Sampling in scene.h). All of them converge to
+/// the same image, but with different noise for the same time.
+enum RT_Sampling
+{
+    RT_Sampling_Mis,      //< Sample the lights and the material, weighted by multiple importance sampling
+    RT_Sampling_Mixture,  //< Sample a 50/50 mixture of the lights and the material
+    RT_Sampling_Material, //< Only sample the material (lights are only found by chance)
+};
+
+/// @brief Where the camera is and how the image is sampled (see Camera_Config in camera.h for the details).
+struct RT_Camera
+{
+    double lookfrom[3];
+    double lookat[3];
+    double vup[3];
+    double vfov;          //< Vertical view angle in degrees
+    double defocus_angle; //< 0 means no defocus blur
+    double focus_dist;
+
+    int samples_per_pixel;
+    int max_depth;
+    int num_threads; //< 0 means one per hardware thread
+    int tile_size;   //< 0 means 16
+    uint64_t seed;   //< The same seed (and scene) always renders the same image
+};
+
+/// @brief Called after each rendered tile with how many tiles are done so far (one call at a time,
+/// from one of the render threads). Return nonzero to cancel the render.
+typedef int (*RT_Progress_Fn)(void *user_data, int tiles_done, int num_tiles);
+
+/// @brief A camera at (0,0,1) looking at the origin, with 100 samples per pixel and a maximum depth of 50.
+struct RT_Camera rt_camera_defaults(void);
+
+/// @return The new (empty) scene, or NULL if it could not be allocated.
+struct RT_Scene *rt_scene_create(void);
+void rt_scene_destroy(struct RT_Scene *scene);
+
+// Materials. Each returns the id of the new material (to use with the objects below), or -1 on failure.
+
+int rt_add_lambertian(struct RT_Scene *scene, double r, double g, double b);
+int rt_add_metal(struct RT_Scene *scene, double r, double g, double b, double fuzz);
+int rt_add_dielectric(struct RT_Scene *scene, double refraction_index);
+int rt_add_diffuse_light(struct RT_Scene *scene, double r, double g, double b);
+
+/// @brief The phase function of a medium (see rt_add_sphere_medium and rt_add_box_medium).
+int rt_add_isotropic(struct RT_Scene *scene, double r, double g, double b);
+
+// Objects. Each returns RT_Ok, or why it could not be added.
+
+enum RT_Status rt_add_sphere(struct RT_Scene *scene, const double center[3], double radius, int material);
+
+/// @brief A sphere that moves from center0 (at the start of the shot) to center1 (at the end), for motion blur.
+enum RT_Status rt_add_moving_sphere(struct RT_Scene *scene, const double center0[3], const double center1[3],
+                                    double radius, int material);
+
+/// @brief An axis-aligned box between the opposite corners a and b.
+enum RT_Status rt_add_box(struct RT_Scene *scene, const double a[3], const double b[3], int material);
+
+/// @brief A homogeneous medium (smoke, fog) filling a sphere. The material should be isotropic.
+enum RT_Status rt_add_sphere_medium(struct RT_Scene *scene, const double center[3], double radius,
+                                    double density, int material);
+
+/// @brief A homogeneous medium (smoke, fog) filling a box. The material should be isotropic.
+enum RT_Status rt_add_box_medium(struct RT_Scene *scene, const double a[3], const double b[3],
+                                 double density, int material);
+
+/// @brief Rays that hit nothing see this color (instead of the default white to blue sky).
+void rt_set_background(struct RT_Scene *scene, double r, double g, double b);
+
+/// @brief Light the scene with an environment map: rays that hit nothing see it (instead of the background),
+/// and it is sampled as a light (so even a small bright sun converges quickly).
+/// @param rgb A latitude-longitude HDR image (width * height pixels, row by row from the top (straight up),
+/// 3 floats per pixel). It is copied. The center column looks toward +x.
+/// @param intensity What to multiply the pixels by.
+/// @return RT_Ok, or RT_Out_Of_Memory (the scene then keeps its previous environment, if any).
+enum RT_Status rt_set_environment(struct RT_Scene *scene, const float *rgb, int width, int height,
+                                  double intensity);
+
+/// @brief Choose how the light arriving at a surface is found (RT_Sampling_Mis, unless set).
+/// @return RT_Ok, or RT_Invalid_Argument for an unknown sampling.
+enum RT_Status rt_set_sampling(struct RT_Scene *scene, enum RT_Sampling sampling);
+
+void rt_scene_set_camera(struct RT_Scene *scene, const struct RT_Camera *camera);
+
+/// @brief Render the scene into rgb (width * height pixels, row by row from the top, 3 floats per pixel).
+/// @remark The colors are linear (not gamma corrected) and not clamped, so lights can be brighter than 1.
+/// The scene must not be changed while it renders. Different scenes can render at the same time.
+/// @param progress Optional (may be NULL).
+/// @return RT_Ok, RT_Cancelled if progress asked to stop, or RT_Out_Of_Memory (rgb is then only partly rendered).
+enum RT_Status rt_render(struct RT_Scene *scene, float *rgb, int width, int height,
+                         RT_Progress_Fn progress, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,11 +4,21 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <threads.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 // Constants
 
-const double infinity = INFINITY;
-const double pi = 3.1415926535897932385;
+static const double infinity = INFINITY;
+static const double pi = 3.1415926535897932385;
 
 // Utility Functions
 
@@ -17,10 +27,70 @@ static inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+/// @brief Compute the sine and cosine of 2 * pi * turns, for turns in [0,1) (to about 1e-14).
+/// @remark Unlike sin and cos from math.h this is not a function call and has no branches,
+/// so it is cheap and loops that use it can be vectorized (see sample_batch.h).
+/// The polynomials are the Taylor series of sin and cos around 0, which are accurate on [-pi/4, pi/4];
+/// we reduce the angle to that range, and then move the result to the right quadrant.
+static inline void sin_cos_turns(double turns, double *sin_out, double *cos_out)
+{
+    // The nearest quarter turn (0 to 4), and what's left of the angle (at most an eighth of a turn either way).
+    double quarter = (double)(int)(4 * turns + 0.5);
+    double x = (2 * pi) * (turns - 0.25 * quarter);
+    double x2 = x * x;
+
+    double s = x * (1 + x2 * (-1.0 / 6 + x2 * (1.0 / 120 + x2 * (-1.0 / 5040 + x2 * (1.0 / 362880 +
+               x2 * (-1.0 / 39916800 + x2 * (1.0 / 6227020800)))))));
+    double c = 1 + x2 * (-1.0 / 2 + x2 * (1.0 / 24 + x2 * (-1.0 / 720 + x2 * (1.0 / 40320 +
+               x2 * (-1.0 / 3628800 + x2 * (1.0 / 479001600 + x2 * (-1.0 / 87178291200)))))));
+
+    // Each quarter turn maps (sin, cos) to (cos, -sin) (and 4 quarter turns are a full turn).
+    bool swap = (quarter == 1) | (quarter == 3);
+    double sin_sign = ((quarter == 2) | (quarter == 3)) ? -1 : 1;
+    double cos_sign = ((quarter == 1) | (quarter == 2)) ? -1 : 1;
+    *sin_out = sin_sign * (swap ? c : s);
+    *cos_out = cos_sign * (swap ? s : c);
+}
+
+/*
+
+We render with several threads, so we can't use rand(): it has a single global state
+(which makes it slow to share, and makes the result depend on how the threads happen to interleave).
+Instead every thread has its own random number generator state (a SplitMix64 generator).
+
+The renderer reseeds the generator for every pixel (from the image seed and the pixel's position),
+so the image we get does not depend on the number of threads or the order in which pixels are rendered.
+
+*/
+
+static thread_local uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+/// @brief Mix the bits of x (the SplitMix64 output function). Also handy for hashing seeds together.
+static inline uint64_t mix_bits(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/// @brief Seed the random number generator of the calling thread.
+static inline void random_seed(uint64_t seed)
+{
+    rng_state = mix_bits(seed);
+}
+
+/// @brief Returns 64 random bits.
+static inline uint64_t random_bits()
+{
+    rng_state += 0x9e3779b97f4a7c15ULL;
+    return mix_bits(rng_state);
+}
+
 /// @brief Returns a random real in [0,1).
 static inline double random_zero_to_one()
 {
-    return rand() / (RAND_MAX + 1.0);
+    // Use the top 53 bits (the precision of a double).
+    return (random_bits() >> 11) * 0x1.0p-53;
 }
 
 /// @brief Returns a random real in [min,max).
@@ -29,6 +99,78 @@ static inline double random_in_range(double min, double max)
     return min + (max - min) * random_zero_to_one();
 }
 
+/// @brief Returns the current wall-clock time in seconds (for timing renders).
+static inline double seconds_now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// @brief Returns a seed that is different for every run of the program, even for runs that start
+/// at the same moment on different machines (or in different processes on the same machine).
+/// @remark Runs whose images are merged (see accumulation.h) must not share a seed,
+/// or they would just render the same samples again.
+static inline uint64_t random_run_seed()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+#ifdef _WIN32
+    uint64_t process = (uint64_t)GetCurrentProcessId();
+#else
+    uint64_t process = (uint64_t)getpid() ^ ((uint64_t)gethostid() << 32);
+#endif
+
+    // The address of a local variable also varies from run to run (with address space layout randomization).
+    uint64_t stack_address = (uint64_t)(uintptr_t)&ts;
+
+    return mix_bits(mix_bits((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ mix_bits(process) ^ stack_address);
+}
+
+/// @brief Returns how many threads the hardware can run at once (at least 1).
+static inline int hardware_threads()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (count < 1) ? 1 : count;
+}
+
+/// @brief Run fn on each of the count jobs (job k at jobs + k * job_size), each on its own thread
+/// (the first on this thread, and so is any whose thread could not start).
+static inline void run_jobs(int (*fn)(void *), void *jobs, size_t job_size, int count)
+{
+    thrd_t *threads = malloc(count * sizeof(thrd_t));
+    bool *started = calloc(count, sizeof(bool));
+
+    for (int k = 1; threads != NULL && started != NULL && k < count; k++)
+    {
+        started[k] = thrd_create(&threads[k], fn, (char *)jobs + k * job_size) == thrd_success;
+    }
+    for (int k = 0; k < count; k++)
+    {
+        if (started == NULL || !started[k])
+        {
+            fn((char *)jobs + k * job_size);
+        }
+    }
+    for (int k = 1; started != NULL && k < count; k++)
+    {
+        if (started[k])
+        {
+            thrd_join(threads[k], NULL);
+        }
+    }
+
+    free(started);
+    free(threads);
+}
+
 // Common Headers
 
 #include "color.h"
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+/*
+
+Batch sampling: generate many random samples at once, into separate arrays for each coordinate
+(a "structure of arrays", x[0..n), y[0..n), z[0..n)), for when rays are processed in batches.
+
+Every loop here does the same work for every element (no rejection loops, no branches, no calls into libm),
+so the compiler can vectorize it: with AVX each instruction works on 4 samples at once (2 with SSE2).
+
+    1. The random numbers: SplitMix64 (see rtweekend.h) adds a constant to its state for every number,
+       so the i-th number of a batch only depends on the state at the start of the batch, and the
+       numbers of a batch can be computed side by side. A batch gives the very same numbers that
+       calling random_zero_to_one() n times would, and leaves the generator in the same state.
+    2. The mappings from random numbers to samples are the closed forms from vec3.h
+       (which use sin_cos_turns from rtweekend.h, rather than calling sin and cos).
+
+The compiler only vectorizes these loops when it may assume sqrt never sets errno and comparisons never trap
+(-fno-math-errno -fno-trapping-math, see CMakeLists.txt; neither changes any result), and the random numbers
+need AVX2 (for the 64 bit multiplies).
+
+The arrays are owned by the caller; the ones passed to a single call must not overlap.
+
+*/
+
+/// @brief Fill out[0..n) with random reals in [0,1) (the next n numbers of the calling thread's generator).
+static inline void random_batch_zero_to_one(double *restrict out, int n)
+{
+    const uint64_t golden = 0x9e3779b97f4a7c15ULL;
+    uint64_t state = rng_state;
+
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = (mix_bits(state + (uint64_t)(i + 1) * golden) >> 11) * 0x1.0p-53;
+    }
+
+    rng_state = state + (uint64_t)n * golden;
+}
+
+/// @brief Fill (x, y, z)[0..n) with random vectors on the surface of the unit sphere (see random_unit_vector).
+static inline void random_batch_unit_vectors(double *restrict x, double *restrict y, double *restrict z, int n)
+{
+    // The random numbers go in x and y first, and are replaced by the samples.
+    random_batch_zero_to_one(x, n);
+    random_batch_zero_to_one(y, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        uniforms_to_unit_vector(x[i], y[i], &x[i], &y[i], &z[i]);
+    }
+}
+
+/// @brief Fill (x, y, z)[0..n) with random vectors on the hemisphere around normal (see random_on_hemisphere).
+static inline void random_batch_on_hemisphere(double *restrict x, double *restrict y, double *restrict z, int n,
+                                              const vec3 normal)
+{
+    random_batch_unit_vectors(x, y, z, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        double sign = (x[i] * normal[0] + y[i] * normal[1] + z[i] * normal[2] <= 0.0) ? -1 : 1;
+        x[i] *= sign;
+        y[i] *= sign;
+        z[i] *= sign;
+    }
+}
+
+/// @brief Fill (x, y, z)[0..n) with random cosine weighted directions around the z axis
+/// (see random_cosine_direction).
+static inline void random_batch_cosine_directions(double *restrict x, double *restrict y, double *restrict z, int n)
+{
+    random_batch_zero_to_one(x, n);
+    random_batch_zero_to_one(y, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        uniforms_to_cosine_direction(x[i], y[i], &x[i], &y[i], &z[i]);
+    }
+}
+
+/// @brief Fill (x, y)[0..n) with random points on the unit disk (see random_in_unit_disk).
+static inline void random_batch_in_unit_disk(double *restrict x, double *restrict y, int n)
+{
+    random_batch_zero_to_one(x, n);
+    random_batch_zero_to_one(y, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        uniforms_to_disk(x[i], y[i], &x[i], &y[i]);
+    }
+}
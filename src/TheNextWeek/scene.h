@@ -0,0 +1,192 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "grid.h"
+#include "lazy_bvh.h"
+#include "environment.h"
+
+/*
+
+Light in a scene can come from two places: the background (what a ray sees if it hits nothing,
+which can be an environment map; see environment.h), and objects made from a Diffuse_Light material.
+
+A ray that bounces around randomly only rarely hits a small light, so the image is very noisy
+unless we take a huge number of samples.
+Instead, at each diffuse bounce we also explicitly sample a direction toward a light
+(this is called next-event estimation) and check if anything blocks it with a shadow ray.
+
+To do this we need a list of the lights in the scene. Every Sphere made from a Diffuse_Light material
+is such a light. (Emissive objects of other shapes still light the scene, just without explicit sampling.)
+So is the environment map, if the scene has one.
+
+*/
+
+/// @brief How we find the light arriving at a (non-specular) surface or medium.
+enum Light_Sampling
+{
+    /// Sample the lights directly (next-event estimation) and follow the scattered ray,
+    /// combining both with multiple importance sampling (the default).
+    Sample_Lights_Mis,
+    /// Sample the scattered direction from a 50/50 mixture of the material pdf and the lights pdf (see pdf.h).
+    Sample_Mixture,
+    /// Only follow the material's own scattered ray (light is only found by chance).
+    Sample_Material_Only,
+};
+
+struct Scene
+{
+    const struct Hittable *world; //< An array of the hittable objects in the scene
+    int world_length;
+
+    /// @brief Optional. A BVH built over world, used to find hits faster. If NULL, we test every object.
+    const struct BVH *bvh;
+
+    /// @brief Optional. A wide BVH collapsed from bvh (see wide_bvh.h). If set, it is used instead of bvh.
+    const struct Wide_BVH *wide_bvh;
+
+    /// @brief Optional. A compressed BVH made from bvh (see compressed_bvh.h). If set, it is used instead of
+    /// bvh (and wide_bvh).
+    const struct Compressed_BVH *compressed_bvh;
+
+    /// @brief Optional. A grid built over world (see grid.h). If set, it is used instead of a BVH.
+    const struct Grid *grid;
+
+    /// @brief Optional. A lazy BVH built over world (see lazy_bvh.h), split further as rays reach its nodes.
+    /// If set, it is used instead of bvh.
+    const struct Lazy_BVH *lazy_bvh;
+
+    const struct Sphere **lights; //< The lights we explicitly sample (see scene_init)
+    int num_lights;
+
+    /// @brief If true, rays that hit nothing see the background color.
+    /// Otherwise they see the default sky (a white to blue gradient).
+    bool has_background;
+    color3 background;
+
+    /// @brief Optional. If set, rays that hit nothing see this map (rather than the background),
+    /// and we sample it as one more light.
+    const struct Environment_Map *environment;
+
+    enum Light_Sampling sampling; //< Set to Sample_Lights_Mis by scene_init
+};
+
+/// @brief Whether the object is one of the lights the scene explicitly samples.
+static inline bool hittable_is_light(const struct Hittable *object)
+{
+    return object->which == (enum Which_Hittable)Sphere &&
+           object->object.sphere.mat_cfg != NULL &&
+           object->object.sphere.mat_cfg->mat == Diffuse_Light;
+}
+
+/// @brief Set up a scene for the given world (this also finds the lights in it).
+/// Call scene_free once you are done with the scene.
+/// @return false if there was not enough memory for the list of lights.
+/// @remark The scene does not copy the world, so the world must outlive the scene.
+static inline bool scene_init(struct Scene *scene, const struct Hittable *world, int world_length)
+{
+    scene->world = world;
+    scene->world_length = world_length;
+    scene->bvh = NULL;
+    scene->wide_bvh = NULL;
+    scene->compressed_bvh = NULL;
+    scene->grid = NULL;
+    scene->lazy_bvh = NULL;
+    scene->has_background = false;
+    scene->background[0] = scene->background[1] = scene->background[2] = 0;
+    scene->environment = NULL;
+    scene->sampling = Sample_Lights_Mis;
+
+    scene->num_lights = 0;
+    for (int i = 0; i < world_length; i++)
+    {
+        scene->num_lights += hittable_is_light(&world[i]);
+    }
+
+    scene->lights = NULL;
+    if (scene->num_lights > 0)
+    {
+        scene->lights = malloc(scene->num_lights * sizeof(struct Sphere *));
+        if (scene->lights == NULL)
+        {
+            scene->num_lights = 0;
+            return false;
+        }
+
+        int light = 0;
+        for (int i = 0; i < world_length; i++)
+        {
+            if (hittable_is_light(&world[i]))
+            {
+                scene->lights[light++] = &world[i].object.sphere;
+            }
+        }
+    }
+    return true;
+}
+
+static inline void scene_free(struct Scene *scene)
+{
+    free(scene->lights);
+    scene->lights = NULL;
+    scene->num_lights = 0;
+}
+
+/// @brief How many lights scene_sample_light picks from (the spheres, and the environment map if there is one).
+static inline int scene_light_count(const struct Scene *scene)
+{
+    return scene->num_lights + (scene->environment != NULL);
+}
+
+/// @brief The probability density (over solid angle) that scene_sample_light returns direction from origin.
+/// @remark Since we pick a light uniformly and a direction might hit more than one light (if they overlap
+/// as seen from origin, and the environment is behind everything), this is the average of the density of every light.
+static inline double scene_light_pdf(const struct Scene *scene, const point3 origin, const vec3 direction, double time)
+{
+    int count = scene_light_count(scene);
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < scene->num_lights; i++)
+    {
+        sum += sphere_pdf_value(scene->lights[i], origin, direction, time);
+    }
+    if (scene->environment != NULL)
+    {
+        sum += environment_pdf(scene->environment, direction);
+    }
+
+    return sum / count;
+}
+
+/// @brief Pick a light uniformly and sample a (unit) direction from origin toward it.
+/// @param light Set to the light we picked (NULL for the environment map).
+/// @return false if there is no light to sample (from origin).
+static inline bool scene_sample_light(const struct Scene *scene, const point3 origin, double time,
+                                      vec3 direction, const struct Sphere **light)
+{
+    int count = scene_light_count(scene);
+    if (count == 0)
+    {
+        return false;
+    }
+
+    int i = (int)(random_zero_to_one() * count);
+    if (i >= scene->num_lights)
+    {
+        *light = NULL;
+        environment_sample(scene->environment, direction);
+        return true;
+    }
+
+    *light = scene->lights[i];
+    return sphere_random_direction(*light, origin, time, direction);
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mapped_file.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+A scene file holds a whole world of spheres (and their materials, and where to look at them from),
+so scenes far too big to write out in code (millions of spheres, see scene_gen.c) can be rendered:
+
+    build\scene_gen.exe big.scene --count 1000000 --layout clustered
+    build\theNextWeek.exe 6 big.scene > image.ppm
+
+The file is a fixed size header, then num_materials Scene_File_Material records, then num_spheres
+Scene_File_Sphere records. Every record is 32 bytes (and the header 128), so the file can be memory mapped
+and read as arrays, and the i-th sphere is always at the same place (so many threads can write or read
+their own part of the file at once). Like accumulation files, everything is stored in the byte order of the
+machine that wrote it (byte_order tells us what it was).
+
+Positions are floats rather than doubles: that halves the size of the file, and a float is still precise
+to about a millionth of the size of the scene.
+
+*/
+
+#define SCENE_FILE_MAGIC "RTSCENE1"
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+
+struct Scene_File_Header
+{
+    char magic[8];           //< SCENE_FILE_MAGIC (without its terminating 0)
+    uint32_t version;        //< SCENE_FILE_VERSION
+    uint32_t byte_order;     //< SCENE_FILE_BYTE_ORDER, as written by the machine that wrote the file
+    uint32_t num_materials;
+    uint32_t has_background; //< If 0, rays that hit nothing see the default sky (otherwise the background)
+    uint64_t num_spheres;
+
+    // The camera.
+    double lookfrom[3];
+    double lookat[3];
+    double vfov; //< Vertical view angle in degrees
+    double defocus_angle;
+    double focus_dist;
+
+    float background[3];
+    uint32_t reserved[3]; //< 0 (room for later versions)
+};
+
+struct Scene_File_Material
+{
+    uint32_t type;          //< An enum Material (but not Isotropic)
+    float color[3];         //< The albedo (or for Diffuse_Light, the emitted radiance)
+    float fuzz;             //< (Metal)
+    float refraction_index; //< (Dielectric)
+    uint32_t reserved[2];
+};
+
+struct Scene_File_Sphere
+{
+    float center0[3]; //< Where the center is at the start of the shot
+    float center1[3]; //< And at the end (the same for a sphere that doesn't move)
+    float radius;
+    uint32_t material; //< Index into the materials of the file
+};
+
+_Static_assert(sizeof(struct Scene_File_Header) == 128, "the scene file header must be 128 bytes");
+_Static_assert(sizeof(struct Scene_File_Material) == 32, "scene file records must be 32 bytes");
+_Static_assert(sizeof(struct Scene_File_Sphere) == 32, "scene file records must be 32 bytes");
+
+/// @brief Make a header for a file with the given number of materials and spheres (and a default camera).
+static inline struct Scene_File_Header make_scene_file_header(uint32_t num_materials, uint64_t num_spheres)
+{
+    struct Scene_File_Header header = {
+        .version = SCENE_FILE_VERSION,
+        .byte_order = SCENE_FILE_BYTE_ORDER,
+        .num_materials = num_materials,
+        .num_spheres = num_spheres,
+        .lookfrom = {0, 0, 1},
+        .vfov = 90,
+        .focus_dist = 10,
+    };
+    memcpy(header.magic, SCENE_FILE_MAGIC, 8);
+    return header;
+}
+
+/// @brief Where the spheres start in a file with this header.
+static inline size_t scene_file_spheres_offset(const struct Scene_File_Header *header)
+{
+    return sizeof(struct Scene_File_Header) + (size_t)header->num_materials * sizeof(struct Scene_File_Material);
+}
+
+/// @brief Whether header is the header of a scene file we can read (on this machine), of file_size bytes.
+/// @param why Set to what is wrong with it (if anything).
+static inline bool scene_file_header_valid(const struct Scene_File_Header *header, size_t file_size,
+                                           const char **why)
+{
+    if (memcmp(header->magic, SCENE_FILE_MAGIC, 8) != 0)
+    {
+        *why = "not a scene file";
+        return false;
+    }
+    if (header->version != SCENE_FILE_VERSION)
+    {
+        *why = "unsupported version";
+        return false;
+    }
+    if (header->byte_order != SCENE_FILE_BYTE_ORDER)
+    {
+        *why = "written by a machine with a different byte order";
+        return false;
+    }
+    // The world is indexed with ints (see Scene).
+    if (header->num_spheres > INT32_MAX)
+    {
+        *why = "too many spheres";
+        return false;
+    }
+    if (file_size != scene_file_spheres_offset(header) + header->num_spheres * sizeof(struct Scene_File_Sphere))
+    {
+        *why = "the file size does not match its header (was it cut short?)";
+        return false;
+    }
+    return true;
+}
+
+/// @brief A scene file loaded into a world we can render.
+struct Scene_File
+{
+    struct Scene_File_Header header;
+
+    struct Material_Cfg *materials;
+    struct Hittable *world; //< One Sphere per sphere of the file
+    int world_length;
+};
+
+/// @brief A range of spheres for one thread to load.
+struct Scene_File_Job
+{
+    const struct Scene_File_Sphere *spheres; //< All the spheres of the (mapped) file
+    const struct Material_Cfg *materials;
+    uint32_t num_materials;
+
+    struct Hittable *world;
+    int first, end;
+
+    bool ok; //< Set to false if a sphere has a material that doesn't exist
+};
+
+static inline void scene_file_free(struct Scene_File *file)
+{
+    free(file->materials);
+    free(file->world);
+    file->materials = NULL;
+    file->world = NULL;
+    file->world_length = 0;
+}
+
+static int scene_file_load_spheres(void *arg)
+{
+    struct Scene_File_Job *job = arg;
+    job->ok = true;
+
+    for (int i = job->first; i < job->end; i++)
+    {
+        const struct Scene_File_Sphere sphere = job->spheres[i];
+        if (sphere.material >= job->num_materials)
+        {
+            job->ok = false;
+            return 0;
+        }
+
+        struct Hittable object = {.which = (enum Which_Hittable)Sphere};
+        for (int a = 0; a < 3; a++)
+        {
+            object.object.sphere.center.origin[a] = sphere.center0[a];
+            object.object.sphere.center.direction[a] = (double)sphere.center1[a] - sphere.center0[a];
+        }
+        object.object.sphere.radius = fmax(0, sphere.radius);
+        object.object.sphere.mat_cfg = &job->materials[sphere.material];
+        job->world[i] = object;
+    }
+
+    return 0;
+}
+
+/// @brief Load a scene file (see the top of this file). Call scene_file_free once you are done with it.
+/// @param num_threads How many threads turn the spheres into world objects (0 means one per hardware thread).
+/// @return false if the file could not be read (the reason is printed to stderr).
+static inline bool scene_file_load(struct Scene_File *file, const char *path, int num_threads)
+{
+    memset(file, 0, sizeof(*file));
+
+    struct Mapped_File mapped;
+    if (!map_file(&mapped, path))
+    {
+        fprintf(stderr, "Could not open the scene file %s\n", path);
+        return false;
+    }
+
+    const char *why = "too small to be a scene file";
+    if (mapped.size >= sizeof(struct Scene_File_Header))
+    {
+        memcpy(&file->header, mapped.data, sizeof(file->header));
+    }
+    if (mapped.size < sizeof(struct Scene_File_Header) || !scene_file_header_valid(&file->header, mapped.size, &why))
+    {
+        fprintf(stderr, "Could not read the scene file %s (%s)\n", path, why);
+        unmap_file(&mapped);
+        return false;
+    }
+
+    uint32_t num_materials = file->header.num_materials;
+    file->world_length = (int)file->header.num_spheres;
+    file->materials = malloc((num_materials > 0 ? num_materials : 1) * sizeof(struct Material_Cfg));
+    file->world = malloc((file->world_length > 0 ? (size_t)file->world_length : 1) * sizeof(struct Hittable));
+    if (file->materials == NULL || file->world == NULL)
+    {
+        fprintf(stderr, "Could not allocate the scene (%i spheres)!\n", file->world_length);
+        unmap_file(&mapped);
+        scene_file_free(file);
+        return false;
+    }
+
+    bool ok = true;
+    for (uint32_t m = 0; m < num_materials; m++)
+    {
+        struct Scene_File_Material material;
+        memcpy(&material, mapped.data + sizeof(struct Scene_File_Header) + m * sizeof(material), sizeof(material));
+
+        struct Material_Cfg *cfg = &file->materials[m];
+        *cfg = (struct Material_Cfg){.mat = (enum Material)material.type,
+                                     .fuzz = material.fuzz,
+                                     .refraction_index = material.refraction_index};
+        for (int c = 0; c < 3; c++)
+        {
+            cfg->albedo[c] = material.color[c];
+            cfg->emit[c] = material.color[c];
+        }
+        // Isotropic is the phase function of a medium, which would make a sphere's surface scatter like fog.
+        ok = ok && material.type <= Diffuse_Light && material.type != Isotropic;
+    }
+
+    // Turning the spheres into world objects is most of the work (and touches every page of the file),
+    // so each thread does its own range of them.
+    if (num_threads <= 0)
+    {
+        num_threads = hardware_threads();
+    }
+    if (num_threads > file->world_length)
+    {
+        num_threads = (file->world_length > 0) ? file->world_length : 1;
+    }
+
+    struct Scene_File_Job *jobs = malloc(num_threads * sizeof(struct Scene_File_Job));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the scene loading threads!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        jobs[t] = (struct Scene_File_Job){
+            .spheres = (const struct Scene_File_Sphere *)(mapped.data + scene_file_spheres_offset(&file->header)),
+            .materials = file->materials,
+            .num_materials = num_materials,
+            .world = file->world,
+            .first = (int)((long long)file->world_length * t / num_threads),
+            .end = (int)((long long)file->world_length * (t + 1) / num_threads),
+        };
+    }
+
+    run_jobs(scene_file_load_spheres, jobs, sizeof(struct Scene_File_Job), num_threads);
+    for (int t = 0; t < num_threads; t++)
+    {
+        ok = ok && jobs[t].ok;
+    }
+
+    free(jobs);
+    unmap_file(&mapped);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Could not read the scene file %s (it has an unknown material, or one a sphere can't have)\n",
+                path);
+        scene_file_free(file);
+        return false;
+    }
+    return true;
+}
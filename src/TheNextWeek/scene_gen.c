@@ -0,0 +1,526 @@
+#include "rtweekend.h"
+#include "scene_file.h"
+
+#include <string.h>
+
+/*
+
+Generates big scenes (thousands to hundreds of millions of spheres) as scene files (see scene_file.h),
+to see how the renderer (the BVH, memory, threads) scales with the size of the scene:
+
+    build\scene_gen.exe big.scene --count 1e6 --layout clustered --materials mixed --moving 0.1
+    build\theNextWeek.exe 6 big.scene > image.ppm
+
+Layouts:
+    grid      - the book's final scene, grown: a jittered grid of small spheres on the ground
+                (which is the top of a sphere big enough to look flat), seen from low down.
+    uniform   - spheres scattered uniformly through a cube.
+    clustered - clusters of a thousand spheres (each a ball of them, denser in its middle),
+                scattered through a cube with lots of empty space between them.
+    nested    - clusters of clusters of clusters...: 8 clusters, each made of 8 smaller ones, and so on,
+                down to the spheres (very uneven, like galaxies).
+
+Material mixes (from a palette of 64 materials, plus one for the ground): diffuse (all Lambertian), mixed
+(like the book: 80% diffuse, 15% metal and 5% glass), shiny (40% diffuse, 40% metal, 20% glass) and lights
+(mixed, with one sphere in 200 a light, against a dark background).
+
+Every sphere only depends on the seed and its index (its random numbers come from hashing them), so the
+same settings always make the same file, however many threads make it. The spheres are made in chunks,
+a chunk per thread at a time, and written to the file in order as they are done.
+
+*/
+
+/// @brief How many spheres each thread makes at a time (2 MB of file).
+#define SCENE_GEN_CHUNK 65536
+
+enum Scene_Gen_Layout
+{
+    Grid_Layout,
+    Uniform_Layout,
+    Clustered_Layout,
+    Nested_Layout,
+};
+
+enum Scene_Gen_Mix
+{
+    Diffuse_Mix,
+    Mixed_Mix,
+    Shiny_Mix,
+    Lights_Mix,
+};
+
+// The palette: the first diffuse materials, then metals, glasses, lights, and the ground.
+#define PALETTE_DIFFUSE 40
+#define PALETTE_METAL 14
+#define PALETTE_GLASS 6
+#define PALETTE_LIGHT 4
+#define PALETTE_SIZE (PALETTE_DIFFUSE + PALETTE_METAL + PALETTE_GLASS + PALETTE_LIGHT + 1)
+#define PALETTE_GROUND (PALETTE_SIZE - 1)
+
+#define CLUSTER_SIZE 1000
+
+struct Scene_Gen_Settings
+{
+    uint64_t count; //< How many spheres (not counting the ground of the grid layout)
+    enum Scene_Gen_Layout layout;
+    enum Scene_Gen_Mix mix;
+    double moving; //< The fraction of the spheres that move during the shot
+    uint64_t seed;
+
+    // Derived from the above (see scene_gen_prepare).
+    double extent;        //< The size of the layout (see scene_gen_sphere)
+    int levels;           //< (Nested) How many levels of clusters there are
+    double ground_radius; //< (Grid)
+};
+
+/// @brief A random number generator for one sphere (or cluster), seeded from the scene seed and its index.
+struct Scene_Gen_Random
+{
+    uint64_t state;
+};
+
+static inline struct Scene_Gen_Random scene_gen_random(uint64_t seed, uint64_t index, uint64_t stream)
+{
+    return (struct Scene_Gen_Random){.state = mix_bits(seed ^ mix_bits(index + 1) ^ mix_bits(stream << 56))};
+}
+
+/// @brief A random real in [0,1).
+static inline double scene_gen_next(struct Scene_Gen_Random *random)
+{
+    random->state += 0x9e3779b97f4a7c15ULL;
+    return (mix_bits(random->state) >> 11) * 0x1.0p-53;
+}
+
+/// @brief A random real with a standard normal distribution (Box-Muller).
+static inline double scene_gen_gaussian(struct Scene_Gen_Random *random)
+{
+    double u1 = 1 - scene_gen_next(random); // In (0,1], so the log is finite
+    double u2 = scene_gen_next(random);
+    double sin_angle, cos_angle;
+    sin_cos_turns(u2, &sin_angle, &cos_angle);
+    return sqrt(-2 * log(u1)) * cos_angle;
+}
+
+/// @brief Fill the palette (the same for every layout, for a given seed).
+static void scene_gen_palette(uint64_t seed, struct Scene_File_Material *palette)
+{
+    struct Scene_Gen_Random random = scene_gen_random(seed, 0, 1);
+    memset(palette, 0, PALETTE_SIZE * sizeof(struct Scene_File_Material));
+
+    for (int m = 0; m < PALETTE_SIZE; m++)
+    {
+        struct Scene_File_Material *material = &palette[m];
+        double r = scene_gen_next(&random), g = scene_gen_next(&random), b = scene_gen_next(&random);
+
+        if (m < PALETTE_DIFFUSE)
+        {
+            // Like the book: the product of two random colors (so mostly darker, saturated ones).
+            material->type = Lambertian;
+            material->color[0] = (float)(r * scene_gen_next(&random));
+            material->color[1] = (float)(g * scene_gen_next(&random));
+            material->color[2] = (float)(b * scene_gen_next(&random));
+        }
+        else if (m < PALETTE_DIFFUSE + PALETTE_METAL)
+        {
+            material->type = Metal;
+            material->color[0] = (float)(0.5 + 0.5 * r);
+            material->color[1] = (float)(0.5 + 0.5 * g);
+            material->color[2] = (float)(0.5 + 0.5 * b);
+            material->fuzz = (float)(0.5 * scene_gen_next(&random));
+        }
+        else if (m < PALETTE_DIFFUSE + PALETTE_METAL + PALETTE_GLASS)
+        {
+            material->type = Dielectric;
+            material->refraction_index = (float)(1.3 + 0.5 * r);
+        }
+        else if (m < PALETTE_GROUND)
+        {
+            material->type = Diffuse_Light;
+            material->color[0] = (float)(4 + 6 * r);
+            material->color[1] = (float)(4 + 6 * g);
+            material->color[2] = (float)(4 + 6 * b);
+        }
+        else
+        {
+            material->type = Lambertian;
+            material->color[0] = material->color[1] = material->color[2] = 0.5f;
+        }
+    }
+}
+
+/// @brief Pick a material from the palette for a sphere (by the mix).
+static inline uint32_t scene_gen_material(enum Scene_Gen_Mix mix, struct Scene_Gen_Random *random)
+{
+    // The fractions of diffuse, metal and glass spheres (the rest are lights).
+    static const double fractions[][3] = {
+        [Diffuse_Mix] = {1, 0, 0},
+        [Mixed_Mix] = {0.8, 0.15, 0.05},
+        [Shiny_Mix] = {0.4, 0.4, 0.2},
+        [Lights_Mix] = {0.795, 0.15, 0.05},
+    };
+
+    double choose = scene_gen_next(random);
+    double which = scene_gen_next(random);
+    const double *f = fractions[mix];
+
+    if (choose < f[0])
+    {
+        return (uint32_t)(which * PALETTE_DIFFUSE);
+    }
+    if (choose < f[0] + f[1])
+    {
+        return PALETTE_DIFFUSE + (uint32_t)(which * PALETTE_METAL);
+    }
+    if (choose < f[0] + f[1] + f[2])
+    {
+        return PALETTE_DIFFUSE + PALETTE_METAL + (uint32_t)(which * PALETTE_GLASS);
+    }
+    return PALETTE_DIFFUSE + PALETTE_METAL + PALETTE_GLASS + (uint32_t)(which * PALETTE_LIGHT);
+}
+
+/// @brief Work out the size of the layout, and point the camera at it.
+static void scene_gen_prepare(struct Scene_Gen_Settings *settings, struct Scene_File_Header *header)
+{
+    double n = (double)settings->count;
+
+    switch (settings->layout)
+    {
+    case Grid_Layout:
+    {
+        // The book's grid is 22 by 22 (with a sphere in each unit square), seen from (13, 2, 3).
+        settings->extent = ceil(sqrt(n));
+        settings->ground_radius = 1000 + 10 * settings->extent;
+        double s = fmax(1, settings->extent / 22);
+        memcpy(header->lookfrom, (double[3]){13 * s, 2 * s, 3 * s}, sizeof(header->lookfrom));
+        header->vfov = 20;
+        break;
+    }
+
+    case Uniform_Layout:
+        // About one sphere every 3 cubic units.
+        settings->extent = 1.5 * cbrt(n);
+        memcpy(header->lookfrom, (double[3]){0.6 * settings->extent, 0.5 * settings->extent, 2 * settings->extent},
+               sizeof(header->lookfrom));
+        header->vfov = 40;
+        break;
+
+    case Clustered_Layout:
+        settings->extent = 12 * cbrt(ceil(n / CLUSTER_SIZE));
+        memcpy(header->lookfrom,
+               (double[3]){0.6 * settings->extent, 0.5 * settings->extent, 2 * settings->extent + 10},
+               sizeof(header->lookfrom));
+        header->vfov = 40;
+        break;
+
+    case Nested_Layout:
+        // Enough levels that the smallest clusters (8 spheres each) hold everything.
+        settings->levels = 1;
+        while (settings->levels < 21 && pow(8, settings->levels) < n)
+        {
+            settings->levels++;
+        }
+        settings->extent = 10;
+        memcpy(header->lookfrom, (double[3]){14, 10, 36}, sizeof(header->lookfrom));
+        header->vfov = 45;
+        break;
+    }
+
+    memset(header->lookat, 0, sizeof(header->lookat));
+    header->defocus_angle = 0;
+    header->focus_dist = 10;
+
+    if (settings->mix == Lights_Mix)
+    {
+        header->has_background = 1;
+        header->background[0] = header->background[1] = 0.02f;
+        header->background[2] = 0.03f;
+    }
+}
+
+/// @brief Make the sphere with the given index (of the layout's spheres).
+static void scene_gen_sphere(const struct Scene_Gen_Settings *settings, uint64_t index, struct Scene_File_Sphere *out)
+{
+    struct Scene_Gen_Random random = scene_gen_random(settings->seed, index, 0);
+    double center[3];
+    double radius;
+
+    switch (settings->layout)
+    {
+    case Grid_Layout:
+    {
+        // Row by row, in unit squares around the origin.
+        uint64_t side = (uint64_t)settings->extent;
+        double x = (double)(index % side) - 0.5 * side + 0.9 * scene_gen_next(&random);
+        double z = (double)(index / side) - 0.5 * side + 0.9 * scene_gen_next(&random);
+
+        // Sit on the ground (which curves away slightly, far out).
+        double R = settings->ground_radius;
+        center[0] = x;
+        center[1] = sqrt(fmax(0, R * R - x * x - z * z)) - R + 0.2;
+        center[2] = z;
+        radius = 0.2;
+        break;
+    }
+
+    case Uniform_Layout:
+        for (int a = 0; a < 3; a++)
+        {
+            center[a] = (scene_gen_next(&random) - 0.5) * settings->extent;
+        }
+        radius = 0.1 + 0.2 * scene_gen_next(&random);
+        break;
+
+    case Clustered_Layout:
+    {
+        // Every sphere of a cluster finds the same cluster center (from the cluster's own random numbers).
+        struct Scene_Gen_Random cluster = scene_gen_random(settings->seed, index / CLUSTER_SIZE, 2);
+        double spread = 1 + 2 * scene_gen_next(&cluster);
+        for (int a = 0; a < 3; a++)
+        {
+            double cluster_center = (scene_gen_next(&cluster) - 0.5) * settings->extent;
+            center[a] = cluster_center + spread * scene_gen_gaussian(&random);
+        }
+        radius = 0.05 + 0.2 * scene_gen_next(&random);
+        break;
+    }
+
+    case Nested_Layout:
+    {
+        // Each level (from the biggest clusters down) picks one of the 8 corners of its cluster by the next
+        // digit of the index in base 8 (least significant first, so when count isn't a power of 8 the spheres
+        // are still spread over all the big clusters), and every cluster is shifted a little (the same way for
+        // all of its spheres, which share the digits so far).
+        double size = settings->extent;
+        center[0] = center[1] = center[2] = 0;
+        for (int level = 0; level < settings->levels; level++)
+        {
+            uint64_t digits = (level < 20) ? index & ((8ULL << (3 * level)) - 1) : index;
+            struct Scene_Gen_Random cluster = scene_gen_random(settings->seed, digits, 3 + level);
+            int corner = (int)((index >> (3 * level)) & 7);
+
+            for (int a = 0; a < 3; a++)
+            {
+                double side = ((corner >> a) & 1) ? 0.5 : -0.5;
+                center[a] += size * (side + 0.3 * (scene_gen_next(&cluster) - 0.5));
+            }
+            size *= 0.45;
+        }
+        radius = size * (0.5 + 0.5 * scene_gen_next(&random));
+        break;
+    }
+
+    default:
+        center[0] = center[1] = center[2] = 0;
+        radius = 0;
+        break;
+    }
+
+    // Moving spheres drift upward (and a little sideways) during the shot, by up to their size.
+    double move[3] = {0, 0, 0};
+    if (scene_gen_next(&random) < settings->moving)
+    {
+        move[0] = radius * (scene_gen_next(&random) - 0.5);
+        move[1] = 2 * radius * scene_gen_next(&random);
+        move[2] = radius * (scene_gen_next(&random) - 0.5);
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        out->center0[a] = (float)center[a];
+        out->center1[a] = (float)(center[a] + move[a]);
+    }
+    out->radius = (float)radius;
+    out->material = scene_gen_material(settings->mix, &random);
+}
+
+/// @brief A chunk of spheres for one thread to make.
+struct Scene_Gen_Job
+{
+    const struct Scene_Gen_Settings *settings;
+    uint64_t first, end; //< The indices of the spheres
+    struct Scene_File_Sphere *spheres;
+};
+
+static int scene_gen_chunk(void *arg)
+{
+    const struct Scene_Gen_Job *job = arg;
+    for (uint64_t i = job->first; i < job->end; i++)
+    {
+        scene_gen_sphere(job->settings, i, &job->spheres[i - job->first]);
+    }
+    return 0;
+}
+
+/// @brief Make the scene and write it to out.
+/// @return false if it could not be written.
+static bool scene_gen_write(FILE *out, struct Scene_Gen_Settings *settings, int num_threads)
+{
+    bool ground = settings->layout == Grid_Layout;
+    struct Scene_File_Header header = make_scene_file_header(PALETTE_SIZE, settings->count + ground);
+    scene_gen_prepare(settings, &header);
+
+    struct Scene_File_Material palette[PALETTE_SIZE];
+    scene_gen_palette(settings->seed, palette);
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(palette, sizeof(palette[0]), PALETTE_SIZE, out) == PALETTE_SIZE;
+
+    if (ground)
+    {
+        float R = (float)settings->ground_radius;
+        struct Scene_File_Sphere sphere = {.center0 = {0, -R, 0}, .center1 = {0, -R, 0}, .radius = R,
+                                           .material = PALETTE_GROUND};
+        ok = ok && fwrite(&sphere, sizeof(sphere), 1, out) == 1;
+    }
+
+    struct Scene_Gen_Job *jobs = malloc(num_threads * sizeof(struct Scene_Gen_Job));
+    struct Scene_File_Sphere *spheres =
+        malloc((size_t)num_threads * SCENE_GEN_CHUNK * sizeof(struct Scene_File_Sphere));
+    if (jobs == NULL || spheres == NULL)
+    {
+        fprintf(stderr, "Could not allocate the generator threads!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t first = 0; ok && first < settings->count; first += (uint64_t)num_threads * SCENE_GEN_CHUNK)
+    {
+        // A chunk per thread.
+        for (int t = 0; t < num_threads; t++)
+        {
+            uint64_t start = first + (uint64_t)t * SCENE_GEN_CHUNK;
+            uint64_t end = start + SCENE_GEN_CHUNK;
+            jobs[t] = (struct Scene_Gen_Job){
+                .settings = settings,
+                .first = (start < settings->count) ? start : settings->count,
+                .end = (end < settings->count) ? end : settings->count,
+                .spheres = spheres + (size_t)t * SCENE_GEN_CHUNK,
+            };
+        }
+        run_jobs(scene_gen_chunk, jobs, sizeof(struct Scene_Gen_Job), num_threads);
+
+        // The chunks follow each other in the buffer, so the whole round is written at once.
+        size_t made = (size_t)(jobs[num_threads - 1].end - first);
+        ok = fwrite(spheres, sizeof(struct Scene_File_Sphere), made, out) == made;
+
+        fprintf(stderr, "\rSpheres made: %llu of %llu", (unsigned long long)(first + made),
+                (unsigned long long)settings->count);
+    }
+
+    free(spheres);
+    free(jobs);
+    return ok;
+}
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "Usage: scene_gen out.scene [--count 1e6] [--layout grid|uniform|clustered|nested]\n"
+            "                 [--materials diffuse|mixed|shiny|lights] [--moving fraction] [--seed n] [--threads n]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    struct Scene_Gen_Settings settings = {.count = 1000000, .layout = Grid_Layout, .mix = Mixed_Mix, .seed = 1};
+    int num_threads = 0;
+
+    static const char *layouts[] = {[Grid_Layout] = "grid", [Uniform_Layout] = "uniform",
+                                    [Clustered_Layout] = "clustered", [Nested_Layout] = "nested"};
+    static const char *mixes[] = {[Diffuse_Mix] = "diffuse", [Mixed_Mix] = "mixed", [Shiny_Mix] = "shiny",
+                                  [Lights_Mix] = "lights"};
+
+    for (int i = 2; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        bool known = false;
+
+        if (strcmp(argv[i], "--count") == 0 && has_value)
+        {
+            // strtod, so 1e8 works too.
+            double count = strtod(argv[++i], NULL);
+            known = count >= 1 && count <= INT32_MAX - 1;
+            settings.count = (uint64_t)count;
+        }
+        else if (strcmp(argv[i], "--layout") == 0 && has_value)
+        {
+            i++;
+            for (int l = 0; l < 4; l++)
+            {
+                if (strcmp(argv[i], layouts[l]) == 0)
+                {
+                    settings.layout = (enum Scene_Gen_Layout)l;
+                    known = true;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--materials") == 0 && has_value)
+        {
+            i++;
+            for (int m = 0; m < 4; m++)
+            {
+                if (strcmp(argv[i], mixes[m]) == 0)
+                {
+                    settings.mix = (enum Scene_Gen_Mix)m;
+                    known = true;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--moving") == 0 && has_value)
+        {
+            settings.moving = atof(argv[++i]);
+            known = settings.moving >= 0 && settings.moving <= 1;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+        {
+            settings.seed = strtoull(argv[++i], NULL, 10);
+            known = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            num_threads = atoi(argv[++i]);
+            known = num_threads >= 0;
+        }
+
+        if (!known)
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (num_threads == 0)
+    {
+        num_threads = hardware_threads();
+    }
+
+    FILE *out = fopen(argv[1], "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    double start_time = seconds_now();
+    bool ok = scene_gen_write(out, &settings, num_threads);
+    ok = (fclose(out) == 0) && ok;
+    double elapsed = seconds_now() - start_time;
+
+    if (!ok)
+    {
+        fprintf(stderr, "\nCould not write %s!\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    double megabytes = (sizeof(struct Scene_File_Header) + PALETTE_SIZE * sizeof(struct Scene_File_Material) +
+                        (settings.count + (settings.layout == Grid_Layout)) * sizeof(struct Scene_File_Sphere)) /
+                       1e6;
+    fprintf(stderr, "\nDone! (%llu %s spheres, %.1f MB in %.2f seconds, %.0f spheres per second)\n",
+            (unsigned long long)settings.count, layouts[settings.layout], megabytes, elapsed,
+            settings.count / elapsed);
+    return EXIT_SUCCESS;
+}
@@ -5,6 +5,9 @@
 #include "vec3.h"
 #include "ray.h"
 #include "material.h"
+#include "onb.h"
+#include "aabb.h"
+#include "vec4.h"
 
 struct Sphere
 {
@@ -19,19 +22,19 @@ struct Sphere
     const struct Material_Cfg *mat_cfg; //< The material config for the material the sphere is made from.
 };
 
-/// @brief Sets the hit record normal vector. Note this will set rec->normal to have unit length.
-/// @param ray
-/// @param outward_normal Assumed to have unit length!
-/// @param rec
-void sphere_set_face_normal(const struct Ray *ray,
-                            const vec3 outward_normal, struct Hit_Record *rec)
+/// @brief The bounding box of the sphere (over the whole shot, from time 0 to time 1).
+static inline struct AABB sphere_bounding_box(const struct Sphere *sphere)
 {
+    point3 center0, center1;
+    memcpy(center0, sphere->center.origin, 3 * sizeof(double));
+    ray_at(center1, &sphere->center, 1.0);
 
-    // The dot product will be positive if the ray goes in the same direction of the outward normal.
-    // This happens if the ray travels from inside the sphere out.
-    rec->front_face = dot(ray->direction, outward_normal) < 0;
-    // We make sure the normal always goes against the ray
-    rec->front_face ? memcpy(rec->normal, outward_normal, 3 * sizeof(double)) : negate(rec->normal, (double *)outward_normal);
+    vec3 rvec = {sphere->radius, sphere->radius, sphere->radius};
+    point3 min, max;
+
+    struct AABB box0 = aabb_from_points(subtract(min, center0, rvec), add(max, center0, rvec));
+    struct AABB box1 = aabb_from_points(subtract(min, center1, rvec), add(max, center1, rvec));
+    return aabb_union(&box0, &box1);
 }
 
 /// @brief detect if the ray hits the sphere
@@ -39,18 +42,18 @@ void sphere_set_face_normal(const struct Ray *ray,
 /// @param ray_interval
 /// @param rec the Hit_Record
 /// @return bool if sphere was hit by given ray
-bool sphere_hit(const struct Sphere *sphere, const struct Ray *ray, struct Interval ray_interval, struct Hit_Record *rec)
+static inline bool sphere_hit(const struct Sphere *sphere, const struct Ray *ray, struct Interval ray_interval, struct Hit_Record *rec)
 {
     // Find out where the sphere center is at this ray's time.
-    point3 current_center;
-    ray_at(current_center, &sphere->center, ray->tm);
+    vec4 current_center = v4_add_scaled(v4_load(sphere->center.origin), v4_load(sphere->center.direction), ray->tm);
 
-    vec3 diff;
-    subtract(diff, current_center, (double *)ray->origin);
+    vec4 origin = v4_load(ray->origin);
+    vec4 direction = v4_load(ray->direction);
+    vec4 diff = v4_sub(current_center, origin);
 
-    double a = len_squared(ray->direction);
-    double h = dot(ray->direction, diff); // Note this is not b.
-    double c = len_squared(diff) - (sphere->radius * sphere->radius);
+    double a = v4_len_squared(direction);
+    double h = v4_dot(direction, diff); // Note this is not b.
+    double c = v4_len_squared(diff) - (sphere->radius * sphere->radius);
     double discriminant = h * h - a * c;
 
     if (discriminant < 0)
@@ -72,18 +75,96 @@ bool sphere_hit(const struct Sphere *sphere, const struct Ray *ray, struct Inter
     }
 
     rec->t = root;
-    ray_at(rec->p, ray, rec->t);
+    vec4 p = v4_add_scaled(origin, direction, root);
+    v4_store(rec->p, p);
 
     // Note that for the normal for a sphere: we can make it into a unit vector by dividing by the sphere radius.
     // This is because the radius is exactly the magnitude of this vector (rec.p - center).
-    vec3 outward_normal;
-    scale(outward_normal,
-          subtract(rec->normal, rec->p, current_center), (1 / sphere->radius));
+    vec4 outward_normal = v4_scale(v4_sub(p, current_center), 1 / sphere->radius);
 
-    sphere_set_face_normal(ray, outward_normal, rec);
+    // The dot product will be positive if the ray goes in the same direction of the outward normal.
+    // This happens if the ray travels from inside the sphere out.
+    // We make sure the normal always goes against the ray
+    rec->front_face = v4_dot(direction, outward_normal) < 0;
+    v4_store(rec->normal, rec->front_face ? outward_normal : v4_neg(outward_normal));
 
     // Copy a pointer to the Material_Cfg this Sphere has. We won't use the hit record to change the material.
     rec->mat_cfg = (struct Material_Cfg *)sphere->mat_cfg;
 
     return true;
 }
+
+/*
+
+To sample a sphere light from some point outside it, we only need to sample directions inside the cone
+of directions that hit the sphere (as seen from that point). This cone has half angle theta_max, where
+sin(theta_max) = radius / distance_to_center.
+Sampling uniformly over the solid angle of the cone gives every such direction the same probability density:
+1 / solid_angle, where solid_angle = 2 * pi * (1 - cos(theta_max)).
+
+*/
+
+/// @brief The cosine of the half angle of the cone of directions from origin that hit the sphere (at time).
+/// @return A value <= -1 if origin is inside the sphere (there is no such cone).
+static double sphere_cos_theta_max(const struct Sphere *sphere, const point3 origin, double time,
+                                   vec4 *to_center)
+{
+    vec4 current_center = v4_add_scaled(v4_load(sphere->center.origin), v4_load(sphere->center.direction), time);
+    *to_center = v4_sub(current_center, v4_load(origin));
+
+    double distance_squared = v4_len_squared(*to_center);
+    double radius_squared = sphere->radius * sphere->radius;
+    if (distance_squared <= radius_squared)
+    {
+        return -1;
+    }
+
+    return sqrt(1 - radius_squared / distance_squared);
+}
+
+/// @brief The probability density (over solid angle) that sphere_random_direction returns direction.
+static inline double sphere_pdf_value(const struct Sphere *sphere, const point3 origin, const vec3 direction, double time)
+{
+    vec4 to_center;
+    double cos_theta_max = sphere_cos_theta_max(sphere, origin, time, &to_center);
+    if (cos_theta_max <= -1)
+    {
+        return 0;
+    }
+
+    // The direction is in the cone if the angle between it and to_center is at most theta_max.
+    vec4 dir = v4_load(direction);
+    if (v4_dot(dir, to_center) < cos_theta_max * sqrt(v4_len_squared(dir) * v4_len_squared(to_center)))
+    {
+        return 0;
+    }
+
+    double solid_angle = 2 * pi * (1 - cos_theta_max);
+    return 1 / solid_angle;
+}
+
+/// @brief Sample a (unit) direction from origin that hits the sphere, uniformly over the solid angle it covers.
+/// @return false if origin is inside the sphere (we then can't sample it this way).
+static inline bool sphere_random_direction(const struct Sphere *sphere, const point3 origin, double time, vec3 direction)
+{
+    vec4 to_center;
+    double cos_theta_max = sphere_cos_theta_max(sphere, origin, time, &to_center);
+    if (cos_theta_max <= -1)
+    {
+        return false;
+    }
+
+    double r1 = random_zero_to_one();
+    double r2 = random_zero_to_one();
+
+    double z = 1 + r2 * (cos_theta_max - 1);
+    double phi = 2 * pi * r1;
+    double sin_theta = sqrt(fmax(0.0, 1 - z * z));
+    vec4 local = v4_make(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+
+    struct ONB onb;
+    onb_build_v4(&onb, to_center);
+    v4_store(direction, onb_local(&onb, local));
+
+    return true;
+}
@@ -0,0 +1,174 @@
+#include "rtweekend.h"
+#include "camera.h"
+#include "scene.h"
+#include "bvh.h"
+#include "scene_file.h"
+#include "tile_order.h"
+#include "perf_counters.h"
+
+#include <string.h>
+
+/*
+
+Compares the orders the tiles can be rendered in (see tile_order.h): renders a scene file with each of them
+(with all the hardware threads, and a BVH) and prints
+
+    - how long it took, and how many million samples per second that is,
+    - the last level cache misses per sample and the miss rate, and the instructions per sample,
+      if the hardware counters are available (see perf_counters.h),
+    - how long it took until the tile in the centre of the image was done (what a preview shows first).
+
+Every order must render exactly the same image (each pixel has its own random numbers).
+
+    build\scene_gen.exe big.scene --count 1000000 --layout clustered
+    build\tile_bench.exe big.scene
+
+Optionally pass the image width (the default is 400), the samples per pixel (the default is 4) and the tile size
+(the default is 16).
+
+*/
+
+/// @brief Where the tiles go (and when the centre tile was done).
+struct Bench_Target
+{
+    struct Pixels_Target pixels;
+    int center_x, center_y; //< The pixel in the centre of the image
+    double start;
+    double center_seconds; //< Written by the thread that renders the centre tile
+};
+
+static void bench_tile_done(void *arg, int x, int y, int width, int height, const color3 *tile)
+{
+    struct Bench_Target *target = arg;
+    pixels_tile_done(&target->pixels, x, y, width, height, tile);
+
+    if (target->center_x >= x && target->center_x < x + width && target->center_y >= y &&
+        target->center_y < y + height)
+    {
+        target->center_seconds = seconds_now() - target->start;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr,
+                "Pass the scene file to render (build\\tile_bench.exe big.scene [width] [samples] [tile size])\n");
+        return EXIT_FAILURE;
+    }
+    int image_width = (argc > 2) ? atoi(argv[2]) : 400;
+    int samples = (argc > 3) ? atoi(argv[3]) : 4;
+    int tile_size = (argc > 4) ? atoi(argv[4]) : CAMERA_TILE_SIZE;
+
+    struct Scene_File file;
+    if (!scene_file_load(&file, argv[1], 0))
+    {
+        return EXIT_FAILURE;
+    }
+
+    struct Scene scene;
+    if (!scene_init(&scene, file.world, file.world_length))
+    {
+        fprintf(stderr, "Could not allocate the scene lights!\n");
+        exit(EXIT_FAILURE);
+    }
+    struct BVH bvh = {0};
+    if (!bvh_build(&bvh, file.world, file.world_length))
+    {
+        fprintf(stderr, "Could not allocate the BVH!\n");
+        exit(EXIT_FAILURE);
+    }
+    scene.bvh = &bvh;
+
+    const struct Scene_File_Header *header = &file.header;
+    scene.has_background = header->has_background != 0;
+    scene.background[0] = header->background[0];
+    scene.background[1] = header->background[1];
+    scene.background[2] = header->background[2];
+    struct Camera_Config cam = {
+        .aspect_ratio = 16.0 / 9.0,
+        .image_width = image_width,
+        .samples_per_pixel = samples,
+        .max_depth = 50,
+        .vfov = header->vfov,
+        .lookfrom = {header->lookfrom[0], header->lookfrom[1], header->lookfrom[2]},
+        .lookat = {header->lookat[0], header->lookat[1], header->lookat[2]},
+        .vup = {0, 1, 0},
+        .defocus_angle = header->defocus_angle,
+        .focus_dist = header->focus_dist,
+        .tile_size = tile_size,
+        .seed = 1,
+    };
+    int image_height = camera_image_height(&cam);
+    double num_samples = (double)image_width * image_height * samples;
+
+    size_t image_size = (size_t)image_width * image_height;
+    color3 *reference = malloc(image_size * sizeof(color3));
+    color3 *pixels = malloc(image_size * sizeof(color3));
+    if (reference == NULL || pixels == NULL)
+    {
+        fprintf(stderr, "Could not allocate the image!\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%i spheres, %i x %i pixels, %i samples per pixel, %i x %i tiles, %i threads\n", file.world_length,
+           image_width, image_height, samples, tile_size, tile_size, hardware_threads());
+    printf("%-9s %9s %12s %15s %10s %16s %14s\n", "order", "seconds", "Msamples/s", "misses/sample", "miss rate",
+           "instr./sample", "centre tile");
+
+    bool all_match = true;
+    for (enum Tile_Order order = Scanline_Tiles; order <= Center_Out_Tiles; order++)
+    {
+        cam.tile_order = order;
+        struct Bench_Target target = {
+            .pixels = {.pixels = (order == Scanline_Tiles) ? reference : pixels, .image_width = image_width},
+            .center_x = image_width / 2,
+            .center_y = image_height / 2,
+        };
+        struct Render_Callbacks callbacks = {.tile_done = bench_tile_done, .arg = &target};
+
+        struct Perf_Counters counters;
+        bool counting = perf_counters_start(&counters);
+        target.start = seconds_now();
+        camera_render_tiles(&scene, &cam, &callbacks);
+        double seconds = seconds_now() - target.start;
+        int64_t counts[Perf_Num_Counters];
+        perf_counters_stop(&counters, counts);
+
+        printf("%-9s %9.3f %12.3f", tile_order_name(order), seconds, num_samples / seconds / 1e6);
+        if (counting && counts[Perf_Cache_Misses] >= 0 && counts[Perf_Cache_References] > 0)
+        {
+            printf(" %15.1f %9.1f%%", counts[Perf_Cache_Misses] / num_samples,
+                   100.0 * counts[Perf_Cache_Misses] / counts[Perf_Cache_References]);
+        }
+        else
+        {
+            printf(" %15s %10s", "n/a", "n/a");
+        }
+        if (counting && counts[Perf_Instructions] >= 0)
+        {
+            printf(" %16.0f", counts[Perf_Instructions] / num_samples);
+        }
+        else
+        {
+            printf(" %16s", "n/a");
+        }
+        printf(" %12.3f s\n", target.center_seconds);
+
+        if (order != Scanline_Tiles && memcmp(pixels, reference, image_size * sizeof(color3)) != 0)
+        {
+            fprintf(stderr, "The %s order rendered a different image than the scanline order!\n",
+                    tile_order_name(order));
+            all_match = false;
+        }
+    }
+
+    free(reference);
+    free(pixels);
+    bvh_free(&bvh);
+    scene_free(&scene);
+    scene_file_free(&file);
+
+    return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
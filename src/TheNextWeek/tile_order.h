@@ -0,0 +1,191 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <string.h>
+
+/*
+
+The order in which the render threads take the tiles of the image (see camera_render_tiles).
+
+Each thread keeps taking the next tile no one has started yet. In scanline order (left to right, then top to
+bottom), the next tile is usually next to the one before it, but the tile after the end of a row is on the
+other side of the image, and the tiles the threads are rendering at the same time are spread along a row.
+
+A space-filling curve visits the tiles so that tiles close together in the order are also close together on
+the image (in both directions), so the tiles rendered one after the other, by one thread or by all of them,
+shoot rays into the same part of the scene and find its BVH nodes and objects still in the cache:
+
+    - Morton (Z) order interleaves the bits of the tile's x and y. It is cheap, but jumps across the image
+      at the end of each block of tiles (the diagonal of the Z).
+    - Hilbert order never jumps: consecutive tiles always share an edge.
+
+A centre-out order renders the tiles closest to the centre of the image first (and the corners last), which is
+where the subject usually is, so a preview of a partly rendered image shows it first.
+
+The curves are made for a square of 2^k x 2^k tiles that covers the image, and the tiles outside the image
+are left out (which keeps the others in the same order).
+
+*/
+
+/// @brief The orders the tiles can be rendered in (see the comment above).
+enum Tile_Order
+{
+    Scanline_Tiles, //< Row by row (the default)
+    Morton_Tiles,
+    Hilbert_Tiles,
+    Center_Out_Tiles,
+};
+
+/// @brief The name of the order, as the --tile-order flag takes it.
+static inline const char *tile_order_name(enum Tile_Order order)
+{
+    switch (order)
+    {
+    case Morton_Tiles:
+        return "morton";
+    case Hilbert_Tiles:
+        return "hilbert";
+    case Center_Out_Tiles:
+        return "center";
+    case Scanline_Tiles:
+    default:
+        return "scanline";
+    }
+}
+
+/// @brief Parse the name of an order (see tile_order_name).
+/// @return false if there is no such order.
+static inline bool tile_order_parse(const char *name, enum Tile_Order *order)
+{
+    for (enum Tile_Order o = Scanline_Tiles; o <= Center_Out_Tiles; o++)
+    {
+        if (strcmp(name, tile_order_name(o)) == 0)
+        {
+            *order = o;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Where the tile (x, y) is along the Morton curve.
+static inline uint64_t tile_morton_index(uint32_t x, uint32_t y)
+{
+    uint64_t index = 0;
+    for (int bit = 0; bit < 32; bit++)
+    {
+        index |= (uint64_t)((x >> bit) & 1) << (2 * bit);
+        index |= (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return index;
+}
+
+/// @brief Where the tile (x, y) is along the Hilbert curve over a side x side square (side a power of 2).
+static inline uint64_t tile_hilbert_index(uint32_t side, uint32_t x, uint32_t y)
+{
+    uint64_t index = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) != 0;
+        uint32_t ry = (y & s) != 0;
+        index += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant, so the curve in it starts where the curve in the quadrant before it ended.
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return index;
+}
+
+/// @brief A tile and where it is in the order (see tile_order_make).
+struct Tile_Order_Key
+{
+    uint64_t key;
+    int tile;
+};
+
+/// @brief Order by key, then (for tiles with the same key) in scanline order.
+static int tile_order_compare(const void *a, const void *b)
+{
+    const struct Tile_Order_Key *ka = a;
+    const struct Tile_Order_Key *kb = b;
+    if (ka->key != kb->key)
+    {
+        return (ka->key > kb->key) ? 1 : -1;
+    }
+    return (ka->tile > kb->tile) - (ka->tile < kb->tile);
+}
+
+/// @brief Fill sequence[0..tiles_x * tiles_y) with the tiles (y * tiles_x + x) in the given order.
+/// @return false if we could not allocate the memory to sort them (sequence is then in scanline order).
+static inline bool tile_order_make(enum Tile_Order order, int tiles_x, int tiles_y, int *sequence)
+{
+    const int num_tiles = tiles_x * tiles_y;
+    for (int tile = 0; tile < num_tiles; tile++)
+    {
+        sequence[tile] = tile;
+    }
+    if (order == Scanline_Tiles)
+    {
+        return true;
+    }
+
+    struct Tile_Order_Key *keys = malloc(num_tiles * sizeof(struct Tile_Order_Key));
+    if (keys == NULL)
+    {
+        return false;
+    }
+
+    uint32_t side = 1;
+    while (side < (uint32_t)tiles_x || side < (uint32_t)tiles_y)
+    {
+        side *= 2;
+    }
+
+    for (int tile = 0; tile < num_tiles; tile++)
+    {
+        uint32_t x = tile % tiles_x;
+        uint32_t y = tile / tiles_x;
+
+        uint64_t key;
+        switch (order)
+        {
+        case Morton_Tiles:
+            key = tile_morton_index(x, y);
+            break;
+        case Hilbert_Tiles:
+            key = tile_hilbert_index(side, x, y);
+            break;
+        case Center_Out_Tiles:
+        default:
+        {
+            // Twice the distance (in tiles) from the centre of the tile to the centre of the image, squared.
+            int64_t dx = 2 * (int64_t)x + 1 - tiles_x;
+            int64_t dy = 2 * (int64_t)y + 1 - tiles_y;
+            key = (uint64_t)(dx * dx + dy * dy);
+            break;
+        }
+        }
+
+        keys[tile] = (struct Tile_Order_Key){.key = key, .tile = tile};
+    }
+
+    qsort(keys, num_tiles, sizeof(struct Tile_Order_Key), tile_order_compare);
+    for (int k = 0; k < num_tiles; k++)
+    {
+        sequence[k] = keys[k].tile;
+    }
+
+    free(keys);
+    return true;
+}
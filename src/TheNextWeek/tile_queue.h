@@ -0,0 +1,73 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <stdatomic.h>
+
+/*
+
+A queue of finished tiles, from the render threads (any number of them) to the one thread that takes them off
+(the image writer, see Image_Writer in camera.h), that never takes a lock, so a render thread that finishes a
+tile never waits for the writer (or for the other render threads) to put it on.
+
+Each tile is put on the queue exactly once, so a queue with room for all the tiles of the image never fills up
+(and never wraps around): a render thread claims the next slot with an atomic add and then stores its value in
+it, and the taker goes through the slots in order, stopping at the first slot whose value is not stored yet.
+
+*/
+
+struct Tile_Queue
+{
+    atomic_int *slots; //< The values put on the queue, plus 1 (0 for a slot whose value is not stored yet)
+    int capacity;
+    atomic_int tail; //< The next slot to claim
+    int head;        //< The next slot to take (only the taker touches this)
+};
+
+/// @brief Make an empty queue with room for capacity values.
+/// @return false if it could not be allocated.
+static inline bool tile_queue_init(struct Tile_Queue *queue, int capacity)
+{
+    *queue = (struct Tile_Queue){.slots = calloc(capacity, sizeof(atomic_int)), .capacity = capacity};
+    atomic_init(&queue->tail, 0);
+    return queue->slots != NULL;
+}
+
+static inline void tile_queue_free(struct Tile_Queue *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+/// @brief Put value (at least 0) on the queue. Any thread may call this.
+/// @remark Everything the thread wrote before this is seen by the thread that takes the value off.
+static inline void tile_queue_push(struct Tile_Queue *queue, int value)
+{
+    int slot = atomic_fetch_add_explicit(&queue->tail, 1, memory_order_relaxed);
+    atomic_store_explicit(&queue->slots[slot], value + 1, memory_order_release);
+}
+
+/// @brief Take the next value off the queue (only one thread may call this).
+/// @return false if there is none yet.
+static inline bool tile_queue_pop(struct Tile_Queue *queue, int *value)
+{
+    if (queue->head == queue->capacity)
+    {
+        return false;
+    }
+    int stored = atomic_load_explicit(&queue->slots[queue->head], memory_order_acquire);
+    if (stored == 0)
+    {
+        return false;
+    }
+    *value = stored - 1;
+    queue->head++;
+    return true;
+}
+
+/// @brief Whether there is no value to take off the queue yet (only the thread that takes them may call this).
+static inline bool tile_queue_empty(struct Tile_Queue *queue)
+{
+    return queue->head == queue->capacity ||
+           atomic_load_explicit(&queue->slots[queue->head], memory_order_acquire) == 0;
+}
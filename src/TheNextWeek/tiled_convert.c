@@ -0,0 +1,147 @@
+#include "rtweekend.h"
+#include "tiled_image.h"
+#include "mapped_file.h"
+#include "color.h"
+#include "pfm.h"
+
+#include <string.h>
+
+/*
+
+Turn a tiled image file (written by theNextWeek with --tiled, see tiled_image.h) into an image:
+
+    build\theNextWeek.exe 6 big.scene --size 65536x32768 --tiled pano.tiles
+    build\tiled_convert.exe pano.tiles pano.pfm
+    build\tiled_convert.exe pano.tiles pano.ppm
+
+If the output ends in .pfm we write the linear colors (to tonemap later), otherwise a binary (P6) ppm image with
+the renderer's own gamma correction (see write_color).
+
+The input is memory mapped and read one row of tiles at a time, from the top down (and we let the OS drop each
+row of tiles once it is converted), and the output is written one row at a time, so this takes the memory of a
+row of tiles no matter how tall the image is.
+
+*/
+
+/// @brief Move to the given position of the file (which can be past 2GB, even where long is 32 bits).
+static bool file_seek(FILE *file, long long position)
+{
+#ifdef _WIN32
+    return _fseeki64(file, position, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)position, SEEK_SET) == 0;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: tiled_convert input.tiles output.(pfm|ppm)\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *input_path = argv[1];
+    const char *output_path = argv[2];
+
+    size_t path_length = strlen(output_path);
+    bool pfm = path_length >= 4 && strcmp(output_path + path_length - 4, ".pfm") == 0;
+
+    double start_time = seconds_now();
+
+    struct Mapped_File input;
+    if (!map_file(&input, input_path) || input.size < sizeof(struct Tiled_Image_Header))
+    {
+        fprintf(stderr, "Could not read %s\n", input_path);
+        return EXIT_FAILURE;
+    }
+
+    struct Tiled_Image_Header header;
+    memcpy(&header, input.data, sizeof(header));
+
+    const char *why;
+    if (!tiled_image_header_valid(&header, input.size, &why))
+    {
+        fprintf(stderr, "Can't convert %s (%s)\n", input_path, why);
+        return EXIT_FAILURE;
+    }
+
+    const int image_width = (int)header.image_width;
+    const int image_height = (int)header.image_height;
+    const int tile_size = (int)header.tile_size;
+    const uint32_t tiles_x = tiled_image_tiles_x(&header);
+
+    FILE *out = fopen(output_path, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    float *rgb = malloc((size_t)image_width * 3 * sizeof(float));
+    unsigned char *bytes = malloc((size_t)image_width * 3);
+    if (rgb == NULL || bytes == NULL)
+    {
+        fprintf(stderr, "Could not allocate the rows!\n");
+        return EXIT_FAILURE;
+    }
+
+    bool ok = pfm ? fprintf(out, "PF\n%i %i\n-1.0\n", image_width, image_height) > 0
+                  : fprintf(out, "P6\n%i %i\n255\n", image_width, image_height) > 0;
+    long long pfm_header_length = ftell(out);
+
+    for (int j = 0; ok && j < image_height; j++)
+    {
+        uint32_t tile_y = j / tile_size;
+        for (uint32_t tile_x = 0; tile_x < tiles_x; tile_x++)
+        {
+            int i0 = (int)tile_x * tile_size;
+            int width = (image_width - i0 < tile_size) ? image_width - i0 : tile_size;
+            const unsigned char *tile = input.data + tiled_image_tile_offset(&header, tile_x, tile_y);
+            tiled_image_load_row(tile, &header, j % tile_size, width, &rgb[(size_t)i0 * 3]);
+        }
+
+        // Done with this row of tiles.
+        if (j % tile_size == tile_size - 1 || j == image_height - 1)
+        {
+            mapped_file_release(&input, tiled_image_tile_offset(&header, 0, tile_y), tiles_x * header.tile_stride);
+        }
+
+        if (!pfm)
+        {
+            for (size_t c = 0; c < (size_t)image_width * 3; c++)
+            {
+                bytes[c] = (unsigned char)(256 * interval_clamp(&intensity, linear_to_gamma(rgb[c])));
+            }
+            ok = fwrite(bytes, 1, (size_t)image_width * 3, out) == (size_t)image_width * 3;
+            continue;
+        }
+
+        if (!pfm_little_endian())
+        {
+            pfm_swap_bytes(rgb, (size_t)image_width * 3);
+        }
+
+        // We read the input from the top down (so the OS can read ahead), but PFM rows go from the bottom up.
+        long long position = pfm_header_length + (long long)(image_height - 1 - j) * image_width * 3 * sizeof(float);
+        ok = file_seek(out, position) &&
+             fwrite(rgb, sizeof(float), (size_t)image_width * 3, out) == (size_t)image_width * 3;
+    }
+
+    ok = (fclose(out) == 0) && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Converted %s (%i x %i, %u samples per pixel, %s) into %s in %.1f s\n", input_path, image_width,
+            image_height, header.samples_per_pixel, (header.format == Tiled_Half) ? "halfs" : "floats", output_path,
+            seconds_now() - start_time);
+
+    unmap_file(&input);
+    free(rgb);
+    free(bytes);
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+
+A tiled image file holds a render too big to keep in memory (say, a 64K x 32K panorama: 24 GB of floats,
+or twice that as the doubles the renderer works in). The renderer maps the file into memory and writes each tile
+into it as soon as it is done (see camera_render_tiled), and then lets the OS write that tile out and drop it
+from memory (see mapped_file_write_back), so the memory a render takes does not grow with the image.
+build\tiled_convert.exe then streams it into a PFM or ppm image, again through a bounded window of it.
+
+The file is a header, padded to the alignment, then the tiles, row of tiles by row of tiles from the top, left
+to right. Each tile is tile_size x tile_size pixels of 3 channels (red, green, blue: linear colors, as floats or
+as halfs, see Tiled_Format), row by row, also in the tiles at the right and bottom edges (which the image only
+partly covers; the rest is 0). Each tile starts at a multiple of the alignment, which is the page size of the
+machine that wrote the file (see mapped_file_page_size), so the pages of one tile are never shared with another
+tile (and can be written out and dropped on their own). With 64 pixel tiles (the default for tiled renders) and
+4 KB pages, a tile is exactly 12 pages of floats or 6 of halfs; with 16 KB or 64 KB pages (on some arm64 and
+ppc64 machines) each tile is padded to a whole number of those.
+
+Like accumulation files, everything is stored in the byte order of the machine that wrote it.
+
+*/
+
+#define TILED_IMAGE_MAGIC "RTTILED1"
+#define TILED_IMAGE_VERSION 2
+#define TILED_IMAGE_BYTE_ORDER 0x01020304u
+
+/// @brief The tile size of tiled renders, if no other is given.
+#define TILED_IMAGE_TILE_SIZE 64
+
+/// @brief What each channel of a pixel is stored as.
+enum Tiled_Format
+{
+    Tiled_Float, //< 32 bit floats
+    Tiled_Half,  //< 16 bit floats (half the size, with about 3 significant digits and a range up to 65504)
+};
+
+struct Tiled_Image_Header
+{
+    char magic[8];           //< TILED_IMAGE_MAGIC (without its terminating 0)
+    uint32_t version;        //< TILED_IMAGE_VERSION
+    uint32_t byte_order;     //< TILED_IMAGE_BYTE_ORDER, as written by the machine that wrote the file
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t tile_size;      //< Pixels across (and down) each tile
+    uint32_t format;         //< An enum Tiled_Format
+    uint64_t tile_stride;    //< Bytes from one tile to the next (a multiple of alignment)
+    uint32_t samples_per_pixel;
+    uint32_t alignment;      //< Where the tiles start (and what each tile is padded to): a power of 2
+    uint64_t seed;           //< The seed of the render
+    uint64_t reserved[1];    //< 0 (room for later versions)
+};
+
+/// @brief Convert a float to a half (rounding to the nearest half, ties to even).
+static inline uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent == 0xff)
+    {
+        // Infinity stays infinity, and NaN stays NaN.
+        return (uint16_t)(sign | 0x7c00 | ((mantissa != 0) ? 0x200 : 0));
+    }
+
+    int half_exponent = (int)exponent - 127 + 15;
+    if (half_exponent >= 31)
+    {
+        return (uint16_t)(sign | 0x7c00); // Too big for a half
+    }
+
+    uint32_t half, rest, halfway;
+    if (half_exponent > 0)
+    {
+        half = sign | ((uint32_t)half_exponent << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+    else
+    {
+        // A subnormal half (or 0): the mantissa, with its leading 1, shifted down past the smallest exponent.
+        if (half_exponent < -10)
+        {
+            return (uint16_t)sign;
+        }
+        int shift = 14 - half_exponent;
+        mantissa |= 0x800000;
+        half = sign | (mantissa >> shift);
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+
+    // Rounding up may carry into the exponent, which is still the right half (up to infinity).
+    if (rest > halfway || (rest == halfway && (half & 1)))
+    {
+        half++;
+    }
+    return (uint16_t)half;
+}
+
+/// @brief Convert a half to a float (exactly).
+static inline float half_to_float(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+
+    if (exponent == 0)
+    {
+        // 0 or a subnormal half (which is a normal float).
+        float value = ldexpf((float)mantissa, -24);
+        return (sign != 0) ? -value : value;
+    }
+
+    uint32_t bits = sign | ((exponent == 31) ? 0x7f800000 : (exponent + 127 - 15) << 23) | (mantissa << 13);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+/// @brief The bytes of the pixels of one tile (before padding it to the alignment).
+static inline uint64_t tiled_image_tile_bytes(uint32_t tile_size, enum Tiled_Format format)
+{
+    return (uint64_t)tile_size * tile_size * 3 * ((format == Tiled_Half) ? 2 : 4);
+}
+
+/// @brief Make the header of a tiled image.
+/// @param alignment The page size of the machine that writes it (a power of 2, at least the size of the header).
+static inline struct Tiled_Image_Header make_tiled_image_header(int image_width, int image_height, int tile_size,
+                                                                enum Tiled_Format format, int samples_per_pixel,
+                                                                uint64_t seed, uint32_t alignment)
+{
+    uint64_t tile_bytes = tiled_image_tile_bytes(tile_size, format);
+    struct Tiled_Image_Header header = {
+        .version = TILED_IMAGE_VERSION,
+        .byte_order = TILED_IMAGE_BYTE_ORDER,
+        .image_width = (uint32_t)image_width,
+        .image_height = (uint32_t)image_height,
+        .tile_size = (uint32_t)tile_size,
+        .format = format,
+        .tile_stride = (tile_bytes + alignment - 1) / alignment * alignment,
+        .samples_per_pixel = (uint32_t)samples_per_pixel,
+        .alignment = alignment,
+        .seed = seed,
+    };
+    memcpy(header.magic, TILED_IMAGE_MAGIC, 8);
+    return header;
+}
+
+/// @brief How many tiles across and down the image is.
+static inline uint32_t tiled_image_tiles_x(const struct Tiled_Image_Header *header)
+{
+    return (header->image_width + header->tile_size - 1) / header->tile_size;
+}
+
+static inline uint32_t tiled_image_tiles_y(const struct Tiled_Image_Header *header)
+{
+    return (header->image_height + header->tile_size - 1) / header->tile_size;
+}
+
+/// @brief Where the tile (tile_x, tile_y) starts in the file.
+static inline uint64_t tiled_image_tile_offset(const struct Tiled_Image_Header *header, uint32_t tile_x,
+                                               uint32_t tile_y)
+{
+    return header->alignment + ((uint64_t)tile_y * tiled_image_tiles_x(header) + tile_x) * header->tile_stride;
+}
+
+/// @brief The size of the whole file.
+static inline uint64_t tiled_image_file_size(const struct Tiled_Image_Header *header)
+{
+    return tiled_image_tile_offset(header, 0, tiled_image_tiles_y(header));
+}
+
+/// @brief Whether header is the header of a tiled image we can read (on this machine), in a file of
+/// file_size bytes.
+/// @param why Set to what is wrong with it (if anything).
+static inline bool tiled_image_header_valid(const struct Tiled_Image_Header *header, uint64_t file_size,
+                                            const char **why)
+{
+    if (memcmp(header->magic, TILED_IMAGE_MAGIC, 8) != 0)
+    {
+        *why = "not a tiled image";
+        return false;
+    }
+    if (header->version != TILED_IMAGE_VERSION)
+    {
+        *why = "unknown version";
+        return false;
+    }
+    if (header->byte_order != TILED_IMAGE_BYTE_ORDER)
+    {
+        *why = "written on a machine with a different byte order";
+        return false;
+    }
+    if (header->image_width == 0 || header->image_height == 0 || header->tile_size == 0 ||
+        header->format > Tiled_Half ||
+        header->tile_stride < tiled_image_tile_bytes(header->tile_size, header->format) ||
+        header->alignment < sizeof(struct Tiled_Image_Header) || (header->alignment & (header->alignment - 1)) != 0 ||
+        header->tile_stride % header->alignment != 0)
+    {
+        *why = "bad size or format";
+        return false;
+    }
+    if (file_size < tiled_image_file_size(header))
+    {
+        *why = "the file is cut short";
+        return false;
+    }
+    return true;
+}
+
+/// @brief Store the pixels (width x height of them, row by row) of a tile, where the tile is in the file.
+static inline void tiled_image_store_tile(unsigned char *tile, const struct Tiled_Image_Header *header,
+                                          const color3 *pixels, int width, int height)
+{
+    const int tile_size = (int)header->tile_size;
+    for (int row = 0; row < height; row++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            size_t at = ((size_t)row * tile_size + i) * 3;
+            const double *color = pixels[row * width + i];
+            if (header->format == Tiled_Half)
+            {
+                uint16_t half[3] = {float_to_half((float)color[0]), float_to_half((float)color[1]),
+                                    float_to_half((float)color[2])};
+                memcpy(tile + at * 2, half, sizeof(half));
+            }
+            else
+            {
+                float rgb[3] = {(float)color[0], (float)color[1], (float)color[2]};
+                memcpy(tile + at * 4, rgb, sizeof(rgb));
+            }
+        }
+    }
+}
+
+/// @brief Read the first width pixels of a row of a tile (where the tile is in the file) as floats (3 per pixel).
+static inline void tiled_image_load_row(const unsigned char *tile, const struct Tiled_Image_Header *header, int row,
+                                        int width, float *rgb)
+{
+    size_t first = (size_t)row * header->tile_size * 3;
+    if (header->format == Tiled_Half)
+    {
+        for (int c = 0; c < 3 * width; c++)
+        {
+            uint16_t half;
+            memcpy(&half, tile + (first + c) * 2, 2);
+            rgb[c] = half_to_float(half);
+        }
+    }
+    else
+    {
+        memcpy(rgb, tile + first * 4, (size_t)width * 3 * sizeof(float));
+    }
+}
@@ -0,0 +1,384 @@
+#include "rtweekend.h"
+#include "pfm.h"
+
+#include <string.h>
+
+/*
+
+Turn a linear PFM image (see pfm.h; run build\theNextWeek.exe 3 --pfm > image.pfm) into a viewable
+8 bit ppm or png image, without rendering it again:
+
+    build\tonemap.exe image.pfm image.png --exposure 1 --curve filmic --gamma 2.2
+
+1. Exposure scales the radiance by 2^stops (like opening the lens of a real camera).
+2. The curve maps the (unbounded) radiance into [0,1]:
+       clamp    - just cut everything brighter than white (what the renderer does for ppm output).
+       reinhard - x / (1 + x), which compresses highlights smoothly but also flattens the whole image.
+       filmic   - a fit of the ACES filmic curve (by Krzysztof Narkowicz), which keeps contrast in the
+                  mid tones and rolls the highlights off gently (like film).
+3. Gamma correction (see color.h). The default gamma 2 matches the renderer's own ppm output.
+
+Gamma correction needs a pow per color component, which is most of the work.
+Since the curve output is in [0,1], we instead look the final byte up in a table indexed by the curve output
+quantized to 16 bits (which is finer than the 8 bits we end up with).
+The rows are split between threads, so even a 4K image takes only milliseconds.
+
+*/
+
+#define TONEMAP_LUT_SIZE 65536
+
+enum Tonemap_Curve
+{
+    Clamp_Curve,
+    Reinhard_Curve,
+    Filmic_Curve,
+};
+
+struct Tonemap_Settings
+{
+    double exposure; //< In stops (the radiance is scaled by 2^exposure)
+    double gamma;
+    enum Tonemap_Curve curve;
+    int num_threads; //< 0 means one per hardware thread
+};
+
+/// @brief A band of rows for one thread to tonemap.
+struct Tonemap_Job
+{
+    const float *rgb;
+    int image_width;
+    int first_row, end_row;
+
+    unsigned char *bytes; //< Where row j starts at bytes + j * stride
+    size_t stride;
+
+    float scale; //< 2^exposure
+    enum Tonemap_Curve curve;
+    const unsigned char *lut; //< The gamma corrected byte for each quantized curve output
+};
+
+static inline float tonemap_curve(float x, enum Tonemap_Curve curve)
+{
+    switch (curve)
+    {
+    case Reinhard_Curve:
+        return x / (1.0f + x);
+
+    case Filmic_Curve:
+        return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+
+    default:
+        return x;
+    }
+}
+
+static int tonemap_rows(void *arg)
+{
+    const struct Tonemap_Job *job = arg;
+
+    for (int j = job->first_row; j < job->end_row; j++)
+    {
+        const float *in = job->rgb + (size_t)j * job->image_width * 3;
+        unsigned char *out = job->bytes + j * job->stride;
+
+        for (int c = 0; c < job->image_width * 3; c++)
+        {
+            float x = in[c] * job->scale;
+            x = (x > 0) ? tonemap_curve(x, job->curve) : 0; // This also maps NaN to 0.
+            x = (x < 1) ? x : 1;
+            out[c] = job->lut[(int)(x * (TONEMAP_LUT_SIZE - 1) + 0.5f)];
+        }
+    }
+
+    return 0;
+}
+
+/// @brief Tonemap the linear image rgb into bytes (3 per pixel), where row j starts at bytes + j * stride.
+static void tonemap(const float *rgb, int image_width, int image_height, unsigned char *bytes, size_t stride,
+                    const struct Tonemap_Settings *settings)
+{
+    // Translate the gamma corrected value in [0,1] to the byte range [0,255] (the same way as write_color).
+    static unsigned char lut[TONEMAP_LUT_SIZE];
+    for (int i = 0; i < TONEMAP_LUT_SIZE; i++)
+    {
+        double corrected = pow((double)i / (TONEMAP_LUT_SIZE - 1), 1.0 / settings->gamma);
+        lut[i] = (unsigned char)(256 * fmin(corrected, 0.999));
+    }
+
+    int num_threads = (settings->num_threads > 0) ? settings->num_threads : hardware_threads();
+    if (num_threads > image_height)
+    {
+        num_threads = image_height;
+    }
+
+    struct Tonemap_Job *jobs = malloc(num_threads * sizeof(struct Tonemap_Job));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the tonemap threads!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        jobs[t] = (struct Tonemap_Job){
+            .rgb = rgb,
+            .image_width = image_width,
+            .first_row = (int)((long long)image_height * t / num_threads),
+            .end_row = (int)((long long)image_height * (t + 1) / num_threads),
+            .bytes = bytes,
+            .stride = stride,
+            .scale = (float)pow(2.0, settings->exposure),
+            .curve = settings->curve,
+            .lut = lut,
+        };
+    }
+
+    run_jobs(tonemap_rows, jobs, sizeof(struct Tonemap_Job), num_threads);
+    free(jobs);
+}
+
+/*
+
+A png file is a signature followed by chunks (IHDR: the image size and format, IDAT: the pixels, IEND).
+The pixels are zlib compressed, but zlib allows "stored" (uncompressed) blocks,
+so we can write a valid png without a compression library (the file is just about as big as a ppm).
+Every row starts with a filter type byte (0, no filter).
+
+*/
+
+static uint32_t png_crc_table[256];
+
+static void png_make_crc_table()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        png_crc_table[n] = c;
+    }
+}
+
+static uint32_t png_crc(uint32_t crc, const unsigned char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = png_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_be32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+/// @brief Write a png chunk whose data is the concatenation of part_a and part_b (either may be empty).
+static bool png_write_chunk(FILE *out, const char *type, const unsigned char *part_a, size_t length_a,
+                            const unsigned char *part_b, size_t length_b)
+{
+    unsigned char header[8];
+    put_be32(header, (uint32_t)(length_a + length_b));
+    memcpy(header + 4, type, 4);
+
+    uint32_t crc = png_crc(0xffffffffu, header + 4, 4);
+    crc = png_crc(crc, part_a, length_a);
+    crc = png_crc(crc, part_b, length_b);
+
+    unsigned char crc_bytes[4];
+    put_be32(crc_bytes, crc ^ 0xffffffffu);
+
+    return fwrite(header, 1, 8, out) == 8 &&
+           fwrite(part_a, 1, length_a, out) == length_a &&
+           fwrite(part_b, 1, length_b, out) == length_b &&
+           fwrite(crc_bytes, 1, 4, out) == 4;
+}
+
+/// @brief Write rows (each one filter byte and then 3 bytes per pixel) as a png file.
+static bool write_png(FILE *out, const unsigned char *rows, int image_width, int image_height)
+{
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+    png_make_crc_table();
+
+    unsigned char ihdr[13];
+    put_be32(ihdr, (uint32_t)image_width);
+    put_be32(ihdr + 4, (uint32_t)image_height);
+    ihdr[8] = 8;  // bits per channel
+    ihdr[9] = 2;  // RGB
+    ihdr[10] = 0; // compression (deflate)
+    ihdr[11] = 0; // filter method
+    ihdr[12] = 0; // no interlacing
+
+    bool ok = fwrite(signature, 1, 8, out) == 8 && png_write_chunk(out, "IHDR", ihdr, 13, NULL, 0);
+
+    // The zlib stream: a 2 byte header, stored blocks of up to 65535 bytes, and the Adler-32 of the data.
+    size_t length = (size_t)image_height * (1 + 3 * (size_t)image_width);
+    static const unsigned char zlib_header[2] = {0x78, 0x01};
+    ok = ok && png_write_chunk(out, "IDAT", zlib_header, 2, NULL, 0);
+
+    uint32_t adler_a = 1, adler_b = 0;
+    for (size_t start = 0; ok && start < length; start += 65535)
+    {
+        size_t block = (length - start < 65535) ? length - start : 65535;
+
+        unsigned char block_header[5];
+        block_header[0] = (start + block == length) ? 1 : 0; // Whether this is the last block
+        block_header[1] = (unsigned char)block;
+        block_header[2] = (unsigned char)(block >> 8);
+        block_header[3] = (unsigned char)~block;
+        block_header[4] = (unsigned char)(~block >> 8);
+
+        for (size_t i = start; i < start + block; i++)
+        {
+            adler_a = (adler_a + rows[i]) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+
+        ok = png_write_chunk(out, "IDAT", block_header, 5, rows + start, block);
+    }
+
+    unsigned char adler[4];
+    put_be32(adler, (adler_b << 16) | adler_a);
+    ok = ok && png_write_chunk(out, "IDAT", adler, 4, NULL, 0);
+
+    return ok && png_write_chunk(out, "IEND", NULL, 0, NULL, 0);
+}
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "Usage: tonemap input.pfm output.(ppm|png) [options]\n"
+            "    --exposure stops   Scale the radiance by 2^stops (default 0)\n"
+            "    --gamma g          Gamma (default 2, like the renderer's ppm output)\n"
+            "    --curve name       clamp (default), reinhard or filmic\n"
+            "    --threads n        How many threads to use (default one per hardware thread)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    const char *input_path = argv[1];
+    const char *output_path = argv[2];
+    struct Tonemap_Settings settings = {.exposure = 0, .gamma = 2, .curve = Clamp_Curve, .num_threads = 0};
+
+    for (int i = 3; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(argv[i], "--exposure") == 0 && has_value)
+        {
+            settings.exposure = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gamma") == 0 && has_value)
+        {
+            settings.gamma = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            settings.num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--curve") == 0 && has_value)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "clamp") == 0)
+            {
+                settings.curve = Clamp_Curve;
+            }
+            else if (strcmp(name, "reinhard") == 0)
+            {
+                settings.curve = Reinhard_Curve;
+            }
+            else if (strcmp(name, "filmic") == 0)
+            {
+                settings.curve = Filmic_Curve;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown curve %s\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!(settings.gamma > 0))
+    {
+        fprintf(stderr, "The gamma must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t path_length = strlen(output_path);
+    bool png = path_length >= 4 && strcmp(output_path + path_length - 4, ".png") == 0;
+
+    double start_time = seconds_now();
+
+    FILE *in = fopen(input_path, "rb");
+    float *rgb;
+    int image_width, image_height;
+    if (in == NULL || !read_pfm(in, &rgb, &image_width, &image_height))
+    {
+        fprintf(stderr, "Could not read %s (as a color PFM file)\n", input_path);
+        return EXIT_FAILURE;
+    }
+    fclose(in);
+
+    double read_time = seconds_now();
+
+    // For a png every row starts with its filter type byte (0); a ppm is just the pixels.
+    size_t stride = (png ? 1 : 0) + 3 * (size_t)image_width;
+    unsigned char *bytes = calloc(stride * image_height, 1);
+    if (bytes == NULL)
+    {
+        fprintf(stderr, "Could not allocate the image!\n");
+        return EXIT_FAILURE;
+    }
+
+    tonemap(rgb, image_width, image_height, bytes + (png ? 1 : 0), stride, &settings);
+
+    double tonemap_time = seconds_now();
+
+    FILE *out = fopen(output_path, "wb");
+    bool ok = out != NULL;
+    if (ok && png)
+    {
+        ok = write_png(out, bytes, image_width, image_height);
+    }
+    else if (ok)
+    {
+        ok = fprintf(out, "P6\n%i %i\n255\n", image_width, image_height) > 0 &&
+             fwrite(bytes, 1, stride * image_height, out) == stride * image_height;
+    }
+    if (out != NULL)
+    {
+        ok = (fclose(out) == 0) && ok;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Tonemapped %ix%i pixels (read %.1f ms, tonemap %.1f ms, write %.1f ms)\n",
+            image_width, image_height, 1000 * (read_time - start_time),
+            1000 * (tonemap_time - read_time), 1000 * (seconds_now() - tonemap_time));
+
+    free(bytes);
+    free(rgb);
+    return 0;
+}
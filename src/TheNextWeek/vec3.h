@@ -15,7 +15,7 @@ typedef vec3 color3;
 
 /// @brief Negate a vector (multiply each coordinate by -1).
 /// @remark Note that ret can potentially be equal to vec (this would mean we modify vec in place).
-double *negate(vec3 ret, vec3 vec)
+static inline double *negate(vec3 ret, vec3 vec)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -26,7 +26,7 @@ double *negate(vec3 ret, vec3 vec)
 }
 
 /// @brief Add vec2 to vec1.
-double *add(vec3 ret, vec3 vec1, vec3 vec2)
+static inline double *add(vec3 ret, vec3 vec1, vec3 vec2)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -36,7 +36,7 @@ double *add(vec3 ret, vec3 vec1, vec3 vec2)
 }
 
 /// @brief Subtract vec2 from vec1.
-double *subtract(vec3 ret, vec3 vec1, vec3 vec2)
+static inline double *subtract(vec3 ret, vec3 vec1, vec3 vec2)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -48,7 +48,7 @@ double *subtract(vec3 ret, vec3 vec1, vec3 vec2)
 
 /// @brief Scale vec by a scalar t.
 /// @remark Note that ret can potentially be equal to vec (this would mean we modify vec in place).
-double *scale(vec3 ret, vec3 vec, double t)
+static inline double *scale(vec3 ret, vec3 vec, double t)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -59,7 +59,7 @@ double *scale(vec3 ret, vec3 vec, double t)
 }
 
 /// @brief Multiply vec1 by vec2 element wise.
-double *multiply(vec3 ret, vec3 vec1, vec3 vec2)
+static inline double *multiply(vec3 ret, vec3 vec1, vec3 vec2)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -90,7 +90,7 @@ static inline void print(const vec3 vec)
 /// @brief Get a unit vector in vec's direction.
 /// @remark Note that ret can potentially be equal to vec (this would mean we modify vec in place).
 /// @remark Assumes vec is not a zero vector (so it has a magnitude different than 0).
-double *unit(vec3 ret, vec3 vec)
+static inline double *unit(vec3 ret, vec3 vec)
 {
     double magnitude = len(vec);
     for (int i = 0; i < 3; i++)
@@ -107,7 +107,7 @@ static inline double dot(const vec3 u, const vec3 v)
 }
 
 /// @brief The cross product of two vec3.
-double *cross(vec3 ret, vec3 vec1, vec3 vec2)
+static inline double *cross(vec3 ret, vec3 vec1, vec3 vec2)
 {
     ret[0] = vec1[1] * vec2[2] - vec1[2] * vec2[1];
     ret[1] = vec1[2] * vec2[0] - vec1[0] * vec2[2];
@@ -131,22 +131,76 @@ static inline void vec_rand_in_range(vec3 vec, double min, double max)
     vec[2] = random_in_range(min, max);
 }
 
-/// @brief Generate a random vector on the surface of the unit sphere.
-/// @remark Rejecting a random vector outside the unit sphere (rejection sampling)
-/// ensures a uniform distribution of sample directions on the surface of the unit sphere.
+/*
+
+The samplers below map two uniform random numbers straight to the shape (a closed form), rather than drawing random
+points in a cube or square until one lands inside the sphere or disk (rejection sampling). Rejection loops run for
+an unpredictable number of rounds (so the CPU mispredicts their branches) on the hottest path of the renderer,
+once per diffuse or fuzzy metal bounce and per defocus sample. Each mapping here is straight line code (the only
+choices in it are selects, which the compiler turns into conditional moves or vector blends rather than branches),
+so the very same mappings also serve the batch samplers (see sample_batch.h).
+
+*/
+
+/// @brief Map two uniform random numbers in [0,1) to a point on the unit sphere (uniformly distributed).
+/// @remark Archimedes: z is uniform in [-1,1] on the unit sphere, so we pick z and then an angle around the z axis.
+static inline void uniforms_to_unit_vector(double u1, double u2, double *x, double *y, double *z)
+{
+    double height = 1 - 2 * u1;
+    double r2 = 1 - height * height;
+    double r = sqrt((r2 > 0) ? r2 : 0);
+
+    double sin_phi, cos_phi;
+    sin_cos_turns(u2, &sin_phi, &cos_phi);
+
+    *x = r * cos_phi;
+    *y = r * sin_phi;
+    *z = height;
+}
+
+/// @brief Map two uniform random numbers in [0,1) to a direction on the hemisphere around the z axis,
+/// with a probability density of cos(theta) / pi (theta being the angle from the z axis).
+static inline void uniforms_to_cosine_direction(double u1, double u2, double *x, double *y, double *z)
+{
+    double sqrt_u2 = sqrt(u2);
+
+    double sin_phi, cos_phi;
+    sin_cos_turns(u1, &sin_phi, &cos_phi);
+
+    *x = cos_phi * sqrt_u2;
+    *y = sin_phi * sqrt_u2;
+    *z = sqrt(1 - u2);
+}
+
+/// @brief Map two uniform random numbers in [0,1) to a point on the unit disk (uniformly distributed),
+/// with Shirley and Chiu's concentric mapping (which maps squares around the center to circles around it).
+static inline void uniforms_to_disk(double u1, double u2, double *x, double *y)
+{
+    double a = 2 * u1 - 1;
+    double b = 2 * u2 - 1;
+
+    // Each of the 4 triangular quarters of the square [-1,1]^2 (split by its diagonals) maps to a quarter of the disk.
+    // At the very center (a = b = 0) the ratio would be 0 / 0, but the radius is 0 there anyway.
+    bool horizontal = fabs(a) > fabs(b);
+    double r = horizontal ? a : b;
+    double safe_r = (r == 0) ? 1 : r;
+    double ratio = (horizontal ? b : a) / safe_r;
+    double turns = horizontal ? 0.125 * ratio : 0.25 - 0.125 * ratio;
+
+    // turns is in [-1/8, 3/8]; sin_cos_turns takes [0,1).
+    double sin_phi, cos_phi;
+    sin_cos_turns(turns + ((turns < 0) ? 1 : 0), &sin_phi, &cos_phi);
+
+    *x = r * cos_phi;
+    *y = r * sin_phi;
+}
+
+/// @brief Generate a random vector on the surface of the unit sphere (uniformly distributed).
 static inline void random_unit_vector(vec3 vec)
 {
-    while (true)
-    {
-        vec_rand_in_range(vec, -1, 1);
-        double lensq = len_squared(vec);
-        if (1e-160 < lensq && lensq <= 1)
-        {
-            // Normalize the vector
-            scale(vec, vec, (1 / sqrt(lensq)));
-            return;
-        }
-    }
+    double u1 = random_zero_to_one();
+    double u2 = random_zero_to_one();
+    uniforms_to_unit_vector(u1, u2, &vec[0], &vec[1], &vec[2]);
 }
 
 /// @brief Generate a random vector on the hemisphere (facing the same direction as the surface normal).
@@ -155,29 +209,30 @@ static inline void random_on_hemisphere(vec3 rand_vec, const vec3 normal)
 {
     random_unit_vector(rand_vec);
 
-    if (dot(rand_vec, normal) <= 0.0) // NOT in the same hemisphere as the normal
-    {
-        negate(rand_vec, rand_vec);
-    }
+    // Flip the vector if it is NOT in the same hemisphere as the normal.
+    double sign = (dot(rand_vec, normal) <= 0.0) ? -1 : 1;
+    scale(rand_vec, rand_vec, sign);
 }
 
-/// @brief Generate a random vector on the unit disk.
-/// @remark Rejecting a random vector outside the unit square (rejection sampling)
-/// ensures a uniform distribution of sample directions on the surface of the unit disk.
+/// @brief Generate a random (unit) direction on the hemisphere around the z axis, with a probability density
+/// proportional to cos(theta) (the angle from the z axis); the density is cos(theta) / pi.
+/// @remark Transform the result with an ONB to get a direction around some other axis (like a surface normal).
+static inline void random_cosine_direction(vec3 vec)
+{
+    double r1 = random_zero_to_one();
+    double r2 = random_zero_to_one();
+    uniforms_to_cosine_direction(r1, r2, &vec[0], &vec[1], &vec[2]);
+}
+
+/// @brief Generate a random vector on the unit disk (uniformly distributed).
 static inline void random_in_unit_disk(vec3 vec)
 {
+    double u1 = random_zero_to_one();
+    double u2 = random_zero_to_one();
+    uniforms_to_disk(u1, u2, &vec[0], &vec[1]);
+
     // The z coordinate stays fixed at 0.
     vec[2] = 0;
-
-    while (true)
-    {
-        vec[0] = random_in_range(-1, 1);
-        vec[1] = random_in_range(-1, 1);
-        if (len_squared(vec) < 1)
-        {
-            return;
-        }
-    }
 }
 
 /// @brief Reflect the vector vec (possibly in place) off a surface with the given surface normal.
@@ -213,7 +268,7 @@ static inline double *refract(vec3 ret, const vec3 uv, const vec3 normal, double
 }
 
 /// @brief Return true if the vector is close to zero in all dimensions.
-bool near_zero(const vec3 vec)
+static inline bool near_zero(const vec3 vec)
 {
     double s = 1e-8;
     return (fabs(vec[0]) < s) && (fabs(vec[1]) < s) && (fabs(vec[2]) < s);
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "rtweekend.h"
+
+/*
+
+The vec3 helpers (see vec3.h) work on arrays through pointers. Any of those pointers might point to the same
+array as any other, so the compiler has to keep every intermediate result in memory (and we need a named
+temporary for every step), which gets in the way of keeping vectors in registers and of vectorizing the math.
+
+A vec4 is a *value*: three doubles padded to four (the last lane is always 0), passed and returned by value.
+Four doubles are exactly one AVX register (or two SSE2 registers), so each operation is one or two instructions,
+and since the functions are inlined, the vectors never leave the registers in between.
+Where neither is available we fall back to plain C on the four lanes (which the compiler can still vectorize).
+
+We use vec4 for the math inside the hot functions (camera rays, sphere intersection, scattering),
+and keep using vec3 arrays for storage (in rays, hit records, objects, ...); v4_load and v4_store move between them.
+
+Note: with AVX a vec4 needs 32 byte alignment, which the compiler only guarantees for variables
+(not for memory from malloc), so don't put a vec4 inside anything that is malloc'd.
+
+*/
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VEC4_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VEC4_SSE2
+#endif
+
+typedef union
+{
+#if defined(VEC4_AVX)
+    __m256d v;
+#elif defined(VEC4_SSE2)
+    __m128d v[2]; //< (x, y) and (z, 0)
+#endif
+    double e[4]; //< x, y, z and 0
+} vec4;
+
+/// @brief Make a vec4 from its 3 coordinates.
+static inline vec4 v4_make(double x, double y, double z)
+{
+    vec4 ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_set_pd(0, z, y, x);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_set_pd(y, x);
+    ret.v[1] = _mm_set_pd(0, z);
+#else
+    ret.e[0] = x;
+    ret.e[1] = y;
+    ret.e[2] = z;
+    ret.e[3] = 0;
+#endif
+    return ret;
+}
+
+static inline vec4 v4_zero()
+{
+    return v4_make(0, 0, 0);
+}
+
+/// @brief Load a vec3 (array) into a vec4.
+static inline vec4 v4_load(const double *restrict vec)
+{
+    return v4_make(vec[0], vec[1], vec[2]);
+}
+
+/// @brief Store a vec4 into a vec3 (array).
+static inline double *v4_store(double *restrict ret, vec4 vec)
+{
+    ret[0] = vec.e[0];
+    ret[1] = vec.e[1];
+    ret[2] = vec.e[2];
+    return ret;
+}
+
+static inline vec4 v4_add(vec4 a, vec4 b)
+{
+    vec4 ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_add_pd(a.v, b.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_add_pd(a.v[0], b.v[0]);
+    ret.v[1] = _mm_add_pd(a.v[1], b.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = a.e[i] + b.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Returns a - b.
+static inline vec4 v4_sub(vec4 a, vec4 b)
+{
+    vec4 ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_sub_pd(a.v, b.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_sub_pd(a.v[0], b.v[0]);
+    ret.v[1] = _mm_sub_pd(a.v[1], b.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = a.e[i] - b.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Multiply a by b element wise.
+static inline vec4 v4_mul(vec4 a, vec4 b)
+{
+    vec4 ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_mul_pd(a.v, b.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_mul_pd(a.v[0], b.v[0]);
+    ret.v[1] = _mm_mul_pd(a.v[1], b.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = a.e[i] * b.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Scale vec by a scalar t.
+static inline vec4 v4_scale(vec4 vec, double t)
+{
+    vec4 ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_mul_pd(vec.v, _mm256_set1_pd(t));
+#elif defined(VEC4_SSE2)
+    __m128d tt = _mm_set1_pd(t);
+    ret.v[0] = _mm_mul_pd(vec.v[0], tt);
+    ret.v[1] = _mm_mul_pd(vec.v[1], tt);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = vec.e[i] * t;
+    }
+#endif
+    return ret;
+}
+
+/// @brief Returns a + t * b (the step most vector math here is made of).
+static inline vec4 v4_add_scaled(vec4 a, vec4 b, double t)
+{
+    return v4_add(a, v4_scale(b, t));
+}
+
+static inline vec4 v4_neg(vec4 vec)
+{
+    return v4_sub(v4_zero(), vec);
+}
+
+/// @brief Returns the dot product of a and b.
+static inline double v4_dot(vec4 a, vec4 b)
+{
+#if defined(VEC4_AVX)
+    __m256d m = _mm256_mul_pd(a.v, b.v);
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1)); // (x + z, y + 0)
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+#elif defined(VEC4_SSE2)
+    __m128d sum = _mm_add_pd(_mm_mul_pd(a.v[0], b.v[0]), _mm_mul_pd(a.v[1], b.v[1])); // (x + z, y + 0)
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+#else
+    return a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2];
+#endif
+}
+
+static inline double v4_len_squared(vec4 vec)
+{
+    return v4_dot(vec, vec);
+}
+
+static inline double v4_len(vec4 vec)
+{
+    return sqrt(v4_dot(vec, vec));
+}
+
+/// @brief Returns a unit vector in vec's direction.
+/// @remark Assumes vec is not a zero vector (so it has a magnitude different than 0).
+static inline vec4 v4_unit(vec4 vec)
+{
+    return v4_scale(vec, 1.0 / v4_len(vec));
+}
+
+/// @brief Returns the cross product of a and b.
+static inline vec4 v4_cross(vec4 a, vec4 b)
+{
+#if defined(__AVX2__)
+    // a.yzx * b.zxy - a.zxy * b.yzx (the padding lane stays 0, since it only ever meets itself).
+    __m256d a_yzx = _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m256d b_yzx = _mm256_permute4x64_pd(b.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m256d c = _mm256_sub_pd(_mm256_mul_pd(a.v, b_yzx), _mm256_mul_pd(a_yzx, b.v)); // (a x b).yzx
+    vec4 ret;
+    ret.v = _mm256_permute4x64_pd(c, _MM_SHUFFLE(3, 0, 2, 1));
+    return ret;
+#else
+    return v4_make(a.e[1] * b.e[2] - a.e[2] * b.e[1],
+                   a.e[2] * b.e[0] - a.e[0] * b.e[2],
+                   a.e[0] * b.e[1] - a.e[1] * b.e[0]);
+#endif
+}
+
+/// @brief Return true if the vector is close to zero in all dimensions.
+static inline bool v4_near_zero(vec4 vec)
+{
+    double s = 1e-8;
+    return (fabs(vec.e[0]) < s) && (fabs(vec.e[1]) < s) && (fabs(vec.e[2]) < s);
+}
+
+/// @brief Reflect vec off a surface with the given surface normal (see reflect in vec3.h).
+static inline vec4 v4_reflect(vec4 vec, vec4 normal)
+{
+    return v4_add_scaled(vec, normal, -2 * v4_dot(vec, normal));
+}
+
+/// @brief Refract the (unit) incident vector uv through a surface with the given normal (see refract in vec3.h).
+static inline vec4 v4_refract(vec4 uv, vec4 normal, double etai_over_etat)
+{
+    double cos_theta = fmin(-v4_dot(uv, normal), 1.0);
+    vec4 r_out_perp = v4_scale(v4_add_scaled(uv, normal, cos_theta), etai_over_etat);
+    vec4 r_out_parallel = v4_scale(normal, -sqrt(fabs(1.0 - v4_len_squared(r_out_perp))));
+    return v4_add(r_out_perp, r_out_parallel);
+}
@@ -0,0 +1,292 @@
+#include "rtweekend.h"
+#include "vec4.h"
+#include "camera.h"
+#include "sphere.h"
+#include "material.h"
+#include "sample_batch.h"
+
+/*
+
+A micro-benchmark of the vec4 value type (see vec4.h) against the vec3 pointer helpers (see vec3.h):
+
+    1. Per operation: each operation applied over arrays of random vectors.
+    2. Per sample: the work of one camera sample that hits a diffuse sphere (make the camera ray,
+       intersect it with the sphere, and scatter off the surface), once written with the vec3 helpers
+       (as the renderer used to do it) and once with the renderer's own (vec4) functions.
+    3. The random samplers: the rejection loops the renderer used to use, against the closed forms in vec3.h,
+       and the batch versions (see sample_batch.h).
+
+Run build\vec_bench.exe (optionally with how many million iterations to run each test, the default is 4).
+
+*/
+
+#define BENCH_VECTORS 1024
+
+static vec3 bench_a[BENCH_VECTORS], bench_b[BENCH_VECTORS], bench_out[BENCH_VECTORS];
+
+/// @brief Keeps the compiler from optimizing away the results we don't look at.
+static volatile double bench_sink;
+
+/// @brief Run body the given number of times (with k going over the test vectors),
+/// and set ns to how many nanoseconds each time took.
+#define BENCH_TIME(ns, iterations, body)                   \
+    do                                                     \
+    {                                                      \
+        double start_ = seconds_now();                     \
+        for (long it_ = 0; it_ < (iterations); it_++)      \
+        {                                                  \
+            int k = (int)(it_ & (BENCH_VECTORS - 1));      \
+            (void)k;                                       \
+            body;                                          \
+        }                                                  \
+        ns = 1e9 * (seconds_now() - start_) / (iterations); \
+    } while (0)
+
+static void bench_report(const char *name, double scalar_ns, double vec4_ns)
+{
+    printf("%-22s %8.2f ns %8.2f ns %7.2fx\n", name, scalar_ns, vec4_ns, scalar_ns / vec4_ns);
+}
+
+/*
+    The camera sample as it was written with the vec3 helpers (before vec4).
+*/
+
+struct Scalar_Camera
+{
+    point3 center, pixel00_loc;
+    vec3 pixel_delta_u, pixel_delta_v;
+};
+
+static inline void scalar_get_ray(struct Ray *ray, const struct Scalar_Camera *cam, int i, int j)
+{
+    point3 offset = {random_zero_to_one() - 0.5, random_zero_to_one() - 0.5, 0};
+
+    point3 temp1, temp2, pixel_sample;
+    scale(temp1, (double *)cam->pixel_delta_u, (i + offset[0]));
+    scale(temp2, (double *)cam->pixel_delta_v, (j + offset[1]));
+    add(pixel_sample, (double *)cam->pixel00_loc, add(temp1, temp1, temp2));
+
+    memcpy(ray->origin, cam->center, 3 * sizeof(double));
+    subtract(ray->direction, pixel_sample, ray->origin);
+    ray->tm = random_zero_to_one();
+}
+
+static inline bool scalar_sphere_hit(const struct Sphere *sphere, const struct Ray *ray, struct Interval ray_interval,
+                                     struct Hit_Record *rec)
+{
+    point3 current_center;
+    ray_at(current_center, &sphere->center, ray->tm);
+
+    vec3 diff;
+    subtract(diff, current_center, (double *)ray->origin);
+
+    double a = len_squared(ray->direction);
+    double h = dot(ray->direction, diff);
+    double c = len_squared(diff) - (sphere->radius * sphere->radius);
+    double discriminant = h * h - a * c;
+    if (discriminant < 0)
+    {
+        return false;
+    }
+
+    double sqrtd = sqrt(discriminant);
+    double root = (h - sqrtd) / a;
+    if (!interval_surrounds(&ray_interval, root))
+    {
+        root = (h + sqrtd) / a;
+        if (!interval_surrounds(&ray_interval, root))
+        {
+            return false;
+        }
+    }
+
+    rec->t = root;
+    ray_at(rec->p, ray, rec->t);
+
+    vec3 outward_normal;
+    scale(outward_normal, subtract(rec->normal, rec->p, current_center), (1 / sphere->radius));
+    rec->front_face = dot(ray->direction, outward_normal) < 0;
+    rec->front_face ? memcpy(rec->normal, outward_normal, 3 * sizeof(double)) : negate(rec->normal, outward_normal);
+    rec->mat_cfg = (struct Material_Cfg *)sphere->mat_cfg;
+    return true;
+}
+
+static inline void scalar_lambertian_scatter(const struct Hit_Record *rec, struct Ray *scattered)
+{
+    // The ONB of the normal, and a cosine weighted direction around it.
+    vec3 w, v, u, a = {0, 0, 0};
+    unit(w, (double *)rec->normal);
+    a[(fabs(w[0]) > 0.9) ? 1 : 0] = 1;
+    unit(v, cross(v, w, a));
+    cross(u, w, v);
+
+    vec3 local;
+    random_cosine_direction(local);
+    for (int i = 0; i < 3; i++)
+    {
+        scattered->direction[i] = local[0] * u[i] + local[1] * v[i] + local[2] * w[i];
+    }
+    memcpy(scattered->origin, rec->p, 3 * sizeof(double));
+}
+
+/*
+    The rejection samplers the renderer used before the closed forms in vec3.h.
+*/
+
+static inline void rejection_unit_vector(vec3 vec)
+{
+    while (true)
+    {
+        vec_rand_in_range(vec, -1, 1);
+        double lensq = len_squared(vec);
+        if (1e-160 < lensq && lensq <= 1)
+        {
+            scale(vec, vec, (1 / sqrt(lensq)));
+            return;
+        }
+    }
+}
+
+static inline void rejection_in_unit_disk(vec3 vec)
+{
+    vec[2] = 0;
+    while (true)
+    {
+        vec[0] = random_in_range(-1, 1);
+        vec[1] = random_in_range(-1, 1);
+        if (len_squared(vec) < 1)
+        {
+            return;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = (long)(((argc > 1) ? atof(argv[1]) : 4) * 1e6);
+
+    random_seed(1);
+    for (int k = 0; k < BENCH_VECTORS; k++)
+    {
+        vec_rand_in_range(bench_a[k], -1, 1);
+        vec_rand_in_range(bench_b[k], -1, 1);
+    }
+
+#if defined(__AVX2__)
+    printf("vec4 uses AVX2\n\n");
+#elif defined(VEC4_AVX)
+    printf("vec4 uses AVX\n\n");
+#elif defined(VEC4_SSE2)
+    printf("vec4 uses SSE2\n\n");
+#else
+    printf("vec4 uses plain C\n\n");
+#endif
+    printf("%-22s %11s %11s %8s\n", "operation", "vec3", "vec4", "speedup");
+
+    // Per operation
+
+    double scalar_ns, vec4_ns;
+
+    BENCH_TIME(scalar_ns, iterations, add(bench_out[k], bench_a[k], bench_b[k]));
+    BENCH_TIME(vec4_ns, iterations, v4_store(bench_out[k], v4_add(v4_load(bench_a[k]), v4_load(bench_b[k]))));
+    bench_report("add", scalar_ns, vec4_ns);
+
+    BENCH_TIME(scalar_ns, iterations, bench_sink = dot(bench_a[k], bench_b[k]));
+    BENCH_TIME(vec4_ns, iterations, bench_sink = v4_dot(v4_load(bench_a[k]), v4_load(bench_b[k])));
+    bench_report("dot", scalar_ns, vec4_ns);
+
+    BENCH_TIME(scalar_ns, iterations, cross(bench_out[k], bench_a[k], bench_b[k]));
+    BENCH_TIME(vec4_ns, iterations, v4_store(bench_out[k], v4_cross(v4_load(bench_a[k]), v4_load(bench_b[k]))));
+    bench_report("cross", scalar_ns, vec4_ns);
+
+    BENCH_TIME(scalar_ns, iterations, unit(bench_out[k], bench_a[k]));
+    BENCH_TIME(vec4_ns, iterations, v4_store(bench_out[k], v4_unit(v4_load(bench_a[k]))));
+    bench_report("unit", scalar_ns, vec4_ns);
+
+    BENCH_TIME(scalar_ns, iterations, reflect(bench_out[k], bench_a[k], bench_b[k]));
+    BENCH_TIME(vec4_ns, iterations, v4_store(bench_out[k], v4_reflect(v4_load(bench_a[k]), v4_load(bench_b[k]))));
+    bench_report("reflect", scalar_ns, vec4_ns);
+
+    // A chain of operations, as they appear in the renderer: (a + 0.5 * b) x a, normalized.
+    vec3 temp;
+    BENCH_TIME(scalar_ns, iterations,
+               unit(bench_out[k], cross(temp, add(temp, bench_a[k], scale(temp, bench_b[k], 0.5)), bench_a[k])));
+    BENCH_TIME(vec4_ns, iterations, {
+        vec4 a = v4_load(bench_a[k]);
+        v4_store(bench_out[k], v4_unit(v4_cross(v4_add_scaled(a, v4_load(bench_b[k]), 0.5), a)));
+    });
+    bench_report("chain", scalar_ns, vec4_ns);
+
+    // Per sample
+
+    struct Camera_Config cfg = {.aspect_ratio = 1, .image_width = BENCH_VECTORS, .samples_per_pixel = 1,
+                                .vfov = 20, .lookfrom = {0, 0, 10}, .lookat = {0, 0, 0}, .vup = {0, 1, 0},
+                                .focus_dist = 10};
+    struct Camera_Info cam_info;
+    camera_initialize(&cfg, &cam_info);
+
+    struct Scalar_Camera scalar_cam;
+    v4_store(scalar_cam.center, cam_info.center);
+    v4_store(scalar_cam.pixel00_loc, cam_info.pixel00_loc);
+    v4_store(scalar_cam.pixel_delta_u, cam_info.pixel_delta_u);
+    v4_store(scalar_cam.pixel_delta_v, cam_info.pixel_delta_v);
+
+    // A sphere that fills the view (so every sample hits it).
+    const struct Material_Cfg gray = {.mat = Lambertian, .albedo = {0.5, 0.5, 0.5}};
+    const struct Sphere sphere = {.center = {.origin = {0, 0, 0}}, .radius = 3, .mat_cfg = &gray};
+    const struct Interval interval = {.min = 0.001, .max = infinity};
+
+    struct Ray ray, scattered = {0};
+    struct Hit_Record rec;
+    color3 attenuation;
+    double pdf;
+    int hits = 0;
+
+    BENCH_TIME(scalar_ns, iterations, {
+        scalar_get_ray(&ray, &scalar_cam, k, k);
+        if (scalar_sphere_hit(&sphere, &ray, interval, &rec))
+        {
+            scalar_lambertian_scatter(&rec, &scattered);
+            hits++;
+        }
+    });
+    BENCH_TIME(vec4_ns, iterations, {
+        get_ray(&ray, &cam_info, k, k, 0);
+        if (sphere_hit(&sphere, &ray, interval, &rec))
+        {
+            lambertian_scatter(&ray, &rec, attenuation, &scattered, &pdf);
+            hits++;
+        }
+    });
+    bench_sink = scattered.direction[0] + hits;
+
+    printf("\n");
+    bench_report("camera sample", scalar_ns, vec4_ns);
+
+    // Samplers (the columns are the rejection loop and the closed form, then the closed form and a batch of
+    // BENCH_VECTORS samples, per sample).
+
+    double closed_ns, batch_ns;
+    static double batch_x[BENCH_VECTORS], batch_y[BENCH_VECTORS], batch_z[BENCH_VECTORS];
+    long batches = iterations / BENCH_VECTORS;
+
+    printf("\n");
+    BENCH_TIME(scalar_ns, iterations, rejection_unit_vector(bench_out[k]));
+    BENCH_TIME(closed_ns, iterations, random_unit_vector(bench_out[k]));
+    BENCH_TIME(batch_ns, batches, random_batch_unit_vectors(batch_x, batch_y, batch_z, BENCH_VECTORS));
+    bench_report("unit vector", scalar_ns, closed_ns);
+    bench_report("unit vector (batch)", closed_ns, batch_ns / BENCH_VECTORS);
+
+    BENCH_TIME(scalar_ns, iterations, rejection_in_unit_disk(bench_out[k]));
+    BENCH_TIME(closed_ns, iterations, random_in_unit_disk(bench_out[k]));
+    BENCH_TIME(batch_ns, batches, random_batch_in_unit_disk(batch_x, batch_y, BENCH_VECTORS));
+    bench_report("unit disk", scalar_ns, closed_ns);
+    bench_report("unit disk (batch)", closed_ns, batch_ns / BENCH_VECTORS);
+
+    BENCH_TIME(scalar_ns, iterations, random_cosine_direction(bench_out[k]));
+    BENCH_TIME(batch_ns, batches, random_batch_cosine_directions(batch_x, batch_y, batch_z, BENCH_VECTORS));
+    bench_report("cosine (batch)", scalar_ns, batch_ns / BENCH_VECTORS);
+    bench_sink = bench_out[0][0] + batch_x[0] + batch_y[0] + batch_z[0];
+
+    return 0;
+}
@@ -0,0 +1,482 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "vec4.h"
+
+/*
+
+A binary BVH (see bvh.h) tests one box per step of the traversal, and most of the time goes into fetching
+nodes and testing their boxes one at a time. A wide BVH collapses the binary tree so every node has up to
+4 (or 8) children: each node takes the place of a binary node and the children of its children (and so on),
+always opening up the child with the largest surface area, until it has as many children as it can hold.
+The tree is then about half (or a third) as deep, and each step tests all the children of a node at once.
+
+To test them at once, a node stores its children's boxes in SoA layout: the min x of all of them,
+then the min y of all of them, and so on. Four doubles are one AVX register (or two SSE2 registers, the same as
+a vec4, see vec4.h), so testing a ray against the slabs of four children is the same handful of instructions
+as testing it against one box. An 8-wide node is two such groups of four children, side by side.
+
+The children the ray hits are visited nearest first, so a close hit lets us skip the boxes further away.
+
+The wide BVH is made from a binary BVH (and uses its world and indices), so build (or refit) the binary BVH
+first, then collapse it with wide_bvh_build (which is cheap, about as fast as a refit).
+
+*/
+
+#define WIDE_BVH_GROUP_SIZE 4 //< Children per group (one SIMD test, see above)
+#define WIDE_BVH_MAX_WIDTH 8
+
+// Each node we pop pushes at most WIDE_BVH_MAX_WIDTH - 1 more entries than it takes off,
+// and the wide tree is no deeper than the binary tree.
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * (WIDE_BVH_MAX_WIDTH - 1) + 1)
+
+/// @brief The boxes of (up to) four children of a node, in SoA layout (see above).
+/// @remark Unused children have empty boxes (min = infinity, max = -infinity), which no ray hits.
+struct Wide_BVH_Group
+{
+    double min[3][WIDE_BVH_GROUP_SIZE]; //< min[axis][child]
+    double max[3][WIDE_BVH_GROUP_SIZE]; //< max[axis][child]
+    int child[WIDE_BVH_GROUP_SIZE];     //< Internal child: the index of its first group. Leaf: its first index
+    int count[WIDE_BVH_GROUP_SIZE];     //< How many objects a leaf child has. 0 for internal (and unused) children.
+};
+
+struct Wide_BVH
+{
+    const struct BVH *bvh; //< The binary BVH this was collapsed from (not owned), for its world and indices
+    int width;             //< How many children a node has (at most): 4 or 8
+
+    struct Wide_BVH_Group *groups; //< Each node is width / WIDE_BVH_GROUP_SIZE groups in a row. The root is first.
+    int num_groups;
+};
+
+/// @brief Four doubles, tested together (see above).
+typedef union
+{
+#if defined(VEC4_AVX)
+    __m256d v;
+#elif defined(VEC4_SSE2)
+    __m128d v[2];
+#endif
+    double e[4];
+} wide_lanes;
+
+static inline wide_lanes wide_lanes_load(const double *lanes)
+{
+    wide_lanes ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_loadu_pd(lanes);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_loadu_pd(lanes);
+    ret.v[1] = _mm_loadu_pd(lanes + 2);
+#else
+    memcpy(ret.e, lanes, sizeof(ret.e));
+#endif
+    return ret;
+}
+
+static inline wide_lanes wide_lanes_set(double value)
+{
+    wide_lanes ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_set1_pd(value);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = ret.v[1] = _mm_set1_pd(value);
+#else
+    ret.e[0] = ret.e[1] = ret.e[2] = ret.e[3] = value;
+#endif
+    return ret;
+}
+
+/// @brief Returns (plane - origin) * inverse_direction, the distance along the ray to each plane.
+static inline wide_lanes wide_lanes_slab(wide_lanes plane, wide_lanes origin, wide_lanes inverse_direction)
+{
+    wide_lanes ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_mul_pd(_mm256_sub_pd(plane.v, origin.v), inverse_direction.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_mul_pd(_mm_sub_pd(plane.v[0], origin.v[0]), inverse_direction.v[0]);
+    ret.v[1] = _mm_mul_pd(_mm_sub_pd(plane.v[1], origin.v[1]), inverse_direction.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = (plane.e[i] - origin.e[i]) * inverse_direction.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Returns the larger of t and bound in each lane, or bound if t is NaN
+/// (a ray parallel to a slab and starting on its plane gives 0 * infinity, and aabb_hit ignores those too).
+static inline wide_lanes wide_lanes_max(wide_lanes t, wide_lanes bound)
+{
+    wide_lanes ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_max_pd(t.v, bound.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_max_pd(t.v[0], bound.v[0]);
+    ret.v[1] = _mm_max_pd(t.v[1], bound.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = (t.e[i] > bound.e[i]) ? t.e[i] : bound.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Returns the smaller of t and bound in each lane, or bound if t is NaN.
+static inline wide_lanes wide_lanes_min(wide_lanes t, wide_lanes bound)
+{
+    wide_lanes ret;
+#if defined(VEC4_AVX)
+    ret.v = _mm256_min_pd(t.v, bound.v);
+#elif defined(VEC4_SSE2)
+    ret.v[0] = _mm_min_pd(t.v[0], bound.v[0]);
+    ret.v[1] = _mm_min_pd(t.v[1], bound.v[1]);
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        ret.e[i] = (t.e[i] < bound.e[i]) ? t.e[i] : bound.e[i];
+    }
+#endif
+    return ret;
+}
+
+/// @brief Returns a bit mask of the lanes where a < b (bit i for lane i).
+static inline int wide_lanes_less(wide_lanes a, wide_lanes b)
+{
+#if defined(VEC4_AVX)
+    return _mm256_movemask_pd(_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ));
+#elif defined(VEC4_SSE2)
+    return _mm_movemask_pd(_mm_cmplt_pd(a.v[0], b.v[0])) | (_mm_movemask_pd(_mm_cmplt_pd(a.v[1], b.v[1])) << 2);
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        mask |= (a.e[i] < b.e[i]) << i;
+    }
+    return mask;
+#endif
+}
+
+/// @brief What the traversal needs to know about a ray, set up once per ray.
+struct Wide_BVH_Ray
+{
+    wide_lanes origin[3];            //< Each coordinate of the origin, in all lanes
+    wide_lanes inverse_direction[3]; //< 1 / each coordinate of the direction, in all lanes
+    bool negative[3];                //< Whether the ray goes toward -axis (so it enters a box through its max)
+};
+
+static inline struct Wide_BVH_Ray wide_bvh_ray(const struct Ray *ray)
+{
+    struct Wide_BVH_Ray ret;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // Division by zero gives +-infinity here, which the slab test handles (see wide_lanes_max).
+        double inverse = 1.0 / ray->direction[axis];
+        ret.origin[axis] = wide_lanes_set(ray->origin[axis]);
+        ret.inverse_direction[axis] = wide_lanes_set(inverse);
+        ret.negative[axis] = inverse < 0;
+    }
+    return ret;
+}
+
+/// @brief Slab test of the ray against the four boxes of the group (the same test as aabb_hit).
+/// @param t_enter Set to where the ray enters each box (only meaningful for the boxes it hits).
+/// @return A bit mask of the boxes the ray is inside of for some t in ray_interval.
+static inline int wide_bvh_group_hit(const struct Wide_BVH_Group *group, const struct Wide_BVH_Ray *ray,
+                                     struct Interval ray_interval, double t_enter[WIDE_BVH_GROUP_SIZE])
+{
+    wide_lanes t_min = wide_lanes_set(ray_interval.min);
+    wide_lanes t_max = wide_lanes_set(ray_interval.max);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // The ray enters the slab through the near plane and leaves through the far one,
+        // so unlike aabb_hit we never need to swap the two distances.
+        const double *near = ray->negative[axis] ? group->max[axis] : group->min[axis];
+        const double *far = ray->negative[axis] ? group->min[axis] : group->max[axis];
+
+        wide_lanes t0 = wide_lanes_slab(wide_lanes_load(near), ray->origin[axis], ray->inverse_direction[axis]);
+        wide_lanes t1 = wide_lanes_slab(wide_lanes_load(far), ray->origin[axis], ray->inverse_direction[axis]);
+        t_min = wide_lanes_max(t0, t_min);
+        t_max = wide_lanes_min(t1, t_max);
+    }
+
+    memcpy(t_enter, t_min.e, WIDE_BVH_GROUP_SIZE * sizeof(double));
+    return wide_lanes_less(t_min, t_max);
+}
+
+/// @brief (Re)build the wide BVH from a binary one (collapsing it, see above). Call wide_bvh_free once you
+/// are done with it.
+/// @param width How many children a node has (at most): 4 or 8.
+/// @remark The wide BVH uses the binary BVH's world and indices, so the binary BVH must outlive it.
+/// Collapse again after refitting (or rebuilding) the binary BVH. wide must be zero initialized before its first
+/// build.
+static inline void wide_bvh_build(struct Wide_BVH *wide, const struct BVH *bvh, int width)
+{
+    width = (width > WIDE_BVH_GROUP_SIZE) ? WIDE_BVH_MAX_WIDTH : WIDE_BVH_GROUP_SIZE;
+    int groups_per_node = width / WIDE_BVH_GROUP_SIZE;
+
+    // Every wide node takes the place of a binary internal node (at least one of them), so there are at most as
+    // many as binary nodes (one for a tree that is a single leaf, whose wide root has just that one leaf).
+    int max_groups = (bvh->num_nodes > 0 ? bvh->num_nodes : 1) * groups_per_node;
+    free(wide->groups);
+    wide->groups = malloc(max_groups * sizeof(struct Wide_BVH_Group));
+    int *queue = malloc((bvh->num_nodes > 0 ? bvh->num_nodes : 1) * sizeof(int));
+    if (wide->groups == NULL || queue == NULL)
+    {
+        fprintf(stderr, "Could not allocate the wide BVH!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wide->bvh = bvh;
+    wide->width = width;
+
+    // The binary nodes to turn into wide nodes, in order (wide node k takes the place of queue[k]). Going breadth
+    // first keeps every node before its children (like the binary tree).
+    int num_nodes = 0;
+    queue[num_nodes++] = 0;
+
+    for (int k = 0; k < num_nodes; k++)
+    {
+        // Start with the binary node's children (or the node itself, if the whole tree is one leaf),
+        // and keep opening up the largest internal one.
+        int children[WIDE_BVH_MAX_WIDTH];
+        int num_children = 0;
+        const struct BVH_Node *node = &bvh->nodes[queue[k]];
+        if (node->count > 0 || bvh->world_length == 0)
+        {
+            children[num_children++] = queue[k];
+        }
+        else
+        {
+            children[num_children++] = node->left;
+            children[num_children++] = node->right;
+        }
+
+        while (num_children < width)
+        {
+            int largest = -1;
+            double largest_area = -1;
+            for (int c = 0; c < num_children; c++)
+            {
+                const struct BVH_Node *child = &bvh->nodes[children[c]];
+                double area = aabb_surface_area(&child->box);
+                if (child->count == 0 && area > largest_area)
+                {
+                    largest = c;
+                    largest_area = area;
+                }
+            }
+            if (largest < 0)
+            {
+                break;
+            }
+
+            const struct BVH_Node *opened = &bvh->nodes[children[largest]];
+            children[largest] = opened->left;
+            children[num_children++] = opened->right;
+        }
+
+        for (int c = 0; c < width; c++)
+        {
+            struct Wide_BVH_Group *group = &wide->groups[k * groups_per_node + c / WIDE_BVH_GROUP_SIZE];
+            int lane = c % WIDE_BVH_GROUP_SIZE;
+
+            if (c >= num_children)
+            {
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    group->min[axis][lane] = infinity;
+                    group->max[axis][lane] = -infinity;
+                }
+                group->child[lane] = 0;
+                group->count[lane] = 0;
+                continue;
+            }
+
+            const struct BVH_Node *child = &bvh->nodes[children[c]];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                group->min[axis][lane] = aabb_axis_interval(&child->box, axis)->min;
+                group->max[axis][lane] = aabb_axis_interval(&child->box, axis)->max;
+            }
+
+            if (child->count > 0 || bvh->world_length == 0)
+            {
+                group->child[lane] = child->first;
+                group->count[lane] = child->count;
+            }
+            else
+            {
+                group->child[lane] = num_nodes * groups_per_node;
+                group->count[lane] = 0;
+                queue[num_nodes++] = children[c];
+            }
+        }
+    }
+
+    wide->num_groups = num_nodes * groups_per_node;
+    free(queue);
+}
+
+static inline void wide_bvh_free(struct Wide_BVH *wide)
+{
+    free(wide->groups);
+    wide->groups = NULL;
+    wide->num_groups = 0;
+}
+
+/// @brief A node (or leaf) waiting on the traversal stack.
+struct Wide_BVH_Entry
+{
+    int child; //< See Wide_BVH_Group.child
+    int count; //< See Wide_BVH_Group.count
+    double t;  //< Where the ray enters its box
+};
+
+/// @brief Test the ray against the children of the node at group (a node is width / 4 groups),
+/// and push the ones it hits onto the stack, the nearest last (so it is visited first).
+static inline void wide_bvh_push_children(const struct Wide_BVH *wide, int group, const struct Wide_BVH_Ray *ray,
+                                          struct Interval ray_interval, struct Wide_BVH_Entry *stack,
+                                          int *stack_size)
+{
+    struct Wide_BVH_Entry hits[WIDE_BVH_MAX_WIDTH];
+    int num_hits = 0;
+
+    for (int g = group; g < group + wide->width / WIDE_BVH_GROUP_SIZE; g++)
+    {
+        double t_enter[WIDE_BVH_GROUP_SIZE];
+        int mask = wide_bvh_group_hit(&wide->groups[g], ray, ray_interval, t_enter);
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            int lane = 0;
+            while (!(mask & (1 << lane)))
+            {
+                lane++;
+            }
+
+            // Insertion sort, farthest first.
+            struct Wide_BVH_Entry entry = {wide->groups[g].child[lane], wide->groups[g].count[lane], t_enter[lane]};
+            int i = num_hits++;
+            while (i > 0 && hits[i - 1].t < entry.t)
+            {
+                hits[i] = hits[i - 1];
+                i--;
+            }
+            hits[i] = entry;
+        }
+    }
+
+    memcpy(stack + *stack_size, hits, num_hits * sizeof(struct Wide_BVH_Entry));
+    *stack_size += num_hits;
+}
+
+/// @brief returns if any objects in the wide BVH are hit by the ray (the same as bvh_hit).
+/// @param rec the Hit Record-- updated accordingly
+static inline bool wide_bvh_hit(const struct Wide_BVH *wide, const struct Ray *ray, struct Interval ray_interval,
+                                struct Hit_Record *rec)
+{
+    const struct BVH *bvh = wide->bvh;
+    if (bvh->world_length == 0)
+    {
+        return false;
+    }
+
+    struct Wide_BVH_Ray wide_ray = wide_bvh_ray(ray);
+    struct Hit_Record temp_rec;
+    bool hit_anything = false;
+    double closest_so_far = ray_interval.max;
+
+    struct Wide_BVH_Entry stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    wide_bvh_push_children(wide, 0, &wide_ray, ray_interval, stack, &stack_size);
+
+    while (stack_size > 0)
+    {
+        struct Wide_BVH_Entry entry = stack[--stack_size];
+
+        // We found a hit closer than this box since we pushed it.
+        if (entry.t >= closest_so_far)
+        {
+            continue;
+        }
+
+        struct Interval interval = {.min = ray_interval.min, .max = closest_so_far};
+        if (entry.count == 0)
+        {
+            wide_bvh_push_children(wide, entry.child, &wide_ray, interval, stack, &stack_size);
+            continue;
+        }
+
+        for (int k = entry.child; k < entry.child + entry.count; k++)
+        {
+            const struct Hittable *object = &bvh->world[bvh->indices[k]];
+            if (hittable_hit(object, ray, (struct Interval){.min = ray_interval.min, .max = closest_so_far},
+                             &temp_rec))
+            {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                *rec = temp_rec;
+                rec->object = object;
+            }
+        }
+    }
+
+    return hit_anything;
+}
+
+/// @brief The wide BVH version of bvh_transmittance (any-hit: stops at the first solid object found).
+static inline double wide_bvh_transmittance(const struct Wide_BVH *wide, const struct Ray *ray,
+                                            struct Interval ray_interval)
+{
+    const struct BVH *bvh = wide->bvh;
+    if (bvh->world_length == 0)
+    {
+        return 1.0;
+    }
+
+    struct Wide_BVH_Ray wide_ray = wide_bvh_ray(ray);
+    struct Hit_Record temp_rec;
+    double transmittance = 1.0;
+
+    struct Wide_BVH_Entry stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    wide_bvh_push_children(wide, 0, &wide_ray, ray_interval, stack, &stack_size);
+
+    while (stack_size > 0)
+    {
+        struct Wide_BVH_Entry entry = stack[--stack_size];
+
+        if (entry.count == 0)
+        {
+            wide_bvh_push_children(wide, entry.child, &wide_ray, ray_interval, stack, &stack_size);
+            continue;
+        }
+
+        for (int k = entry.child; k < entry.child + entry.count; k++)
+        {
+            const struct Hittable *object = &bvh->world[bvh->indices[k]];
+
+            if (object->which == (enum Which_Hittable)Constant_Medium)
+            {
+                transmittance *= constant_medium_transmittance(&object->object.constant_medium, ray, ray_interval);
+                if (transmittance <= 0)
+                {
+                    return 0;
+                }
+            }
+            else if (hittable_hit(object, ray, ray_interval, &temp_rec))
+            {
+                return 0;
+            }
+        }
+    }
+
+    return transmittance;
+}